@@ -0,0 +1,24 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+namespace bm
+{
+    // Layout of an uncompressed 24-bit bitmap, parsed straight from the file bytes.
+    struct BitmapInfo
+    {
+        int width, height;
+        size_t pixel_offset;
+        size_t row_pitch;
+        bool top_down;
+    };
+
+    // Validates BITMAPFILEHEADER and BITMAPINFOHEADER in place. Only 24-bit BI_RGB images are accepted.
+    bool readBitmapInfo(const unsigned char* data, size_t size, BitmapInfo& info);
+
+    // Returns row j of the image, where row 0 is the bottom one regardless of the storage order.
+    const unsigned char* getBitmapRow(const unsigned char* data, const BitmapInfo& info, int j);
+
+    // Extracts the first (blue) channel of count BGR pixels and writes it as channel * scale.
+    void decodeBitmapRow(const unsigned char* pixels, int count, float scale, float* output);
+}
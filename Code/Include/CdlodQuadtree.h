@@ -0,0 +1,99 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "HeightField.h"
+
+namespace bm
+{
+    // One node (or part of one) selected for drawing. Every node is drawn with the same grid patch of leaf size quads,
+    // so the level alone decides its vertex spacing: 2^level samples.
+    struct CdlodDrawRecord
+    {
+        uint32_t node;       // Row-major index of the node within its level.
+        uint16_t level;
+        uint16_t quadrants;  // Quadrants to draw, bit 0 is (-X, -Z), 1 (+X, -Z), 2 (-X, +Z), 3 (+X, +Z). 15 is the whole node.
+        float morph_start;   // Distances over which the vertices morph into the next coarser level.
+        float morph_end;
+    };
+
+    // Continuous distance-dependent level of detail quadtree (Strugar, "Continuous Distance-Dependent Level of Detail
+    // for Rendering Heightmaps"). Level 0 are the leaves; each level up doubles the node size and the vertex spacing.
+    // Nodes only store their height range, positions follow from the level and the index.
+    class CdlodQuadtree
+    {
+    public:
+        CdlodQuadtree() = default;
+       ~CdlodQuadtree() = default;
+
+        CdlodQuadtree(const CdlodQuadtree&) = default;
+        CdlodQuadtree(CdlodQuadtree&&) = default;
+
+        CdlodQuadtree& operator=(const CdlodQuadtree&) = default;
+        CdlodQuadtree& operator=(CdlodQuadtree&&) = default;
+
+    public:
+        // leaf_size is the number of quads along a side of a leaf and of the grid patch, a power of two.
+        void build(const HeightField& height_field, int leaf_size = 32, unsigned thread_count = 0U);
+
+        // Selects the nodes to draw for a camera. error_scale is the viewport height divided by 2 * tan(fov / 2); a level is
+        // used up to the distance at which the error of the next coarser one reaches max_pixel_error pixels.
+        void select(const Vector3D& camera_position, float error_scale, float max_pixel_error, std::vector<CdlodDrawRecord>& records) const;
+
+    public:
+        bool isEmpty() const { return levels.empty(); }
+
+        int getLeafSize() const { return leaf_size; }
+        int getLevelCount() const { return static_cast<int>(levels.size()); }
+
+        int getNodeColumns(int level) const { return levels[level].columns; }
+        int getNodeRows(int level) const { return levels[level].rows; }
+
+        // Largest vertical error of any node of the level against the full resolution heightmap.
+        float getLevelError(int level) const { return levels[level].error; }
+
+        // First sample of a node and its size in samples.
+        int getNodeX(int level, uint32_t node) const { return static_cast<int>(node % levels[level].columns) * getNodeSize(level); }
+        int getNodeZ(int level, uint32_t node) const { return static_cast<int>(node / levels[level].columns) * getNodeSize(level); }
+        int getNodeSize(int level) const { return leaf_size << level; }
+
+        void getNodeBounds(int level, uint32_t node, Vector3D& bounds_min, Vector3D& bounds_max) const;
+
+        size_t getMemoryUsage() const;
+
+    private:
+        struct Level
+        {
+            int columns, rows;
+
+            std::vector<float> min_heights;
+            std::vector<float> max_heights;
+
+            float error;
+        };
+
+        // Distance ranges of every level for one selection.
+        struct Ranges
+        {
+            float visibility[32];
+            float morph_start[32];
+        };
+
+        void selectNode(int level, int column, int row, const Vector3D& camera_position, const Ranges& ranges,
+                        std::vector<CdlodDrawRecord>& records) const;
+
+        bool intersectsSphere(int level, int column, int row, const Vector3D& center, float radius) const;
+
+    private:
+        int leaf_size = 32;
+
+        int width = 0;
+        int height = 0;
+        float spacing = 1.0f;
+
+        std::vector<Level> levels;
+    };
+}
@@ -0,0 +1,134 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "HeightField.h"
+
+namespace bm
+{
+    // Height field kept compressed in memory, for heightmaps too large to hold as floats. Samples are quantized to
+    // multiples of a precision and stored in blocks of 8 x 8: a base, the lowest sample of the block, then every sample
+    // minus the base with the bits the largest difference needs. Row r of a block takes bytes [r * bits, (r + 1) * bits)
+    // of it, so a block row is unpacked with a single shuffle per four samples.
+    //
+    // Every block header holds its base, its bit count and where its bits start, so a sample is read in constant time from
+    // its block header and a single unaligned load, a row segment eight samples at a time. Blocks are stored in row-major
+    // order but don't depend on each other, so one whose heights changed is encoded again on its own (see update).
+    class CompressedHeightField
+    {
+    public:
+        CompressedHeightField() = default;
+       ~CompressedHeightField() = default;
+
+        CompressedHeightField(const CompressedHeightField&) = default;
+        CompressedHeightField(CompressedHeightField&&) = default;
+
+        CompressedHeightField& operator=(const CompressedHeightField&) = default;
+        CompressedHeightField& operator=(CompressedHeightField&&) = default;
+
+    public:
+        // Starts an empty field of width x height samples. No sample moves by more than half the precision, unless it's
+        // beyond 2^30 steps of it from 0, where it's clamped; a NaN sample is stored as 0.
+        void reset(int width, int height, float spacing, float precision);
+
+        // Appends the next row of blocks from rows [8 * block_row, 8 * block_row + 8), cut at the bottom of the field, whose
+        // rows are stride floats apart. Lets a heightmap be compressed a band at a time, without ever loading it whole. A
+        // row that would take the data past 1 GB isn't appended, and the field never completes.
+        void appendBlockRow(const float* rows, size_t stride);
+
+        // Compresses a whole height field, the rows of blocks split over thread_count threads. Incomplete past 1 GB of data.
+        void build(const HeightField& height_field, float precision, unsigned thread_count = 0U);
+
+        bool isEmpty() const { return blocks.empty(); }
+
+        // True once every row of blocks was appended.
+        bool isComplete() const { return block_rows_done == block_rows && !isEmpty(); }
+
+        int getWidth() const { return width; }
+        int getHeight() const { return height; }
+        float getSpacing() const { return spacing; }
+        float getPrecision() const { return precision; }
+
+        float getX(int i) const { return static_cast<float>(i) * spacing; }
+        float getZ(int j) const { return static_cast<float>(j) * spacing; }
+
+    public:
+        float getHeight(int i, int j) const
+        {
+            auto block = blocks.data() + static_cast<size_t>(j >> block_shift) * block_columns + (i >> block_shift);
+            auto bits = block->bits;
+
+            auto position = static_cast<size_t>(((j & block_mask) << block_shift) + (i & block_mask)) * bits;
+
+            uint64_t word;
+            std::memcpy(&word, data.data() + static_cast<size_t>(block->offset) * block_size + position / 8U, sizeof(word));
+
+            auto delta = static_cast<int32_t>((word >> (position % 8U)) & ((1ULL << bits) - 1ULL));
+            return static_cast<float>(block->base + delta) * precision;
+        }
+
+        // Samples [first_column, last_column) of row j.
+        void decodeRow(int j, int first_column, int last_column, float* output) const;
+
+        // The 8 x 8 samples of a block, row by row, repeating the last column and row of the field past its border.
+        void decodeBlock(int block_column, int block_row, float* output) const;
+
+        // Decodes the heights into a height field of the same size, rows split over thread_count threads.
+        void decode(HeightField& height_field, unsigned thread_count = 0U) const;
+
+        // Encodes the blocks holding samples [x0, x1] x [z0, z1] of a complete field again from height_field, which has its
+        // size. Blocks that need more bits than before move to the end of the data, which is compacted back into row-major
+        // order once the space they left behind reaches the size of the data itself.
+        void update(const HeightField& height_field, int x0, int z0, int x1, int z1);
+
+        // The height a sample of the given height decodes to.
+        float quantize(float height) const;
+
+        size_t getMemoryUsage() const;
+
+    private:
+        static constexpr int block_shift = 3;
+        static constexpr int block_size = 1 << block_shift;
+        static constexpr int block_mask = block_size - 1;
+
+        // Bytes past the data that row decoding may load, and ignore.
+        static constexpr size_t data_padding = 32U;
+
+        // Data a block can start in, in units of block_size bytes: 1 GB.
+        static constexpr uint32_t max_offset = (1U << 27U) - 1U;
+
+        struct Block
+        {
+            int32_t base;
+            uint32_t offset : 27; // In units of block_size bytes, a block of b bits per sample takes b of them.
+            uint32_t bits : 5;
+        };
+
+        void encodeBlockRow(const float* rows, size_t stride, int block_row, Block* headers, std::vector<unsigned char>& block_data) const;
+        void encodeBlock(const float* rows, size_t stride, int block_column, int block_row, Block& header, std::vector<unsigned char>& block_data) const;
+        void decodeBlockRow(const Block* block, int row, float* output) const;
+
+        // Appends block data to the data, before its padding, and returns the offset it starts at. False if that offset
+        // doesn't fit a block header.
+        bool appendData(const std::vector<unsigned char>& block_data, uint32_t& offset);
+        void compact();
+
+    private:
+        int width = 0;
+        int height = 0;
+        float spacing = 1.0f;
+        float precision = 1.0f;
+
+        int block_columns = 0;
+        int block_rows = 0;
+        int block_rows_done = 0;
+
+        std::vector<Block> blocks; // Row-major.
+        std::vector<unsigned char> data;
+        size_t unused_size = 0U;   // Bytes of data left behind by blocks that moved.
+    };
+}
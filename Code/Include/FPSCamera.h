@@ -2,6 +2,8 @@
 
 #pragma once
 
+#include "FrustumCulling.h"
+
 namespace bm
 {
     class FPSCamera
@@ -31,6 +33,10 @@ namespace bm
         Matrix getView() { return view; }
         Matrix getProjection() { return projection; }
 
+        // View * projection and its planes, refreshed whenever the view changes.
+        Matrix getViewProjection() const { return view_projection; }
+        const Frustum& getFrustum() const { return frustum; }
+
     public:
         float& getMoveLeftRight() { return left_right; }
         float& getMoveBackForward() { return back_forward; }
@@ -42,9 +48,12 @@ namespace bm
         Matrix projection;
         Matrix view;
         Matrix world;
+        Matrix view_projection;
 
         Matrix rotation;
 
+        Frustum frustum;
+
         Vector position;
         Vector target;
         Vector up;
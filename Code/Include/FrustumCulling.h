@@ -0,0 +1,64 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace bm
+{
+    // View frustum as six planes: left, right, bottom, top, near and far. A point p is inside a plane when
+    // dot(plane.xyz, p) + plane.w >= 0; the normals have unit length, so that value is also the distance.
+    struct Frustum
+    {
+        Vector4D planes[6];
+    };
+
+    // Frustum of a view * projection matrix in the DirectX conventions (row vectors, depth from 0 to 1).
+    Frustum computeFrustum(const Matrix& view_projection);
+
+    // Axis aligned boxes as structure of arrays, center and half extent per axis, so that the frustum test runs over
+    // four or eight boxes at a time.
+    class BoundingBoxes
+    {
+    public:
+        BoundingBoxes() = default;
+       ~BoundingBoxes() = default;
+
+        BoundingBoxes(const BoundingBoxes&) = default;
+        BoundingBoxes(BoundingBoxes&&) = default;
+
+        BoundingBoxes& operator=(const BoundingBoxes&) = default;
+        BoundingBoxes& operator=(BoundingBoxes&&) = default;
+
+    public:
+        void clear();
+        void reserve(size_t count);
+
+        void add(const Vector3D& bounds_min, const Vector3D& bounds_max);
+        void set(size_t index, const Vector3D& bounds_min, const Vector3D& bounds_max);
+
+    public:
+        size_t getCount() const { return center_x.size(); }
+
+        const float* getCenterX() const { return center_x.data(); }
+        const float* getCenterY() const { return center_y.data(); }
+        const float* getCenterZ() const { return center_z.data(); }
+
+        const float* getExtentX() const { return extent_x.data(); }
+        const float* getExtentY() const { return extent_y.data(); }
+        const float* getExtentZ() const { return extent_z.data(); }
+
+    private:
+        std::vector<float> center_x, center_y, center_z;
+        std::vector<float> extent_x, extent_y, extent_z;
+    };
+
+    // False when the box is completely outside one of the frustum planes, the test of cullBoundingBoxes for a single box.
+    bool isBoxInFrustum(const Frustum& frustum, const Vector3D& bounds_min, const Vector3D& bounds_max);
+
+    // Replaces visible with the indices, in increasing order, of the boxes that are not completely outside one of the
+    // frustum planes. Like any plane-by-plane test it is conservative: boxes near the edges of the frustum may pass.
+    // Returns the number of visible boxes.
+    size_t cullBoundingBoxes(const Frustum& frustum, const BoundingBoxes& boxes, std::vector<uint32_t>& visible);
+}
@@ -0,0 +1,48 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "HeightField.h"
+#include "TerrainChunk.h"
+
+namespace bm
+{
+    // Edges of a chunk. A stitching variant is a combination of them: on a stitched edge the neighbour is drawn one level
+    // coarser, so the edge only keeps the vertices of that coarser level and no T-junctions open up between the chunks.
+    enum GeomipmapEdge : unsigned
+    {
+        geomipmap_edge_left = 1U,   // -X
+        geomipmap_edge_right = 2U,  // +X
+        geomipmap_edge_bottom = 4U, // -Z
+        geomipmap_edge_top = 8U     // +Z
+    };
+
+    constexpr unsigned geomipmap_variant_count = 16U;
+
+    // Level l uses every 2^l-th sample; the last row and column of a chunk are always kept, so any chunk size works.
+    // Levels stop at the one that only keeps the corners.
+    int getGeomipmapLevelCount(int width, int height);
+
+    // Row-major local indices of a width x height chunk at the given level, with the edges in stitched_edges reduced
+    // to the vertices of the next level. Same winding and diagonal as the full resolution chunk, degenerate triangles are dropped.
+    void buildGeomipmapIndices(int width, int height, int level, unsigned stitched_edges, std::vector<uint16_t>& indices);
+
+    // Largest vertical distance between the samples of a chunk and the surface of the chunk at the given level.
+    float computeGeomipmapError(const HeightField& height_field, int x, int z, int width, int height, int level);
+
+    // Picks the coarsest level of every chunk whose error, projected to the screen, stays within max_pixel_error.
+    // error_scale is the viewport height divided by 2 * tan(fov / 2). Afterwards chunks are refined until neighbours
+    // differ by at most one level, which is what the stitching variants cover. Chunks are laid out in rows of chunk_columns.
+    void selectGeomipmapLevels(const std::vector<TerrainChunk>& chunks,
+                               int chunk_columns,
+                               const Vector3D& camera_position,
+                               float error_scale,
+                               float max_pixel_error,
+                               std::vector<int>& levels);
+
+    // Edges of a chunk whose neighbour was selected one level coarser.
+    unsigned getGeomipmapStitching(const std::vector<int>& levels, int chunk_columns, int chunk);
+}
@@ -0,0 +1,111 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "MappedFile.h"
+
+namespace bm
+{
+    // Heightmap codec for integer samples, tile by tile. Every tile is coded on its own: the samples are first divided by
+    // 2 * max_error + 1 (rounded, so no sample moves by more than max_error), then predicted from their west, north and
+    // north-west neighbours (W + N - NW). The residuals are bit-packed 128 at a time with as many bits as the largest of
+    // them needs, which on terrain is a handful.
+    //
+    // Decoding goes block by block: four residuals per SSE instruction are unpacked, summed along the row and added to
+    // the row above in registers, without a pass over memory in between, so it runs at the speed of the stores of the
+    // decoded heights rather than at the speed of an entropy decoder.
+    struct HeightCodecSettings
+    {
+        // Threads used to encode the tiles, 0 means one per hardware thread. The file doesn't depend on it.
+        unsigned thread_count = 0U;
+
+        // Samples per side of a tile, the unit of random access and of parallel decoding.
+        int tile_size = 128;
+
+        // Largest difference between a decoded sample and the original one, in sample steps. 0 is lossless.
+        int max_error = 0;
+    };
+
+    // Appends the code of width x height samples, whose rows are stride samples apart, to output.
+    void encodeHeightTile(const uint16_t* samples, int width, int height, size_t stride, int max_error, std::vector<unsigned char>& output);
+
+    // Decodes a tile of width x height samples as sample * scale into output, whose rows are output_stride floats apart.
+    // Damaged data is reported rather than read past.
+    bool decodeHeightTile(const unsigned char* data, size_t size, int width, int height, float scale, float* output, size_t output_stride);
+
+    // Entry of the tile index of a .bmhc file.
+    struct CompressedHeightTile
+    {
+        uint64_t offset;
+        uint32_t size;
+        uint32_t padding;
+    };
+
+    // Layout of a .bmhc file: the header, the row-major index of the tiles at index_offset, then the tile codes. The
+    // tiles split the heightmap without overlapping, the ones on the right and top edges may be smaller.
+    struct CompressedHeightFileHeader
+    {
+        char magic[4];
+        uint32_t version;
+
+        int32_t width, height;
+        int32_t tile_size;
+        int32_t max_error;
+
+        int32_t columns, rows;
+
+        uint64_t index_offset; // columns * rows CompressedHeightTile.
+        uint64_t file_size;
+    };
+
+    // Bumped whenever the layout of the file or of the tile code changes.
+    constexpr uint32_t compressed_height_file_version = 1U;
+
+    // Compresses the first channel of a 24-bit heightmap bitmap into a .bmhc file. The bitmap is memory-mapped and encoded
+    // one row of tiles at a time. The file is written as file_name.partial and renamed once complete, a failed conversion
+    // leaves file_name alone.
+    bool convertBitmapToCompressedHeights(const wchar_t* bitmap_file_name, const wchar_t* file_name,
+                                          const HeightCodecSettings& settings = HeightCodecSettings());
+
+    // Memory-mapped .bmhc file, decoded straight from the mapped view.
+    class CompressedHeightFile
+    {
+    public:
+        CompressedHeightFile(const wchar_t* file_name);
+       ~CompressedHeightFile() = default;
+
+        CompressedHeightFile(const CompressedHeightFile&) = delete;
+        CompressedHeightFile(CompressedHeightFile&&) = delete;
+
+        CompressedHeightFile& operator=(const CompressedHeightFile&) = delete;
+        CompressedHeightFile& operator=(CompressedHeightFile&&) = delete;
+
+    public:
+        // False if the file is missing, truncated, of another version or not a .bmhc file at all.
+        bool isValid() const { return valid; }
+
+        const CompressedHeightFileHeader& getHeader() const { return *reinterpret_cast<const CompressedHeightFileHeader*>(file.getData()); }
+
+        int getWidth() const { return getHeader().width; }
+        int getHeight() const { return getHeader().height; }
+
+        const CompressedHeightTile& getTile(int column, int row) const
+        {
+            auto tiles = reinterpret_cast<const CompressedHeightTile*>(file.getData() + getHeader().index_offset);
+            return tiles[row * getHeader().columns + column];
+        }
+
+        // Decodes one tile as sample * scale into its place in output, a plane of width * height floats.
+        bool decodeTile(int column, int row, float scale, float* output) const;
+
+        // Decodes every tile into output, split over thread_count threads.
+        bool decode(float scale, float* output, unsigned thread_count) const;
+
+    private:
+        MappedFile file;
+        bool valid;
+    };
+}
@@ -0,0 +1,72 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <vector>
+
+#include "NormalPacking.h"
+
+namespace bm
+{
+    // Regular grid of height samples stored as structure of arrays: one contiguous row-major plane of heights
+    // and a separate plane of octahedral-packed normals. X and Z are not stored, they follow from the grid spacing.
+    class HeightField
+    {
+    public:
+        HeightField() = default;
+        HeightField(int width, int height, float spacing);
+       ~HeightField() = default;
+
+        HeightField(const HeightField&) = default;
+        HeightField(HeightField&&) = default;
+
+        HeightField& operator=(const HeightField&) = default;
+        HeightField& operator=(HeightField&&) = default;
+
+    public:
+        void resize(int width, int height, float spacing);
+
+        bool isEmpty() const { return heights.empty(); }
+
+        int getWidth() const { return width; }
+        int getHeight() const { return height; }
+        float getSpacing() const { return spacing; }
+
+        int getIndex(int i, int j) const { return (width * j) + i; }
+
+        // Samples of a row from column i on that are contiguous in memory: the rest of the row (see HeightFieldAccess.h).
+        int getContiguousColumns(int i) const { return width - i; }
+
+        float getX(int i) const { return static_cast<float>(i) * spacing; }
+        float getZ(int j) const { return static_cast<float>(j) * spacing; }
+
+    public:
+        float getHeight(int i, int j) const { return heights[getIndex(i, j)]; }
+        void setHeight(int i, int j, float value) { heights[getIndex(i, j)] = value; }
+
+        float* getHeights() { return heights.data(); }
+        const float* getHeights() const { return heights.data(); }
+
+        float* getRow(int j) { return heights.data() + getIndex(0, j); }
+        const float* getRow(int j) const { return heights.data() + getIndex(0, j); }
+
+        Vector3D getPosition(int i, int j) const { return Vector3D(getX(i), getHeight(i, j), getZ(j)); }
+
+    public:
+        Vector3D getNormal(int i, int j) const { return unpackNormal(normals[getIndex(i, j)]); }
+        void setNormal(int i, int j, const Vector3D& normal) { normals[getIndex(i, j)] = packNormal(normal); }
+
+        uint32_t* getPackedNormals() { return normals.data(); }
+        const uint32_t* getPackedNormals() const { return normals.data(); }
+
+        size_t getMemoryUsage() const;
+
+    private:
+        int width = 0;
+        int height = 0;
+        float spacing = 1.0f;
+
+        std::vector<float> heights;
+        std::vector<uint32_t> normals;
+    };
+}
@@ -0,0 +1,51 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+namespace bm
+{
+    // Layout independent access to the samples of a HeightField or a TiledHeightField. Both have the same per sample
+    // accessors; these add the runs of samples that are contiguous in memory, which bulk copies and vector kernels load.
+
+    // Calls function(i, count, index) for the runs of columns [first, last) of row j that are contiguous in memory, index
+    // being that of sample (i, j) in the heights and the packed normals: a single run on a HeightField, one per tile
+    // on a TiledHeightField.
+    template<typename Field, typename Function>
+    void forEachRowRun(const Field& height_field, int j, int first, int last, Function&& function)
+    {
+        for(auto i = first; i < last;)
+        {
+            auto count = std::min(height_field.getContiguousColumns(i), last - i);
+            function(i, count, height_field.getIndex(i, j));
+
+            i += count;
+        }
+    }
+
+    // Heights and normals of columns [first_column, last_column) of rows [first_row, last_row) from one height field into
+    // another of the same size, whatever their layouts.
+    template<typename Source, typename Target>
+    void copyHeightField(const Source& source, Target& target, int first_column, int last_column, int first_row, int last_row)
+    {
+        auto heights = source.getHeights();
+        auto normals = source.getPackedNormals();
+
+        for(auto j = first_row; j < last_row; j++)
+        {
+            forEachRowRun(target, j, first_column, last_column, [&](int i, int count, int index)
+            {
+                forEachRowRun(source, j, i, i + count, [&](int source_i, int source_count, int source_index)
+                {
+                    auto offset = index + (source_i - i);
+
+                    std::memcpy(target.getHeights() + offset, heights + source_index, static_cast<size_t>(source_count) * sizeof(float));
+                    std::memcpy(target.getPackedNormals() + offset, normals + source_index, static_cast<size_t>(source_count) * sizeof(uint32_t));
+                });
+            });
+        }
+    }
+}
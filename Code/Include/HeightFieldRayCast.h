@@ -0,0 +1,44 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include "HeightPyramid.h"
+#include "TiledHeightField.h"
+
+namespace bm
+{
+    struct HeightFieldRayHit
+    {
+        Vector3D position;
+        Vector3D normal; // Of the triangle hit.
+
+        int i, j; // Quad hit, the one between samples (i, j) and (i + 1, j + 1).
+        float distance; // Along the ray, in units of its direction's length. Negative for a miss of castHeightFieldRays.
+    };
+
+    // First intersection of the ray origin + t * direction, t in [0, max_distance], with the triangles of the height field
+    // below a pyramid, split along the diagonal from (i, j) to (i + 1, j + 1) like Terrain::buildTerrainModel. For line
+    // of sight, pass the segment between the two points as direction and 1 as max_distance.
+    //
+    // The ray walks the quadtree of the pyramid's maxima from the top, skipping every node it passes above and only
+    // going down to the quads under the nodes it could hit, so it visits a few nodes per level instead of every quad.
+    bool castHeightFieldRay(const HeightPyramid& height_pyramid, const Vector3D& origin, const Vector3D& direction, float max_distance,
+                            HeightFieldRayHit& hit);
+
+    // The above for count rays, with the misses flagged in their distances. Rays are independent, so disjoint ranges can
+    // be cast concurrently.
+    void castHeightFieldRays(const HeightPyramid& height_pyramid, const Vector3D* origins, const Vector3D* directions, size_t count,
+                             float max_distance, HeightFieldRayHit* hits);
+
+    // The same against a tiled copy of the height field the pyramid was built from: the pyramid's levels above the samples
+    // pick the quads, and the samples of the quads the ray goes down to are read from the copy.
+    bool castHeightFieldRay(const HeightPyramid& height_pyramid, const TiledHeightField& height_field, const Vector3D& origin,
+                            const Vector3D& direction, float max_distance, HeightFieldRayHit& hit);
+
+    void castHeightFieldRays(const HeightPyramid& height_pyramid, const TiledHeightField& height_field, const Vector3D* origins,
+                             const Vector3D* directions, size_t count, float max_distance, HeightFieldRayHit* hits);
+
+    // Tests every triangle of the height field. The reference the accelerated cast is checked against.
+    bool castHeightFieldRayReference(const HeightField& height_field, const Vector3D& origin, const Vector3D& direction, float max_distance,
+                                     HeightFieldRayHit& hit);
+}
@@ -0,0 +1,78 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <vector>
+
+#include "HeightField.h"
+
+namespace bm
+{
+    // Min/max mip pyramid of a height field. Level 0 are the samples themselves, read from the height field, and every
+    // level up keeps the lowest and highest sample of blocks twice as large: block (i, j) of level l covers samples
+    // [i * 2^l, (i + 1) * 2^l) along each axis, cut at the border. The top level is a single block.
+    //
+    // The pyramid keeps a pointer to the height field it was built from, which has to stay where it is, so it can be
+    // neither copied nor moved.
+    class HeightPyramid
+    {
+    public:
+        HeightPyramid() = default;
+       ~HeightPyramid() = default;
+
+        HeightPyramid(const HeightPyramid&) = delete;
+        HeightPyramid(HeightPyramid&&) = delete;
+
+        HeightPyramid& operator=(const HeightPyramid&) = delete;
+        HeightPyramid& operator=(HeightPyramid&&) = delete;
+
+    public:
+        void build(const HeightField& height_field, unsigned thread_count = 0U);
+
+        // Refreshes the blocks over the samples of [x0, x1] x [z0, z1] after they changed.
+        void update(int x0, int z0, int x1, int z1);
+
+        // Lowest and highest sample of [x0, x1] x [z0, z1], clamped to the height field. Exact: the largest blocks within
+        // the rectangle are used, going down a level only along its border and only where a block could still widen
+        // the range. The interior costs a handful of lookups whatever its size, but the border can take down to single
+        // samples all along it, so a query is O(x1 - x0 + z1 - z0) lookups at worst; use getBoundingRange where bounds do.
+        void getRange(int x0, int z0, int x1, int z1, float& min_height, float& max_height) const;
+
+        // Bounds of the same rectangle read from at most four blocks of one level, which can cover up to twice the
+        // rectangle along each axis. Always a constant four lookups.
+        void getBoundingRange(int x0, int z0, int x1, int z1, float& min_height, float& max_height) const;
+
+    public:
+        bool isEmpty() const { return height_field == nullptr; }
+
+        const HeightField& getHeightField() const { return *height_field; }
+
+        int getLevelCount() const { return static_cast<int>(levels.size()) + 1; }
+
+        int getColumns(int level) const { return level == 0 ? height_field->getWidth() : levels[level - 1].columns; }
+        int getRows(int level) const { return level == 0 ? height_field->getHeight() : levels[level - 1].rows; }
+
+        float getMin(int level, int i, int j) const;
+        float getMax(int level, int i, int j) const;
+
+        size_t getMemoryUsage() const;
+
+    private:
+        struct Level
+        {
+            int columns, rows;
+            std::vector<float> min, max;
+        };
+
+        void reduceRows(int level, int first_row, int last_row, int first_column, int last_column);
+
+        // Lowest level whose blocks are at least as large as the rectangle, which then spans two of them at most along each axis.
+        int getCoveringLevel(int x0, int z0, int x1, int z1) const;
+
+        void visitBlock(int level, int i, int j, int x0, int z0, int x1, int z1, float& min_height, float& max_height) const;
+
+    private:
+        const HeightField* height_field = nullptr;
+        std::vector<Level> levels; // From level 1 up.
+    };
+}
@@ -0,0 +1,33 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include "CompressedHeightField.h"
+#include "HeightField.h"
+#include "TiledHeightField.h"
+
+namespace bm
+{
+    // Bilinearly interpolated heights of a height field under count world positions (x[k], z[k]), which are clamped to its
+    // extent. If normals isn't null, it gets the normals of the same bilinear surface, (-gx, 1, -gz) normalized from its
+    // height gradient. The heights are the ones stored in the field, so the positions are in the units of its spacing.
+    //
+    // Queries are evaluated 4 (SSE4.1) or 8 (AVX2, with gathers) at a time, the remainder by the scalar code; all of them
+    // give the same results. The arrays are read and written in order only, so disjoint ranges can be sampled concurrently.
+    void sampleHeightField(const HeightField& height_field, const float* x, const float* z, size_t count, float* heights,
+                           Vector3D* normals = nullptr);
+
+    // Scalar version of the above, the reference the vectorized one is checked against.
+    void sampleHeightFieldReference(const HeightField& height_field, const float* x, const float* z, size_t count, float* heights,
+                                    Vector3D* normals = nullptr);
+
+    // The same over a tiled height field. Every corner of a query is indexed on its own, since a cell on a tile border
+    // has its right or lower corners in the next tile; the results are those of the row-major version.
+    void sampleHeightField(const TiledHeightField& height_field, const float* x, const float* z, size_t count, float* heights,
+                           Vector3D* normals = nullptr);
+
+    // The same queries over a compressed height field, one at a time: each reads its four samples straight from their
+    // blocks, so the field is never decoded. Matches sampleHeightFieldReference over the decoded field.
+    void sampleHeightField(const CompressedHeightField& height_field, const float* x, const float* z, size_t count, float* heights,
+                           Vector3D* normals = nullptr);
+}
@@ -0,0 +1,125 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace bm
+{
+    // Levels a .bmheights file can hold, enough for heightmaps of 2^20 samples per side in tiles of 32.
+    constexpr int max_height_tile_levels = 16;
+
+    // One level of detail of a .bmheights file. Level l keeps every 2^l-th sample of level 0, so the samples it keeps
+    // stay exactly where they are in the full heightmap.
+    struct HeightTileLevel
+    {
+        int32_t width, height;   // Samples.
+        int32_t columns, rows;   // Tiles.
+        uint32_t first_tile;     // Index of the level's first record, the records of a level are row-major.
+    };
+
+    // Entry of the tile index: where the tile lies in the file and the range of its heights.
+    struct HeightTileRecord
+    {
+        uint64_t offset;
+        uint32_t size;
+
+        // Range of the heights under the tile, without the apron: of its own samples on level 0, of every level 0 sample
+        // it stands for on the coarser levels, which don't keep them all.
+        float min_height, max_height;
+
+        uint32_t padding;
+    };
+
+    static_assert(sizeof(HeightTileRecord) == 24U, "HeightTileRecord is stored as raw bytes.");
+
+    // Layout of a .bmheights file: the header, the index of every tile of every level at index_offset, then the tiles.
+    // A tile has tile_size samples per side and shares its border samples with its neighbours. It is stored as
+    // (tile_size + 2)^2 float heights, row-major, with an apron of one sample around it so that normals can be computed
+    // on its borders without the neighbours. Samples past the edge of the level repeat the edge.
+    struct HeightTileFileHeader
+    {
+        char magic[4];
+        uint32_t version;
+
+        int32_t width, height; // Samples of level 0.
+        int32_t tile_size;
+        int32_t level_count;
+
+        uint32_t tile_count;
+        uint32_t padding;
+
+        uint64_t index_offset; // tile_count HeightTileRecord.
+        uint64_t file_size;
+
+        HeightTileLevel levels[max_height_tile_levels];
+    };
+
+    // Bumped whenever the layout of the file or the meaning of its contents changes.
+    constexpr uint32_t height_tile_file_version = 2U;
+
+    struct HeightTileFileSettings
+    {
+        // Threads used to build the tiles, 0 means one per hardware thread. The file doesn't depend on it.
+        unsigned thread_count = 0U;
+
+        // Samples per side of a tile. 129 matches the default tiles of TerrainTileCache.
+        int tile_size = 129;
+
+        // Heights are stored as channel * height_scale / height_reduction, the scaling Terrain applies to the bitmap.
+        float height_scale = 8.0f;
+        float height_reduction = 15.0f;
+    };
+
+    // Converts a 24-bit heightmap bitmap into a .bmheights file, with levels down to the first that fits in one tile.
+    // The bitmap is memory-mapped and the tiles are written as they are built, so the whole image is never in memory.
+    // The file is written as file_name.partial and renamed once complete, a failed conversion leaves file_name alone.
+    bool convertBitmapToHeightTiles(const wchar_t* bitmap_file_name, const wchar_t* file_name,
+                                    const HeightTileFileSettings& settings = HeightTileFileSettings());
+
+    // Open .bmheights file. The header and the index are read once, any tile can then be found in constant time and
+    // fetched with one read.
+    class HeightTileFile
+    {
+    public:
+        HeightTileFile(const wchar_t* file_name);
+       ~HeightTileFile();
+
+        HeightTileFile(const HeightTileFile&) = delete;
+        HeightTileFile(HeightTileFile&&) = delete;
+
+        HeightTileFile& operator=(const HeightTileFile&) = delete;
+        HeightTileFile& operator=(HeightTileFile&&) = delete;
+
+    public:
+        // False if the file is missing, truncated or of another version.
+        bool isValid() const { return valid; }
+
+        const HeightTileFileHeader& getHeader() const { return header; }
+
+        int getLevelCount() const { return header.level_count; }
+        const HeightTileLevel& getLevel(int level) const { return header.levels[level]; }
+
+        // Samples per side of a stored tile, apron included.
+        int getStoredTileSize() const { return header.tile_size + 2; }
+
+        const HeightTileRecord& getTile(int level, int column, int row) const
+        {
+            auto& tile_level = header.levels[level];
+            return tiles[tile_level.first_tile + static_cast<uint32_t>(row * tile_level.columns + column)];
+        }
+
+        // Reads the getStoredTileSize()^2 heights of a tile, apron included, with a single read at the offset of its
+        // record. The file position isn't used, so tiles can be read from several threads at once.
+        bool readTile(int level, int column, int row, float* heights) const;
+
+    private:
+        HANDLE file;
+
+        HeightTileFileHeader header;
+        std::vector<HeightTileRecord> tiles;
+
+        bool valid;
+    };
+}
@@ -0,0 +1,65 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "HeightPyramid.h"
+
+namespace bm
+{
+    // Occlusion culling of height field chunks with a 1D horizon around the camera: one elevation per azimuth bin, below
+    // which everything farther away is known to be under the terrain. Small blocks of the height field are walked front
+    // to back in rings around the camera's block (an order no ray from the camera ever goes against), each one tested
+    // against the horizon with its highest sample and then raising it with its lowest one. A chunk is hidden when all of
+    // its blocks are.
+    //
+    // Bins cover azimuths rather than screen columns: with a pitched camera screen columns aren't vertical planes, and the
+    // horizon only holds within a vertical plane. Azimuths use a diamond angle, monotonic in the real angle and cheaper.
+    class HorizonCulling
+    {
+    public:
+        explicit HorizonCulling(int bin_count = 4096);
+       ~HorizonCulling() = default;
+
+        HorizonCulling(const HorizonCulling&) = default;
+        HorizonCulling(HorizonCulling&&) = default;
+
+        HorizonCulling& operator=(const HorizonCulling&) = default;
+        HorizonCulling& operator=(HorizonCulling&&) = default;
+
+    public:
+        // Keeps the height range of every block of block_size quads per side, which has to divide the quads per side of
+        // the chunks that are culled.
+        void build(const HeightPyramid& height_pyramid, int block_size);
+
+        // Refreshes the blocks over the samples of [x0, x1] x [z0, z1] after they changed.
+        void update(const HeightPyramid& height_pyramid, int x0, int z0, int x1, int z1);
+
+        // visible lists chunks of chunk_quads quads per side, chunk_columns of them per row, starting at the first sample.
+        // The hidden ones are removed and the order of the rest is kept. chunk_errors, if given, is the largest vertical
+        // distance of every chunk's drawn surface from the height field (of its level of detail, say). The camera has to
+        // be above the terrain: below the lowest sample of its block nothing is culled, and between that and the surface
+        // chunks behind the ground above the camera are. Returns the number of visible chunks left.
+        size_t cull(const Vector3D& camera_position, int chunk_quads, int chunk_columns, const float* chunk_errors, std::vector<uint32_t>& visible);
+
+        bool isEmpty() const { return block_min.empty(); }
+
+        int getBlockSize() const { return block_size; }
+        int getBinCount() const { return static_cast<int>(horizon.size()); }
+
+    private:
+        void updateBlocks(const HeightPyramid& height_pyramid, int first_column, int last_column, int first_row, int last_row);
+
+    private:
+        int block_size;
+        int block_columns, block_rows;
+        float spacing;
+
+        std::vector<float> block_min, block_max;
+
+        std::vector<float> horizon; // Tangent of the elevation of every bin.
+        std::vector<uint8_t> chunk_states;
+    };
+}
@@ -0,0 +1,33 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+namespace bm
+{
+    // Read-only memory mapping of a whole file. The view stays valid until the object is destroyed.
+    class MappedFile
+    {
+    public:
+        MappedFile(const wchar_t* file_name);
+       ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile(MappedFile&&) = delete;
+
+        MappedFile& operator=(const MappedFile&) = delete;
+        MappedFile& operator=(MappedFile&&) = delete;
+
+    public:
+        bool isOpen() const { return data != nullptr; }
+
+        const unsigned char* getData() const { return data; }
+        size_t getSize() const { return size; }
+
+    private:
+        HANDLE file;
+        HANDLE mapping;
+
+        const unsigned char* data;
+        size_t size;
+    };
+}
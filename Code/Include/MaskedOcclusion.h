@@ -0,0 +1,123 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "FrustumCulling.h"
+
+namespace bm
+{
+    // Work and time of a MaskedOcclusion since its last clear, for profiling.
+    struct MaskedOcclusionStats
+    {
+        size_t triangle_count;     // Occluder triangles submitted.
+        size_t raster_count;       // Screen triangles left after clipping and culling.
+        double raster_milliseconds;
+
+        size_t query_count;
+        size_t hidden_count;
+        double query_milliseconds;
+    };
+
+    // Small depth-only software rasterizer for occlusion culling, after Masked Software Occlusion Culling (Hasselgren,
+    // Andersson and Akenine-Möller). The screen is split into tiles of 32x8 pixels that keep a coverage bit per pixel
+    // and two depths instead of a depth per pixel: z0 holds for the whole tile, z1 for the covered pixels of the layer
+    // being built, which replaces z0 as soon as it covers the tile. Bounding boxes are tested against z0 tile by tile,
+    // the coarse level of a hierarchical depth buffer, and against z1 where the layer covers them.
+    //
+    // Coverage is sampled at pixel centers, so at this low resolution a sliver of an occludee thinner than a pixel along
+    // an occluder's silhouette can be culled. Tile rows are rasterized in parallel; the result doesn't depend on the
+    // number of threads.
+    class MaskedOcclusion
+    {
+    public:
+        // The resolution is rounded up to whole tiles.
+        MaskedOcclusion(int width = 256, int height = 128, unsigned thread_count = 0U);
+       ~MaskedOcclusion() = default;
+
+        MaskedOcclusion(const MaskedOcclusion&) = default;
+        MaskedOcclusion(MaskedOcclusion&&) = default;
+
+        MaskedOcclusion& operator=(const MaskedOcclusion&) = default;
+        MaskedOcclusion& operator=(MaskedOcclusion&&) = default;
+
+    public:
+        // Empties the depth buffer for a frame seen through view_projection, in the DirectX conventions.
+        void clear(const Matrix& view_projection);
+
+        // Rasterizes indexed world space triangles of either winding as occluders. They must not be in front of what they
+        // stand for, like a mesh under the terrain surface.
+        void renderOccluders(const Vector3D* positions, size_t vertex_count, const uint32_t* indices, size_t triangle_count);
+
+        // Same as renderOccluders on the scalar code of a BM_DISABLE_SIMD build, whatever the build, for testing the
+        // vector code against.
+        void renderOccludersReference(const Vector3D* positions, size_t vertex_count, const uint32_t* indices, size_t triangle_count);
+
+        // False when the box is hidden behind the occluders or off the screen.
+        bool isBoxVisible(const Vector3D& bounds_min, const Vector3D& bounds_max) const;
+
+        // Removes the hidden boxes from visible and keeps the order of the rest. Returns the number of visible boxes left.
+        size_t cullBoundingBoxes(const BoundingBoxes& boxes, std::vector<uint32_t>& visible);
+
+    public:
+        int getWidth() const { return tile_columns * tile_width; }
+        int getHeight() const { return tile_rows * tile_height; }
+
+        // Depth behind which the whole tile is hidden, 1 while nothing covers it.
+        float getTileDepth(int tile_x, int tile_y) const { return tiles[tile_y * tile_columns + tile_x].z0; }
+
+        const MaskedOcclusionStats& getStats() const { return stats; }
+
+    public:
+        static constexpr int tile_width = 32;
+        static constexpr int tile_height = 8;
+
+    private:
+        struct Tile
+        {
+            uint32_t mask[tile_height]; // Bit k of row r is pixel k of the row.
+            float z0, z1;
+        };
+
+        // Edges are positive inside, depth is a plane over the screen, both in pixels.
+        struct ScreenTriangle
+        {
+            float edge_a[3], edge_b[3], edge_c[3];
+            float depth_x, depth_y, depth_0;
+            float depth_max;
+            float min_x, min_y, max_x, max_y;
+            int first_tile_x, last_tile_x;
+            int first_tile_y, last_tile_y;
+        };
+
+        void renderOccluders(const Vector3D* positions, size_t vertex_count, const uint32_t* indices, size_t triangle_count, bool reference);
+
+        void setupTriangle(const Vector4D* clip);
+        void rasterizeTileRow(const ScreenTriangle& triangle, int tile_y, bool reference);
+
+        // First and last pixel of every row of a tile row within the triangle, and the coverage masks of one of its tiles
+        // from those, false when it's empty. The vector code gives the same results as the reference code.
+        static void getRowSpans(const ScreenTriangle& triangle, int tile_y, int* first, int* last);
+        static void getRowSpansReference(const ScreenTriangle& triangle, int tile_y, int* first, int* last);
+        static bool getCoverage(const int* first, const int* last, int tile_left, uint32_t* coverage);
+        static bool getCoverageReference(const int* first, const int* last, int tile_left, uint32_t* coverage);
+
+        void updateTile(Tile& tile, const uint32_t* coverage, float depth);
+
+    private:
+        int tile_columns, tile_rows;
+        unsigned thread_count;
+
+        float view_projection[4][4];
+
+        std::vector<Tile> tiles;
+
+        std::vector<Vector4D> clip_vertices;
+        std::vector<ScreenTriangle> triangles;
+        std::vector<std::vector<uint32_t>> tile_row_triangles; // Triangles overlapping every tile row, in submission order.
+
+        MaskedOcclusionStats stats;
+    };
+}
@@ -0,0 +1,41 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include "HeightField.h"
+
+namespace bm
+{
+    // Normal, tangent and binormal of one height field sample.
+    struct HeightFieldFrame
+    {
+        Vector3D normal;
+        Vector3D tangent;
+        Vector3D binormal;
+    };
+
+    // Per-vertex normals of a height field, each one the average of the (up to four) face normals that touch the vertex,
+    // with the quads split along the same diagonal as Terrain::buildTerrainModel.
+    //
+    // Interior vertices are handled 4 (SSE4.1) or 8 (AVX2) at a time, the outermost rows and columns by a scalar edge pass.
+    // Only rows [first_row, last_row) are written, so disjoint row bands can be processed concurrently.
+    void computeHeightFieldNormals(HeightField& height_field, int first_row, int last_row);
+
+    // Straightforward scalar version that builds the face normals first and then averages them.
+    // Kept as the reference the vectorized kernels are checked against.
+    void computeHeightFieldNormalsReference(HeightField& height_field);
+
+    // Closed-form tangent frames of one row of samples. On a regular grid textured along X and against Z, the tangent and
+    // the binormal only depend on the height gradient (gx, gz), taken from central differences (one-sided on the borders):
+    //   T = (1, gx, 0) / sqrt(1 + gx^2),  B = (0, -gz, -1) / sqrt(1 + gz^2),  N = (-gx, 1, -gz) / sqrt(1 + gx^2 + gz^2)
+    // This replaces the per-face tangent and binormal averaging, and the normal pass, for meshes built from a height field.
+    // The row is read-only, so any set of rows can be processed concurrently.
+    void computeHeightFieldFrames(const HeightField& height_field, int row, HeightFieldFrame* frames);
+
+    // The frames of columns [first_column, last_column) of a row only, frames[0] being the one of first_column. Bit for
+    // bit the same as those of the whole row, so edits can refresh part of a mesh built from it.
+    void computeHeightFieldFrames(const HeightField& height_field, int row, int first_column, int last_column, HeightFieldFrame* frames);
+
+    // The frame above for a single gradient, e.g. the one of a planar triangle.
+    HeightFieldFrame getGradientFrame(float gx, float gz);
+}
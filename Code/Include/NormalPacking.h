@@ -0,0 +1,95 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+namespace bm
+{
+    // Octahedral normal encoding: the unit sphere is projected onto the octahedron |x| + |y| + |z| = 1,
+    // unfolded around the Y (up) axis and stored as two 16-bit signed normalized values.
+    // Maximum angular error is well below 0.01 degree.
+    inline float signNotZero(float value)
+    {
+        return value < 0.0f ? -1.0f : 1.0f;
+    }
+
+    // Rounds half away from zero like std::lround, which is a library call: in double precision, adding the half to a
+    // float of at most 32767 is exact, and the conversion truncates.
+    inline int16_t quantizeSnorm16(float value)
+    {
+        value = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+
+        auto scaled = value * 32767.0f;
+        return static_cast<int16_t>(static_cast<int>(static_cast<double>(scaled) + (scaled < 0.0f ? -0.5 : 0.5)));
+    }
+
+    // Projects a normal onto the unfolded octahedron, both coordinates are in [-1, 1].
+    inline void projectOctahedral(const Vector3D& normal, float& u, float& v)
+    {
+        auto l1_norm = std::fabs(normal.x) + std::fabs(normal.y) + std::fabs(normal.z);
+        auto x = normal.x / l1_norm;
+        auto z = normal.z / l1_norm;
+
+        // Fold the lower hemisphere over the diagonals.
+        if(normal.y < 0.0f)
+        {
+            auto folded_x = (1.0f - std::fabs(z)) * signNotZero(x);
+            auto folded_z = (1.0f - std::fabs(x)) * signNotZero(z);
+
+            x = folded_x;
+            z = folded_z;
+        }
+
+        u = x;
+        v = z;
+    }
+
+    inline Vector3D unprojectOctahedral(float u, float v)
+    {
+        auto x = u;
+        auto z = v;
+        auto y = 1.0f - std::fabs(x) - std::fabs(z);
+
+        if(y < 0.0f)
+        {
+            auto unfolded_x = (1.0f - std::fabs(z)) * signNotZero(x);
+            auto unfolded_z = (1.0f - std::fabs(x)) * signNotZero(z);
+
+            x = unfolded_x;
+            z = unfolded_z;
+        }
+
+        auto length = std::sqrt(x * x + y * y + z * z);
+
+        return Vector3D(x / length, y / length, z / length);
+    }
+
+    inline void encodeOctahedral(const Vector3D& normal, int16_t& u, int16_t& v)
+    {
+        float x, z;
+        projectOctahedral(normal, x, z);
+
+        u = quantizeSnorm16(x);
+        v = quantizeSnorm16(z);
+    }
+
+    inline Vector3D decodeOctahedral(int16_t u, int16_t v)
+    {
+        return unprojectOctahedral(static_cast<float>(u) / 32767.0f, static_cast<float>(v) / 32767.0f);
+    }
+
+    inline uint32_t packNormal(const Vector3D& normal)
+    {
+        int16_t u, v;
+        encodeOctahedral(normal, u, v);
+
+        return static_cast<uint16_t>(u) | (static_cast<uint32_t>(static_cast<uint16_t>(v)) << 16);
+    }
+
+    inline Vector3D unpackNormal(uint32_t packed)
+    {
+        return decodeOctahedral(static_cast<int16_t>(packed & 0xFFFFU), static_cast<int16_t>(packed >> 16));
+    }
+}
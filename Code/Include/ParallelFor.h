@@ -0,0 +1,56 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace bm
+{
+    // Number of worker threads to use for a requested count, where 0 means one per hardware thread.
+    inline unsigned resolveThreadCount(unsigned thread_count)
+    {
+        if(thread_count == 0U)
+            thread_count = std::thread::hardware_concurrency();
+
+        return thread_count == 0U ? 1U : thread_count;
+    }
+
+    // Splits [begin, end) into contiguous bands of nearly equal size and calls body(band_begin, band_end) for each of them,
+    // one band per thread. The calling thread processes the first band itself. The split only depends on the range and the
+    // thread count, and bands never overlap, so a body that writes only its own band gives the same result for any thread count.
+    template<typename Function>
+    void parallelFor(int begin, int end, unsigned thread_count, Function&& body)
+    {
+        auto count = end - begin;
+        if(count <= 0)
+            return;
+
+        auto band_count = static_cast<int>(std::min(resolveThreadCount(thread_count), static_cast<unsigned>(count)));
+        if(band_count == 1)
+        {
+            body(begin, end);
+            return;
+        }
+
+        auto getBandBegin([&](int band)
+        {
+            return begin + static_cast<int>((static_cast<long long>(count) * band) / band_count);
+        });
+
+        std::vector<std::thread> workers;
+        workers.reserve(band_count - 1);
+
+        for(auto band = 1; band < band_count; band++)
+            workers.emplace_back([&body, band_begin = getBandBegin(band), band_end = getBandBegin(band + 1)]()
+            {
+                body(band_begin, band_end);
+            });
+
+        body(begin, getBandBegin(1));
+
+        for(auto& worker : workers)
+            worker.join();
+    }
+}
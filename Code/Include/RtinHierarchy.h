@@ -0,0 +1,60 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "HeightField.h"
+
+namespace bm
+{
+    // Error hierarchy of a right-triangulated irregular network over a height field (Evans, Kirkpatrick and Townsend,
+    // "Right-Triangulated Irregular Networks"). The height field is covered by a 2^k + 1 grid split recursively into
+    // right triangles along their hypotenuse; every hypotenuse midpoint stores the largest vertical error of any triangle
+    // below it, so a single threshold extracts a crack-free mesh.
+    //
+    // Building the hierarchy is the offline part, extracting a mesh for a given error is cheap and can run at any time.
+    class RtinHierarchy
+    {
+    public:
+        RtinHierarchy() = default;
+       ~RtinHierarchy() = default;
+
+        RtinHierarchy(const RtinHierarchy&) = default;
+        RtinHierarchy(RtinHierarchy&&) = default;
+
+        RtinHierarchy& operator=(const RtinHierarchy&) = default;
+        RtinHierarchy& operator=(RtinHierarchy&&) = default;
+
+    public:
+        // Triangles are never extracted across the lines every block_size samples, so the mesh can be cut into chunks
+        // of that many quads. 0 leaves the mesh in one piece.
+        void build(const HeightField& height_field, int block_size = 0);
+
+        // Appends the triangles of the mesh within max_error of the height field, as row-major sample indices of the
+        // height field, three per triangle, with the winding of the full resolution terrain mesh.
+        void extractMesh(float max_error, std::vector<uint32_t>& triangles) const;
+
+    public:
+        bool isEmpty() const { return errors.empty(); }
+
+        // Samples per side of the covering grid.
+        int getGridSize() const { return grid_size; }
+
+        // Error at a hypotenuse midpoint, infinite where the triangles have to be split regardless of the heights.
+        float getError(int x, int z) const { return errors[static_cast<size_t>(z) * grid_size + x]; }
+
+        size_t getMemoryUsage() const { return errors.capacity() * sizeof(float); }
+
+    private:
+        void extractTriangle(int ax, int az, int bx, int bz, int cx, int cz, float max_error, std::vector<uint32_t>& triangles) const;
+
+    private:
+        int width = 0;
+        int height = 0;
+        int grid_size = 0;
+
+        std::vector<float> errors;
+    };
+}
@@ -0,0 +1,16 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+// Compile-time selection of the vector instruction sets used by the CPU-side terrain kernels.
+// SSE4.1 is the baseline on x86/x64; AVX2 paths are enabled when the compiler targets it (/arch:AVX2).
+// Define BM_DISABLE_SIMD to fall back to the scalar code everywhere.
+#if !defined(BM_DISABLE_SIMD) && (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+#   define BM_SIMD_SSE4 1
+#   include <smmintrin.h>
+
+#   if defined(__AVX2__)
+#       define BM_SIMD_AVX2 1
+#       include <immintrin.h>
+#   endif
+#endif
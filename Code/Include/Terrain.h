@@ -4,19 +4,94 @@
 
 #include <d3d11.h>
 
-#include <stdio.h>
+#include "CdlodQuadtree.h"
+#include "CompressedHeightField.h"
+#include "FrustumCulling.h"
+#include "HeightField.h"
+#include "HeightFieldRayCast.h"
+#include "HeightPyramid.h"
+#include "HorizonCulling.h"
+#include "MaskedOcclusion.h"
+#include "NormalKernels.h"
+#include "TerrainChunk.h"
+#include "TiledHeightField.h"
 
 namespace bm
 {
+    enum class TerrainMeshType
+    {
+        Unindexed, // Six unique vertices per quad.
+        Indexed    // One shared vertex per heightmap sample and a triangle index buffer.
+    };
+
+    enum class TerrainTangentFrames
+    {
+        PerFace, // Face normals, tangents and binormals averaged around every vertex, three separate passes.
+        Gradient // Closed form from the height gradient, computed while the model is built.
+    };
+
+    enum class TerrainLevelOfDetail
+    {
+        None,
+        Geomipmapping, // Per chunk levels of the indexed mesh with stitched edges, see Geomipmapping.h.
+        Cdlod          // Quadtree of morphing grid patches displaced by a height texture, see CdlodQuadtree.h.
+    };
+
+    struct TerrainSettings
+    {
+        // Threads used to build the terrain, 0 means one per hardware thread. The result doesn't depend on it.
+        unsigned thread_count = 0U;
+
+        TerrainMeshType mesh_type = TerrainMeshType::Indexed;
+
+        // Samples per side of a chunk of the indexed mesh. At most 256, so that a chunk can be drawn with 16-bit indices.
+        int chunk_size = 65;
+
+        // The compact format has to be drawn with the matching TerrainShader format.
+        TerrainVertexFormat vertex_format = TerrainVertexFormat::Full;
+
+        TerrainTangentFrames tangent_frames = TerrainTangentFrames::Gradient;
+
+        // Reorders the triangles and vertices of every chunk for the post-transform vertex cache and for vertex fetch.
+        bool optimize_vertex_cache = true;
+
+        // Largest vertical error, in world units, of the indexed mesh after RTIN simplification (see RtinHierarchy.h).
+        // The chunks then only keep the samples the simplified triangles use, with tangent frames recomputed from those
+        // triangles, and geomipmapping is skipped. 0 keeps every sample.
+        float simplification_error = 0.0f;
+
+        // Levels are picked by selectLevelsOfDetail. Geomipmapping needs the full indexed mesh; CDLOD draws its own patches
+        // and has to be drawn with the Patch format of TerrainShader.
+        TerrainLevelOfDetail level_of_detail = TerrainLevelOfDetail::Geomipmapping;
+
+        // Cache of the finished build, reused while the heightmap and the settings above stay the same and rebuilt
+        // automatically otherwise. Empty disables it.
+        std::wstring bake_file_name;
+
+        // Lets cullDrawCalls also drop the chunks hidden behind nearer terrain (see HorizonCulling.h). Not used with CDLOD.
+        bool horizon_culling = true;
+
+        // Also drops the chunks hidden behind a coarse mesh under the terrain, drawn by a small software rasterizer (see
+        // MaskedOcclusion.h). Not used with CDLOD either.
+        bool occlusion_culling = false;
+
+        // Keeps a second copy of the heightmap in tiles of 16 x 16 samples (see TiledHeightField.h) for getGroundHeights,
+        // castRay and castRays, at another 8 bytes per sample. On large maps it makes queries scattered over the terrain or
+        // running along Z cheaper, and ones running along X dearer. Rays read the quads they reach from it, the levels above
+        // stay in the pyramid.
+        bool tiled_ground_queries = false;
+
+        // Above 0, quantizes the heightmap to this step, in world units, and keeps it as a CompressedHeightField (see
+        // CompressedHeightField.h) that getGroundHeights answers from instead, at a byte or two per sample on terrain. The
+        // normals and the meshes are built from its decoded rows and edits are quantized the same way, so what is drawn
+        // and what the queries answer stay the same. 8 / 15, the step of a bitmap, keeps bitmap heights to within float
+        // rounding.
+        float ground_height_precision = 0.0f;
+    };
+
     class Terrain
     {
     private:
-        struct HeightMapType
-        {
-            float x, y, z;
-            float nx, ny, nz;
-        };
-
         struct VectorType
         {
             float x, y, z;
@@ -48,7 +123,9 @@ namespace bm
         };
 
     public:
-        Terrain(ID3D11Device*, const wchar_t* height_map_file_name, const wchar_t* diffuse_map_file_name, const wchar_t* bump_map_file_name);
+        // The heightmap is either a 24-bit bitmap or a .bmhc file written by convertBitmapToCompressedHeights.
+        Terrain(ID3D11Device*, const wchar_t* height_map_file_name, const wchar_t* diffuse_map_file_name, const wchar_t* bump_map_file_name,
+                const TerrainSettings& settings = TerrainSettings());
        ~Terrain();
 
         Terrain(const Terrain&) = delete;
@@ -61,33 +138,195 @@ namespace bm
         void render(ID3D11DeviceContext* device_context);
 
         int getIndexCount();
+
+        const std::vector<TerrainChunk>& getChunks() const { return chunks; }
+        const std::vector<TerrainDrawCall>& getDrawCalls() const { return draw_calls; }
+
+        // Draw calls that survived the last cullDrawCalls, all of them before the first one.
+        const std::vector<TerrainDrawCall>& getVisibleDrawCalls() const { return visible_draw_calls; }
+
+        // Height ranges of any region of the heightmap.
+        const HeightPyramid& getHeightPyramid() const { return height_pyramid; }
+
+        // Ground height under each of count world X/Z positions, bilinear between the heightmap samples as scaled by
+        // loadHeightMap and reduceHeightMap, and the normal of that surface if normals isn't null. Positions off the
+        // terrain are clamped to its border. Large batches are split over settings.thread_count threads.
+        void getGroundHeights(const float* x, const float* z, size_t count, float* heights, Vector3D* normals = nullptr) const;
+
+        // First hit of a world ray with the terrain triangles within max_distance (see castHeightFieldRay), for picking
+        // and line of sight. The batched cast flags misses with a negative distance and splits over the threads too.
+        bool castRay(const Vector3D& origin, const Vector3D& direction, float max_distance, HeightFieldRayHit& hit) const;
+        void castRays(const Vector3D* origins, const Vector3D* directions, size_t count, float max_distance, HeightFieldRayHit* hits) const;
+
+        // Sets the width x height samples from (x, z), clipped to the terrain, to heights (row by row, in the world units
+        // of getGroundHeights) and refreshes only what depends on them: the tangent frames up to one sample around them,
+        // the vertices of those samples, and the bounds, level of detail errors and culling data of the chunks touched.
+        // Needs the indexed mesh with gradient frames, without simplification or CDLOD, and returns false otherwise.
+        // The compact vertex format clamps the heights to the range it was quantized for.
+        bool editHeights(int x, int z, int width, int height, const float* heights);
+
+        // Vertex buffer ranges rewritten by the edits since the last render, which uploads them. The bytes of the ranges
+        // follow each other in getBufferUpdateData.
+        const std::vector<TerrainBufferUpdate>& getBufferUpdates() const { return buffer_updates; }
+        const std::vector<unsigned char>& getBufferUpdateData() const { return buffer_update_data; }
+
+        const CdlodQuadtree& getCdlodQuadtree() const { return cdlod_quadtree; }
+        const std::vector<CdlodDrawRecord>& getCdlodRecords() const { return cdlod_records; }
+
+        // Picks the level of every chunk (or the CDLOD nodes) for a camera, so that nothing is off by more than
+        // max_pixel_error pixels, and updates the draw calls with it.
+        void selectLevelsOfDetail(const Vector& camera_position, const Matrix& projection, float viewport_height, float max_pixel_error = 2.0f);
+
+        // Keeps the draw calls whose chunk (or CDLOD node) bounds intersect the frustum and, with horizon or occlusion
+        // culling, whose chunk isn't hidden behind nearer terrain, in their original order. A camera under the ground
+        // (a free camera flying through a hill) gets the frustum culling alone. Call it after selectLevelsOfDetail,
+        // which replaces the draw calls.
+        void cullDrawCalls(const Frustum& frustum, const Vector& camera_position, const Matrix& view_projection);
+
+        // Tests the world bounds of other objects (trees, buildings, units) against the terrain occluders of the last
+        // cullDrawCalls, so the terrain hides them too. False only if the bounds are hidden behind the terrain or off the
+        // screen; true whenever that cullDrawCalls didn't rasterize occluders (occlusion culling off, the CDLOD mode, a
+        // camera under the ground). cullObjects removes the hidden ones from visible, keeping the order of the rest.
+        bool isObjectVisible(const Vector3D& bounds_min, const Vector3D& bounds_max) const;
+        size_t cullObjects(const BoundingBoxes& bounds, std::vector<uint32_t>& visible);
+
+        // Rasterizer of the occlusion culling, for its statistics.
+        const MaskedOcclusion& getMaskedOcclusion() const { return masked_occlusion; }
+
         ID3D11ShaderResourceView* getColorTexture();
         ID3D11ShaderResourceView* getNormalMapTexture();
 
+        // Heightmap as an R32_FLOAT texture for the CDLOD patches, null in the other modes.
+        ID3D11ShaderResourceView* getHeightTexture();
+
     private:
         // For constructor, to make it easier for understanding.
+        bool buildTerrain(ID3D11Device* device, const wchar_t* height_map_file_name, uint64_t content_hash);
+
+        uint64_t hashTerrainSource(const wchar_t* height_map_file_name);
+        bool loadBake(ID3D11Device* device, uint64_t content_hash);
+
+        // Releases the buffers and drops the mesh a loadBake that failed part way left behind, so that buildTerrain starts
+        // from nothing.
+        void releaseMesh();
+
+        // Geomipmapping index sets of the chunks, and their errors unless they were loaded with them.
+        bool buildLevelsOfDetail(ID3D11Device* device, bool compute_errors);
+        void updateLodDrawCalls();
+
+        bool buildCdlod(ID3D11Device* device);
+        void updateCdlodDrawCalls();
+
+        bool isBelowGround(const Vector3D& position) const;
+        const float* updateChunkErrors();
+
+        void buildOccluderMesh();
+        void updateOccluderHeights(int first_column, int last_column, int first_row, int last_row);
+        void updateOccluderMesh(const Frustum& frustum, float pixel_scale, const float* errors, const Vector3D& camera_position);
+
         bool loadHeightMap(const wchar_t* file_name);
         void reduceHeightMap();
         bool calculateNormals();
 
         bool buildTerrainModel();
+        bool buildIndexedTerrainModel();
 
         void calculateTerrainVectors();
+        void calculateIndexedTerrainVectors();
+
+        void buildTerrainChunks();
+        void calculateSimplifiedTerrainVectors(const std::vector<uint32_t>& triangles);
+
+        void setFrame(ModelType& model, const HeightFieldFrame& frame);
+        void storeFrameNormals(int row, const HeightFieldFrame* frames);
+
         void calculateTangentBinormal(TempVertexType vertex1, TempVertexType vertex2, TempVertexType vertex3, VectorType& tangent, VectorType& binormal);
 
-        bool initializeBuffers(ID3D11Device* device);
+        void buildVertices(std::vector<unsigned char>& vertices);
+        void updateVertices(const TerrainChunk& chunk, int x0, int z0, int x1, int z1);
+
+        static void storeVertex(CompactTerrainVertex& vertex, const ModelType& model, const TerrainChunk& chunk);
+        static void storeVertex(VertexType& vertex, const ModelType& model, const TerrainChunk& chunk);
+        bool initializeBuffers(ID3D11Device* device, const void* vertices, const void* indices);
+
+        size_t getIndexSize() const;
 
         bool loadTextures(ID3D11Device* device, const wchar_t* diffuse_texture_file_name, const wchar_t* bump_map_file_name);
 
     private:
+        // Scaling applied to the heightmap samples by loadHeightMap and reduceHeightMap.
+        static constexpr float grid_spacing = 32.0f;
+        static constexpr float height_scale = 8.0f;
+        static constexpr float height_reduction = 15.0f;
+
+        // Quads per side of a CDLOD leaf node and of the grid patch drawn for every node.
+        static constexpr int cdlod_patch_size = 32;
+
+        // Ground queries and rays handed to a thread at a time, so that small batches stay on the calling one.
+        static constexpr size_t ground_query_batch = 16384U;
+        static constexpr size_t ray_cast_batch = 256U;
+
+        // Unchanged vertices an edit rewrites rather than start another buffer update.
+        static constexpr UINT buffer_update_gap = 8U;
+
+        // Top and two walls of every occluder cell.
+        static constexpr uint32_t occluder_cell_quads = 3U;
+
+    private:
+        TerrainSettings settings;
+
         int terrain_width, terrain_height;
 
-        HeightMapType* height_map;
+        HeightField height_map;
+        HeightPyramid height_pyramid; // Over height_map, rebuilt with it.
+        TiledHeightField tiled_height_map; // Copy of height_map for getGroundHeights, empty unless settings.tiled_ground_queries.
+        CompressedHeightField compressed_height_map; // Encoding of height_map for getGroundHeights, empty unless settings.ground_height_precision.
         ModelType* terrain_model;
 
+        std::vector<TerrainChunk> chunks;
+        std::vector<uint16_t> chunk_indices;
+        std::vector<uint16_t> chunk_vertices; // Row-major sample of every chunk vertex in buffer order, empty if not reordered.
+        std::vector<TerrainDrawCall> draw_calls;
+
+        BoundingBoxes draw_call_bounds; // World bounds of every draw call.
+        std::vector<uint32_t> visible_indices;
+        std::vector<TerrainDrawCall> visible_draw_calls;
+
+        HorizonCulling horizon_culling; // Empty unless used.
+        std::vector<float> chunk_errors;
+
+        // Occluder cells of occluder_step quads per side, empty unless used: their lowest samples, those lowered by the
+        // errors of the frame, and the quads drawn for the cells in the frustum, nearest cell first. The rasterizer runs
+        // on the calling thread, a frame's occluders are too few to pay for starting threads.
+        int occluder_step, occluder_columns;
+        std::vector<float> occluder_heights, occluder_levels;
+        std::vector<Vector3D> occluder_vertices;
+        std::vector<uint32_t> occluder_indices;
+        MaskedOcclusion masked_occlusion;
+        bool occluders_rendered; // By the last cullDrawCalls.
+
+        int chunk_columns;
+        std::vector<uint16_t> lod_indices;
+        std::vector<TerrainLodRange> lod_ranges;
+        std::vector<int> lod_levels;
+
+        CdlodQuadtree cdlod_quadtree;
+        std::vector<CdlodDrawRecord> cdlod_records;
+
         int vertex_count, index_count;
+        UINT vertex_stride;
+        DXGI_FORMAT index_format;
+
+        // Edits not uploaded yet, and the frames of the samples around the last one.
+        std::vector<TerrainBufferUpdate> buffer_updates;
+        std::vector<unsigned char> buffer_update_data;
+        std::vector<HeightFieldFrame> edit_frames;
+        std::vector<unsigned char> edit_samples; // Of a chunk, non-zero where they were edited.
 
-        ID3D11Buffer *vertex_buffer, *index_buffer;
+        ID3D11Buffer *vertex_buffer, *index_buffer, *lod_index_buffer;
+        ID3D11Buffer *patch_vertex_buffer, *patch_index_buffer;
+        ID3D11Texture2D* height_texture_resource;
+        ID3D11ShaderResourceView* height_texture;
         ID3D11ShaderResourceView* diffuse_texture, *bump_texture;
     };
 }
\ No newline at end of file
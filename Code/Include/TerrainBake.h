@@ -0,0 +1,104 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+
+#include "MappedFile.h"
+#include "TerrainChunk.h"
+
+namespace bm
+{
+    // Layout of a .bmterrain file: the header followed by 16-byte aligned sections at the offsets it records.
+    // Everything is stored exactly as the terrain uses it, so loading is a bulk copy and the vertex and index sections
+    // go to the GPU straight from the mapped view.
+    struct TerrainBakeHeader
+    {
+        char magic[4];
+        uint32_t version;
+
+        // Hash of the heightmap file and of every setting that changes the baked data.
+        uint64_t content_hash;
+
+        int32_t terrain_width;
+        int32_t terrain_height;
+
+        uint32_t vertex_stride;
+        uint32_t vertex_count;
+        uint32_t index_size;
+        uint32_t index_count;
+        uint32_t chunk_count;
+        uint32_t vertex_order_count; // vertex_count if the chunk vertices were reordered, 0 otherwise.
+
+        uint64_t heights_offset;  // terrain_width * terrain_height floats.
+        uint64_t normals_offset;  // terrain_width * terrain_height packed normals.
+        uint64_t chunks_offset;   // chunk_count TerrainChunk.
+        uint64_t vertices_offset; // vertex_count * vertex_stride bytes.
+        uint64_t indices_offset;  // index_count * index_size bytes.
+        uint64_t vertex_order_offset; // vertex_order_count row-major chunk samples of the vertices.
+
+        uint64_t file_size;
+
+        // hashBytes of the sections, each chained into the next, in the order above.
+        uint64_t sections_hash;
+    };
+
+    // Bumped whenever the layout of the file or of TerrainChunk changes.
+    constexpr uint32_t terrain_bake_version = 4U;
+
+    static_assert(std::is_trivially_copyable<TerrainChunk>::value, "TerrainChunk is stored in the bake as raw bytes.");
+
+    // 64-bit hash of a block of bytes, chained through seed. Not cryptographic, only used to detect stale bakes.
+    uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 0U);
+
+    // Memory-mapped .bmterrain file, checked against the hash of the data it is expected to contain.
+    class TerrainBake
+    {
+    public:
+        TerrainBake(const wchar_t* file_name, uint64_t content_hash);
+       ~TerrainBake() = default;
+
+        TerrainBake(const TerrainBake&) = delete;
+        TerrainBake(TerrainBake&&) = delete;
+
+        TerrainBake& operator=(const TerrainBake&) = delete;
+        TerrainBake& operator=(TerrainBake&&) = delete;
+
+    public:
+        // False if the file is missing, truncated, of another version, baked from different data or damaged: the sections
+        // have to match their hash and every chunk has to lie inside the terrain and the vertex and index sections.
+        bool isValid() const { return valid; }
+
+        const TerrainBakeHeader& getHeader() const { return *reinterpret_cast<const TerrainBakeHeader*>(file.getData()); }
+
+        const float* getHeights() const { return getSection<float>(getHeader().heights_offset); }
+        const uint32_t* getNormals() const { return getSection<uint32_t>(getHeader().normals_offset); }
+        const TerrainChunk* getChunks() const { return getSection<TerrainChunk>(getHeader().chunks_offset); }
+        const void* getVertices() const { return getSection<unsigned char>(getHeader().vertices_offset); }
+        const void* getIndices() const { return getSection<unsigned char>(getHeader().indices_offset); }
+        const uint16_t* getVertexOrder() const { return getSection<uint16_t>(getHeader().vertex_order_offset); }
+
+    private:
+        template<typename Type>
+        const Type* getSection(uint64_t offset) const { return reinterpret_cast<const Type*>(file.getData() + offset); }
+
+        bool hasValidChunks() const;
+
+    private:
+        MappedFile file;
+        bool valid;
+    };
+
+    // Writes a bake, the header's offsets and file size are filled in here. The header goes last, so a partially written
+    // file never passes validation, and the file is written as file_name.partial and renamed once complete, so a failed
+    // write leaves file_name alone.
+    bool writeTerrainBake(const wchar_t* file_name,
+                          TerrainBakeHeader header,
+                          const float* heights,
+                          const uint32_t* normals,
+                          const TerrainChunk* chunks,
+                          const void* vertices,
+                          const void* indices,
+                          const uint16_t* vertex_order);
+}
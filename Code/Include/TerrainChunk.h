@@ -0,0 +1,76 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include "TerrainVertex.h"
+
+namespace bm
+{
+    // Enough levels of detail for the largest chunk, 256 samples per side.
+    constexpr int max_terrain_lod_levels = 9;
+
+    // Fixed-size piece of the terrain mesh. Chunks share the terrain vertex and index buffers; each one owns a contiguous
+    // vertex range (so 16-bit indices are enough) and a contiguous index range. Neighbouring chunks duplicate their border samples.
+    struct TerrainChunk
+    {
+        // First heightmap sample and size of the chunk in samples.
+        int x, z;
+        int width, height;
+
+        UINT base_vertex;
+        UINT vertex_count;
+
+        UINT start_index;
+        UINT index_count;
+
+        // Axis aligned bounds in world space.
+        Vector3D bounds_min;
+        Vector3D bounds_max;
+
+        // Dequantization constants for the compact vertex format.
+        CompactVertexTransform transform;
+
+        // Geomipmapping levels, each with its largest vertical error, and the first of the lod_level_count * 16 index
+        // ranges of the chunk's level and stitching variants (see Geomipmapping.h).
+        int lod_level_count;
+        float lod_errors[max_terrain_lod_levels];
+        UINT lod_ranges;
+    };
+
+    // Part of the level of detail index buffer drawn for one level and stitching variant.
+    struct TerrainLodRange
+    {
+        UINT start_index;
+        UINT index_count;
+    };
+
+    // Placement of the CDLOD grid patch for one node (see CdlodQuadtree.h).
+    struct TerrainPatchTransform
+    {
+        // First heightmap sample of the node, samples per patch quad and world units per sample.
+        float x, z;
+        float step;
+        float spacing;
+
+        // Distances from the camera over which the vertices morph into the next coarser level.
+        float morph_start, morph_end;
+    };
+
+    // Range of the terrain vertex buffer rewritten by an edit, in bytes.
+    struct TerrainBufferUpdate
+    {
+        UINT offset;
+        UINT size;
+    };
+
+    // Arguments of one DrawIndexed call.
+    struct TerrainDrawCall
+    {
+        UINT index_count;
+        UINT start_index;
+        INT base_vertex;
+
+        CompactVertexTransform transform;
+        TerrainPatchTransform patch;
+    };
+}
@@ -6,6 +6,8 @@
 
 #include <fstream>
 
+#include "TerrainChunk.h"
+
 namespace bm
 {
     class TerrainShader
@@ -26,8 +28,25 @@ namespace bm
             float padding;
         };
 
+        struct ChunkBufferType
+        {
+            Vector4D position_offset;
+            Vector4D position_step;
+            Vector4D texture_transform;
+        };
+
+        struct PatchBufferType
+        {
+            Vector4D placement;
+            Vector4D morph;
+            Vector4D camera_position;
+        };
+
     public:
-        TerrainShader(ID3D11Device*, const wchar_t* vs_file_name, const wchar_t* ps_file_name);
+        TerrainShader(ID3D11Device*,
+                      const wchar_t* vs_file_name,
+                      const wchar_t* ps_file_name,
+                      TerrainVertexFormat vertex_format = TerrainVertexFormat::Full);
        ~TerrainShader();
         
 		TerrainShader(const TerrainShader&) = delete;
@@ -38,14 +57,15 @@ namespace bm
 
 	public:
         bool render(ID3D11DeviceContext* device_context,
-                    int index_count,
+                    const std::vector<TerrainDrawCall>& draw_calls,
                     Matrix&& world,
                     Matrix&& view,
                     Matrix&& projection,
                     Vector4D diffuse_color,
                     Vector3D light_direction,
                     ID3D11ShaderResourceView* diffuse_texture,
-                    ID3D11ShaderResourceView* bump_map_texture);
+                    ID3D11ShaderResourceView* bump_map_texture,
+                    ID3D11ShaderResourceView* height_texture = nullptr);
 
     private:
         bool initializeShader(ID3D11Device* device, const wchar_t* vs_file_name, const wchar_t* ps_file_name);
@@ -59,11 +79,17 @@ namespace bm
                                  Vector4D diffuse_color,
                                  Vector3D light_direction,
                                  ID3D11ShaderResourceView* diffuse_texture,
-                                 ID3D11ShaderResourceView* bump_map_texture);
+                                 ID3D11ShaderResourceView* bump_map_texture,
+                                 ID3D11ShaderResourceView* height_texture);
+
+        bool renderShader(ID3D11DeviceContext* device_context, const std::vector<TerrainDrawCall>& draw_calls);
 
-        void renderShader(ID3D11DeviceContext* device_context, int indexCount);
+        bool setChunkParameters(ID3D11DeviceContext* device_context, const CompactVertexTransform& transform);
+        bool setPatchParameters(ID3D11DeviceContext* device_context, const TerrainPatchTransform& patch);
 
     private:
+        TerrainVertexFormat vertex_format;
+
         ID3D11VertexShader* vertex_shader;
         ID3D11PixelShader* pixel_shader;
 
@@ -72,5 +98,10 @@ namespace bm
 
         ID3D11Buffer* matrix_buffer;
         ID3D11Buffer* light_buffer;
+        ID3D11Buffer* chunk_buffer;
+        ID3D11Buffer* patch_buffer;
+
+        // Taken from the view matrix for the morphing of the CDLOD patches.
+        Vector3D camera_position;
     };
 }
\ No newline at end of file
@@ -0,0 +1,219 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <d3d11.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "BitmapReader.h"
+#include "CompressedHeightField.h"
+#include "FrustumCulling.h"
+#include "HeightTileFile.h"
+#include "MappedFile.h"
+#include "NormalKernels.h"
+#include "TerrainChunk.h"
+
+namespace bm
+{
+    struct TerrainTileSettings
+    {
+        // Samples per side of a tile, neighbouring tiles share their border samples. At most 256, so that a tile can be
+        // drawn with 16-bit indices. A .bmheights heightmap brings its own.
+        int tile_size = 129;
+
+        // Tiles closer than this to the camera along X and Z, in world units, are loaded; the nearest ones first.
+        float load_radius = 8192.0f;
+
+        // Bytes the cache may hold at most: the tile mesh, the scratch of the workers, the compressed heightmap if any, the
+        // vertices of the tiles being built and the vertex buffer, whose slots are all allocated up front. The number of
+        // slots follows from it, tiles in the load radius beyond that number are not loaded.
+        size_t memory_budget = 256U << 20;
+
+        // Background threads that read and build the tiles, 0 means one per hardware thread.
+        unsigned worker_count = 2U;
+
+        // The compact format has to be drawn with the matching TerrainShader format.
+        TerrainVertexFormat vertex_format = TerrainVertexFormat::Full;
+
+        // Above 0, the whole heightmap is read once into a CompressedHeightField quantized to this step, in world units,
+        // and kept in memory against the budget; the tiles are built from it and the file is closed. Ground height
+        // queries need it. 8 / 15, the step of a bitmap, keeps bitmap heights to within float rounding.
+        float height_precision = 0.0f;
+    };
+
+    // Terrain streamed in tiles from a heightmap too large to build at once, either a .bmheights file (see HeightTileFile.h)
+    // whose level 0 tiles are read one at a time, a bitmap that stays memory-mapped, or a compressed copy of either held in
+    // memory. Worker threads read the tiles around the camera and build their vertices, and update uploads the finished
+    // ones into slots of a single vertex buffer that every tile is drawn from. Tiles that leave the load radius stay
+    // cached until their slot is needed, the least recently used one goes first.
+    //
+    // Every tile is read with a one-sample apron, so the tangent frames on its borders come from the same samples as in
+    // its neighbours and as in a Terrain built from the whole heightmap, and no seams show between tiles.
+    class TerrainTileCache
+    {
+    private:
+        struct VertexType
+        {
+            Vector3D position;
+            Vector2D texture;
+            Vector3D normal;
+            Vector3D tangent;
+            Vector3D binormal;
+        };
+
+        enum class TileState
+        {
+            Empty,
+            Queued,   // Waiting for a worker.
+            Building, // Owned by a worker.
+            Built,    // Vertices ready for the next update to upload.
+            Resident
+        };
+
+        // One slot of the vertex buffer and the tile that occupies it.
+        struct TerrainTile
+        {
+            TileState state = TileState::Empty;
+            int column = 0, row = 0;
+
+            // Last update that wanted the tile.
+            uint64_t last_used = 0U;
+
+            std::vector<unsigned char> vertices; // Freed once uploaded.
+
+            Vector3D bounds_min, bounds_max;
+            CompactVertexTransform transform;
+        };
+
+    public:
+        TerrainTileCache(ID3D11Device*, const wchar_t* height_map_file_name, const wchar_t* diffuse_map_file_name, const wchar_t* bump_map_file_name,
+                         const TerrainTileSettings& settings = TerrainTileSettings());
+       ~TerrainTileCache();
+
+        TerrainTileCache(const TerrainTileCache&) = delete;
+        TerrainTileCache(TerrainTileCache&&) = delete;
+
+        TerrainTileCache& operator=(const TerrainTileCache&) = delete;
+        TerrainTileCache& operator=(TerrainTileCache&&) = delete;
+
+    public:
+        // False if the heightmap, the textures or the buffers could not be loaded, or not even one tile fits the budget.
+        // Empty texture file names leave the textures out, for a cache that streams the tiles without drawing them.
+        bool isValid() const { return valid; }
+
+        // Uploads the tiles the workers have finished, then queues the missing ones around the camera, nearest first,
+        // evicting cached tiles outside the load radius to make room. Replaces the draw calls with the resident tiles.
+        void update(ID3D11DeviceContext* device_context, const Vector& camera_position);
+
+        // Keeps the draw calls whose tile bounds intersect the frustum, in their original order.
+        void cullDrawCalls(const Frustum& frustum);
+
+        void render(ID3D11DeviceContext* device_context);
+
+        const std::vector<TerrainDrawCall>& getDrawCalls() const { return draw_calls; }
+        const std::vector<TerrainDrawCall>& getVisibleDrawCalls() const { return visible_draw_calls; }
+
+        ID3D11ShaderResourceView* getColorTexture() { return diffuse_texture; }
+        ID3D11ShaderResourceView* getNormalMapTexture() { return bump_texture; }
+
+    public:
+        int getTerrainWidth() const { return terrain_width; }
+        int getTerrainHeight() const { return terrain_height; }
+
+        int getColumnCount() const { return column_count; }
+        int getRowCount() const { return row_count; }
+
+        bool isTileResident(int column, int row) const;
+
+        size_t getSlotCount() const { return tiles.size(); }
+        size_t getResidentTileCount() const { return draw_calls.size(); }
+
+        // Tiles queued or being built, and tiles built but not uploaded yet.
+        size_t getPendingTileCount() const;
+
+        // Bytes held against the budget now and at most so far. Tiles reserve their share before they are allocated.
+        size_t getMemoryUsage() const;
+        size_t getPeakMemoryUsage() const;
+
+        // Ground height under each of count world X/Z positions anywhere on the heightmap, resident tile or not, like
+        // Terrain::getGroundHeights. False unless the heightmap is held compressed (see height_precision).
+        bool getGroundHeights(const float* x, const float* z, size_t count, float* heights, Vector3D* normals = nullptr) const;
+
+        const CompressedHeightField& getCompressedHeights() const { return compressed_heights; }
+
+        // Builds the vertices of a tile on the calling thread exactly as a worker does before uploading them, but returns
+        // them row-major, tile_size^2 of them in the vertex format of the settings, the last sample of the heightmap
+        // repeated past its edge. For checking the tiles against each other and against Terrain; false if it can't be read.
+        bool buildTileVertices(int column, int row, std::vector<unsigned char>& vertices) const;
+
+    private:
+        bool loadHeightMap(const wchar_t* file_name);
+        bool compressHeightMap();
+        bool initializeBuffers(ID3D11Device* device);
+        bool loadTextures(ID3D11Device* device, const wchar_t* diffuse_texture_file_name, const wchar_t* bump_map_file_name);
+
+        void runWorker();
+        bool buildTile(TerrainTile& tile, HeightField& apron, std::vector<float>& stored_heights, std::vector<HeightFieldFrame>& frames) const;
+
+        int acquireSlot(uint64_t frame);
+        void updateDrawCalls();
+
+    private:
+        // Same scaling as Terrain, so that a tile lines up with the terrain built from the whole heightmap.
+        static constexpr float grid_spacing = 32.0f;
+        static constexpr float height_scale = 8.0f;
+        static constexpr float height_reduction = 15.0f;
+
+        // Tiles in flight per worker, so that a worker finds the next one queued when it finishes.
+        static constexpr size_t jobs_per_worker = 2U;
+
+    private:
+        TerrainTileSettings settings;
+        bool valid;
+
+        // The heightmap, one or the other, or the compressed copy that replaces both.
+        std::unique_ptr<HeightTileFile> tile_file;
+        std::unique_ptr<MappedFile> height_map_file;
+        BitmapInfo bitmap_info;
+        CompressedHeightField compressed_heights;
+
+        int terrain_width, terrain_height;
+        int column_count, row_count;
+        float min_height, max_height; // Range the compact vertices are quantized over, the same for every tile.
+
+        // Vertex buffer position of every row-major tile sample, and the tile triangles over those positions.
+        std::vector<uint16_t> vertex_order;
+        std::vector<uint16_t> indices;
+
+        UINT vertex_stride;
+        size_t slot_size;   // Bytes of one slot of the vertex buffer, also held by a tile until its vertices are uploaded.
+        size_t job_limit;
+
+        std::vector<TerrainTile> tiles; // One per slot.
+        std::vector<int> tile_slots;    // Slot of every tile of the heightmap, -1 if it has none.
+        uint64_t frame;
+
+        std::vector<TerrainDrawCall> draw_calls;
+        BoundingBoxes draw_call_bounds;
+        std::vector<uint32_t> visible_indices;
+        std::vector<TerrainDrawCall> visible_draw_calls;
+
+        // The job queue, the states of the tiles and the memory accounting are shared with the workers.
+        mutable std::mutex mutex;
+        std::condition_variable jobs_changed;
+        std::deque<int> jobs;
+        std::vector<int> built_tiles;
+        size_t memory_usage, peak_memory_usage;
+        bool stopping;
+
+        std::vector<std::thread> workers;
+
+        ID3D11Buffer *vertex_buffer, *index_buffer;
+        ID3D11ShaderResourceView* diffuse_texture, *bump_texture;
+    };
+}
@@ -0,0 +1,59 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+
+namespace bm
+{
+    enum class TerrainVertexFormat
+    {
+        Full,   // 56 bytes: float position, texture coordinates, normal, tangent and binormal.
+        Compact, // 16 bytes: see CompactTerrainVertex.
+        Patch    // 8 bytes: grid position within a CDLOD patch, the rest comes from the height texture. Only drawn by
+                 // TerrainShader, the terrain's own vertices are always Full or Compact.
+    };
+
+    // Quantized terrain vertex.
+    //  position      R16G16B16A16_UINT  x, y, z as steps from the chunk origin, w holds the octahedral normal as two snorm8 values.
+    //  texture       R16G16_UNORM       texture coordinates normalized over the texture range of the chunk.
+    //  tangent_frame R8G8B8A8_SNORM     quaternion rotating X, Y, Z onto tangent, binormal and normal; a negative W flips the binormal.
+    struct CompactTerrainVertex
+    {
+        uint16_t position[4];
+        uint16_t texture[2];
+        int8_t tangent_frame[4];
+    };
+
+    static_assert(sizeof(CompactTerrainVertex) == 16U, "The compact terrain vertex must stay 16 bytes.");
+
+    // Dequantization constants of one chunk: position = position_offset + quantized * position_step,
+    // texture = texture_offset + normalized * texture_extent.
+    struct CompactVertexTransform
+    {
+        Vector3D position_offset;
+        Vector3D position_step;
+
+        Vector2D texture_offset;
+        Vector2D texture_extent;
+    };
+
+    CompactTerrainVertex encodeCompactVertex(const CompactVertexTransform& transform,
+                                             const Vector3D& position,
+                                             const Vector2D& texture,
+                                             const Vector3D& normal,
+                                             const Vector3D& tangent,
+                                             const Vector3D& binormal);
+
+    void decodeCompactVertex(const CompactTerrainVertex& vertex,
+                             const CompactVertexTransform& transform,
+                             Vector3D& position,
+                             Vector2D& texture,
+                             Vector3D& normal,
+                             Vector3D& tangent,
+                             Vector3D& binormal);
+
+    // Tangent frame as a quaternion. The frame is orthonormalized around the normal first; reflected frames are marked by a negative W.
+    void encodeTangentFrame(const Vector3D& normal, const Vector3D& tangent, const Vector3D& binormal, int8_t quaternion[4]);
+    void decodeTangentFrame(const int8_t quaternion[4], Vector3D& normal, Vector3D& tangent, Vector3D& binormal);
+}
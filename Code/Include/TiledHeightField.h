@@ -0,0 +1,92 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "HeightField.h"
+
+namespace bm
+{
+    // Height field with the same samples and accessors as HeightField, stored in tiles of 16 x 16 samples instead of
+    // whole rows. A row of a tile is 64 bytes, a cache line's worth, and the rows of a tile follow each other, so the
+    // samples around most samples are within a kilobyte, where in a row-major plane the rows above and below are a whole
+    // row apart and usually on other pages. Tiles are kept row by row, the last ones of each row and column padded out.
+    //
+    // Kernels written against the accessors, and against the row runs of HeightFieldAccess.h where they work on contiguous
+    // samples, run unchanged on either layout.
+    class TiledHeightField
+    {
+    public:
+        static constexpr int tile_shift = 4;
+        static constexpr int tile_size = 1 << tile_shift;
+        static constexpr int tile_mask = tile_size - 1;
+
+        TiledHeightField() = default;
+        TiledHeightField(int width, int height, float spacing);
+       ~TiledHeightField() = default;
+
+        TiledHeightField(const TiledHeightField&) = default;
+        TiledHeightField(TiledHeightField&&) = default;
+
+        TiledHeightField& operator=(const TiledHeightField&) = default;
+        TiledHeightField& operator=(TiledHeightField&&) = default;
+
+    public:
+        void resize(int width, int height, float spacing);
+
+        // Copies the heights and normals of a height field of any size, rows split over thread_count threads.
+        void build(const HeightField& height_field, unsigned thread_count = 0U);
+
+        bool isEmpty() const { return heights.empty(); }
+
+        int getWidth() const { return width; }
+        int getHeight() const { return height; }
+        float getSpacing() const { return spacing; }
+
+        // The index of a sample is the sum of an offset of its column and one of its row.
+        int getColumnOffset(int i) const { return ((i >> tile_shift) << (2 * tile_shift)) + (i & tile_mask); }
+        int getRowOffset(int j) const { return (((j >> tile_shift) * tile_columns) << (2 * tile_shift)) + ((j & tile_mask) << tile_shift); }
+
+        int getIndex(int i, int j) const { return getRowOffset(j) + getColumnOffset(i); }
+
+        int getTileColumns() const { return tile_columns; }
+        int getTileRows() const { return tile_rows; }
+
+        // Samples of a row from column i on that are contiguous in memory: the rest of the tile's row.
+        int getContiguousColumns(int i) const { return std::min(tile_size - (i & tile_mask), width - i); }
+
+        float getX(int i) const { return static_cast<float>(i) * spacing; }
+        float getZ(int j) const { return static_cast<float>(j) * spacing; }
+
+    public:
+        float getHeight(int i, int j) const { return heights[getIndex(i, j)]; }
+        void setHeight(int i, int j, float value) { heights[getIndex(i, j)] = value; }
+
+        float* getHeights() { return heights.data(); }
+        const float* getHeights() const { return heights.data(); }
+
+        Vector3D getPosition(int i, int j) const { return Vector3D(getX(i), getHeight(i, j), getZ(j)); }
+
+    public:
+        Vector3D getNormal(int i, int j) const { return unpackNormal(normals[getIndex(i, j)]); }
+        void setNormal(int i, int j, const Vector3D& normal) { normals[getIndex(i, j)] = packNormal(normal); }
+
+        uint32_t* getPackedNormals() { return normals.data(); }
+        const uint32_t* getPackedNormals() const { return normals.data(); }
+
+        size_t getMemoryUsage() const;
+
+    private:
+        int width = 0;
+        int height = 0;
+        float spacing = 1.0f;
+
+        int tile_columns = 0;
+        int tile_rows = 0;
+
+        std::vector<float> heights;
+        std::vector<uint32_t> normals;
+    };
+}
@@ -0,0 +1,30 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace bm
+{
+    // Post-transform vertex cache efficiency of an index stream.
+    struct VertexCacheStats
+    {
+        // Average cache miss ratio: transformed vertices per triangle, between 0.5 (ideal for large grids) and 3.
+        float acmr;
+
+        // Average transform to vertex ratio: transformed vertices per referenced vertex, 1 is ideal.
+        float atvr;
+    };
+
+    // Simulates a FIFO post-transform cache of the given size over a triangle list.
+    VertexCacheStats simulateVertexCache(const uint16_t* indices, size_t index_count, size_t vertex_count, size_t cache_size = 16U);
+
+    // Reorders the triangles of a triangle list for a post-transform vertex cache (Forsyth, "Linear-Speed Vertex Cache Optimisation").
+    // The triangles themselves, including their winding, are left untouched; only their order changes.
+    void optimizeVertexCache(uint16_t* indices, size_t index_count, size_t vertex_count);
+
+    // Renumbers the vertices in the order the index stream first uses them, so vertex fetches walk the buffer forward.
+    // On return vertex_order[new_index] is the old index of the vertex, unreferenced vertices are moved to the end.
+    void optimizeVertexFetch(uint16_t* indices, size_t index_count, size_t vertex_count, std::vector<uint16_t>& vertex_order);
+}
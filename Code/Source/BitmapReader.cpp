@@ -0,0 +1,118 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include <climits>
+
+#include "BitmapReader.h"
+#include "Simd.h"
+
+namespace bm
+{
+    namespace
+    {
+        constexpr size_t file_header_size = 14U;
+        constexpr size_t info_header_size = 40U;
+
+        // The headers are little-endian and packed, so they are read byte by byte instead of through
+        // the <Windows.h> structures, which would depend on the compiler packing and host endianness.
+        unsigned int readU16(const unsigned char* p)
+        {
+            return p[0] | (p[1] << 8);
+        }
+
+        unsigned int readU32(const unsigned char* p)
+        {
+            return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<unsigned int>(p[3]) << 24);
+        }
+
+        int readI32(const unsigned char* p)
+        {
+            return static_cast<int>(readU32(p));
+        }
+    }
+
+    bool readBitmapInfo(const unsigned char* data, size_t size, BitmapInfo& info)
+    {
+        if(!data || size < file_header_size + info_header_size)
+            return false;
+
+        // BITMAPFILEHEADER: bfType, bfSize, bfReserved1, bfReserved2, bfOffBits.
+        if(data[0] != 'B' || data[1] != 'M')
+            return false;
+
+        auto pixel_offset = static_cast<size_t>(readU32(data + 10));
+
+        // BITMAPINFOHEADER (or one of its larger successors): biSize, biWidth, biHeight, biPlanes, biBitCount, biCompression.
+        auto info_header = data + file_header_size;
+        if(readU32(info_header) < info_header_size)
+            return false;
+
+        auto width = readI32(info_header + 4);
+        auto height = readI32(info_header + 8);
+        auto planes = readU16(info_header + 12);
+        auto bit_count = readU16(info_header + 14);
+        auto compression = readU32(info_header + 16);
+
+        if(planes != 1U || bit_count != 24U || compression != 0U)
+            return false;
+
+        if(width <= 0 || height == 0 || height == INT_MIN)
+            return false;
+
+        info.width = width;
+        info.height = height < 0 ? -height : height;
+        info.top_down = height < 0;
+
+        // Every row is padded to a multiple of four bytes.
+        info.row_pitch = (static_cast<size_t>(width) * 3U + 3U) & ~static_cast<size_t>(3U);
+        info.pixel_offset = pixel_offset;
+
+        if(pixel_offset < file_header_size + info_header_size || pixel_offset > size)
+            return false;
+
+        if(info.row_pitch * static_cast<size_t>(info.height) > size - pixel_offset)
+            return false;
+
+        return true;
+    }
+
+    const unsigned char* getBitmapRow(const unsigned char* data, const BitmapInfo& info, int j)
+    {
+        auto row = info.top_down ? info.height - 1 - j : j;
+
+        return data + info.pixel_offset + info.row_pitch * static_cast<size_t>(row);
+    }
+
+    void decodeBitmapRow(const unsigned char* pixels, int count, float scale, float* output)
+    {
+        auto i = int();
+
+#ifdef BM_SIMD_SSE4
+        // De-interleave 16 pixels (48 bytes) per iteration: pick every third byte of the three loads.
+        const auto shuffle0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const auto shuffle1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+        const auto shuffle2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+        const auto scale4 = _mm_set1_ps(scale);
+
+        for(; i + 16 <= count; i += 16)
+        {
+            auto source = pixels + i * 3;
+
+            auto a = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source)), shuffle0);
+            auto b = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 16)), shuffle1);
+            auto c = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 32)), shuffle2);
+
+            auto channel = _mm_or_si128(_mm_or_si128(a, b), c);
+
+            _mm_storeu_ps(output + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(channel)), scale4));
+            _mm_storeu_ps(output + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(channel, 4))), scale4));
+            _mm_storeu_ps(output + i + 8, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(channel, 8))), scale4));
+            _mm_storeu_ps(output + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(channel, 12))), scale4));
+        }
+#endif
+
+        for(; i < count; i++)
+            output[i] = static_cast<float>(pixels[i * 3]) * scale;
+    }
+}
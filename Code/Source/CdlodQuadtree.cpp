@@ -0,0 +1,235 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "CdlodQuadtree.h"
+#include "Geomipmapping.h"
+#include "ParallelFor.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace bm
+{
+    namespace
+    {
+        constexpr int max_level_count = 32;
+
+        // Share of a level's range over which its vertices morph into the next coarser level.
+        constexpr float morph_ratio = 0.3f;
+    }
+
+    void CdlodQuadtree::build(const HeightField& height_field, int leaf_size, unsigned thread_count)
+    {
+        this->leaf_size = leaf_size;
+
+        width = height_field.getWidth();
+        height = height_field.getHeight();
+        spacing = height_field.getSpacing();
+
+        levels.clear();
+
+        if(width < 2 || height < 2)
+            return;
+
+        // Leaves: height range of the (leaf_size + 1)^2 samples under every node, clamped to the heightmap.
+        Level leaves;
+        leaves.columns = (width - 2) / leaf_size + 1;
+        leaves.rows = (height - 2) / leaf_size + 1;
+        leaves.min_heights.assign(static_cast<size_t>(leaves.columns) * leaves.rows, FLT_MAX);
+        leaves.max_heights.assign(static_cast<size_t>(leaves.columns) * leaves.rows, -FLT_MAX);
+        leaves.error = 0.0f;
+
+        parallelFor(0, leaves.rows, thread_count, [&](int first_row, int last_row)
+        {
+            for(auto row = first_row; row < last_row; row++)
+            {
+                auto min_heights = leaves.min_heights.data() + static_cast<size_t>(row) * leaves.columns;
+                auto max_heights = leaves.max_heights.data() + static_cast<size_t>(row) * leaves.columns;
+
+                for(auto j = row * leaf_size; j <= std::min((row + 1) * leaf_size, height - 1); j++)
+                {
+                    auto samples = height_field.getRow(j);
+
+                    for(auto column = int(); column < leaves.columns; column++)
+                    {
+                        auto first = samples + column * leaf_size;
+                        auto last = samples + std::min((column + 1) * leaf_size, width - 1) + 1;
+                        auto range = std::minmax_element(first, last);
+
+                        min_heights[column] = std::min(min_heights[column], *range.first);
+                        max_heights[column] = std::max(max_heights[column], *range.second);
+                    }
+                }
+            }
+        });
+
+        levels.push_back(std::move(leaves));
+
+        // Parents take the range of their (up to four) children, up to a level with a single node.
+        while((levels.back().columns > 1 || levels.back().rows > 1) && static_cast<int>(levels.size()) < max_level_count)
+        {
+            auto& children = levels.back();
+
+            Level parents;
+            parents.columns = (children.columns + 1) / 2;
+            parents.rows = (children.rows + 1) / 2;
+            parents.min_heights.assign(static_cast<size_t>(parents.columns) * parents.rows, FLT_MAX);
+            parents.max_heights.assign(static_cast<size_t>(parents.columns) * parents.rows, -FLT_MAX);
+
+            for(auto row = int(); row < children.rows; row++)
+            {
+                for(auto column = int(); column < children.columns; column++)
+                {
+                    auto child = static_cast<size_t>(row) * children.columns + column;
+                    auto parent = static_cast<size_t>(row / 2) * parents.columns + column / 2;
+
+                    parents.min_heights[parent] = std::min(parents.min_heights[parent], children.min_heights[child]);
+                    parents.max_heights[parent] = std::max(parents.max_heights[parent], children.max_heights[child]);
+                }
+            }
+
+            levels.push_back(std::move(parents));
+        }
+
+        // Error of every level: the full resolution samples against the surface of the level's grid, which splits its
+        // cells along the same diagonal as the mesh. Measured in strips one cell high, like geomipmapping chunks.
+        for(auto level = 1; level < static_cast<int>(levels.size()); level++)
+        {
+            auto step = 1 << level;
+            auto strips = (height - 2) / step + 1;
+            std::vector<float> strip_errors(strips, 0.0f);
+
+            parallelFor(0, strips, thread_count, [&](int first_strip, int last_strip)
+            {
+                for(auto strip = first_strip; strip < last_strip; strip++)
+                {
+                    auto z = strip * step;
+                    strip_errors[strip] = computeGeomipmapError(height_field, 0, z, width, std::min(step + 1, height - z), level);
+                }
+            });
+
+            levels[level].error = *std::max_element(strip_errors.begin(), strip_errors.end());
+        }
+    }
+
+    void CdlodQuadtree::select(const Vector3D& camera_position, float error_scale, float max_pixel_error, std::vector<CdlodDrawRecord>& records) const
+    {
+        records.clear();
+
+        if(levels.empty())
+            return;
+
+        auto level_count = static_cast<int>(levels.size());
+
+        // Level l is good enough wherever the error of level l + 1 would still be visible, and each range has to leave
+        // room for a whole node of the next level, so that neighbouring nodes never differ by more than one level.
+        Ranges ranges;
+        auto previous_range = 0.0f;
+
+        for(auto level = int(); level < level_count; level++)
+        {
+            auto node_diagonal = 1.41421356f * static_cast<float>(getNodeSize(level)) * spacing;
+            auto range = FLT_MAX;
+
+            if(level + 1 < level_count)
+            {
+                range = levels[level + 1].error * error_scale / max_pixel_error;
+                range = std::max(range, std::max(2.0f * previous_range, previous_range + 2.0f * node_diagonal));
+            }
+
+            ranges.visibility[level] = range;
+            ranges.morph_start[level] = range == FLT_MAX ? FLT_MAX : range - morph_ratio * (range - previous_range);
+
+            previous_range = range;
+        }
+
+        auto& roots = levels.back();
+
+        for(auto row = int(); row < roots.rows; row++)
+        {
+            for(auto column = int(); column < roots.columns; column++)
+                selectNode(level_count - 1, column, row, camera_position, ranges, records);
+        }
+    }
+
+    void CdlodQuadtree::selectNode(int level, int column, int row, const Vector3D& camera_position, const Ranges& ranges,
+                                   std::vector<CdlodDrawRecord>& records) const
+    {
+        auto& nodes = levels[level];
+        auto node = static_cast<uint32_t>(row * nodes.columns + column);
+
+        auto addRecord([&](uint16_t quadrants)
+        {
+            records.push_back({node, static_cast<uint16_t>(level), quadrants, ranges.morph_start[level], ranges.visibility[level]});
+        });
+
+        if(level == 0 || !intersectsSphere(level, column, row, camera_position, ranges.visibility[level - 1]))
+        {
+            addRecord(15U);
+            return;
+        }
+
+        // Children within their own range are drawn by themselves, the rest of the node at this level.
+        auto& children = levels[level - 1];
+        auto quadrants = 0U;
+
+        for(auto quadrant = 0U; quadrant < 4U; quadrant++)
+        {
+            auto child_column = column * 2 + static_cast<int>(quadrant & 1U);
+            auto child_row = row * 2 + static_cast<int>(quadrant >> 1U);
+
+            // Quadrants past the edge of the heightmap have no child and nothing to draw.
+            if(child_column >= children.columns || child_row >= children.rows)
+                continue;
+
+            if(intersectsSphere(level - 1, child_column, child_row, camera_position, ranges.visibility[level - 1]))
+                selectNode(level - 1, child_column, child_row, camera_position, ranges, records);
+            else
+                quadrants |= 1U << quadrant;
+        }
+
+        if(quadrants)
+            addRecord(static_cast<uint16_t>(quadrants));
+    }
+
+    bool CdlodQuadtree::intersectsSphere(int level, int column, int row, const Vector3D& center, float radius) const
+    {
+        auto& nodes = levels[level];
+        auto node = static_cast<size_t>(row) * nodes.columns + column;
+        auto size = getNodeSize(level);
+
+        auto min_x = static_cast<float>(column * size) * spacing;
+        auto max_x = static_cast<float>(std::min((column + 1) * size, width - 1)) * spacing;
+        auto min_z = static_cast<float>(row * size) * spacing;
+        auto max_z = static_cast<float>(std::min((row + 1) * size, height - 1)) * spacing;
+
+        auto dx = std::max(std::max(min_x - center.x, center.x - max_x), 0.0f);
+        auto dy = std::max(std::max(nodes.min_heights[node] - center.y, center.y - nodes.max_heights[node]), 0.0f);
+        auto dz = std::max(std::max(min_z - center.z, center.z - max_z), 0.0f);
+
+        return dx * dx + dy * dy + dz * dz <= radius * radius;
+    }
+
+    void CdlodQuadtree::getNodeBounds(int level, uint32_t node, Vector3D& bounds_min, Vector3D& bounds_max) const
+    {
+        auto x = getNodeX(level, node);
+        auto z = getNodeZ(level, node);
+        auto size = getNodeSize(level);
+
+        bounds_min = Vector3D(static_cast<float>(x) * spacing, levels[level].min_heights[node], static_cast<float>(z) * spacing);
+        bounds_max = Vector3D(static_cast<float>(std::min(x + size, width - 1)) * spacing, levels[level].max_heights[node],
+                              static_cast<float>(std::min(z + size, height - 1)) * spacing);
+    }
+
+    size_t CdlodQuadtree::getMemoryUsage() const
+    {
+        auto usage = levels.capacity() * sizeof(Level);
+
+        for(auto& level : levels)
+            usage += (level.min_heights.capacity() + level.max_heights.capacity()) * sizeof(float);
+
+        return usage;
+    }
+}
@@ -0,0 +1,396 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "CompressedHeightField.h"
+#include "ParallelFor.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+namespace bm
+{
+    namespace
+    {
+        // Quantized samples are kept within [-2^30, 2^30 - 1], so that the difference of any two fits 31 bits.
+        constexpr int32_t quantized_min = -(1 << 30), quantized_max = (1 << 30) - 1;
+
+        int32_t quantizeHeight(float height, float precision)
+        {
+            // A NaN would get through the clamp, which it compares false with, to a cast it's undefined for.
+            if(std::isnan(height))
+                return 0;
+
+            // Clamped as a double, which holds both bounds exactly, where a float rounds 2^30 - 1 up to 2^30.
+            auto quantized = static_cast<double>(std::round(height / precision));
+            quantized = std::min(std::max(quantized, static_cast<double>(quantized_min)), static_cast<double>(quantized_max));
+
+            return static_cast<int32_t>(quantized);
+        }
+
+        uint32_t getBitCount(uint32_t value)
+        {
+            auto bits = uint32_t();
+            for(; value != 0U; value >>= 1U)
+                bits++;
+
+            return bits;
+        }
+
+#ifdef BM_SIMD_SSE4
+        // Most bits per sample the vector path unpacks: a sample then spans at most 4 bytes from a bit offset below 8.
+        constexpr uint32_t vector_bits = 24U;
+
+        // Per number of bits, the shuffles that move the 4 bytes holding each sample of the two halves of a block row
+        // into its lane, and the multipliers that shift its lowest bit up to bit 32 - bits.
+        struct RowUnpacker
+        {
+            __m128i shuffles[2];
+            __m128i multipliers[2];
+        };
+
+        std::array<RowUnpacker, vector_bits + 1U> makeRowUnpackers()
+        {
+            std::array<RowUnpacker, vector_bits + 1U> unpackers;
+
+            for(auto bits = 1U; bits <= vector_bits; bits++)
+            {
+                for(auto half = 0U; half < 2U; half++)
+                {
+                    alignas(16) uint8_t shuffle[16];
+                    alignas(16) uint32_t multiplier[4];
+
+                    // The second half is loaded from the byte its first sample starts in.
+                    auto half_start = (4U * half * bits) / 8U;
+
+                    for(auto lane = 0U; lane < 4U; lane++)
+                    {
+                        auto position = (4U * half + lane) * bits;
+
+                        for(auto byte = 0U; byte < 4U; byte++)
+                            shuffle[lane * 4U + byte] = static_cast<uint8_t>(position / 8U - half_start + byte);
+
+                        multiplier[lane] = 1U << (32U - bits - position % 8U);
+                    }
+
+                    unpackers[bits].shuffles[half] = _mm_load_si128(reinterpret_cast<const __m128i*>(shuffle));
+                    unpackers[bits].multipliers[half] = _mm_load_si128(reinterpret_cast<const __m128i*>(multiplier));
+                }
+            }
+
+            return unpackers;
+        }
+#endif
+    }
+
+    void CompressedHeightField::reset(int width, int height, float spacing, float precision)
+    {
+        this->width = width;
+        this->height = height;
+        this->spacing = spacing;
+        this->precision = precision;
+
+        block_columns = (width + block_mask) >> block_shift;
+        block_rows = (height + block_mask) >> block_shift;
+        block_rows_done = 0;
+
+        blocks.assign(static_cast<size_t>(block_columns) * block_rows, Block());
+        data.assign(data_padding, 0U);
+        unused_size = 0U;
+    }
+
+    void CompressedHeightField::appendBlockRow(const float* rows, size_t stride)
+    {
+        if(block_rows_done == block_rows)
+            return;
+
+        std::vector<unsigned char> block_data;
+
+        auto headers = blocks.data() + static_cast<size_t>(block_rows_done) * block_columns;
+        encodeBlockRow(rows, stride, block_rows_done, headers, block_data);
+
+        uint32_t first_offset;
+        if(!appendData(block_data, first_offset))
+            return;
+
+        for(auto c = 0; c < block_columns; c++)
+            headers[c].offset += first_offset;
+
+        if(++block_rows_done == block_rows)
+            data.shrink_to_fit();
+    }
+
+    void CompressedHeightField::build(const HeightField& height_field, float precision, unsigned thread_count)
+    {
+        reset(height_field.getWidth(), height_field.getHeight(), height_field.getSpacing(), precision);
+
+        // Rows of blocks are encoded apart, then chained in order.
+        std::vector<std::vector<unsigned char>> row_data(block_rows);
+
+        parallelFor(0, block_rows, thread_count, [&](int first_row, int last_row)
+        {
+            for(auto r = first_row; r < last_row; r++)
+                encodeBlockRow(height_field.getRow(r << block_shift), static_cast<size_t>(width), r,
+                               blocks.data() + static_cast<size_t>(r) * block_columns, row_data[r]);
+        });
+
+        auto data_size = size_t();
+        for(auto& block_data : row_data)
+            data_size += block_data.size();
+
+        data.reserve(data_size + data_padding);
+
+        for(; block_rows_done < block_rows; block_rows_done++)
+        {
+            uint32_t first_offset;
+            if(!appendData(row_data[block_rows_done], first_offset))
+                return;
+
+            for(auto c = 0; c < block_columns; c++)
+                blocks[static_cast<size_t>(block_rows_done) * block_columns + c].offset += first_offset;
+        }
+    }
+
+    void CompressedHeightField::decodeRow(int j, int first_column, int last_column, float* output) const
+    {
+        auto row_blocks = blocks.data() + static_cast<size_t>(j >> block_shift) * block_columns;
+        auto row = j & block_mask;
+
+        for(auto i = first_column; i < last_column;)
+        {
+            auto block_x0 = i & ~block_mask;
+            auto block = row_blocks + (i >> block_shift);
+
+            // Whole block rows straight into the output, the partial ones at the ends through a copy.
+            if(i == block_x0 && i + block_size <= last_column)
+            {
+                decodeBlockRow(block, row, output + (i - first_column));
+                i += block_size;
+                continue;
+            }
+
+            float samples[block_size];
+            decodeBlockRow(block, row, samples);
+
+            auto end = std::min(block_x0 + block_size, last_column);
+            std::copy(samples + (i - block_x0), samples + (end - block_x0), output + (i - first_column));
+            i = end;
+        }
+    }
+
+    void CompressedHeightField::decodeBlock(int block_column, int block_row, float* output) const
+    {
+        auto block = blocks.data() + static_cast<size_t>(block_row) * block_columns + block_column;
+
+        for(auto r = 0; r < block_size; r++)
+            decodeBlockRow(block, r, output + r * block_size);
+    }
+
+    void CompressedHeightField::decode(HeightField& height_field, unsigned thread_count) const
+    {
+        height_field.resize(width, height, spacing);
+
+        parallelFor(0, height, thread_count, [&](int first_row, int last_row)
+        {
+            for(auto j = first_row; j < last_row; j++)
+                decodeRow(j, 0, width, height_field.getRow(j));
+        });
+    }
+
+    void CompressedHeightField::update(const HeightField& height_field, int x0, int z0, int x1, int z1)
+    {
+        if(!isComplete())
+            return;
+
+        std::vector<unsigned char> block_data;
+
+        for(auto r = std::max(z0, 0) >> block_shift; r <= std::min(z1, height - 1) >> block_shift; r++)
+        {
+            for(auto c = std::max(x0, 0) >> block_shift; c <= std::min(x1, width - 1) >> block_shift; c++)
+            {
+                auto& header = blocks[static_cast<size_t>(r) * block_columns + c];
+
+                Block new_header;
+                block_data.clear();
+                encodeBlock(height_field.getRow(r << block_shift), static_cast<size_t>(width), c, r, new_header, block_data);
+
+                // In place if it still fits, with what it no longer needs left unused.
+                if(new_header.bits <= header.bits)
+                {
+                    std::copy(block_data.begin(), block_data.end(), data.begin() + static_cast<size_t>(header.offset) * block_size);
+                    unused_size += static_cast<size_t>(header.bits - new_header.bits) * block_size;
+
+                    new_header.offset = header.offset;
+                    header = new_header;
+                    continue;
+                }
+
+                // Moved to the end, or everything compacted first when the data can't grow any further.
+                uint32_t offset;
+                if(!appendData(block_data, offset))
+                {
+                    compact();
+                    if(!appendData(block_data, offset))
+                        return;
+                }
+
+                unused_size += static_cast<size_t>(header.bits) * block_size;
+
+                new_header.offset = offset;
+                header = new_header;
+            }
+        }
+
+        if(unused_size >= data.size() - data_padding - unused_size)
+            compact();
+    }
+
+    float CompressedHeightField::quantize(float height) const
+    {
+        return static_cast<float>(quantizeHeight(height, precision)) * precision;
+    }
+
+    size_t CompressedHeightField::getMemoryUsage() const
+    {
+        return blocks.capacity() * sizeof(Block) + data.capacity();
+    }
+
+    bool CompressedHeightField::appendData(const std::vector<unsigned char>& block_data, uint32_t& offset)
+    {
+        // The padding stays at the end of the data.
+        auto data_size = data.size() - data_padding;
+        if(data_size / block_size + block_data.size() / block_size > max_offset)
+            return false;
+
+        offset = static_cast<uint32_t>(data_size / block_size);
+
+        data.resize(data_size);
+        data.insert(data.end(), block_data.begin(), block_data.end());
+        data.resize(data.size() + data_padding, 0U);
+
+        return true;
+    }
+
+    void CompressedHeightField::compact()
+    {
+        std::vector<unsigned char> compacted;
+        compacted.reserve(data.size() - unused_size);
+
+        for(auto& block : blocks)
+        {
+            auto source = data.begin() + static_cast<size_t>(block.offset) * block_size;
+
+            block.offset = static_cast<uint32_t>(compacted.size() / block_size);
+            compacted.insert(compacted.end(), source, source + static_cast<size_t>(block.bits) * block_size);
+        }
+
+        compacted.resize(compacted.size() + data_padding, 0U);
+
+        data.swap(compacted);
+        unused_size = 0U;
+    }
+
+    void CompressedHeightField::encodeBlockRow(const float* rows, size_t stride, int block_row, Block* headers,
+                                               std::vector<unsigned char>& block_data) const
+    {
+        block_data.clear();
+
+        for(auto c = 0; c < block_columns; c++)
+            encodeBlock(rows, stride, c, block_row, headers[c], block_data);
+    }
+
+    void CompressedHeightField::encodeBlock(const float* rows, size_t stride, int block_column, int block_row, Block& header,
+                                            std::vector<unsigned char>& block_data) const
+    {
+        auto x0 = block_column << block_shift;
+        auto row_count = std::min(block_size, height - (block_row << block_shift));
+        auto column_count = std::min(block_size, width - x0);
+
+        // Past the border of the field, the block repeats its last column and row.
+        int32_t samples[block_size * block_size];
+
+        for(auto r = 0; r < block_size; r++)
+        {
+            auto source = rows + static_cast<size_t>(std::min(r, row_count - 1)) * stride + x0;
+
+            for(auto i = 0; i < block_size; i++)
+                samples[r * block_size + i] = quantizeHeight(source[std::min(i, column_count - 1)], precision);
+        }
+
+        auto range = std::minmax_element(samples, samples + block_size * block_size);
+        auto base = *range.first;
+        auto bits = getBitCount(static_cast<uint32_t>(*range.second - base));
+
+        header.base = base;
+        header.offset = static_cast<uint32_t>(block_data.size() / block_size);
+        header.bits = bits;
+
+        // Every row packs into exactly bits bytes, lowest bits first.
+        for(auto r = 0; r < block_size; r++)
+        {
+            auto accumulator = uint64_t();
+            auto accumulated = uint32_t();
+
+            for(auto i = 0; i < block_size; i++)
+            {
+                accumulator |= static_cast<uint64_t>(static_cast<uint32_t>(samples[r * block_size + i] - base)) << accumulated;
+                accumulated += bits;
+
+                for(; accumulated >= 8U; accumulated -= 8U, accumulator >>= 8U)
+                    block_data.push_back(static_cast<unsigned char>(accumulator & 0xFFU));
+            }
+        }
+    }
+
+    void CompressedHeightField::decodeBlockRow(const Block* block, int row, float* output) const
+    {
+        auto bits = static_cast<uint32_t>(block->bits);
+        auto bytes = data.data() + static_cast<size_t>(block->offset) * block_size + static_cast<size_t>(row) * bits;
+
+#ifdef BM_SIMD_SSE4
+        if(bits <= vector_bits)
+        {
+            static const auto unpackers = makeRowUnpackers();
+
+            const auto base = _mm_set1_epi32(block->base);
+            const auto precision4 = _mm_set1_ps(precision);
+
+            if(bits == 0U)
+            {
+                auto heights = _mm_mul_ps(_mm_cvtepi32_ps(base), precision4);
+                _mm_storeu_ps(output, heights);
+                _mm_storeu_ps(output + 4, heights);
+                return;
+            }
+
+            auto& unpacker = unpackers[bits];
+            auto shift = _mm_cvtsi32_si128(static_cast<int>(32U - bits));
+
+            for(auto half = 0U; half < 2U; half++)
+            {
+                auto source = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + (4U * half * bits) / 8U));
+
+                auto deltas = _mm_shuffle_epi8(source, unpacker.shuffles[half]);
+                deltas = _mm_srl_epi32(_mm_mullo_epi32(deltas, unpacker.multipliers[half]), shift);
+
+                _mm_storeu_ps(output + 4U * half, _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(deltas, base)), precision4));
+            }
+
+            return;
+        }
+#endif
+
+        for(auto i = 0U; i < static_cast<uint32_t>(block_size); i++)
+        {
+            auto position = i * bits;
+
+            uint64_t word;
+            std::memcpy(&word, bytes + position / 8U, sizeof(word));
+
+            auto delta = static_cast<int32_t>((word >> (position % 8U)) & ((1ULL << bits) - 1ULL));
+            output[i] = static_cast<float>(block->base + delta) * precision;
+        }
+    }
+}
@@ -15,6 +15,9 @@ namespace bm
         view = DirectX::XMMatrixLookAtLH(position, target, up);
         projection = DirectX::XMMatrixPerspectiveFovLH(0.4f * DirectX::XM_PI, width / height, 1.f, 100'000.f);
         world = DirectX::XMMatrixIdentity();
+
+        view_projection = DirectX::XMMatrixMultiply(view, projection);
+        frustum = computeFrustum(view_projection);
     }
 
     void FPSCamera::update()
@@ -36,6 +39,9 @@ namespace bm
         target = position + target;
 
         view = DirectX::XMMatrixLookAtLH(position, target, up);
+
+        view_projection = DirectX::XMMatrixMultiply(view, projection);
+        frustum = computeFrustum(view_projection);
     }
 
     void FPSCamera::setPosition(const float& x, const float& y, const float& z)
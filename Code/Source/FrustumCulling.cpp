@@ -0,0 +1,217 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "FrustumCulling.h"
+#include "Simd.h"
+
+#include <cmath>
+
+namespace bm
+{
+    namespace
+    {
+        // Signed distance of the box's nearest corner from the plane is at least the distance of the center minus the
+        // projected half extent; a negative result against any plane puts the whole box outside.
+        bool isBoxVisible(const Frustum& frustum, float cx, float cy, float cz, float ex, float ey, float ez)
+        {
+            for(auto& plane : frustum.planes)
+            {
+                auto distance = plane.x * cx + plane.y * cy + plane.z * cz + plane.w;
+                auto radius = std::fabs(plane.x) * ex + std::fabs(plane.y) * ey + std::fabs(plane.z) * ez;
+
+                if(distance + radius < 0.0f)
+                    return false;
+            }
+
+            return true;
+        }
+    }
+
+    Frustum computeFrustum(const Matrix& view_projection)
+    {
+        // Gribb and Hartmann: with clip = p * M, each plane is a sum or difference of the matrix columns.
+        DirectX::XMFLOAT4X4 m;
+        DirectX::XMStoreFloat4x4(&m, view_projection);
+
+        auto column([&](int c) { return Vector4D(m.m[0][c], m.m[1][c], m.m[2][c], m.m[3][c]); });
+        auto add([](const Vector4D& a, const Vector4D& b) { return Vector4D(a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w); });
+        auto subtract([](const Vector4D& a, const Vector4D& b) { return Vector4D(a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w); });
+
+        auto x = column(0);
+        auto y = column(1);
+        auto z = column(2);
+        auto w = column(3);
+
+        Frustum frustum;
+        frustum.planes[0] = add(w, x);
+        frustum.planes[1] = subtract(w, x);
+        frustum.planes[2] = add(w, y);
+        frustum.planes[3] = subtract(w, y);
+        frustum.planes[4] = z;
+        frustum.planes[5] = subtract(w, z);
+
+        for(auto& plane : frustum.planes)
+        {
+            auto length = std::sqrt(plane.x * plane.x + plane.y * plane.y + plane.z * plane.z);
+            if(length > 0.0f)
+                plane = Vector4D(plane.x / length, plane.y / length, plane.z / length, plane.w / length);
+        }
+
+        return frustum;
+    }
+
+    bool isBoxInFrustum(const Frustum& frustum, const Vector3D& bounds_min, const Vector3D& bounds_max)
+    {
+        return isBoxVisible(frustum, 0.5f * (bounds_min.x + bounds_max.x), 0.5f * (bounds_min.y + bounds_max.y), 0.5f * (bounds_min.z + bounds_max.z),
+                            0.5f * (bounds_max.x - bounds_min.x), 0.5f * (bounds_max.y - bounds_min.y), 0.5f * (bounds_max.z - bounds_min.z));
+    }
+
+    void BoundingBoxes::clear()
+    {
+        for(auto array : {&center_x, &center_y, &center_z, &extent_x, &extent_y, &extent_z})
+            array->clear();
+    }
+
+    void BoundingBoxes::reserve(size_t count)
+    {
+        for(auto array : {&center_x, &center_y, &center_z, &extent_x, &extent_y, &extent_z})
+            array->reserve(count);
+    }
+
+    void BoundingBoxes::add(const Vector3D& bounds_min, const Vector3D& bounds_max)
+    {
+        center_x.push_back(0.5f * (bounds_min.x + bounds_max.x));
+        center_y.push_back(0.5f * (bounds_min.y + bounds_max.y));
+        center_z.push_back(0.5f * (bounds_min.z + bounds_max.z));
+
+        extent_x.push_back(0.5f * (bounds_max.x - bounds_min.x));
+        extent_y.push_back(0.5f * (bounds_max.y - bounds_min.y));
+        extent_z.push_back(0.5f * (bounds_max.z - bounds_min.z));
+    }
+
+    void BoundingBoxes::set(size_t index, const Vector3D& bounds_min, const Vector3D& bounds_max)
+    {
+        center_x[index] = 0.5f * (bounds_min.x + bounds_max.x);
+        center_y[index] = 0.5f * (bounds_min.y + bounds_max.y);
+        center_z[index] = 0.5f * (bounds_min.z + bounds_max.z);
+
+        extent_x[index] = 0.5f * (bounds_max.x - bounds_min.x);
+        extent_y[index] = 0.5f * (bounds_max.y - bounds_min.y);
+        extent_z[index] = 0.5f * (bounds_max.z - bounds_min.z);
+    }
+
+    size_t cullBoundingBoxes(const Frustum& frustum, const BoundingBoxes& boxes, std::vector<uint32_t>& visible)
+    {
+        auto count = boxes.getCount();
+        auto cx = boxes.getCenterX(), cy = boxes.getCenterY(), cz = boxes.getCenterZ();
+        auto ex = boxes.getExtentX(), ey = boxes.getExtentY(), ez = boxes.getExtentZ();
+
+        // Every index of a block with a visible box is stored, only the visible ones advance the output.
+        visible.resize(count);
+        auto output = visible.data();
+        auto visible_count = size_t();
+
+        auto i = size_t();
+
+#ifdef BM_SIMD_AVX2
+        {
+            const auto zero = _mm256_setzero_ps();
+
+            __m256 px[6], py[6], pz[6], pw[6], ax[6], ay[6], az[6];
+            for(auto p = 0; p < 6; p++)
+            {
+                auto& plane = frustum.planes[p];
+                px[p] = _mm256_set1_ps(plane.x);
+                py[p] = _mm256_set1_ps(plane.y);
+                pz[p] = _mm256_set1_ps(plane.z);
+                pw[p] = _mm256_set1_ps(plane.w);
+                ax[p] = _mm256_set1_ps(std::fabs(plane.x));
+                ay[p] = _mm256_set1_ps(std::fabs(plane.y));
+                az[p] = _mm256_set1_ps(std::fabs(plane.z));
+            }
+
+            for(; i + 8 <= count; i += 8)
+            {
+                auto x = _mm256_loadu_ps(cx + i), y = _mm256_loadu_ps(cy + i), z = _mm256_loadu_ps(cz + i);
+                auto hx = _mm256_loadu_ps(ex + i), hy = _mm256_loadu_ps(ey + i), hz = _mm256_loadu_ps(ez + i);
+
+                // Lanes are set as soon as one plane has the box completely outside.
+                auto outside = _mm256_setzero_ps();
+                for(auto p = 0; p < 6; p++)
+                {
+                    auto distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(px[p], x), _mm256_mul_ps(py[p], y)),
+                                                  _mm256_add_ps(_mm256_mul_ps(pz[p], z), pw[p]));
+                    auto radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax[p], hx), _mm256_mul_ps(ay[p], hy)), _mm256_mul_ps(az[p], hz));
+
+                    outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(distance, radius), zero, _CMP_LT_OQ));
+                }
+
+                auto mask = ~_mm256_movemask_ps(outside);
+                if(mask & 0xFF)
+                {
+                    for(auto k = 0; k < 8; k++)
+                    {
+                        output[visible_count] = static_cast<uint32_t>(i + k);
+                        visible_count += (mask >> k) & 1;
+                    }
+                }
+            }
+        }
+#endif
+
+#ifdef BM_SIMD_SSE4
+        {
+            const auto zero = _mm_setzero_ps();
+
+            __m128 px[6], py[6], pz[6], pw[6], ax[6], ay[6], az[6];
+            for(auto p = 0; p < 6; p++)
+            {
+                auto& plane = frustum.planes[p];
+                px[p] = _mm_set1_ps(plane.x);
+                py[p] = _mm_set1_ps(plane.y);
+                pz[p] = _mm_set1_ps(plane.z);
+                pw[p] = _mm_set1_ps(plane.w);
+                ax[p] = _mm_set1_ps(std::fabs(plane.x));
+                ay[p] = _mm_set1_ps(std::fabs(plane.y));
+                az[p] = _mm_set1_ps(std::fabs(plane.z));
+            }
+
+            for(; i + 4 <= count; i += 4)
+            {
+                auto x = _mm_loadu_ps(cx + i), y = _mm_loadu_ps(cy + i), z = _mm_loadu_ps(cz + i);
+                auto hx = _mm_loadu_ps(ex + i), hy = _mm_loadu_ps(ey + i), hz = _mm_loadu_ps(ez + i);
+
+                auto outside = _mm_setzero_ps();
+                for(auto p = 0; p < 6; p++)
+                {
+                    auto distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px[p], x), _mm_mul_ps(py[p], y)), _mm_add_ps(_mm_mul_ps(pz[p], z), pw[p]));
+                    auto radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax[p], hx), _mm_mul_ps(ay[p], hy)), _mm_mul_ps(az[p], hz));
+
+                    outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), zero));
+                }
+
+                auto mask = ~_mm_movemask_ps(outside);
+                if(mask & 0xF)
+                {
+                    for(auto k = 0; k < 4; k++)
+                    {
+                        output[visible_count] = static_cast<uint32_t>(i + k);
+                        visible_count += (mask >> k) & 1;
+                    }
+                }
+            }
+        }
+#endif
+
+        for(; i < count; i++)
+        {
+            output[visible_count] = static_cast<uint32_t>(i);
+            visible_count += isBoxVisible(frustum, cx[i], cy[i], cz[i], ex[i], ey[i], ez[i]) ? 1U : 0U;
+        }
+
+        visible.resize(visible_count);
+
+        return visible_count;
+    }
+}
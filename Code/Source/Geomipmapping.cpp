@@ -0,0 +1,311 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Geomipmapping.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace bm
+{
+    namespace
+    {
+        // Sample offsets of one level along a side of size samples: every step-th one and the last one.
+        void getLevelSamples(int size, int level, std::vector<int>& samples)
+        {
+            auto step = 1 << level;
+
+            samples.clear();
+            for(auto sample = int(); sample < size - 1; sample += step)
+                samples.push_back(sample);
+
+            samples.push_back(size - 1);
+        }
+
+        // The surface of a row of cells of one level, sample by sample. Every cell, spanned by the level samples
+        // [x0, x1] x [z0, z1], is split along the diagonal from (x0, z0) to (x1, z1) like the quads of the full resolution
+        // mesh: with u and v the position of a sample across it, its surface is base + u * upper_u + v * upper_v where
+        // u >= v, and base + v * lower_v + u * lower_u past the diagonal.
+        struct CellRow
+        {
+            std::vector<float> u, base, upper_u, upper_v, lower_u, lower_v;
+        };
+
+        // Largest distance between samples [0, count) of a row at v and the surface of their cells.
+        float getRowError(const float* samples, const CellRow& cells, int count, float v)
+        {
+            auto i = 0;
+            auto error = 0.0f;
+
+#ifdef BM_SIMD_AVX2
+            {
+                const auto v8 = _mm256_set1_ps(v);
+                const auto magnitude = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+                auto errors = _mm256_setzero_ps();
+
+                for(; i + 8 <= count; i += 8)
+                {
+                    auto u = _mm256_loadu_ps(cells.u.data() + i);
+                    auto base = _mm256_loadu_ps(cells.base.data() + i);
+
+                    auto upper = _mm256_add_ps(_mm256_add_ps(base, _mm256_mul_ps(u, _mm256_loadu_ps(cells.upper_u.data() + i))),
+                                               _mm256_mul_ps(v8, _mm256_loadu_ps(cells.upper_v.data() + i)));
+                    auto lower = _mm256_add_ps(_mm256_add_ps(base, _mm256_mul_ps(v8, _mm256_loadu_ps(cells.lower_v.data() + i))),
+                                               _mm256_mul_ps(u, _mm256_loadu_ps(cells.lower_u.data() + i)));
+
+                    auto surface = _mm256_blendv_ps(lower, upper, _mm256_cmp_ps(u, v8, _CMP_GE_OQ));
+                    errors = _mm256_max_ps(errors, _mm256_and_ps(_mm256_sub_ps(_mm256_loadu_ps(samples + i), surface), magnitude));
+                }
+
+                alignas(32) float lanes[8];
+                _mm256_store_ps(lanes, errors);
+                error = *std::max_element(lanes, lanes + 8);
+            }
+#endif
+
+#ifdef BM_SIMD_SSE4
+            {
+                const auto v4 = _mm_set1_ps(v);
+                const auto magnitude = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+                auto errors = _mm_set1_ps(error);
+
+                for(; i + 4 <= count; i += 4)
+                {
+                    auto u = _mm_loadu_ps(cells.u.data() + i);
+                    auto base = _mm_loadu_ps(cells.base.data() + i);
+
+                    auto upper = _mm_add_ps(_mm_add_ps(base, _mm_mul_ps(u, _mm_loadu_ps(cells.upper_u.data() + i))),
+                                            _mm_mul_ps(v4, _mm_loadu_ps(cells.upper_v.data() + i)));
+                    auto lower = _mm_add_ps(_mm_add_ps(base, _mm_mul_ps(v4, _mm_loadu_ps(cells.lower_v.data() + i))),
+                                            _mm_mul_ps(u, _mm_loadu_ps(cells.lower_u.data() + i)));
+
+                    auto surface = _mm_blendv_ps(lower, upper, _mm_cmpge_ps(u, v4));
+                    errors = _mm_max_ps(errors, _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(samples + i), surface), magnitude));
+                }
+
+                alignas(16) float lanes[4];
+                _mm_store_ps(lanes, errors);
+                error = *std::max_element(lanes, lanes + 4);
+            }
+#endif
+
+            for(; i < count; i++)
+            {
+                auto surface = cells.u[i] >= v ? cells.base[i] + cells.u[i] * cells.upper_u[i] + v * cells.upper_v[i]
+                                               : cells.base[i] + v * cells.lower_v[i] + cells.u[i] * cells.lower_u[i];
+
+                error = std::max(error, std::fabs(samples[i] - surface));
+            }
+
+            return error;
+        }
+
+        float getDistance(const TerrainChunk& chunk, const Vector3D& point)
+        {
+            auto dx = std::max(std::max(chunk.bounds_min.x - point.x, point.x - chunk.bounds_max.x), 0.0f);
+            auto dy = std::max(std::max(chunk.bounds_min.y - point.y, point.y - chunk.bounds_max.y), 0.0f);
+            auto dz = std::max(std::max(chunk.bounds_min.z - point.z, point.z - chunk.bounds_max.z), 0.0f);
+
+            return std::sqrt(dx * dx + dy * dy + dz * dz);
+        }
+    }
+
+    int getGeomipmapLevelCount(int width, int height)
+    {
+        auto quads = std::max(width, height) - 1;
+
+        auto levels = 1;
+        while((1 << (levels - 1)) < quads)
+            levels++;
+
+        return levels;
+    }
+
+    void buildGeomipmapIndices(int width, int height, int level, unsigned stitched_edges, std::vector<uint16_t>& indices)
+    {
+        std::vector<int> columns, rows;
+        getLevelSamples(width, level, columns);
+        getLevelSamples(height, level, rows);
+
+        auto last_column = static_cast<int>(columns.size()) - 1;
+        auto last_row = static_cast<int>(rows.size()) - 1;
+
+        // On a stitched edge every odd vertex, except for the corner, is collapsed onto the previous one, which belongs
+        // to the coarser level. The triangles touching it either degenerate or stretch along the edge without folding over.
+        auto getVertex([&](int column, int row)
+        {
+            if(((column == 0 && (stitched_edges & geomipmap_edge_left)) || (column == last_column && (stitched_edges & geomipmap_edge_right))) &&
+               (row & 1) && row != last_row)
+                row--;
+
+            if(((row == 0 && (stitched_edges & geomipmap_edge_bottom)) || (row == last_row && (stitched_edges & geomipmap_edge_top))) &&
+               (column & 1) && column != last_column)
+                column--;
+
+            return static_cast<uint16_t>((rows[row] * width) + columns[column]);
+        });
+
+        auto addTriangle([&](uint16_t a, uint16_t b, uint16_t c)
+        {
+            if(a == b || b == c || a == c)
+                return;
+
+            indices.push_back(a);
+            indices.push_back(b);
+            indices.push_back(c);
+        });
+
+        for(auto row = int(); row < last_row; row++)
+        {
+            for(auto column = int(); column < last_column; column++)
+            {
+                auto bottom_left = getVertex(column, row);
+                auto bottom_right = getVertex(column + 1, row);
+                auto upper_left = getVertex(column, row + 1);
+                auto upper_right = getVertex(column + 1, row + 1);
+
+                addTriangle(upper_left, upper_right, bottom_left);
+                addTriangle(bottom_left, upper_right, bottom_right);
+            }
+        }
+    }
+
+    float computeGeomipmapError(const HeightField& height_field, int x, int z, int width, int height, int level)
+    {
+        if(level == 0)
+            return 0.0f;
+
+        std::vector<int> columns, rows;
+        getLevelSamples(width, level, columns);
+        getLevelSamples(height, level, rows);
+
+        // The surface is linear along the edges of the cells, so a sample on an edge two cells share can be taken by
+        // either: by the cell it starts, the samples of the last column or row by the cell they end.
+        CellRow cells;
+        for(auto row_data : {&cells.u, &cells.base, &cells.upper_u, &cells.upper_v, &cells.lower_u, &cells.lower_v})
+            row_data->resize(width);
+
+        for(auto column = size_t(); column + 1U < columns.size(); column++)
+        {
+            auto last = column + 2U < columns.size() ? columns[column + 1U] - 1 : columns[column + 1U];
+
+            for(auto i = columns[column]; i <= last; i++)
+                cells.u[i] = static_cast<float>(i - columns[column]) / static_cast<float>(columns[column + 1U] - columns[column]);
+        }
+
+        auto error = 0.0f;
+
+        for(auto row = size_t(); row + 1U < rows.size(); row++)
+        {
+            auto z0 = z + rows[row];
+            auto z1 = z + rows[row + 1U];
+
+            for(auto column = size_t(); column + 1U < columns.size(); column++)
+            {
+                auto x0 = x + columns[column];
+                auto x1 = x + columns[column + 1U];
+
+                auto h00 = height_field.getHeight(x0, z0), h10 = height_field.getHeight(x1, z0);
+                auto h01 = height_field.getHeight(x0, z1), h11 = height_field.getHeight(x1, z1);
+
+                auto last = column + 2U < columns.size() ? x1 - 1 : x1;
+
+                for(auto i = x0 - x; i <= last - x; i++)
+                {
+                    cells.base[i] = h00;
+                    cells.upper_u[i] = h10 - h00;
+                    cells.upper_v[i] = h11 - h10;
+                    cells.lower_u[i] = h11 - h01;
+                    cells.lower_v[i] = h01 - h00;
+                }
+            }
+
+            auto last_j = row + 2U < rows.size() ? z1 - 1 : z1;
+
+            for(auto j = z0; j <= last_j; j++)
+            {
+                auto v = static_cast<float>(j - z0) / static_cast<float>(z1 - z0);
+                error = std::max(error, getRowError(height_field.getRow(j) + x, cells, width, v));
+            }
+        }
+
+        return error;
+    }
+
+    void selectGeomipmapLevels(const std::vector<TerrainChunk>& chunks,
+                               int chunk_columns,
+                               const Vector3D& camera_position,
+                               float error_scale,
+                               float max_pixel_error,
+                               std::vector<int>& levels)
+    {
+        auto chunk_count = static_cast<int>(chunks.size());
+        auto chunk_rows = chunk_count / chunk_columns;
+
+        levels.resize(chunks.size());
+
+        for(auto c = int(); c < chunk_count; c++)
+        {
+            auto& chunk = chunks[c];
+
+            // Inside the bounds the distance is zero and only the full resolution is good enough.
+            auto max_error = getDistance(chunk, camera_position) * max_pixel_error / error_scale;
+
+            auto level = 0;
+            while(level + 1 < chunk.lod_level_count && chunk.lod_errors[level + 1] <= max_error)
+                level++;
+
+            levels[c] = level;
+        }
+
+        // Lowering a level can only lower its neighbours further, so this settles after a few sweeps.
+        for(auto changed = true; changed;)
+        {
+            changed = false;
+
+            for(auto c = int(); c < chunk_count; c++)
+            {
+                auto column = c % chunk_columns;
+                auto row = c / chunk_columns;
+
+                auto limit = levels[c];
+                if(column > 0)
+                    limit = std::min(limit, levels[c - 1] + 1);
+                if(column < chunk_columns - 1)
+                    limit = std::min(limit, levels[c + 1] + 1);
+                if(row > 0)
+                    limit = std::min(limit, levels[c - chunk_columns] + 1);
+                if(row < chunk_rows - 1)
+                    limit = std::min(limit, levels[c + chunk_columns] + 1);
+
+                if(limit < levels[c])
+                {
+                    levels[c] = limit;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    unsigned getGeomipmapStitching(const std::vector<int>& levels, int chunk_columns, int chunk)
+    {
+        auto chunk_rows = static_cast<int>(levels.size()) / chunk_columns;
+        auto column = chunk % chunk_columns;
+        auto row = chunk / chunk_columns;
+        auto level = levels[chunk];
+
+        auto edges = 0U;
+        if(column > 0 && levels[chunk - 1] > level)
+            edges |= geomipmap_edge_left;
+        if(column < chunk_columns - 1 && levels[chunk + 1] > level)
+            edges |= geomipmap_edge_right;
+        if(row > 0 && levels[chunk - chunk_columns] > level)
+            edges |= geomipmap_edge_bottom;
+        if(row < chunk_rows - 1 && levels[chunk + chunk_columns] > level)
+            edges |= geomipmap_edge_top;
+
+        return edges;
+    }
+}
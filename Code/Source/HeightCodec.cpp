@@ -0,0 +1,535 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "HeightCodec.h"
+#include "BitmapReader.h"
+#include "ParallelFor.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <numeric>
+#include <utility>
+
+namespace bm
+{
+    namespace
+    {
+        constexpr char compressed_height_magic[4] = {'B', 'M', 'H', 'C'};
+        constexpr uint64_t index_alignment = 16U;
+
+        // Residuals are packed 128 at a time, all with the bits of the largest one. Residual i of a block goes to lane
+        // i % 4 of 32-bit words interleaved four by four, as bits (i / 4) * bits of that lane, so that an SSE register
+        // unpacks four consecutive residuals at once.
+        constexpr int block_size = 128;
+        constexpr int block_lanes = 4;
+
+        // Tile code: step, a byte of bits per block, then the packed blocks, bits * 16 bytes each. Multi-byte values are
+        // little-endian.
+        template<typename Type>
+        void append(std::vector<unsigned char>& output, Type value)
+        {
+            auto size = output.size();
+            output.resize(size + sizeof(Type));
+            std::memcpy(output.data() + size, &value, sizeof(Type));
+        }
+
+        uint32_t zigzag(int32_t value)
+        {
+            return (static_cast<uint32_t>(value) << 1U) ^ static_cast<uint32_t>(value >> 31);
+        }
+
+#ifndef BM_SIMD_SSE4
+        int32_t unzigzag(uint32_t value)
+        {
+            return static_cast<int32_t>(value >> 1U) ^ -static_cast<int32_t>(value & 1U);
+        }
+#endif
+
+        uint32_t getBitCount(uint32_t value)
+        {
+            auto bits = uint32_t();
+            for(; value != 0U; value >>= 1U)
+                bits++;
+
+            return bits;
+        }
+
+        void packBlock(const uint32_t* residuals, uint32_t bits, uint32_t* words)
+        {
+            for(auto i = 0; i < block_size; i++)
+            {
+                auto lane = i % block_lanes;
+                auto offset = static_cast<uint32_t>(i / block_lanes) * bits;
+
+                auto word = offset / 32U, shift = offset % 32U;
+
+                words[word * block_lanes + lane] |= residuals[i] << shift;
+                if(shift + bits > 32U)
+                    words[(word + 1U) * block_lanes + lane] |= residuals[i] >> (32U - shift);
+            }
+        }
+
+        constexpr uint32_t block_groups = block_size / block_lanes;
+
+#ifdef BM_SIMD_SSE4
+        // Residuals 4 * Group to 4 * Group + 3 of a block of Bits per residual, zigzag undone. Both are template arguments,
+        // so that the word, the shifts and whether the residuals straddle two words are compile-time constants.
+        template<uint32_t Bits, uint32_t Group>
+        __m128i unpackGroup(const unsigned char* words)
+        {
+            constexpr auto offset = Group * Bits, word = offset / 32U, shift = offset % 32U;
+
+            // A block of 0 bits has no words to read.
+            if(Bits == 0U)
+                return _mm_setzero_si128();
+
+            auto values = _mm_srli_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(words) + word), shift);
+
+            // The high bits of residuals that straddle two words.
+            if(shift + Bits > 32U)
+                values = _mm_or_si128(values, _mm_slli_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(words) + word + 1), 32U - shift));
+
+            values = _mm_and_si128(values, _mm_set1_epi32(static_cast<int>(static_cast<uint32_t>((1ULL << Bits) - 1ULL))));
+
+            return _mm_xor_si128(_mm_srli_epi32(values, 1), _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(values, _mm_set1_epi32(1))));
+        }
+
+        template<uint32_t Bits, uint32_t... Groups>
+        void unpackGroups(const unsigned char* words, int32_t* residuals, std::integer_sequence<uint32_t, Groups...>)
+        {
+            int expand[] = {(_mm_storeu_si128(reinterpret_cast<__m128i*>(residuals + Groups * block_lanes), unpackGroup<Bits, Groups>(words)), 0)...};
+            (void)expand;
+        }
+
+        // Rebuilds group Group of a block that lies within one row: its residuals summed along the row on top of carry,
+        // added to the row above and scaled.
+        template<uint32_t Bits, uint32_t Group>
+        void decodeGroup(const unsigned char* words, int32_t* above, __m128i& carry, const __m128i& step, const __m128& scale, float* output)
+        {
+            auto prefix = unpackGroup<Bits, Group>(words);
+            prefix = _mm_add_epi32(prefix, _mm_slli_si128(prefix, 4));
+            prefix = _mm_add_epi32(prefix, _mm_slli_si128(prefix, 8));
+            prefix = _mm_add_epi32(prefix, carry);
+
+            carry = _mm_shuffle_epi32(prefix, _MM_SHUFFLE(3, 3, 3, 3));
+
+            auto samples = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(above + Group * block_lanes)), prefix);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(above + Group * block_lanes), samples);
+
+            _mm_storeu_ps(output + Group * block_lanes, _mm_mul_ps(_mm_cvtepi32_ps(_mm_mullo_epi32(samples, step)), scale));
+        }
+
+        template<uint32_t Bits, uint32_t... Groups>
+        int32_t decodeGroups(const unsigned char* words, int32_t* above, int32_t sum, int32_t step, float scale, float* output,
+                             std::integer_sequence<uint32_t, Groups...>)
+        {
+            const auto step4 = _mm_set1_epi32(step);
+            const auto scale4 = _mm_set1_ps(scale);
+            auto carry = _mm_set1_epi32(sum);
+
+            int expand[] = {(decodeGroup<Bits, Groups>(words, above, carry, step4, scale4, output), 0)...};
+            (void)expand;
+
+            return _mm_cvtsi128_si32(carry);
+        }
+#endif
+
+        // Unpacks a block of Bits per residual and undoes their zigzag. Bits is a template argument, so that the word and
+        // shift of every residual are known at compile time.
+        template<uint32_t Bits>
+        void unpackBlock(const unsigned char* words, int32_t* residuals)
+        {
+#ifdef BM_SIMD_SSE4
+            unpackGroups<Bits>(words, residuals, std::make_integer_sequence<uint32_t, block_groups>());
+#else
+            for(auto i = 0; i < block_size; i++)
+            {
+                auto lane = i % block_lanes;
+                auto offset = static_cast<uint32_t>(i / block_lanes) * Bits;
+
+                auto word = offset / 32U, shift = offset % 32U;
+
+                uint32_t low, high = 0U;
+                std::memcpy(&low, words + (word * block_lanes + lane) * sizeof(uint32_t), sizeof(uint32_t));
+                if(shift + Bits > 32U)
+                    std::memcpy(&high, words + ((word + 1U) * block_lanes + lane) * sizeof(uint32_t), sizeof(uint32_t));
+
+                residuals[i] = unzigzag(static_cast<uint32_t>((((static_cast<uint64_t>(high) << 32U) | low) >> shift) & ((1ULL << Bits) - 1ULL)));
+            }
+#endif
+        }
+
+        template<>
+        void unpackBlock<0U>(const unsigned char*, int32_t* residuals)
+        {
+            std::fill_n(residuals, block_size, 0);
+        }
+
+        template<uint32_t... Bits>
+        constexpr auto makeUnpackers(std::integer_sequence<uint32_t, Bits...>)
+        {
+            return std::array<void (*)(const unsigned char*, int32_t*), sizeof...(Bits)>{unpackBlock<Bits>...};
+        }
+
+        // Unpacker for every number of bits from 0 to 32.
+        constexpr auto unpackers = makeUnpackers(std::make_integer_sequence<uint32_t, 33U>());
+
+        // Rebuilds samples of a row from their residuals: the samples minus those of the row above are the running sum of
+        // the residuals, starting from sum. above holds the quantized row above (zeros for the first row) and is replaced
+        // by this one. Returns the running sum after the last sample.
+        int32_t reconstructRow(const int32_t* residuals, int32_t* above, int count, int32_t sum, int32_t step, float scale, float* output)
+        {
+            auto i = int();
+
+#ifdef BM_SIMD_SSE4
+            const auto step4 = _mm_set1_epi32(step);
+            const auto scale4 = _mm_set1_ps(scale);
+            auto carry = _mm_set1_epi32(sum);
+
+            for(; i + 4 <= count; i += 4)
+            {
+                auto prefix = _mm_loadu_si128(reinterpret_cast<const __m128i*>(residuals + i));
+                prefix = _mm_add_epi32(prefix, _mm_slli_si128(prefix, 4));
+                prefix = _mm_add_epi32(prefix, _mm_slli_si128(prefix, 8));
+                prefix = _mm_add_epi32(prefix, carry);
+
+                carry = _mm_shuffle_epi32(prefix, _MM_SHUFFLE(3, 3, 3, 3));
+
+                auto samples = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(above + i)), prefix);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(above + i), samples);
+
+                _mm_storeu_ps(output + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_mullo_epi32(samples, step4)), scale4));
+            }
+
+            sum = _mm_cvtsi128_si32(carry);
+#endif
+
+            for(; i < count; i++)
+            {
+                sum += residuals[i];
+                above[i] += sum;
+
+                output[i] = static_cast<float>(above[i] * step) * scale;
+            }
+
+            return sum;
+        }
+
+        // Decodes a block of Bits per residual that lies within one row straight into it. With SSE every four residuals
+        // are unpacked, summed along the row from sum, added to the row above and scaled in registers, so that the
+        // residuals never go through memory. Returns the running sum after the block.
+        template<uint32_t Bits>
+        int32_t decodeBlock(const unsigned char* words, int32_t* above, int32_t sum, int32_t step, float scale, float* output)
+        {
+#ifdef BM_SIMD_SSE4
+            return decodeGroups<Bits>(words, above, sum, step, scale, output, std::make_integer_sequence<uint32_t, block_groups>());
+#else
+            int32_t residuals[block_size];
+            unpackBlock<Bits>(words, residuals);
+
+            return reconstructRow(residuals, above, block_size, sum, step, scale, output);
+#endif
+        }
+
+        template<uint32_t... Bits>
+        constexpr auto makeBlockDecoders(std::integer_sequence<uint32_t, Bits...>)
+        {
+            return std::array<int32_t (*)(const unsigned char*, int32_t*, int32_t, int32_t, float, float*), sizeof...(Bits)>{decodeBlock<Bits>...};
+        }
+
+        // Block decoder for every number of bits from 0 to 32.
+        constexpr auto block_decoders = makeBlockDecoders(std::make_integer_sequence<uint32_t, 33U>());
+    }
+
+    void encodeHeightTile(const uint16_t* samples, int width, int height, size_t stride, int max_error, std::vector<unsigned char>& output)
+    {
+        auto step = static_cast<uint32_t>(2 * max_error + 1);
+        auto count = static_cast<size_t>(width) * height;
+        auto block_count = (count + block_size - 1U) / block_size;
+
+        // Residuals of the quantized samples against W + N - NW, in sample order. The last block is padded with zeros.
+        std::vector<uint32_t> residuals(block_count * block_size, 0U);
+        std::vector<int32_t> above(width, 0), row(width);
+
+        for(auto j = int(); j < height; j++)
+        {
+            for(auto i = int(); i < width; i++)
+            {
+                row[i] = static_cast<int32_t>((samples[j * stride + i] + static_cast<uint32_t>(max_error)) / step);
+
+                auto predicted = above[i] + (i > 0 ? row[i - 1] - above[i - 1] : 0);
+                residuals[static_cast<size_t>(j) * width + i] = zigzag(row[i] - predicted);
+            }
+
+            above.swap(row);
+        }
+
+        append(output, static_cast<uint16_t>(step));
+
+        auto bits_offset = output.size();
+        output.resize(bits_offset + block_count);
+
+        std::vector<uint32_t> words;
+        for(auto block = size_t(); block < block_count; block++)
+        {
+            auto first = residuals.begin() + block * block_size;
+            auto bits = getBitCount(std::accumulate(first, first + block_size, 0U, [](uint32_t bits, uint32_t residual) { return bits | residual; }));
+
+            output[bits_offset + block] = static_cast<unsigned char>(bits);
+
+            if(bits == 0U)
+                continue;
+
+            words.assign(bits * block_lanes, 0U);
+            packBlock(&*first, bits, words.data());
+
+            for(auto word : words)
+                append(output, word);
+        }
+    }
+
+    bool decodeHeightTile(const unsigned char* data, size_t size, int width, int height, float scale, float* output, size_t output_stride)
+    {
+        auto count = static_cast<size_t>(width) * height;
+        auto block_count = (count + block_size - 1U) / block_size;
+
+        uint16_t step;
+        if(size < sizeof(step) + block_count)
+            return false;
+
+        std::memcpy(&step, data, sizeof(step));
+
+        auto block_bits = data + sizeof(step);
+        auto words = block_bits + block_count;
+
+        // The blocks have to fit the code before any of them is unpacked.
+        auto words_size = size_t();
+        for(auto block = size_t(); block < block_count; block++)
+        {
+            if(block_bits[block] > 32U)
+                return false;
+
+            words_size += block_bits[block] * block_lanes * sizeof(uint32_t);
+        }
+
+        if(step == 0U || words_size != size - sizeof(step) - block_count)
+            return false;
+
+        // Scratch of the thread, so that decoding allocates nothing once it has decoded a tile as wide: the quantized
+        // row above, and the residuals of a block that spans the end of a row.
+        thread_local std::vector<int32_t> above;
+        above.assign(width, 0);
+
+        int32_t residuals[block_size];
+
+        // Block by block in sample order, each one rebuilt into the rows it covers as soon as it is unpacked.
+        auto i = int(), j = int();
+        auto sum = int32_t();
+
+        for(auto block = size_t(); block < block_count; block++)
+        {
+            auto bits = static_cast<uint32_t>(block_bits[block]);
+
+            if(i + block_size <= width)
+            {
+                sum = block_decoders[bits](words, above.data() + i, sum, step, scale, output + j * output_stride + i);
+                i += block_size;
+            }
+            else
+            {
+                unpackers[bits](words, residuals);
+
+                for(auto k = int(); k < block_size && j < height; )
+                {
+                    auto count = std::min(block_size - k, width - i);
+                    sum = reconstructRow(residuals + k, above.data() + i, count, sum, step, scale, output + j * output_stride + i);
+
+                    k += count;
+                    i += count;
+
+                    if(i == width)
+                    {
+                        i = 0;
+                        j++;
+                        sum = 0;
+                    }
+                }
+            }
+
+            if(i == width)
+            {
+                i = 0;
+                j++;
+                sum = 0;
+            }
+
+            words += bits * block_lanes * sizeof(uint32_t);
+        }
+
+        return true;
+    }
+
+    bool convertBitmapToCompressedHeights(const wchar_t* bitmap_file_name, const wchar_t* file_name, const HeightCodecSettings& settings)
+    {
+        if(settings.tile_size < 1 || settings.max_error < 0 || 2 * settings.max_error + 1 > 0xFFFF)
+            return false;
+
+        MappedFile bitmap(bitmap_file_name);
+        if(!bitmap.isOpen())
+            return false;
+
+        BitmapInfo bitmap_info;
+        if(!readBitmapInfo(bitmap.getData(), bitmap.getSize(), bitmap_info))
+            return false;
+
+        CompressedHeightFileHeader header = {};
+        std::memcpy(header.magic, compressed_height_magic, sizeof(compressed_height_magic));
+        header.version = compressed_height_file_version;
+        header.width = bitmap_info.width;
+        header.height = bitmap_info.height;
+        header.tile_size = settings.tile_size;
+        header.max_error = settings.max_error;
+        header.columns = (header.width + settings.tile_size - 1) / settings.tile_size;
+        header.rows = (header.height + settings.tile_size - 1) / settings.tile_size;
+        header.index_offset = (sizeof(CompressedHeightFileHeader) + index_alignment - 1U) & ~(index_alignment - 1U);
+
+        std::vector<CompressedHeightTile> tiles(static_cast<size_t>(header.columns) * header.rows, CompressedHeightTile());
+
+        // Written next to file_name and moved over it once complete, like a .bmheights file.
+        auto partial_file_name = std::wstring(file_name) + L".partial";
+
+        std::ofstream height_file(fs::path(partial_file_name), std::ios::binary | std::ios::trunc);
+        if(!height_file)
+            return false;
+
+        // Zeroed header and index first, the real ones are written once all the tiles made it to the file.
+        const CompressedHeightFileHeader empty_header = {};
+        height_file.write(reinterpret_cast<const char*>(&empty_header), sizeof(empty_header));
+
+        const char padding[index_alignment] = {};
+        height_file.write(padding, static_cast<std::streamsize>(header.index_offset - sizeof(empty_header)));
+        height_file.write(reinterpret_cast<const char*>(tiles.data()), static_cast<std::streamsize>(tiles.size() * sizeof(CompressedHeightTile)));
+
+        auto offset = header.index_offset + tiles.size() * sizeof(CompressedHeightTile);
+
+        // One row of tiles at a time: its samples are pulled out of the bitmap, the tiles encoded in parallel and
+        // written in order.
+        std::vector<uint16_t> band(static_cast<size_t>(header.width) * settings.tile_size);
+        std::vector<std::vector<unsigned char>> codes(header.columns);
+
+        for(auto row = 0; row < header.rows; row++)
+        {
+            auto z0 = row * settings.tile_size;
+            auto band_height = std::min(settings.tile_size, header.height - z0);
+
+            for(auto j = 0; j < band_height; j++)
+            {
+                auto pixels = getBitmapRow(bitmap.getData(), bitmap_info, z0 + j);
+                auto samples = band.data() + static_cast<size_t>(j) * header.width;
+
+                for(auto i = 0; i < header.width; i++)
+                    samples[i] = pixels[static_cast<size_t>(i) * 3U];
+            }
+
+            parallelFor(0, header.columns, settings.thread_count, [&](int first_column, int last_column)
+            {
+                for(auto column = first_column; column < last_column; column++)
+                {
+                    auto x0 = column * settings.tile_size;
+
+                    codes[column].clear();
+                    encodeHeightTile(band.data() + x0, std::min(settings.tile_size, header.width - x0), band_height, header.width,
+                                     settings.max_error, codes[column]);
+                }
+            });
+
+            for(auto column = 0; column < header.columns; column++)
+            {
+                auto& tile = tiles[static_cast<size_t>(row) * header.columns + column];
+                tile.offset = offset;
+                tile.size = static_cast<uint32_t>(codes[column].size());
+
+                height_file.write(reinterpret_cast<const char*>(codes[column].data()), static_cast<std::streamsize>(tile.size));
+                offset += tile.size;
+            }
+        }
+
+        header.file_size = offset;
+
+        height_file.seekp(static_cast<std::streamoff>(header.index_offset));
+        height_file.write(reinterpret_cast<const char*>(tiles.data()), static_cast<std::streamsize>(tiles.size() * sizeof(CompressedHeightTile)));
+
+        height_file.seekp(0);
+        height_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        height_file.close();
+
+        if(!height_file || !MoveFileExW(partial_file_name.c_str(), file_name, MOVEFILE_REPLACE_EXISTING))
+        {
+            DeleteFileW(partial_file_name.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    CompressedHeightFile::CompressedHeightFile(const wchar_t* file_name) :
+        file(file_name),
+        valid(false)
+    {
+        if(!file.isOpen() || file.getSize() < sizeof(CompressedHeightFileHeader))
+            return;
+
+        auto& header = getHeader();
+        if(std::memcmp(header.magic, compressed_height_magic, sizeof(compressed_height_magic)) != 0 ||
+           header.version != compressed_height_file_version ||
+           header.file_size != file.getSize() ||
+           header.width <= 0 || header.height <= 0 || header.tile_size <= 0 ||
+           header.columns != (header.width + header.tile_size - 1) / header.tile_size ||
+           header.rows != (header.height + header.tile_size - 1) / header.tile_size)
+            return;
+
+        // The index and the tiles have to lie inside the file, in case it was produced by a broken writer.
+        auto tile_count = static_cast<uint64_t>(header.columns) * header.rows;
+        if(header.index_offset % index_alignment != 0U || header.index_offset > header.file_size ||
+           tile_count * sizeof(CompressedHeightTile) > header.file_size - header.index_offset)
+            return;
+
+        auto tiles = reinterpret_cast<const CompressedHeightTile*>(file.getData() + header.index_offset);
+
+        valid = std::all_of(tiles, tiles + tile_count, [&](const CompressedHeightTile& tile)
+        {
+            return tile.offset <= header.file_size && tile.size <= header.file_size - tile.offset;
+        });
+    }
+
+    bool CompressedHeightFile::decodeTile(int column, int row, float scale, float* output) const
+    {
+        auto& header = getHeader();
+        auto& tile = getTile(column, row);
+
+        auto x0 = column * header.tile_size, z0 = row * header.tile_size;
+
+        return decodeHeightTile(file.getData() + tile.offset, tile.size,
+                                std::min(header.tile_size, header.width - x0), std::min(header.tile_size, header.height - z0),
+                                scale, output + static_cast<size_t>(z0) * header.width + x0, static_cast<size_t>(header.width));
+    }
+
+    bool CompressedHeightFile::decode(float scale, float* output, unsigned thread_count) const
+    {
+        auto& header = getHeader();
+
+        // Each band of tiles writes its own samples only, a failure anywhere fails the whole decode.
+        std::vector<char> results(static_cast<size_t>(header.columns) * header.rows, 0);
+
+        parallelFor(0, header.columns * header.rows, thread_count, [&](int first_tile, int last_tile)
+        {
+            for(auto tile = first_tile; tile < last_tile; tile++)
+                results[tile] = decodeTile(tile % header.columns, tile / header.columns, scale, output);
+        });
+
+        return std::all_of(results.begin(), results.end(), [](char result) { return result != 0; });
+    }
+}
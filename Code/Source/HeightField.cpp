@@ -0,0 +1,30 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "HeightField.h"
+
+namespace bm
+{
+    HeightField::HeightField(int width, int height, float spacing)
+    {
+        resize(width, height, spacing);
+    }
+
+    void HeightField::resize(int width, int height, float spacing)
+    {
+        this->width = width;
+        this->height = height;
+        this->spacing = spacing;
+
+        auto sample_count = static_cast<size_t>(width) * static_cast<size_t>(height);
+
+        heights.assign(sample_count, 0.0f);
+        normals.assign(sample_count, packNormal(Vector3D(0.0f, 1.0f, 0.0f)));
+    }
+
+    size_t HeightField::getMemoryUsage() const
+    {
+        return heights.capacity() * sizeof(float) + normals.capacity() * sizeof(uint32_t);
+    }
+}
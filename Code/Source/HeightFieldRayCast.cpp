@@ -0,0 +1,254 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "HeightFieldRayCast.h"
+#include "NormalKernels.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace bm
+{
+    namespace
+    {
+        // Nearest hit within [0, max_distance] of the two triangles of quad (i, j), if any. Every triangle is the plane
+        // through sample (i, j) with its gradient, clipped to its half of the quad.
+        template<typename Field>
+        bool intersectQuad(const Field& height_field, int i, int j, const Vector3D& origin, const Vector3D& direction,
+                           float max_distance, HeightFieldRayHit& hit)
+        {
+            // Keeps rays from slipping between the triangles through their shared edges.
+            static constexpr float edge_tolerance = 1e-5f;
+
+            auto spacing = height_field.getSpacing();
+            auto x = height_field.getX(i), z = height_field.getZ(j);
+
+            auto h00 = height_field.getHeight(i, j), h10 = height_field.getHeight(i + 1, j);
+            auto h01 = height_field.getHeight(i, j + 1), h11 = height_field.getHeight(i + 1, j + 1);
+
+            // The triangle towards (i, j + 1) first, then the one towards (i + 1, j).
+            const float gradients[2][2] = {{(h11 - h01) / spacing, (h01 - h00) / spacing}, {(h10 - h00) / spacing, (h11 - h10) / spacing}};
+
+            auto found = false;
+
+            for(auto triangle = 0; triangle < 2; triangle++)
+            {
+                auto gx = gradients[triangle][0], gz = gradients[triangle][1];
+
+                auto denominator = direction.y - gx * direction.x - gz * direction.z;
+                if(denominator == 0.0f)
+                    continue;
+
+                auto t = (h00 + gx * (origin.x - x) + gz * (origin.z - z) - origin.y) / denominator;
+                if(t < 0.0f || t > max_distance)
+                    continue;
+
+                auto u = (origin.x + t * direction.x - x) / spacing;
+                auto v = (origin.z + t * direction.z - z) / spacing;
+
+                if(u < -edge_tolerance || u > 1.0f + edge_tolerance || v < -edge_tolerance || v > 1.0f + edge_tolerance)
+                    continue;
+
+                if(triangle == 0 ? u > v + edge_tolerance : u < v - edge_tolerance)
+                    continue;
+
+                hit.position = Vector3D(origin.x + t * direction.x, origin.y + t * direction.y, origin.z + t * direction.z);
+                hit.normal = getGradientFrame(gx, gz).normal;
+                hit.i = i;
+                hit.j = j;
+                hit.distance = t;
+
+                max_distance = t;
+                found = true;
+            }
+
+            return found;
+        }
+
+        // Highest sample of the quads [i * 2^level, (i + 1) * 2^level) along each axis. Their far border is the first
+        // sample of the next blocks of the pyramid, so those are taken in as well. The samples themselves, level 0, are
+        // read from the height field the ray is cast against.
+        template<typename Field>
+        float getNodeMax(const HeightPyramid& height_pyramid, const Field& height_field, int level, int i, int j)
+        {
+            auto last_i = std::min(i + 1, height_pyramid.getColumns(level) - 1);
+            auto last_j = std::min(j + 1, height_pyramid.getRows(level) - 1);
+
+            if(level == 0)
+            {
+                auto max_height = std::max(height_field.getHeight(i, j), height_field.getHeight(last_i, j));
+                return std::max(max_height, std::max(height_field.getHeight(i, last_j), height_field.getHeight(last_i, last_j)));
+            }
+
+            auto max_height = std::max(height_pyramid.getMax(level, i, j), height_pyramid.getMax(level, last_i, j));
+            return std::max(max_height, std::max(height_pyramid.getMax(level, i, last_j), height_pyramid.getMax(level, last_i, last_j)));
+        }
+
+        // Narrows [t_min, t_max] to where the ray is within [low, high] along one axis.
+        bool clipRay(float origin, float direction, float low, float high, float& t_min, float& t_max)
+        {
+            if(direction == 0.0f)
+                return origin >= low && origin <= high;
+
+            auto t0 = (low - origin) / direction;
+            auto t1 = (high - origin) / direction;
+            if(t0 > t1)
+                std::swap(t0, t1);
+
+            t_min = std::max(t_min, t0);
+            t_max = std::min(t_max, t1);
+
+            return t_min <= t_max;
+        }
+
+        template<typename Field>
+        bool castRay(const HeightPyramid& height_pyramid, const Field& height_field, const Vector3D& origin, const Vector3D& direction,
+                     float max_distance, HeightFieldRayHit& hit)
+        {
+            auto quad_columns = height_field.getWidth() - 1;
+            auto quad_rows = height_field.getHeight() - 1;
+            if(quad_columns < 1 || quad_rows < 1)
+                return false;
+
+            auto top = height_pyramid.getLevelCount() - 1;
+
+            auto t_min = 0.0f, t_max = max_distance;
+            if(!clipRay(origin.x, direction.x, 0.0f, height_field.getX(quad_columns), t_min, t_max) ||
+               !clipRay(origin.z, direction.z, 0.0f, height_field.getZ(quad_rows), t_min, t_max) ||
+               !clipRay(origin.y, direction.y, height_pyramid.getMin(top, 0, 0), height_pyramid.getMax(top, 0, 0), t_min, t_max))
+                return false;
+
+            auto step_i = direction.x < 0.0f ? -1 : 1;
+            auto step_j = direction.z < 0.0f ? -1 : 1;
+
+            auto infinity = std::numeric_limits<float>::infinity();
+
+            // Node (i, j) of a level covers quads [i * 2^level, (i + 1) * 2^level) along each axis, the top one all of them.
+            auto level = top;
+            auto i = 0, j = 0;
+            auto t = t_min;
+
+            for(;;)
+            {
+                auto first_i = i << level, last_i = std::min((i + 1) << level, quad_columns);
+                auto first_j = j << level, last_j = std::min((j + 1) << level, quad_rows);
+
+                auto exit_x = direction.x > 0.0f ? (height_field.getX(last_i) - origin.x) / direction.x :
+                              direction.x < 0.0f ? (height_field.getX(first_i) - origin.x) / direction.x : infinity;
+                auto exit_z = direction.z > 0.0f ? (height_field.getZ(last_j) - origin.z) / direction.z :
+                              direction.z < 0.0f ? (height_field.getZ(first_j) - origin.z) / direction.z : infinity;
+
+                auto t_exit = std::max(std::min(std::min(exit_x, exit_z), t_max), t);
+
+                // The ray is lowest at one end of its span over the node.
+                auto low = std::min(origin.y + t * direction.y, origin.y + t_exit * direction.y);
+                if(low <= getNodeMax(height_pyramid, height_field, level, i, j))
+                {
+                    if(level == 0)
+                    {
+                        if(intersectQuad(height_field, i, j, origin, direction, max_distance, hit))
+                            return true;
+                    }
+                    else
+                    {
+                        // Down to the child the ray enters the node through.
+                        level--;
+
+                        auto middle_i = (2 * i + 1) << level, middle_j = (2 * j + 1) << level;
+                        auto x = origin.x + t * direction.x, z = origin.z + t * direction.z;
+
+                        i = 2 * i + (middle_i < quad_columns && x >= height_field.getX(middle_i) ? 1 : 0);
+                        j = 2 * j + (middle_j < quad_rows && z >= height_field.getZ(middle_j) ? 1 : 0);
+                        continue;
+                    }
+                }
+
+                if(t_exit >= t_max)
+                    return false;
+
+                t = t_exit;
+
+                // On to the next node of the same level, through a corner if the ray leaves through one.
+                auto previous_i = i, previous_j = j;
+
+                if(exit_x <= exit_z)
+                    i += step_i;
+                if(exit_z <= exit_x)
+                    j += step_j;
+
+                if(i < 0 || j < 0 || (i << level) >= quad_columns || (j << level) >= quad_rows)
+                    return false;
+
+                // And up for as long as that also left the parent, whose other children are still untested.
+                while(level < top && ((i >> 1) != (previous_i >> 1) || (j >> 1) != (previous_j >> 1)))
+                {
+                    level++;
+
+                    i >>= 1;
+                    j >>= 1;
+                    previous_i >>= 1;
+                    previous_j >>= 1;
+                }
+            }
+        }
+    }
+
+    bool castHeightFieldRay(const HeightPyramid& height_pyramid, const Vector3D& origin, const Vector3D& direction, float max_distance,
+                            HeightFieldRayHit& hit)
+    {
+        if(height_pyramid.isEmpty())
+            return false;
+
+        return castRay(height_pyramid, height_pyramid.getHeightField(), origin, direction, max_distance, hit);
+    }
+
+    bool castHeightFieldRay(const HeightPyramid& height_pyramid, const TiledHeightField& height_field, const Vector3D& origin,
+                            const Vector3D& direction, float max_distance, HeightFieldRayHit& hit)
+    {
+        if(height_pyramid.isEmpty())
+            return false;
+
+        return castRay(height_pyramid, height_field, origin, direction, max_distance, hit);
+    }
+
+    void castHeightFieldRays(const HeightPyramid& height_pyramid, const Vector3D* origins, const Vector3D* directions, size_t count,
+                             float max_distance, HeightFieldRayHit* hits)
+    {
+        for(auto k = size_t(0); k < count; k++)
+        {
+            if(!castHeightFieldRay(height_pyramid, origins[k], directions[k], max_distance, hits[k]))
+                hits[k].distance = -1.0f;
+        }
+    }
+
+    void castHeightFieldRays(const HeightPyramid& height_pyramid, const TiledHeightField& height_field, const Vector3D* origins,
+                             const Vector3D* directions, size_t count, float max_distance, HeightFieldRayHit* hits)
+    {
+        for(auto k = size_t(0); k < count; k++)
+        {
+            if(!castHeightFieldRay(height_pyramid, height_field, origins[k], directions[k], max_distance, hits[k]))
+                hits[k].distance = -1.0f;
+        }
+    }
+
+    bool castHeightFieldRayReference(const HeightField& height_field, const Vector3D& origin, const Vector3D& direction, float max_distance,
+                                     HeightFieldRayHit& hit)
+    {
+        auto found = false;
+
+        for(auto j = 0; j < height_field.getHeight() - 1; j++)
+        {
+            for(auto i = 0; i < height_field.getWidth() - 1; i++)
+            {
+                if(intersectQuad(height_field, i, j, origin, direction, max_distance, hit))
+                {
+                    max_distance = hit.distance;
+                    found = true;
+                }
+            }
+        }
+
+        return found;
+    }
+}
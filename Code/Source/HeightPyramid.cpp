@@ -0,0 +1,281 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "HeightPyramid.h"
+#include "ParallelFor.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace bm
+{
+    namespace
+    {
+        struct Minimum
+        {
+            static float apply(float a, float b) { return std::min(a, b); }
+#ifdef BM_SIMD_SSE4
+            static __m128 apply(__m128 a, __m128 b) { return _mm_min_ps(a, b); }
+#endif
+#ifdef BM_SIMD_AVX2
+            static __m256 apply(__m256 a, __m256 b) { return _mm256_min_ps(a, b); }
+#endif
+        };
+
+        struct Maximum
+        {
+            static float apply(float a, float b) { return std::max(a, b); }
+#ifdef BM_SIMD_SSE4
+            static __m128 apply(__m128 a, __m128 b) { return _mm_max_ps(a, b); }
+#endif
+#ifdef BM_SIMD_AVX2
+            static __m256 apply(__m256 a, __m256 b) { return _mm256_max_ps(a, b); }
+#endif
+        };
+
+        // Reduces the 2x2 blocks of two source rows into output[first, last]: output[c] comes from source columns 2c and
+        // 2c + 1, the last column standing in for the missing one of an odd row.
+        template<typename Operation>
+        void reduceBlocks(const float* row0, const float* row1, int source_columns, int first, int last, float* output)
+        {
+            auto c = first;
+
+#ifdef BM_SIMD_AVX2
+            for(; c + 8 <= last + 1 && 2 * c + 16 <= source_columns; c += 8)
+            {
+                auto a = Operation::apply(_mm256_loadu_ps(row0 + 2 * c), _mm256_loadu_ps(row1 + 2 * c));
+                auto b = Operation::apply(_mm256_loadu_ps(row0 + 2 * c + 8), _mm256_loadu_ps(row1 + 2 * c + 8));
+
+                // The shuffles work within 128-bit lanes, the permutation puts the lanes back in order.
+                auto even = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+                auto odd = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+
+                _mm256_storeu_ps(output + c, Operation::apply(even, odd));
+            }
+#endif
+
+#ifdef BM_SIMD_SSE4
+            for(; c + 4 <= last + 1 && 2 * c + 8 <= source_columns; c += 4)
+            {
+                auto a = Operation::apply(_mm_loadu_ps(row0 + 2 * c), _mm_loadu_ps(row1 + 2 * c));
+                auto b = Operation::apply(_mm_loadu_ps(row0 + 2 * c + 4), _mm_loadu_ps(row1 + 2 * c + 4));
+
+                auto even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+                auto odd = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+
+                _mm_storeu_ps(output + c, Operation::apply(even, odd));
+            }
+#endif
+
+            for(; c <= last; c++)
+            {
+                auto s = 2 * c;
+                auto t = std::min(s + 1, source_columns - 1);
+
+                output[c] = Operation::apply(Operation::apply(row0[s], row0[t]), Operation::apply(row1[s], row1[t]));
+            }
+        }
+    }
+
+    void HeightPyramid::build(const HeightField& height_field, unsigned thread_count)
+    {
+        this->height_field = &height_field;
+
+        // Sizes first, so that a rebuild over a height field of the same size keeps the storage of every level.
+        auto columns = height_field.getWidth();
+        auto rows = height_field.getHeight();
+        auto count = size_t(0);
+
+        while(columns > 1 || rows > 1)
+        {
+            columns = (columns + 1) / 2;
+            rows = (rows + 1) / 2;
+
+            if(levels.size() <= count)
+                levels.emplace_back();
+
+            auto& level = levels[count++];
+            level.columns = columns;
+            level.rows = rows;
+            level.min.resize(static_cast<size_t>(columns) * rows);
+            level.max.resize(level.min.size());
+        }
+
+        levels.resize(count);
+
+        // Rows of a level only read their own two source rows.
+        for(auto level = 1; level < getLevelCount(); level++)
+        {
+            parallelFor(0, getRows(level), thread_count, [&](int first_row, int last_row)
+            {
+                reduceRows(level, first_row, last_row - 1, 0, getColumns(level) - 1);
+            });
+        }
+    }
+
+    void HeightPyramid::update(int x0, int z0, int x1, int z1)
+    {
+        if(isEmpty())
+            return;
+
+        x0 = std::max(x0, 0);
+        z0 = std::max(z0, 0);
+        x1 = std::min(x1, height_field->getWidth() - 1);
+        z1 = std::min(z1, height_field->getHeight() - 1);
+
+        if(x0 > x1 || z0 > z1)
+            return;
+
+        for(auto level = 1; level < getLevelCount(); level++)
+            reduceRows(level, z0 >> level, z1 >> level, x0 >> level, x1 >> level);
+    }
+
+    void HeightPyramid::reduceRows(int level, int first_row, int last_row, int first_column, int last_column)
+    {
+        auto& output = levels[level - 1];
+        auto source_columns = getColumns(level - 1);
+        auto source_rows = getRows(level - 1);
+
+        for(auto row = first_row; row <= last_row; row++)
+        {
+            auto s = 2 * row;
+            auto t = std::min(s + 1, source_rows - 1);
+
+            auto output_min = output.min.data() + static_cast<size_t>(row) * output.columns;
+            auto output_max = output.max.data() + static_cast<size_t>(row) * output.columns;
+
+            if(level == 1)
+            {
+                reduceBlocks<Minimum>(height_field->getRow(s), height_field->getRow(t), source_columns, first_column, last_column, output_min);
+                reduceBlocks<Maximum>(height_field->getRow(s), height_field->getRow(t), source_columns, first_column, last_column, output_max);
+            }
+            else
+            {
+                auto& source = levels[level - 2];
+                auto offset0 = static_cast<size_t>(s) * source_columns, offset1 = static_cast<size_t>(t) * source_columns;
+
+                reduceBlocks<Minimum>(source.min.data() + offset0, source.min.data() + offset1, source_columns, first_column, last_column, output_min);
+                reduceBlocks<Maximum>(source.max.data() + offset0, source.max.data() + offset1, source_columns, first_column, last_column, output_max);
+            }
+        }
+    }
+
+    float HeightPyramid::getMin(int level, int i, int j) const
+    {
+        if(level == 0)
+            return height_field->getHeight(i, j);
+
+        auto& data = levels[level - 1];
+        return data.min[static_cast<size_t>(j) * data.columns + i];
+    }
+
+    float HeightPyramid::getMax(int level, int i, int j) const
+    {
+        if(level == 0)
+            return height_field->getHeight(i, j);
+
+        auto& data = levels[level - 1];
+        return data.max[static_cast<size_t>(j) * data.columns + i];
+    }
+
+    void HeightPyramid::getRange(int x0, int z0, int x1, int z1, float& min_height, float& max_height) const
+    {
+        min_height = std::numeric_limits<float>::max();
+        max_height = -std::numeric_limits<float>::max();
+
+        if(isEmpty())
+            return;
+
+        x0 = std::max(x0, 0);
+        z0 = std::max(z0, 0);
+        x1 = std::min(x1, height_field->getWidth() - 1);
+        z1 = std::min(z1, height_field->getHeight() - 1);
+
+        if(x0 > x1 || z0 > z1)
+            return;
+
+        // From the blocks at least as large as the rectangle, at most two along each axis, rather than from the top.
+        auto level = getCoveringLevel(x0, z0, x1, z1);
+
+        for(auto j = z0 >> level; j <= z1 >> level; j++)
+        {
+            for(auto i = x0 >> level; i <= x1 >> level; i++)
+                visitBlock(level, i, j, x0, z0, x1, z1, min_height, max_height);
+        }
+    }
+
+    int HeightPyramid::getCoveringLevel(int x0, int z0, int x1, int z1) const
+    {
+        auto size = std::max(x1 - x0, z1 - z0) + 1;
+        auto level = 0;
+        while((1 << level) < size && level + 1 < getLevelCount())
+            level++;
+
+        return level;
+    }
+
+    void HeightPyramid::visitBlock(int level, int i, int j, int x0, int z0, int x1, int z1, float& min_height, float& max_height) const
+    {
+        auto block_x0 = i << level, block_x1 = std::min(((i + 1) << level) - 1, height_field->getWidth() - 1);
+        auto block_z0 = j << level, block_z1 = std::min(((j + 1) << level) - 1, height_field->getHeight() - 1);
+
+        if(block_x0 > x1 || block_x1 < x0 || block_z0 > z1 || block_z1 < z0)
+            return;
+
+        auto block_min = getMin(level, i, j), block_max = getMax(level, i, j);
+
+        // Nothing in a block within the range found so far can change it.
+        if(block_min >= min_height && block_max <= max_height)
+            return;
+
+        if(level == 0 || (block_x0 >= x0 && block_x1 <= x1 && block_z0 >= z0 && block_z1 <= z1))
+        {
+            min_height = std::min(min_height, block_min);
+            max_height = std::max(max_height, block_max);
+            return;
+        }
+
+        for(auto child_j = 2 * j; child_j <= std::min(2 * j + 1, getRows(level - 1) - 1); child_j++)
+            for(auto child_i = 2 * i; child_i <= std::min(2 * i + 1, getColumns(level - 1) - 1); child_i++)
+                visitBlock(level - 1, child_i, child_j, x0, z0, x1, z1, min_height, max_height);
+    }
+
+    void HeightPyramid::getBoundingRange(int x0, int z0, int x1, int z1, float& min_height, float& max_height) const
+    {
+        min_height = std::numeric_limits<float>::max();
+        max_height = -std::numeric_limits<float>::max();
+
+        if(isEmpty())
+            return;
+
+        x0 = std::max(x0, 0);
+        z0 = std::max(z0, 0);
+        x1 = std::min(x1, height_field->getWidth() - 1);
+        z1 = std::min(z1, height_field->getHeight() - 1);
+
+        if(x0 > x1 || z0 > z1)
+            return;
+
+        auto level = getCoveringLevel(x0, z0, x1, z1);
+
+        for(auto j = z0 >> level; j <= z1 >> level; j++)
+        {
+            for(auto i = x0 >> level; i <= x1 >> level; i++)
+            {
+                min_height = std::min(min_height, getMin(level, i, j));
+                max_height = std::max(max_height, getMax(level, i, j));
+            }
+        }
+    }
+
+    size_t HeightPyramid::getMemoryUsage() const
+    {
+        auto size = levels.capacity() * sizeof(Level);
+        for(auto& level : levels)
+            size += (level.min.capacity() + level.max.capacity()) * sizeof(float);
+
+        return size;
+    }
+}
@@ -0,0 +1,334 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "HeightQueries.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace bm
+{
+    namespace
+    {
+        // One query. The vector paths below repeat the same operations in the same order, lane by lane. Any field with
+        // the sample accessors of HeightField will do.
+        template<typename Field>
+        void sampleOne(const Field& height_field, float inverse_spacing, float x, float z, float& height, Vector3D* normal)
+        {
+            auto width = height_field.getWidth();
+            auto rows = height_field.getHeight();
+
+            auto fx = std::min(std::max(x * inverse_spacing, 0.0f), static_cast<float>(width - 1));
+            auto fz = std::min(std::max(z * inverse_spacing, 0.0f), static_cast<float>(rows - 1));
+
+            // The last cell takes the far border, a height field a single sample wide or deep repeats it.
+            auto i = std::min(static_cast<int>(fx), std::max(width - 2, 0));
+            auto j = std::min(static_cast<int>(fz), std::max(rows - 2, 0));
+
+            auto tx = fx - static_cast<float>(i);
+            auto tz = fz - static_cast<float>(j);
+
+            auto next_column = width > 1 ? 1 : 0;
+            auto next_row = rows > 1 ? 1 : 0;
+
+            auto h00 = height_field.getHeight(i, j), h10 = height_field.getHeight(i + next_column, j);
+            auto h01 = height_field.getHeight(i, j + next_row), h11 = height_field.getHeight(i + next_column, j + next_row);
+
+            auto dx0 = h10 - h00, dx1 = h11 - h01;
+            auto dz0 = h01 - h00, dz1 = h11 - h10;
+
+            auto top = h00 + dx0 * tx;
+            auto bottom = h01 + dx1 * tx;
+            height = top + (bottom - top) * tz;
+
+            if(normal)
+            {
+                auto gx = (dx0 + (dx1 - dx0) * tz) * inverse_spacing;
+                auto gz = (dz0 + (dz1 - dz0) * tx) * inverse_spacing;
+                auto n = 1.0f / std::sqrt(1.0f + gx * gx + gz * gz);
+
+                *normal = Vector3D(-gx * n, n, -gz * n);
+            }
+        }
+
+#if defined(BM_SIMD_SSE4)
+        // Corners of the cells (i, j) of four queries, a lane each. In a row-major field the right corners follow the left
+        // ones and the lower ones are a row further; in a tiled one a cell on a tile border has them in the next tile, so
+        // every corner gets its own index, the sum of the offsets of its column and row.
+        void loadCorners(const HeightField& height_field, __m128i i, __m128i j, __m128& h00, __m128& h10, __m128& h01, __m128& h11)
+        {
+            auto width = height_field.getWidth();
+            auto samples = height_field.getHeights();
+
+            // No gathers before AVX2, the four corners of every lane are loaded one by one.
+            alignas(16) int index[4];
+            _mm_store_si128(reinterpret_cast<__m128i*>(index), _mm_add_epi32(_mm_mullo_epi32(j, _mm_set1_epi32(width)), i));
+
+            auto p0 = samples + index[0], p1 = samples + index[1], p2 = samples + index[2], p3 = samples + index[3];
+
+            h00 = _mm_setr_ps(p0[0], p1[0], p2[0], p3[0]);
+            h10 = _mm_setr_ps(p0[1], p1[1], p2[1], p3[1]);
+            h01 = _mm_setr_ps(p0[width], p1[width], p2[width], p3[width]);
+            h11 = _mm_setr_ps(p0[width + 1], p1[width + 1], p2[width + 1], p3[width + 1]);
+        }
+
+        __m128i getColumnOffsets(__m128i i)
+        {
+            const auto tile_mask = _mm_set1_epi32(TiledHeightField::tile_mask);
+
+            return _mm_add_epi32(_mm_slli_epi32(_mm_srli_epi32(i, TiledHeightField::tile_shift), 2 * TiledHeightField::tile_shift),
+                                 _mm_and_si128(i, tile_mask));
+        }
+
+        __m128i getRowOffsets(__m128i j, __m128i tile_row_size)
+        {
+            const auto tile_mask = _mm_set1_epi32(TiledHeightField::tile_mask);
+
+            return _mm_add_epi32(_mm_mullo_epi32(_mm_srli_epi32(j, TiledHeightField::tile_shift), tile_row_size),
+                                 _mm_slli_epi32(_mm_and_si128(j, tile_mask), TiledHeightField::tile_shift));
+        }
+
+        void loadCorners(const TiledHeightField& height_field, __m128i i, __m128i j, __m128& h00, __m128& h10, __m128& h01, __m128& h11)
+        {
+            auto samples = height_field.getHeights();
+
+            const auto one = _mm_set1_epi32(1);
+            const auto tile_row_size = _mm_set1_epi32(height_field.getTileColumns() << (2 * TiledHeightField::tile_shift));
+
+            auto left = getColumnOffsets(i), right = getColumnOffsets(_mm_add_epi32(i, one));
+            auto top = getRowOffsets(j, tile_row_size), bottom = getRowOffsets(_mm_add_epi32(j, one), tile_row_size);
+
+            alignas(16) int index[4][4];
+            _mm_store_si128(reinterpret_cast<__m128i*>(index[0]), _mm_add_epi32(top, left));
+            _mm_store_si128(reinterpret_cast<__m128i*>(index[1]), _mm_add_epi32(top, right));
+            _mm_store_si128(reinterpret_cast<__m128i*>(index[2]), _mm_add_epi32(bottom, left));
+            _mm_store_si128(reinterpret_cast<__m128i*>(index[3]), _mm_add_epi32(bottom, right));
+
+            auto loadLanes([&](const int* lanes)
+            {
+                return _mm_setr_ps(samples[lanes[0]], samples[lanes[1]], samples[lanes[2]], samples[lanes[3]]);
+            });
+
+            h00 = loadLanes(index[0]);
+            h10 = loadLanes(index[1]);
+            h01 = loadLanes(index[2]);
+            h11 = loadLanes(index[3]);
+        }
+
+#   if defined(BM_SIMD_AVX2)
+        // Eight lanes of the above, with gathers.
+        void loadCorners(const HeightField& height_field, __m256i i, __m256i j, __m256& h00, __m256& h10, __m256& h01, __m256& h11)
+        {
+            auto stride = _mm256_set1_epi32(height_field.getWidth());
+            auto base = reinterpret_cast<const double*>(height_field.getHeights());
+
+            auto index = _mm256_add_epi32(_mm256_mullo_epi32(j, stride), i);
+            auto below = _mm256_add_epi32(index, stride);
+
+            // Both corners of a row at once, as 64-bit gathers of four lanes each, then split into left and right.
+            auto loadPairs([&](__m256i indices, __m256& left, __m256& right)
+            {
+                auto low = _mm256_castpd_ps(_mm256_i32gather_pd(base, _mm256_castsi256_si128(indices), 4));
+                auto high = _mm256_castpd_ps(_mm256_i32gather_pd(base, _mm256_extracti128_si256(indices, 1), 4));
+
+                left = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(low, high, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0)));
+                right = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(_mm256_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0)));
+            });
+
+            loadPairs(index, h00, h10);
+            loadPairs(below, h01, h11);
+        }
+
+        void loadCorners(const TiledHeightField& height_field, __m256i i, __m256i j, __m256& h00, __m256& h10, __m256& h01, __m256& h11)
+        {
+            auto samples = height_field.getHeights();
+
+            const auto one = _mm256_set1_epi32(1);
+            const auto tile_mask = _mm256_set1_epi32(TiledHeightField::tile_mask);
+            const auto tile_row_size = _mm256_set1_epi32(height_field.getTileColumns() << (2 * TiledHeightField::tile_shift));
+
+            auto getColumnOffsets([&](__m256i columns)
+            {
+                return _mm256_add_epi32(_mm256_slli_epi32(_mm256_srli_epi32(columns, TiledHeightField::tile_shift), 2 * TiledHeightField::tile_shift),
+                                        _mm256_and_si256(columns, tile_mask));
+            });
+
+            auto getRowOffsets([&](__m256i rows)
+            {
+                return _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(rows, TiledHeightField::tile_shift), tile_row_size),
+                                        _mm256_slli_epi32(_mm256_and_si256(rows, tile_mask), TiledHeightField::tile_shift));
+            });
+
+            auto left = getColumnOffsets(i), right = getColumnOffsets(_mm256_add_epi32(i, one));
+            auto top = getRowOffsets(j), bottom = getRowOffsets(_mm256_add_epi32(j, one));
+
+            h00 = _mm256_i32gather_ps(samples, _mm256_add_epi32(top, left), 4);
+            h10 = _mm256_i32gather_ps(samples, _mm256_add_epi32(top, right), 4);
+            h01 = _mm256_i32gather_ps(samples, _mm256_add_epi32(bottom, left), 4);
+            h11 = _mm256_i32gather_ps(samples, _mm256_add_epi32(bottom, right), 4);
+        }
+#   endif
+
+        // Queries of either layout 8 (AVX2) and 4 (SSE4.1) at a time, as long as there are that many left. Returns how
+        // many were done, the scalar code does the rest.
+        template<typename Field>
+        size_t sampleVector(const Field& height_field, const float* x, const float* z, size_t count, float* heights, Vector3D* normals)
+        {
+            auto k = size_t(0);
+
+            auto inverse_spacing = 1.0f / height_field.getSpacing();
+            auto width = height_field.getWidth();
+            auto rows = height_field.getHeight();
+
+            if(width < 2 || rows < 2)
+                return k;
+
+#   if defined(BM_SIMD_AVX2)
+            {
+                auto scale = _mm256_set1_ps(inverse_spacing);
+                auto zero = _mm256_setzero_ps();
+                auto one = _mm256_set1_ps(1.0f);
+                auto max_x = _mm256_set1_ps(static_cast<float>(width - 1));
+                auto max_z = _mm256_set1_ps(static_cast<float>(rows - 1));
+                auto last_i = _mm256_set1_epi32(width - 2);
+                auto last_j = _mm256_set1_epi32(rows - 2);
+
+                for(; k + 8 <= count; k += 8)
+                {
+                    auto fx = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(x + k), scale), zero), max_x);
+                    auto fz = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(z + k), scale), zero), max_z);
+
+                    auto i = _mm256_min_epi32(_mm256_cvttps_epi32(fx), last_i);
+                    auto j = _mm256_min_epi32(_mm256_cvttps_epi32(fz), last_j);
+
+                    auto tx = _mm256_sub_ps(fx, _mm256_cvtepi32_ps(i));
+                    auto tz = _mm256_sub_ps(fz, _mm256_cvtepi32_ps(j));
+
+                    __m256 h00, h10, h01, h11;
+                    loadCorners(height_field, i, j, h00, h10, h01, h11);
+
+                    auto dx0 = _mm256_sub_ps(h10, h00), dx1 = _mm256_sub_ps(h11, h01);
+
+                    auto top = _mm256_add_ps(h00, _mm256_mul_ps(dx0, tx));
+                    auto bottom = _mm256_add_ps(h01, _mm256_mul_ps(dx1, tx));
+                    _mm256_storeu_ps(heights + k, _mm256_add_ps(top, _mm256_mul_ps(_mm256_sub_ps(bottom, top), tz)));
+
+                    if(normals)
+                    {
+                        auto dz0 = _mm256_sub_ps(h01, h00), dz1 = _mm256_sub_ps(h11, h10);
+
+                        auto gx = _mm256_mul_ps(_mm256_add_ps(dx0, _mm256_mul_ps(_mm256_sub_ps(dx1, dx0), tz)), scale);
+                        auto gz = _mm256_mul_ps(_mm256_add_ps(dz0, _mm256_mul_ps(_mm256_sub_ps(dz1, dz0), tx)), scale);
+                        auto length = _mm256_add_ps(_mm256_add_ps(one, _mm256_mul_ps(gx, gx)), _mm256_mul_ps(gz, gz));
+                        auto n = _mm256_div_ps(one, _mm256_sqrt_ps(length));
+
+                        alignas(32) float nx[8], ny[8], nz[8];
+                        _mm256_store_ps(nx, _mm256_mul_ps(_mm256_sub_ps(zero, gx), n));
+                        _mm256_store_ps(ny, n);
+                        _mm256_store_ps(nz, _mm256_mul_ps(_mm256_sub_ps(zero, gz), n));
+
+                        for(auto lane = 0; lane < 8; lane++)
+                            normals[k + lane] = Vector3D(nx[lane], ny[lane], nz[lane]);
+                    }
+                }
+            }
+#   endif
+
+            auto scale = _mm_set1_ps(inverse_spacing);
+            auto zero = _mm_setzero_ps();
+            auto one = _mm_set1_ps(1.0f);
+            auto max_x = _mm_set1_ps(static_cast<float>(width - 1));
+            auto max_z = _mm_set1_ps(static_cast<float>(rows - 1));
+            auto last_i = _mm_set1_epi32(width - 2);
+            auto last_j = _mm_set1_epi32(rows - 2);
+
+            for(; k + 4 <= count; k += 4)
+            {
+                auto fx = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(x + k), scale), zero), max_x);
+                auto fz = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(z + k), scale), zero), max_z);
+
+                auto i = _mm_min_epi32(_mm_cvttps_epi32(fx), last_i);
+                auto j = _mm_min_epi32(_mm_cvttps_epi32(fz), last_j);
+
+                auto tx = _mm_sub_ps(fx, _mm_cvtepi32_ps(i));
+                auto tz = _mm_sub_ps(fz, _mm_cvtepi32_ps(j));
+
+                __m128 h00, h10, h01, h11;
+                loadCorners(height_field, i, j, h00, h10, h01, h11);
+
+                auto dx0 = _mm_sub_ps(h10, h00), dx1 = _mm_sub_ps(h11, h01);
+
+                auto top = _mm_add_ps(h00, _mm_mul_ps(dx0, tx));
+                auto bottom = _mm_add_ps(h01, _mm_mul_ps(dx1, tx));
+                _mm_storeu_ps(heights + k, _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), tz)));
+
+                if(normals)
+                {
+                    auto dz0 = _mm_sub_ps(h01, h00), dz1 = _mm_sub_ps(h11, h10);
+
+                    auto gx = _mm_mul_ps(_mm_add_ps(dx0, _mm_mul_ps(_mm_sub_ps(dx1, dx0), tz)), scale);
+                    auto gz = _mm_mul_ps(_mm_add_ps(dz0, _mm_mul_ps(_mm_sub_ps(dz1, dz0), tx)), scale);
+                    auto length = _mm_add_ps(_mm_add_ps(one, _mm_mul_ps(gx, gx)), _mm_mul_ps(gz, gz));
+                    auto n = _mm_div_ps(one, _mm_sqrt_ps(length));
+
+                    alignas(16) float nx[4], ny[4], nz[4];
+                    _mm_store_ps(nx, _mm_mul_ps(_mm_sub_ps(zero, gx), n));
+                    _mm_store_ps(ny, n);
+                    _mm_store_ps(nz, _mm_mul_ps(_mm_sub_ps(zero, gz), n));
+
+                    for(auto lane = 0; lane < 4; lane++)
+                        normals[k + lane] = Vector3D(nx[lane], ny[lane], nz[lane]);
+                }
+            }
+
+            return k;
+        }
+#endif
+
+        template<typename Field>
+        void sampleField(const Field& height_field, const float* x, const float* z, size_t count, float* heights, Vector3D* normals)
+        {
+            auto k = size_t(0);
+            auto inverse_spacing = 1.0f / height_field.getSpacing();
+
+#if defined(BM_SIMD_SSE4)
+            k = sampleVector(height_field, x, z, count, heights, normals);
+#endif
+
+            for(; k < count; k++)
+                sampleOne(height_field, inverse_spacing, x[k], z[k], heights[k], normals ? normals + k : nullptr);
+        }
+    }
+
+    void sampleHeightField(const HeightField& height_field, const float* x, const float* z, size_t count, float* heights,
+                           Vector3D* normals)
+    {
+        sampleField(height_field, x, z, count, heights, normals);
+    }
+
+    void sampleHeightField(const TiledHeightField& height_field, const float* x, const float* z, size_t count, float* heights,
+                           Vector3D* normals)
+    {
+        sampleField(height_field, x, z, count, heights, normals);
+    }
+
+    void sampleHeightFieldReference(const HeightField& height_field, const float* x, const float* z, size_t count, float* heights,
+                                    Vector3D* normals)
+    {
+        auto inverse_spacing = 1.0f / height_field.getSpacing();
+
+        for(auto k = size_t(0); k < count; k++)
+            sampleOne(height_field, inverse_spacing, x[k], z[k], heights[k], normals ? normals + k : nullptr);
+    }
+
+    void sampleHeightField(const CompressedHeightField& height_field, const float* x, const float* z, size_t count, float* heights,
+                           Vector3D* normals)
+    {
+        auto inverse_spacing = 1.0f / height_field.getSpacing();
+
+        for(auto k = size_t(0); k < count; k++)
+            sampleOne(height_field, inverse_spacing, x[k], z[k], heights[k], normals ? normals + k : nullptr);
+    }
+}
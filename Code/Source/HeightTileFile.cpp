@@ -0,0 +1,290 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "HeightTileFile.h"
+#include "BitmapReader.h"
+#include "MappedFile.h"
+#include "ParallelFor.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace bm
+{
+    namespace
+    {
+        constexpr char height_tile_magic[4] = {'B', 'M', 'H', 'T'};
+        constexpr uint64_t index_alignment = 16U;
+
+        // Fills the level sizes of a heightmap, down to the first level that fits in one tile. False if that takes
+        // more than max_height_tile_levels.
+        bool computeLevels(HeightTileFileHeader& header)
+        {
+            auto tile_quads = header.tile_size - 1;
+            auto first_tile = 0U;
+
+            for(auto level = 0; level < max_height_tile_levels; level++)
+            {
+                auto& tile_level = header.levels[level];
+                tile_level.width = ((header.width - 1) >> level) + 1;
+                tile_level.height = ((header.height - 1) >> level) + 1;
+                tile_level.columns = std::max((tile_level.width - 1 + tile_quads - 1) / tile_quads, 1);
+                tile_level.rows = std::max((tile_level.height - 1 + tile_quads - 1) / tile_quads, 1);
+                tile_level.first_tile = first_tile;
+
+                first_tile += static_cast<uint32_t>(tile_level.columns * tile_level.rows);
+
+                if(tile_level.columns == 1 && tile_level.rows == 1)
+                {
+                    header.level_count = level + 1;
+                    header.tile_count = first_tile;
+
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // Ranges of the tiles of a level from the ones of the level below. A tile covers 2 x 2 tiles of the level below,
+        // the last column and row also the ones past the last sample the level keeps, so that the range holds every
+        // sample of the full heightmap under the tile and not only those the level keeps.
+        void reduceTileRanges(const HeightTileFileHeader& header, int level, std::vector<HeightTileRecord>& records)
+        {
+            auto& tile_level = header.levels[level];
+            auto& finer_level = header.levels[level - 1];
+
+            for(auto row = 0; row < tile_level.rows; row++)
+            {
+                auto finer_row0 = 2 * row, finer_row1 = row == tile_level.rows - 1 ? finer_level.rows - 1 : std::min(2 * row + 1, finer_level.rows - 1);
+
+                for(auto column = 0; column < tile_level.columns; column++)
+                {
+                    auto finer_column0 = 2 * column;
+                    auto finer_column1 = column == tile_level.columns - 1 ? finer_level.columns - 1 : std::min(2 * column + 1, finer_level.columns - 1);
+
+                    auto& record = records[tile_level.first_tile + row * tile_level.columns + column];
+                    record.min_height = std::numeric_limits<float>::max();
+                    record.max_height = std::numeric_limits<float>::lowest();
+
+                    for(auto finer_row = finer_row0; finer_row <= finer_row1; finer_row++)
+                    {
+                        for(auto finer_column = finer_column0; finer_column <= finer_column1; finer_column++)
+                        {
+                            auto& finer = records[finer_level.first_tile + finer_row * finer_level.columns + finer_column];
+                            record.min_height = std::min(record.min_height, finer.min_height);
+                            record.max_height = std::max(record.max_height, finer.max_height);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    bool convertBitmapToHeightTiles(const wchar_t* bitmap_file_name, const wchar_t* file_name, const HeightTileFileSettings& settings)
+    {
+        if(settings.tile_size < 2)
+            return false;
+
+        MappedFile bitmap(bitmap_file_name);
+        if(!bitmap.isOpen())
+            return false;
+
+        BitmapInfo bitmap_info;
+        if(!readBitmapInfo(bitmap.getData(), bitmap.getSize(), bitmap_info))
+            return false;
+
+        HeightTileFileHeader header = {};
+        std::memcpy(header.magic, height_tile_magic, sizeof(height_tile_magic));
+        header.version = height_tile_file_version;
+        header.width = bitmap_info.width;
+        header.height = bitmap_info.height;
+        header.tile_size = settings.tile_size;
+
+        if(!computeLevels(header))
+            return false;
+
+        // Every tile has the same size, so the offsets are known up front. The ranges are filled in as the level 0 tiles are
+        // built, and reduced from them for the coarser levels.
+        auto stored_size = static_cast<size_t>(settings.tile_size) + 2U;
+        auto tile_bytes = stored_size * stored_size * sizeof(float);
+
+        header.index_offset = (sizeof(HeightTileFileHeader) + index_alignment - 1U) & ~(index_alignment - 1U);
+
+        std::vector<HeightTileRecord> records(header.tile_count);
+
+        auto offset = header.index_offset + records.size() * sizeof(HeightTileRecord);
+        for(auto& record : records)
+        {
+            record = {};
+            record.offset = offset;
+            record.size = static_cast<uint32_t>(tile_bytes);
+            record.min_height = std::numeric_limits<float>::max();
+            record.max_height = std::numeric_limits<float>::lowest();
+
+            offset += tile_bytes;
+        }
+
+        header.file_size = offset;
+
+        // Written next to file_name and moved over it once complete, so that a failed conversion leaves no file behind that
+        // is newer than the bitmap.
+        auto partial_file_name = std::wstring(file_name) + L".partial";
+
+        std::ofstream tile_file(fs::path(partial_file_name), std::ios::binary | std::ios::trunc);
+        if(!tile_file)
+            return false;
+
+        // Zeroed header and index first, the real ones are written once all the tiles made it to the file.
+        const HeightTileFileHeader empty_header = {};
+        tile_file.write(reinterpret_cast<const char*>(&empty_header), sizeof(empty_header));
+
+        const char padding[index_alignment] = {};
+        tile_file.write(padding, static_cast<std::streamsize>(header.index_offset - sizeof(empty_header)));
+        tile_file.write(reinterpret_cast<const char*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(HeightTileRecord)));
+
+        // Scaled exactly like Terrain::loadHeightMap and Terrain::reduceHeightMap.
+        auto getHeight([&](int x, int z)
+        {
+            auto pixels = getBitmapRow(bitmap.getData(), bitmap_info, z);
+            return (static_cast<float>(pixels[static_cast<size_t>(x) * 3U]) * settings.height_scale) / settings.height_reduction;
+        });
+
+        // One row of tiles at a time, built in parallel and written in order.
+        std::vector<float> tile_row;
+
+        for(auto level = 0; level < header.level_count; level++)
+        {
+            auto& tile_level = header.levels[level];
+            tile_row.resize(static_cast<size_t>(tile_level.columns) * stored_size * stored_size);
+
+            if(level > 0)
+                reduceTileRanges(header, level, records);
+
+            for(auto row = 0; row < tile_level.rows; row++)
+            {
+                parallelFor(0, tile_level.columns, settings.thread_count, [&](int first_column, int last_column)
+                {
+                    for(auto column = first_column; column < last_column; column++)
+                    {
+                        auto heights = tile_row.data() + static_cast<size_t>(column) * stored_size * stored_size;
+                        auto& record = records[tile_level.first_tile + row * tile_level.columns + column];
+
+                        auto x0 = column * (settings.tile_size - 1) - 1, z0 = row * (settings.tile_size - 1) - 1;
+
+                        for(auto j = size_t(); j < stored_size; j++)
+                        {
+                            auto z = std::min(std::max(z0 + static_cast<int>(j), 0), tile_level.height - 1);
+
+                            for(auto i = size_t(); i < stored_size; i++)
+                            {
+                                auto x = std::min(std::max(x0 + static_cast<int>(i), 0), tile_level.width - 1);
+
+                                auto height = getHeight(x << level, z << level);
+                                heights[j * stored_size + i] = height;
+
+                                // The apron belongs to the neighbours, the coarser levels have their ranges already.
+                                if(level > 0 || i == 0U || j == 0U || i == stored_size - 1U || j == stored_size - 1U)
+                                    continue;
+
+                                record.min_height = std::min(record.min_height, height);
+                                record.max_height = std::max(record.max_height, height);
+                            }
+                        }
+                    }
+                });
+
+                tile_file.write(reinterpret_cast<const char*>(tile_row.data()), static_cast<std::streamsize>(tile_level.columns * tile_bytes));
+            }
+        }
+
+        tile_file.seekp(static_cast<std::streamoff>(header.index_offset));
+        tile_file.write(reinterpret_cast<const char*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(HeightTileRecord)));
+
+        tile_file.seekp(0);
+        tile_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        tile_file.close();
+
+        if(!tile_file || !MoveFileExW(partial_file_name.c_str(), file_name, MOVEFILE_REPLACE_EXISTING))
+        {
+            DeleteFileW(partial_file_name.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    HeightTileFile::HeightTileFile(const wchar_t* file_name) :
+        file(INVALID_HANDLE_VALUE),
+        header(),
+        valid(false)
+    {
+        file = CreateFileW(file_name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+        if(file == INVALID_HANDLE_VALUE)
+            return;
+
+        LARGE_INTEGER file_size;
+        if(!GetFileSizeEx(file, &file_size) || file_size.QuadPart < static_cast<LONGLONG>(sizeof(HeightTileFileHeader)))
+            return;
+
+        auto read([&](uint64_t offset, void* data, size_t size)
+        {
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = static_cast<DWORD>(offset);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32U);
+
+            DWORD bytes_read = 0U;
+            return ReadFile(file, data, static_cast<DWORD>(size), &bytes_read, &overlapped) && bytes_read == size;
+        });
+
+        if(!read(0U, &header, sizeof(header)))
+            return;
+
+        if(std::memcmp(header.magic, height_tile_magic, sizeof(height_tile_magic)) != 0 ||
+           header.version != height_tile_file_version ||
+           header.file_size != static_cast<uint64_t>(file_size.QuadPart) ||
+           header.width <= 0 || header.height <= 0 || header.tile_size < 2)
+            return;
+
+        // The levels have to be the ones the converter makes, and the index and the tiles have to lie inside the file.
+        auto expected = header;
+        if(!computeLevels(expected) || expected.level_count != header.level_count || expected.tile_count != header.tile_count ||
+           std::memcmp(expected.levels, header.levels, sizeof(header.levels)) != 0)
+            return;
+
+        auto index_size = static_cast<uint64_t>(header.tile_count) * sizeof(HeightTileRecord);
+        if(header.index_offset > header.file_size || index_size > header.file_size - header.index_offset)
+            return;
+
+        tiles.resize(header.tile_count);
+        if(!read(header.index_offset, tiles.data(), static_cast<size_t>(index_size)))
+            return;
+
+        auto tile_bytes = static_cast<uint64_t>(getStoredTileSize()) * getStoredTileSize() * sizeof(float);
+
+        valid = std::all_of(tiles.begin(), tiles.end(), [&](const HeightTileRecord& tile)
+        {
+            return tile.size == tile_bytes && tile.offset <= header.file_size && tile.size <= header.file_size - tile.offset;
+        });
+    }
+
+    HeightTileFile::~HeightTileFile()
+    {
+        if(file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+    }
+
+    bool HeightTileFile::readTile(int level, int column, int row, float* heights) const
+    {
+        auto& tile = getTile(level, column, row);
+
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(tile.offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(tile.offset >> 32U);
+
+        DWORD bytes_read = 0U;
+        return ReadFile(file, heights, tile.size, &bytes_read, &overlapped) && bytes_read == tile.size;
+    }
+}
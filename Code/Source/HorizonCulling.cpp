@@ -0,0 +1,257 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "HorizonCulling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace bm
+{
+    namespace
+    {
+        enum ChunkState : uint8_t
+        {
+            Skipped,
+            Hidden, // So far.
+            Visible
+        };
+
+        // Angle of (x, z) in [0, 4), a quarter turn per unit and monotonic in the real angle.
+        float getDiamondAngle(float x, float z)
+        {
+            if(z >= 0.0f)
+                return x >= 0.0f ? z / (x + z) : 1.0f - x / (z - x);
+
+            return x < 0.0f ? 2.0f - z / (-x - z) : 3.0f + x / (x - z);
+        }
+
+        // Difference of two diamond angles in [-2, 2).
+        float wrapAngle(float angle)
+        {
+            return angle >= 2.0f ? angle - 4.0f : (angle < -2.0f ? angle + 4.0f : angle);
+        }
+    }
+
+    HorizonCulling::HorizonCulling(int bin_count) :
+        block_size(0),
+        block_columns(0),
+        block_rows(0),
+        spacing(1.0f),
+        horizon(std::max(bin_count, 4))
+    {
+    }
+
+    void HorizonCulling::build(const HeightPyramid& height_pyramid, int block_size)
+    {
+        auto& height_field = height_pyramid.getHeightField();
+
+        this->block_size = std::max(block_size, 1);
+        spacing = height_field.getSpacing();
+
+        auto width = height_field.getWidth();
+        auto height = height_field.getHeight();
+
+        block_columns = width > 1 ? (width - 2) / this->block_size + 1 : 0;
+        block_rows = height > 1 ? (height - 2) / this->block_size + 1 : 0;
+
+        block_min.resize(static_cast<size_t>(block_columns) * block_rows);
+        block_max.resize(block_min.size());
+
+        updateBlocks(height_pyramid, 0, block_columns - 1, 0, block_rows - 1);
+    }
+
+    void HorizonCulling::update(const HeightPyramid& height_pyramid, int x0, int z0, int x1, int z1)
+    {
+        if(isEmpty())
+            return;
+
+        // A sample on a block border belongs to the blocks on both sides.
+        updateBlocks(height_pyramid, std::max((x0 - 1) / block_size, 0), std::min(x1 / block_size, block_columns - 1),
+                     std::max((z0 - 1) / block_size, 0), std::min(z1 / block_size, block_rows - 1));
+    }
+
+    void HorizonCulling::updateBlocks(const HeightPyramid& height_pyramid, int first_column, int last_column, int first_row, int last_row)
+    {
+        // Neighbouring blocks share their border samples, so every triangle of the full mesh is within one block's range.
+        for(auto block_row = first_row; block_row <= last_row; block_row++)
+        {
+            for(auto block_column = first_column; block_column <= last_column; block_column++)
+            {
+                auto b = static_cast<size_t>(block_row) * block_columns + block_column;
+
+                auto x = block_column * block_size;
+                auto z = block_row * block_size;
+
+                height_pyramid.getRange(x, z, x + block_size, z + block_size, block_min[b], block_max[b]);
+            }
+        }
+    }
+
+    size_t HorizonCulling::cull(const Vector3D& camera_position, int chunk_quads, int chunk_columns, const float* chunk_errors,
+                                std::vector<uint32_t>& visible)
+    {
+        if(isEmpty() || visible.empty() || chunk_quads % block_size != 0)
+            return visible.size();
+
+        auto block_extent = static_cast<float>(block_size) * spacing;
+        auto camera_column = static_cast<int>(std::floor(camera_position.x / block_extent));
+        auto camera_row = static_cast<int>(std::floor(camera_position.z / block_extent));
+
+        // Under the lowest sample of its block the camera is under the ground, where the horizon means nothing.
+        if(camera_column >= 0 && camera_column < block_columns && camera_row >= 0 && camera_row < block_rows &&
+           camera_position.y < block_min[static_cast<size_t>(camera_row) * block_columns + camera_column])
+            return visible.size();
+
+        auto blocks_per_chunk = chunk_quads / block_size;
+        auto chunk_rows = (block_rows - 1) / blocks_per_chunk + 1;
+
+        chunk_states.assign(static_cast<size_t>(chunk_columns) * chunk_rows, Skipped);
+        for(auto index : visible)
+            chunk_states[index] = Hidden;
+
+        std::fill(horizon.begin(), horizon.end(), -std::numeric_limits<float>::infinity());
+
+        auto bin_count = static_cast<int>(horizon.size());
+        auto bin_scale = static_cast<float>(bin_count) / 4.0f;
+        auto getBin([&](int bin) { return ((bin % bin_count) + bin_count) % bin_count; });
+
+        auto processBlock([&](int column, int row)
+        {
+            auto b = static_cast<size_t>(row) * block_columns + column;
+            auto chunk = static_cast<size_t>(row / blocks_per_chunk) * chunk_columns + column / blocks_per_chunk;
+            auto error = chunk_errors ? chunk_errors[chunk] : 0.0f;
+
+            auto min_x = static_cast<float>(column) * block_extent - camera_position.x;
+            auto min_z = static_cast<float>(row) * block_extent - camera_position.z;
+            auto max_x = min_x + block_extent, max_z = min_z + block_extent;
+
+            auto min_height = block_min[b] - error - camera_position.y;
+            auto max_height = block_max[b] + error - camera_position.y;
+
+            // Horizontal distances to the nearest and the farthest point of the block.
+            auto near_x = std::max(std::max(min_x, -max_x), 0.0f);
+            auto near_z = std::max(std::max(min_z, -max_z), 0.0f);
+            auto far_x = std::max(std::fabs(min_x), std::fabs(max_x));
+            auto far_z = std::max(std::fabs(min_z), std::fabs(max_z));
+
+            auto near_distance = std::sqrt(near_x * near_x + near_z * near_z);
+            auto far_distance = std::sqrt(far_x * far_x + far_z * far_z);
+
+            // The camera stands on (or right next to) the block: visible and it occludes nothing.
+            if(near_distance <= 1e-3f * block_extent)
+            {
+                if(chunk_states[chunk] == Hidden)
+                    chunk_states[chunk] = Visible;
+
+                return;
+            }
+
+            // Azimuth range of the block, which can't reach half a turn from outside of it.
+            auto center_angle = getDiamondAngle(0.5f * (min_x + max_x), 0.5f * (min_z + max_z));
+            auto low = 2.0f, high = -2.0f;
+
+            for(auto corner_x : {min_x, max_x})
+            {
+                for(auto corner_z : {min_z, max_z})
+                {
+                    auto offset = wrapAngle(getDiamondAngle(corner_x, corner_z) - center_angle);
+                    low = std::min(low, offset);
+                    high = std::max(high, offset);
+                }
+            }
+
+            auto first_bin = (center_angle + low) * bin_scale;
+            auto last_bin = (center_angle + high) * bin_scale;
+
+            // Tested with an upper bound of the elevation of its highest point, against every bin it touches.
+            if(chunk_states[chunk] == Hidden)
+            {
+                auto elevation = max_height / (max_height >= 0.0f ? near_distance : far_distance);
+
+                auto bin = getBin(static_cast<int>(std::floor(first_bin)));
+                for(auto count = static_cast<int>(std::floor(last_bin)) - static_cast<int>(std::floor(first_bin)); count >= 0; count--)
+                {
+                    if(elevation >= horizon[bin])
+                    {
+                        chunk_states[chunk] = Visible;
+                        break;
+                    }
+
+                    bin = bin + 1 < bin_count ? bin + 1 : 0;
+                }
+            }
+
+            // Every ray within the block's azimuths crosses the block, so one below a point of its lowest level is under
+            // the terrain from there on. A lower bound of the elevation of that level raises the bins the block fully covers.
+            auto elevation = min_height / (min_height <= 0.0f ? near_distance : far_distance);
+
+            auto bin = getBin(static_cast<int>(std::ceil(first_bin)));
+            for(auto count = static_cast<int>(std::floor(last_bin)) - static_cast<int>(std::ceil(first_bin)); count > 0; count--)
+            {
+                horizon[bin] = std::max(horizon[bin], elevation);
+                bin = bin + 1 < bin_count ? bin + 1 : 0;
+            }
+        });
+
+        // Rings of blocks around the camera's block, by Chebyshev distance and within a ring by the smaller of the two
+        // offsets. Both only grow along any ray, so a block always comes after the blocks in front of it.
+        // Blocks past the last ring of a tested chunk can't hide anything that matters.
+        auto ring_count = 0;
+        for(auto index : visible)
+        {
+            auto first_column = static_cast<int>(index) % chunk_columns * blocks_per_chunk;
+            auto first_row = static_cast<int>(index) / chunk_columns * blocks_per_chunk;
+
+            ring_count = std::max(ring_count, std::max(std::abs(camera_column - first_column), std::abs(camera_column - (first_column + blocks_per_chunk - 1))));
+            ring_count = std::max(ring_count, std::max(std::abs(camera_row - first_row), std::abs(camera_row - (first_row + blocks_per_chunk - 1))));
+        }
+
+        for(auto ring = 0; ring <= ring_count; ring++)
+        {
+            for(auto minor = 0; minor <= ring; minor++)
+            {
+                int offsets[8][2];
+                auto offset_count = 0;
+
+                for(auto major_x : {true, false})
+                {
+                    for(auto sign_x : {1, -1})
+                    {
+                        for(auto sign_z : {1, -1})
+                        {
+                            auto x = sign_x * (major_x ? ring : minor);
+                            auto z = sign_z * (major_x ? minor : ring);
+
+                            auto duplicate = false;
+                            for(auto k = 0; k < offset_count; k++)
+                                duplicate = duplicate || (offsets[k][0] == x && offsets[k][1] == z);
+
+                            if(duplicate)
+                                continue;
+
+                            offsets[offset_count][0] = x;
+                            offsets[offset_count][1] = z;
+                            offset_count++;
+                        }
+                    }
+                }
+
+                for(auto k = 0; k < offset_count; k++)
+                {
+                    auto column = camera_column + offsets[k][0];
+                    auto row = camera_row + offsets[k][1];
+
+                    if(column >= 0 && column < block_columns && row >= 0 && row < block_rows)
+                        processBlock(column, row);
+                }
+            }
+        }
+
+        visible.erase(std::remove_if(visible.begin(), visible.end(), [&](uint32_t index) { return chunk_states[index] != Visible; }), visible.end());
+
+        return visible.size();
+    }
+}
@@ -10,6 +10,8 @@
 
 #include <Terrain.h>
 #include <TerrainShader.h>
+#include <TerrainTileCache.h>
+#include <HeightCodec.h>
 
 using namespace bm;
 
@@ -49,8 +51,83 @@ int __stdcall WinMain(HINSTANCE, HINSTANCE, char*, int)
 
     auto d3d11_renderer = std::make_shared<bm::D3D11Renderer>(SCREEN_WIDTH, SCREEN_HEIGHT, ENABLE_FULLSCREEN, window->getHandle(), ENABLE_VSYNC);
 
-    auto terrain = std::make_shared<bm::Terrain>(d3d11_renderer->getDevice(), resources[0].c_str(), resources[1].c_str(), resources[2].c_str());
-    auto terrain_shader = std::make_shared<bm::TerrainShader>(d3d11_renderer->getDevice(), resources[3].c_str(), resources[4].c_str());
+    bm::TerrainSettings terrain_settings;
+    terrain_settings.thread_count = 0U; // one per hardware thread.
+    terrain_settings.mesh_type = bm::TerrainMeshType::Indexed;
+    terrain_settings.chunk_size = 65;
+    terrain_settings.vertex_format = bm::TerrainVertexFormat::Full;
+    terrain_settings.tangent_frames = bm::TerrainTangentFrames::Gradient;
+    terrain_settings.optimize_vertex_cache = true;
+    terrain_settings.simplification_error = 0.0f; // world units, 0 keeps every sample.
+    terrain_settings.level_of_detail = bm::TerrainLevelOfDetail::Geomipmapping;
+    terrain_settings.bake_file_name = resource_directory_name + L"heightmap.bmterrain"s; // rebuilt when the heightmap or settings change.
+    terrain_settings.horizon_culling = true;
+    terrain_settings.occlusion_culling = false; // software rasterized occluders, on top of the horizon.
+    terrain_settings.tiled_ground_queries = false; // a tiled copy of the heights for getGroundHeights.
+    terrain_settings.ground_height_precision = 0.0f; // world units, above 0 keeps the heights compressed for getGroundHeights.
+
+    // Streams the heightmap in tiles around the camera instead, for heightmaps too large to build at once.
+    constexpr auto ENABLE_TILED_TERRAIN = false;
+
+    bm::TerrainTileSettings tile_settings;
+    tile_settings.tile_size = 129;
+    tile_settings.load_radius = 8192.f; // world units.
+    tile_settings.memory_budget = 256U << 20;
+    tile_settings.worker_count = 2U;
+    tile_settings.vertex_format = terrain_settings.vertex_format;
+    tile_settings.height_precision = 0.f; // world units, above 0 keeps the whole heightmap compressed in memory.
+
+    // The compact vertex format is dequantized by its own vertex shader, the CDLOD patches are displaced by another one.
+    auto shader_vertex_format = terrain_settings.vertex_format;
+    if (!ENABLE_TILED_TERRAIN && terrain_settings.level_of_detail == bm::TerrainLevelOfDetail::Cdlod)
+    {
+        shader_vertex_format = bm::TerrainVertexFormat::Patch;
+        resources[3] = resource_directory_name + terrain_name + L"_cdlod_vs"s + hlsl_file_extension;
+    }
+    else if (terrain_settings.vertex_format == bm::TerrainVertexFormat::Compact)
+        resources[3] = resource_directory_name + terrain_name + L"_compact_vs"s + hlsl_file_extension;
+
+    std::shared_ptr<bm::Terrain> terrain;
+    std::shared_ptr<bm::TerrainTileCache> terrain_tiles;
+    if (ENABLE_TILED_TERRAIN)
+    {
+        // The tiles are streamed from a pyramid converted from the heightmap, again whenever the heightmap is newer or the
+        // pyramid doesn't validate.
+        auto height_map_file_name = resource_directory_name + L"heightmap.bmheights"s;
+        if (!fs::exists(height_map_file_name) || fs::last_write_time(height_map_file_name) < fs::last_write_time(resources[0]) ||
+            !bm::HeightTileFile(height_map_file_name.c_str()).isValid())
+        {
+            bm::HeightTileFileSettings tile_file_settings;
+            tile_file_settings.tile_size = tile_settings.tile_size;
+
+            // Streamed from the bitmap itself if that fails.
+            if (!bm::convertBitmapToHeightTiles(resources[0].c_str(), height_map_file_name.c_str(), tile_file_settings))
+                height_map_file_name = resources[0];
+        }
+
+        terrain_tiles = std::make_shared<bm::TerrainTileCache>(d3d11_renderer->getDevice(), height_map_file_name.c_str(), resources[1].c_str(), resources[2].c_str(), tile_settings);
+    }
+    else
+    {
+        // Loaded from a compressed copy of the heightmap, converted again whenever the heightmap is newer or the copy doesn't
+        // validate.
+        auto height_map_file_name = resource_directory_name + L"heightmap.bmhc"s;
+        if (!fs::exists(height_map_file_name) || fs::last_write_time(height_map_file_name) < fs::last_write_time(resources[0]) ||
+            !bm::CompressedHeightFile(height_map_file_name.c_str()).isValid())
+        {
+            bm::HeightCodecSettings height_codec_settings;
+            height_codec_settings.max_error = 0; // in heightmap steps, 0 is lossless.
+
+            // Loaded from the bitmap itself if that fails.
+            if (!bm::convertBitmapToCompressedHeights(resources[0].c_str(), height_map_file_name.c_str(), height_codec_settings))
+                height_map_file_name = resources[0];
+        }
+
+        terrain = std::make_shared<bm::Terrain>(d3d11_renderer->getDevice(), height_map_file_name.c_str(), resources[1].c_str(), resources[2].c_str(), terrain_settings);
+    }
+
+    auto terrain_shader = std::make_shared<bm::TerrainShader>(d3d11_renderer->getDevice(), resources[3].c_str(), resources[4].c_str(),
+                                                              shader_vertex_format);
    
     auto fps_camera = std::make_shared<bm::FPSCamera>(static_cast<float>(SCREEN_WIDTH),  static_cast<float>(SCREEN_HEIGHT));
     fps_camera->setPosition(500.f, 75.f, 400.f);
@@ -65,19 +142,47 @@ int __stdcall WinMain(HINSTANCE, HINSTANCE, char*, int)
         direct_input_8->update(fps_camera->getMoveLeftRight(), fps_camera->getMoveBackForward(), fps_camera->getYaw(), fps_camera->getPitch());
         fps_camera->update();
 
+        if (terrain_tiles)
+        {
+            terrain_tiles->update(d3d11_renderer->getDeviceContext(), fps_camera->getPosition());
+            terrain_tiles->cullDrawCalls(fps_camera->getFrustum());
+
+            d3d11_renderer->clearScreen(CLEAR_COLOR);
+
+            terrain_tiles->render(d3d11_renderer->getDeviceContext());
+
+            terrain_shader->render(d3d11_renderer->getDeviceContext(),
+                                   terrain_tiles->getVisibleDrawCalls(),
+                                   fps_camera->getWorld(),
+                                   fps_camera->getView(),
+                                   fps_camera->getProjection(),
+                                   {0.82f, 0.82f, 0.82f, 1.0f},
+                                   {-0.0f, -1.0f, 0.0f},
+                                   terrain_tiles->getColorTexture(),
+                                   terrain_tiles->getNormalMapTexture());
+
+            d3d11_renderer->swapBuffers();
+            continue;
+        }
+
+        constexpr auto MAX_PIXEL_ERROR = 2.0f;
+        terrain->selectLevelsOfDetail(fps_camera->getPosition(), fps_camera->getProjection(), static_cast<float>(SCREEN_HEIGHT), MAX_PIXEL_ERROR);
+        terrain->cullDrawCalls(fps_camera->getFrustum(), fps_camera->getPosition(), fps_camera->getViewProjection());
+
         d3d11_renderer->clearScreen(CLEAR_COLOR);
 
         terrain->render(d3d11_renderer->getDeviceContext());
 
         terrain_shader->render(d3d11_renderer->getDeviceContext(),
-                               terrain->getIndexCount(),
+                               terrain->getVisibleDrawCalls(),
                                fps_camera->getWorld(),
                                fps_camera->getView(),
                                fps_camera->getProjection(),
                                {0.82f, 0.82f, 0.82f, 1.0f},
                                {-0.0f, -1.0f, 0.0f},
                                terrain->getColorTexture(),
-                               terrain->getNormalMapTexture());
+                               terrain->getNormalMapTexture(),
+                               terrain->getHeightTexture());
 
         d3d11_renderer->swapBuffers();
     }
@@ -0,0 +1,47 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "MappedFile.h"
+
+namespace bm
+{
+    MappedFile::MappedFile(const wchar_t* file_name) :
+        file(INVALID_HANDLE_VALUE),
+        mapping(nullptr),
+        data(nullptr),
+        size(0U)
+    {
+        file = CreateFileW(file_name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if(file == INVALID_HANDLE_VALUE)
+            return;
+
+        LARGE_INTEGER file_size;
+        if(!GetFileSizeEx(file, &file_size) || file_size.QuadPart <= 0)
+            return;
+
+        // Empty files can't be mapped, so they are reported as not open.
+        mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0U, 0U, nullptr);
+        if(!mapping)
+            return;
+
+        auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0U, 0U, 0U);
+        if(!view)
+            return;
+
+        data = static_cast<const unsigned char*>(view);
+        size = static_cast<size_t>(file_size.QuadPart);
+    }
+
+    MappedFile::~MappedFile()
+    {
+        if(data)
+            UnmapViewOfFile(data);
+
+        if(mapping)
+            CloseHandle(mapping);
+
+        if(file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+    }
+}
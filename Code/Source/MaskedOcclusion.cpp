@@ -0,0 +1,505 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "MaskedOcclusion.h"
+#include "ParallelFor.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+namespace bm
+{
+    namespace
+    {
+        // Triangles are clipped against the near plane and a guard band of twice the screen around it, which keeps the
+        // edge equations of the screen triangles within a sane range.
+        constexpr int clip_plane_count = 5;
+        constexpr float guard_band = 2.0f;
+
+        constexpr uint32_t full_row = 0xFFFFFFFFU;
+
+        float getClipDistance(const Vector4D& v, int plane)
+        {
+            switch(plane)
+            {
+                case 0: return v.z;
+                case 1: return guard_band * v.w + v.x;
+                case 2: return guard_band * v.w - v.x;
+                case 3: return guard_band * v.w + v.y;
+                default: return guard_band * v.w - v.y;
+            }
+        }
+
+        // Bits first to last of a tile row, both within [0, 31] unless the span is empty.
+        uint32_t getRowMask(int first, int last)
+        {
+            return last < first ? 0U : (full_row >> (31 - (last - first))) << first;
+        }
+
+        double getMilliseconds(std::chrono::steady_clock::time_point start)
+        {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    MaskedOcclusion::MaskedOcclusion(int width, int height, unsigned thread_count) :
+        tile_columns(std::max((width + tile_width - 1) / tile_width, 1)),
+        tile_rows(std::max((height + tile_height - 1) / tile_height, 1)),
+        thread_count(thread_count),
+        tiles(static_cast<size_t>(tile_columns) * tile_rows),
+        tile_row_triangles(tile_rows),
+        stats()
+    {
+        clear(DirectX::XMMatrixIdentity());
+    }
+
+    void MaskedOcclusion::clear(const Matrix& view_projection)
+    {
+        DirectX::XMFLOAT4X4 m;
+        DirectX::XMStoreFloat4x4(&m, view_projection);
+
+        for(auto r = 0; r < 4; r++)
+            for(auto c = 0; c < 4; c++)
+                this->view_projection[r][c] = m.m[r][c];
+
+        for(auto& tile : tiles)
+        {
+            std::fill(std::begin(tile.mask), std::end(tile.mask), 0U);
+            tile.z0 = 1.0f;
+            tile.z1 = 0.0f;
+        }
+
+        stats = MaskedOcclusionStats();
+    }
+
+    void MaskedOcclusion::renderOccluders(const Vector3D* positions, size_t vertex_count, const uint32_t* indices, size_t triangle_count)
+    {
+        renderOccluders(positions, vertex_count, indices, triangle_count, false);
+    }
+
+    void MaskedOcclusion::renderOccludersReference(const Vector3D* positions, size_t vertex_count, const uint32_t* indices, size_t triangle_count)
+    {
+        renderOccluders(positions, vertex_count, indices, triangle_count, true);
+    }
+
+    void MaskedOcclusion::renderOccluders(const Vector3D* positions, size_t vertex_count, const uint32_t* indices, size_t triangle_count, bool reference)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        clip_vertices.resize(vertex_count);
+        for(size_t v = 0; v < vertex_count; v++)
+        {
+            auto& p = positions[v];
+            auto& m = view_projection;
+
+            clip_vertices[v] = Vector4D(p.x * m[0][0] + p.y * m[1][0] + p.z * m[2][0] + m[3][0],
+                                        p.x * m[0][1] + p.y * m[1][1] + p.z * m[2][1] + m[3][1],
+                                        p.x * m[0][2] + p.y * m[1][2] + p.z * m[2][2] + m[3][2],
+                                        p.x * m[0][3] + p.y * m[1][3] + p.z * m[2][3] + m[3][3]);
+        }
+
+        triangles.clear();
+
+        for(size_t t = 0; t < triangle_count; t++)
+        {
+            Vector4D polygon[3 + clip_plane_count], clipped[3 + clip_plane_count];
+            auto polygon_count = 3;
+
+            for(auto k = 0; k < 3; k++)
+                polygon[k] = clip_vertices[indices[3 * t + k]];
+
+            // Sutherland-Hodgman, only for the planes some vertex is outside of.
+            for(auto plane = 0; plane < clip_plane_count && polygon_count >= 3; plane++)
+            {
+                auto outside = 0;
+                for(auto k = 0; k < polygon_count; k++)
+                    outside += getClipDistance(polygon[k], plane) < 0.0f ? 1 : 0;
+
+                if(outside == 0)
+                    continue;
+
+                auto clipped_count = 0;
+                for(auto k = 0; k < polygon_count; k++)
+                {
+                    auto& a = polygon[k];
+                    auto& b = polygon[(k + 1) % polygon_count];
+                    auto da = getClipDistance(a, plane), db = getClipDistance(b, plane);
+
+                    if(da >= 0.0f)
+                        clipped[clipped_count++] = a;
+
+                    if((da >= 0.0f) != (db >= 0.0f))
+                    {
+                        auto t = da / (da - db);
+                        clipped[clipped_count++] = Vector4D(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t, a.w + (b.w - a.w) * t);
+                    }
+                }
+
+                std::copy(clipped, clipped + clipped_count, polygon);
+                polygon_count = clipped_count;
+            }
+
+            for(auto k = 2; k < polygon_count; k++)
+            {
+                Vector4D fan[3] = {polygon[0], polygon[k - 1], polygon[k]};
+                setupTriangle(fan);
+            }
+        }
+
+        for(auto& row : tile_row_triangles)
+            row.clear();
+
+        for(size_t t = 0; t < triangles.size(); t++)
+            for(auto tile_y = triangles[t].first_tile_y; tile_y <= triangles[t].last_tile_y; tile_y++)
+                tile_row_triangles[tile_y].push_back(static_cast<uint32_t>(t));
+
+        // Every tile row is only written by its own band, in submission order.
+        parallelFor(0, tile_rows, thread_count, [&](int begin, int end)
+        {
+            for(auto tile_y = begin; tile_y < end; tile_y++)
+                for(auto t : tile_row_triangles[tile_y])
+                    rasterizeTileRow(triangles[t], tile_y, reference);
+        });
+
+        stats.triangle_count += triangle_count;
+        stats.raster_count += triangles.size();
+        stats.raster_milliseconds += getMilliseconds(start);
+    }
+
+    void MaskedOcclusion::setupTriangle(const Vector4D* clip)
+    {
+        auto width = static_cast<float>(getWidth());
+        auto height = static_cast<float>(getHeight());
+
+        float x[3], y[3], z[3];
+        for(auto k = 0; k < 3; k++)
+        {
+            auto inverse_w = 1.0f / clip[k].w;
+            x[k] = (clip[k].x * inverse_w * 0.5f + 0.5f) * width;
+            y[k] = (0.5f - clip[k].y * inverse_w * 0.5f) * height;
+            z[k] = clip[k].z * inverse_w;
+        }
+
+        auto area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if(!(std::fabs(area) > 0.0f))
+            return;
+
+        ScreenTriangle triangle;
+        triangle.min_x = std::max(std::min({x[0], x[1], x[2]}), 0.0f);
+        triangle.min_y = std::max(std::min({y[0], y[1], y[2]}), 0.0f);
+        triangle.max_x = std::min(std::max({x[0], x[1], x[2]}), width);
+        triangle.max_y = std::min(std::max({y[0], y[1], y[2]}), height);
+
+        // Pixels whose centers are within the bounds; none leaves nothing to draw.
+        auto first_x = static_cast<int>(std::ceil(triangle.min_x - 0.5f)), last_x = static_cast<int>(std::floor(triangle.max_x - 0.5f));
+        auto first_y = static_cast<int>(std::ceil(triangle.min_y - 0.5f)), last_y = static_cast<int>(std::floor(triangle.max_y - 0.5f));
+        if(first_x > last_x || first_y > last_y)
+            return;
+
+        triangle.first_tile_x = first_x / tile_width;
+        triangle.last_tile_x = last_x / tile_width;
+        triangle.first_tile_y = first_y / tile_height;
+        triangle.last_tile_y = last_y / tile_height;
+
+        for(auto k = 0; k < 3; k++)
+        {
+            auto i = k, j = (k + 1) % 3;
+            auto sign = area > 0.0f ? 1.0f : -1.0f;
+
+            triangle.edge_a[k] = sign * (y[i] - y[j]);
+            triangle.edge_b[k] = sign * (x[j] - x[i]);
+            triangle.edge_c[k] = sign * (x[i] * y[j] - x[j] * y[i]);
+        }
+
+        triangle.depth_x = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) / area;
+        triangle.depth_y = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) / area;
+        triangle.depth_0 = z[0] - triangle.depth_x * x[0] - triangle.depth_y * y[0];
+        triangle.depth_max = std::max({z[0], z[1], z[2]});
+
+        triangles.push_back(triangle);
+    }
+
+    void MaskedOcclusion::getRowSpans(const ScreenTriangle& triangle, int tile_y, int* first, int* last)
+    {
+#if defined(BM_SIMD_AVX2)
+        {
+            auto row_y = static_cast<float>(tile_y * tile_height) + 0.5f;
+            auto y = _mm256_add_ps(_mm256_set1_ps(row_y), _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f));
+            auto left = _mm256_set1_ps(triangle.min_x), right = _mm256_set1_ps(triangle.max_x);
+
+            for(auto e = 0; e < 3; e++)
+            {
+                auto a = triangle.edge_a[e];
+                auto value = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(triangle.edge_b[e]), y), _mm256_set1_ps(triangle.edge_c[e]));
+
+                if(a > 0.0f)
+                    left = _mm256_max_ps(left, _mm256_div_ps(_mm256_sub_ps(_mm256_setzero_ps(), value), _mm256_set1_ps(a)));
+                else if(a < 0.0f)
+                    right = _mm256_min_ps(right, _mm256_div_ps(_mm256_sub_ps(_mm256_setzero_ps(), value), _mm256_set1_ps(a)));
+                else
+                    right = _mm256_blendv_ps(right, _mm256_set1_ps(-1.0f), _mm256_cmp_ps(value, _mm256_setzero_ps(), _CMP_LT_OQ));
+            }
+
+            left = _mm256_min_ps(left, _mm256_set1_ps(triangle.max_x + 1.0f));
+            right = _mm256_max_ps(right, _mm256_set1_ps(triangle.min_x - 1.0f));
+
+            auto half = _mm256_set1_ps(0.5f);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(first), _mm256_cvttps_epi32(_mm256_ceil_ps(_mm256_sub_ps(left, half))));
+            _mm256_store_si256(reinterpret_cast<__m256i*>(last), _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_sub_ps(right, half))));
+        }
+#elif defined(BM_SIMD_SSE4)
+        auto row_y = static_cast<float>(tile_y * tile_height) + 0.5f;
+
+        for(auto half_row = 0; half_row < tile_height; half_row += 4)
+        {
+            auto y = _mm_add_ps(_mm_set1_ps(row_y + static_cast<float>(half_row)), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+            auto left = _mm_set1_ps(triangle.min_x), right = _mm_set1_ps(triangle.max_x);
+
+            for(auto e = 0; e < 3; e++)
+            {
+                auto a = triangle.edge_a[e];
+                auto value = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(triangle.edge_b[e]), y), _mm_set1_ps(triangle.edge_c[e]));
+
+                if(a > 0.0f)
+                    left = _mm_max_ps(left, _mm_div_ps(_mm_sub_ps(_mm_setzero_ps(), value), _mm_set1_ps(a)));
+                else if(a < 0.0f)
+                    right = _mm_min_ps(right, _mm_div_ps(_mm_sub_ps(_mm_setzero_ps(), value), _mm_set1_ps(a)));
+                else
+                    right = _mm_blendv_ps(right, _mm_set1_ps(-1.0f), _mm_cmplt_ps(value, _mm_setzero_ps()));
+            }
+
+            left = _mm_min_ps(left, _mm_set1_ps(triangle.max_x + 1.0f));
+            right = _mm_max_ps(right, _mm_set1_ps(triangle.min_x - 1.0f));
+
+            auto half = _mm_set1_ps(0.5f);
+            _mm_store_si128(reinterpret_cast<__m128i*>(first + half_row), _mm_cvttps_epi32(_mm_ceil_ps(_mm_sub_ps(left, half))));
+            _mm_store_si128(reinterpret_cast<__m128i*>(last + half_row), _mm_cvttps_epi32(_mm_floor_ps(_mm_sub_ps(right, half))));
+        }
+#else
+        getRowSpansReference(triangle, tile_y, first, last);
+#endif
+    }
+
+    void MaskedOcclusion::getRowSpansReference(const ScreenTriangle& triangle, int tile_y, int* first, int* last)
+    {
+        auto row_y = static_cast<float>(tile_y * tile_height) + 0.5f;
+
+        for(auto r = 0; r < tile_height; r++)
+        {
+            auto y = row_y + static_cast<float>(r);
+            auto left = triangle.min_x, right = triangle.max_x;
+
+            for(auto e = 0; e < 3; e++)
+            {
+                auto a = triangle.edge_a[e];
+                auto value = triangle.edge_b[e] * y + triangle.edge_c[e];
+
+                if(a > 0.0f)
+                    left = std::max(left, (0.0f - value) / a);
+                else if(a < 0.0f)
+                    right = std::min(right, (0.0f - value) / a);
+                else if(value < 0.0f)
+                    right = -1.0f;
+            }
+
+            left = std::min(left, triangle.max_x + 1.0f);
+            right = std::max(right, triangle.min_x - 1.0f);
+
+            first[r] = static_cast<int>(std::ceil(left - 0.5f));
+            last[r] = static_cast<int>(std::floor(right - 0.5f));
+        }
+    }
+
+    bool MaskedOcclusion::getCoverage(const int* first, const int* last, int tile_left, uint32_t* coverage)
+    {
+#if defined(BM_SIMD_AVX2)
+        auto base = _mm256_set1_epi32(tile_left);
+        auto low = _mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(first)), base),
+                                                     _mm256_setzero_si256()), _mm256_set1_epi32(tile_width));
+        auto high = _mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(last)), base),
+                                                      _mm256_set1_epi32(-1)), _mm256_set1_epi32(tile_width - 1));
+
+        // Shifts by 32 or more give zero, which takes care of the empty rows.
+        auto count = _mm256_add_epi32(_mm256_sub_epi32(_mm256_set1_epi32(tile_width - 1), high), low);
+        auto mask = _mm256_sllv_epi32(_mm256_srlv_epi32(_mm256_set1_epi32(-1), count), low);
+
+        _mm256_store_si256(reinterpret_cast<__m256i*>(coverage), mask);
+        return !_mm256_testz_si256(mask, mask);
+#else
+        return getCoverageReference(first, last, tile_left, coverage);
+#endif
+    }
+
+    bool MaskedOcclusion::getCoverageReference(const int* first, const int* last, int tile_left, uint32_t* coverage)
+    {
+        auto covered = 0U;
+        for(auto r = 0; r < tile_height; r++)
+        {
+            auto low = std::min(std::max(first[r] - tile_left, 0), tile_width);
+            auto high = std::min(std::max(last[r] - tile_left, -1), tile_width - 1);
+
+            coverage[r] = getRowMask(low, high);
+            covered |= coverage[r];
+        }
+
+        return covered != 0U;
+    }
+
+    void MaskedOcclusion::rasterizeTileRow(const ScreenTriangle& triangle, int tile_y, bool reference)
+    {
+        // First and last covered pixel of every row of the tile row, clamped to the triangle's bounds so that they stay
+        // finite: a row the triangle misses ends up with last < first.
+        alignas(32) int first[tile_height], last[tile_height];
+
+        if(reference)
+            getRowSpansReference(triangle, tile_y, first, last);
+        else
+            getRowSpans(triangle, tile_y, first, last);
+
+        auto tile_top = static_cast<float>(tile_y * tile_height);
+
+        for(auto tile_x = triangle.first_tile_x; tile_x <= triangle.last_tile_x; tile_x++)
+        {
+            auto tile_left = tile_x * tile_width;
+
+            alignas(32) uint32_t coverage[tile_height];
+            if(!(reference ? getCoverageReference(first, last, tile_left, coverage) : getCoverage(first, last, tile_left, coverage)))
+                continue;
+
+            // Largest depth of the plane over the part of the tile within the triangle's bounds, never past its vertices.
+            auto left = std::max(static_cast<float>(tile_left), triangle.min_x);
+            auto right = std::min(static_cast<float>(tile_left + tile_width), triangle.max_x);
+            auto top = std::max(tile_top, triangle.min_y);
+            auto bottom = std::min(tile_top + static_cast<float>(tile_height), triangle.max_y);
+
+            auto depth = triangle.depth_0 + triangle.depth_x * (triangle.depth_x > 0.0f ? right : left) +
+                         triangle.depth_y * (triangle.depth_y > 0.0f ? bottom : top);
+
+            updateTile(tiles[tile_y * tile_columns + tile_x], coverage, std::min(depth, triangle.depth_max));
+        }
+    }
+
+    void MaskedOcclusion::updateTile(Tile& tile, const uint32_t* coverage, float depth)
+    {
+        if(depth >= tile.z0)
+            return;
+
+        // A layer much farther than the new triangle, compared to how much it gains over z0, is dropped instead of pushing
+        // the triangle back to its depth.
+        if(tile.z1 - depth > tile.z0 - tile.z1)
+        {
+            std::fill(std::begin(tile.mask), std::end(tile.mask), 0U);
+            tile.z1 = 0.0f;
+        }
+
+        tile.z1 = std::max(tile.z1, depth);
+
+        auto full = full_row;
+        for(auto r = 0; r < tile_height; r++)
+        {
+            tile.mask[r] |= coverage[r];
+            full &= tile.mask[r];
+        }
+
+        // A layer that covers the whole tile becomes its depth.
+        if(full == full_row)
+        {
+            tile.z0 = tile.z1;
+            tile.z1 = 0.0f;
+            std::fill(std::begin(tile.mask), std::end(tile.mask), 0U);
+        }
+    }
+
+    bool MaskedOcclusion::isBoxVisible(const Vector3D& bounds_min, const Vector3D& bounds_max) const
+    {
+        auto& m = view_projection;
+
+        auto min_x = std::numeric_limits<float>::max(), min_y = min_x, min_depth = min_x;
+        auto max_x = -min_x, max_y = -min_x;
+
+        for(auto corner = 0; corner < 8; corner++)
+        {
+            auto x = corner & 1 ? bounds_max.x : bounds_min.x;
+            auto y = corner & 2 ? bounds_max.y : bounds_min.y;
+            auto z = corner & 4 ? bounds_max.z : bounds_min.z;
+
+            auto clip_z = x * m[0][2] + y * m[1][2] + z * m[2][2] + m[3][2];
+            auto clip_w = x * m[0][3] + y * m[1][3] + z * m[2][3] + m[3][3];
+
+            // Reaches in front of the near plane.
+            if(clip_z < 0.0f || clip_w <= 0.0f)
+                return true;
+
+            auto inverse_w = 1.0f / clip_w;
+            auto screen_x = (x * m[0][0] + y * m[1][0] + z * m[2][0] + m[3][0]) * inverse_w;
+            auto screen_y = (x * m[0][1] + y * m[1][1] + z * m[2][1] + m[3][1]) * inverse_w;
+
+            min_x = std::min(min_x, screen_x);
+            max_x = std::max(max_x, screen_x);
+            min_y = std::min(min_y, screen_y);
+            max_y = std::max(max_y, screen_y);
+            min_depth = std::min(min_depth, clip_z * inverse_w);
+        }
+
+        // Every pixel the projected bounds touch, top row first.
+        auto width = static_cast<float>(getWidth());
+        auto height = static_cast<float>(getHeight());
+
+        auto left = std::max(std::floor((min_x * 0.5f + 0.5f) * width), 0.0f);
+        auto right = std::min(std::ceil((max_x * 0.5f + 0.5f) * width), width) - 1.0f;
+        auto top = std::max(std::floor((0.5f - max_y * 0.5f) * height), 0.0f);
+        auto bottom = std::min(std::ceil((0.5f - min_y * 0.5f) * height), height) - 1.0f;
+
+        if(left > right || top > bottom)
+            return false;
+
+        auto first_x = static_cast<int>(left), last_x = static_cast<int>(right);
+        auto first_y = static_cast<int>(top), last_y = static_cast<int>(bottom);
+
+        for(auto tile_y = first_y / tile_height; tile_y <= last_y / tile_height; tile_y++)
+        {
+            for(auto tile_x = first_x / tile_width; tile_x <= last_x / tile_width; tile_x++)
+            {
+                auto& tile = tiles[tile_y * tile_columns + tile_x];
+                if(min_depth >= tile.z0)
+                    continue;
+
+                // Still hidden where the layer in progress covers every pixel of the box in front of it.
+                if(min_depth < tile.z1)
+                    return true;
+
+                auto row_mask = getRowMask(std::max(first_x - tile_x * tile_width, 0), std::min(last_x - tile_x * tile_width, tile_width - 1));
+
+                for(auto r = std::max(first_y - tile_y * tile_height, 0); r <= std::min(last_y - tile_y * tile_height, tile_height - 1); r++)
+                    if(row_mask & ~tile.mask[r])
+                        return true;
+            }
+        }
+
+        return false;
+    }
+
+    size_t MaskedOcclusion::cullBoundingBoxes(const BoundingBoxes& boxes, std::vector<uint32_t>& visible)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        auto cx = boxes.getCenterX(), cy = boxes.getCenterY(), cz = boxes.getCenterZ();
+        auto ex = boxes.getExtentX(), ey = boxes.getExtentY(), ez = boxes.getExtentZ();
+
+        auto count = visible.size();
+        visible.erase(std::remove_if(visible.begin(), visible.end(), [&](uint32_t i)
+        {
+            return !isBoxVisible(Vector3D(cx[i] - ex[i], cy[i] - ey[i], cz[i] - ez[i]), Vector3D(cx[i] + ex[i], cy[i] + ey[i], cz[i] + ez[i]));
+        }), visible.end());
+
+        stats.query_count += count;
+        stats.hidden_count += count - visible.size();
+        stats.query_milliseconds += getMilliseconds(start);
+
+        return visible.size();
+    }
+}
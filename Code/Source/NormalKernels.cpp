@@ -0,0 +1,335 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "NormalKernels.h"
+#include "Simd.h"
+
+#include <algorithm>
+
+namespace bm
+{
+    namespace
+    {
+        // For a face with corners h1 = (i, j), h2 = (i + 1, j), h3 = (i, j + 1) the cross product used by the reference reduces to
+        // s * (h1 - h2, s, h1 - h3). Summed over the four faces around an interior vertex and divided by s that gives
+        // (dx, 4s, dz) with the two differences below. The octahedral encoding divides by the L1 norm, so no normalization is needed.
+        //
+        // The arithmetic and the rounding (to nearest even, as cvtps2dq) are those of the vector versions, so a normal doesn't
+        // depend on whether its sample lands in a vector lane or in a scalar tail.
+        uint32_t packInteriorNormal(float dx, float dz, float four_spacing)
+        {
+            auto l1_norm = std::fabs(dx) + four_spacing + std::fabs(dz);
+            auto scale = 32767.0f / l1_norm;
+
+            auto u = static_cast<int16_t>(std::nearbyint(dx * scale));
+            auto v = static_cast<int16_t>(std::nearbyint(dz * scale));
+
+            return static_cast<uint16_t>(u) | (static_cast<uint32_t>(static_cast<uint16_t>(v)) << 16);
+        }
+
+        void computeInteriorScalar(const float* below, const float* row, const float* above, uint32_t* normals, int first, int last, float four_spacing)
+        {
+            for(auto i = first; i < last; i++)
+            {
+                auto dx = (below[i - 1] - below[i + 1]) + (row[i - 1] - row[i + 1]);
+                auto dz = (below[i - 1] - above[i - 1]) + (below[i] - above[i]);
+
+                normals[i] = packInteriorNormal(dx, dz, four_spacing);
+            }
+        }
+
+        // General case for vertices on the border of the grid: only the faces that exist are summed.
+        void computeEdgeNormal(HeightField& height_field, int i, int j)
+        {
+            auto width = height_field.getWidth();
+            auto height = height_field.getHeight();
+            auto spacing = height_field.getSpacing();
+
+            float sum[3] = {0.0f, 0.0f, 0.0f};
+
+            auto addFace([&](int fi, int fj)
+            {
+                if(fi < 0 || fj < 0 || fi >= width - 1 || fj >= height - 1)
+                    return;
+
+                auto h1 = height_field.getHeight(fi, fj);
+
+                sum[0] += h1 - height_field.getHeight(fi + 1, fj);
+                sum[1] += spacing;
+                sum[2] += h1 - height_field.getHeight(fi, fj + 1);
+            });
+
+            addFace(i - 1, j - 1);
+            addFace(i, j - 1);
+            addFace(i - 1, j);
+            addFace(i, j);
+
+            // A degenerate 1xN grid has no faces at all.
+            if(sum[1] == 0.0f)
+                sum[1] = 1.0f;
+
+            height_field.getPackedNormals()[height_field.getIndex(i, j)] = packInteriorNormal(sum[0], sum[2], sum[1]);
+        }
+
+#ifdef BM_SIMD_SSE4
+        __m128i packInteriorNormals4(__m128 dx, __m128 dz, __m128 four_spacing)
+        {
+            const auto abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+            const auto snorm_scale = _mm_set1_ps(32767.0f);
+
+            auto l1_norm = _mm_add_ps(_mm_add_ps(_mm_and_ps(dx, abs_mask), _mm_and_ps(dz, abs_mask)), four_spacing);
+            auto scale = _mm_div_ps(snorm_scale, l1_norm);
+
+            auto u = _mm_cvtps_epi32(_mm_mul_ps(dx, scale));
+            auto v = _mm_cvtps_epi32(_mm_mul_ps(dz, scale));
+
+            return _mm_or_si128(_mm_and_si128(u, _mm_set1_epi32(0xFFFF)), _mm_slli_epi32(v, 16));
+        }
+#endif
+
+#ifdef BM_SIMD_AVX2
+        __m256i packInteriorNormals8(__m256 dx, __m256 dz, __m256 four_spacing)
+        {
+            const auto abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+            const auto snorm_scale = _mm256_set1_ps(32767.0f);
+
+            auto l1_norm = _mm256_add_ps(_mm256_add_ps(_mm256_and_ps(dx, abs_mask), _mm256_and_ps(dz, abs_mask)), four_spacing);
+            auto scale = _mm256_div_ps(snorm_scale, l1_norm);
+
+            auto u = _mm256_cvtps_epi32(_mm256_mul_ps(dx, scale));
+            auto v = _mm256_cvtps_epi32(_mm256_mul_ps(dz, scale));
+
+            return _mm256_or_si256(_mm256_and_si256(u, _mm256_set1_epi32(0xFFFF)), _mm256_slli_epi32(v, 16));
+        }
+#endif
+
+        void storeFrame(HeightFieldFrame& frame, float gx, float gz, float tangent_scale, float binormal_scale, float normal_scale)
+        {
+            frame.normal = Vector3D(-gx * normal_scale, normal_scale, -gz * normal_scale);
+            frame.tangent = Vector3D(tangent_scale, gx * tangent_scale, 0.0f);
+            frame.binormal = Vector3D(0.0f, -gz * binormal_scale, -binormal_scale);
+        }
+
+        void computeFrame(const float* below, const float* row, const float* above, int i, int width, float spacing, float z_scale,
+                          HeightFieldFrame& frame)
+        {
+            // One-sided differences on the left and right border, a single column has no slope along X.
+            auto left = std::max(i - 1, 0);
+            auto right = std::min(i + 1, width - 1);
+            auto gx = right > left ? (row[right] - row[left]) / (static_cast<float>(right - left) * spacing) : 0.0f;
+            auto gz = (above[i] - below[i]) * z_scale;
+
+            storeFrame(frame, gx, gz, 1.0f / std::sqrt(1.0f + gx * gx), 1.0f / std::sqrt(1.0f + gz * gz),
+                       1.0f / std::sqrt(1.0f + gx * gx + gz * gz));
+        }
+
+        void computeInteriorRow(const float* below, const float* row, const float* above, uint32_t* normals, int width, float four_spacing)
+        {
+            auto i = 1;
+            auto last = width - 1;
+
+#ifdef BM_SIMD_AVX2
+            const auto four_spacing8 = _mm256_set1_ps(four_spacing);
+
+            for(; i + 8 <= last; i += 8)
+            {
+                auto below_left = _mm256_loadu_ps(below + i - 1);
+                auto below_center = _mm256_loadu_ps(below + i);
+                auto below_right = _mm256_loadu_ps(below + i + 1);
+                auto row_left = _mm256_loadu_ps(row + i - 1);
+                auto row_right = _mm256_loadu_ps(row + i + 1);
+                auto above_left = _mm256_loadu_ps(above + i - 1);
+                auto above_center = _mm256_loadu_ps(above + i);
+
+                auto dx = _mm256_add_ps(_mm256_sub_ps(below_left, below_right), _mm256_sub_ps(row_left, row_right));
+                auto dz = _mm256_add_ps(_mm256_sub_ps(below_left, above_left), _mm256_sub_ps(below_center, above_center));
+
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(normals + i), packInteriorNormals8(dx, dz, four_spacing8));
+            }
+#endif
+
+#ifdef BM_SIMD_SSE4
+            const auto four_spacing4 = _mm_set1_ps(four_spacing);
+
+            for(; i + 4 <= last; i += 4)
+            {
+                auto below_left = _mm_loadu_ps(below + i - 1);
+                auto below_center = _mm_loadu_ps(below + i);
+                auto below_right = _mm_loadu_ps(below + i + 1);
+                auto row_left = _mm_loadu_ps(row + i - 1);
+                auto row_right = _mm_loadu_ps(row + i + 1);
+                auto above_left = _mm_loadu_ps(above + i - 1);
+                auto above_center = _mm_loadu_ps(above + i);
+
+                auto dx = _mm_add_ps(_mm_sub_ps(below_left, below_right), _mm_sub_ps(row_left, row_right));
+                auto dz = _mm_add_ps(_mm_sub_ps(below_left, above_left), _mm_sub_ps(below_center, above_center));
+
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(normals + i), packInteriorNormals4(dx, dz, four_spacing4));
+            }
+#endif
+
+            computeInteriorScalar(below, row, above, normals, i, last, four_spacing);
+        }
+    }
+
+    void computeHeightFieldNormals(HeightField& height_field, int first_row, int last_row)
+    {
+        auto width = height_field.getWidth();
+        auto height = height_field.getHeight();
+        auto four_spacing = 4.0f * height_field.getSpacing();
+
+        for(auto j = first_row; j < last_row; j++)
+        {
+            // Edge pass: the first and last rows and the first and last column of every other row.
+            if(j == 0 || j == height - 1 || width < 3)
+            {
+                for(auto i = int(); i < width; i++)
+                    computeEdgeNormal(height_field, i, j);
+
+                continue;
+            }
+
+            computeEdgeNormal(height_field, 0, j);
+            computeEdgeNormal(height_field, width - 1, j);
+
+            computeInteriorRow(height_field.getRow(j - 1), height_field.getRow(j), height_field.getRow(j + 1),
+                               height_field.getPackedNormals() + height_field.getIndex(0, j), width, four_spacing);
+        }
+    }
+
+    void computeHeightFieldNormalsReference(HeightField& height_field)
+    {
+        auto width = height_field.getWidth();
+        auto height = height_field.getHeight();
+
+        // Un-normalized face normals, one per quad.
+        std::vector<Vector3D> normals((width - 1) * (height - 1));
+
+        for(auto j = int(); j < (height - 1); j++)
+        {
+            for(auto i = int(); i < (width - 1); i++)
+            {
+                auto vertex1 = height_field.getPosition(i, j);
+                auto vertex2 = height_field.getPosition(i + 1, j);
+                auto vertex3 = height_field.getPosition(i, j + 1);
+
+                float vector1[3] = {vertex1.x - vertex3.x, vertex1.y - vertex3.y, vertex1.z - vertex3.z};
+                float vector2[3] = {vertex3.x - vertex2.x, vertex3.y - vertex2.y, vertex3.z - vertex2.z};
+
+                auto& normal = normals[(j * (width - 1)) + i];
+                normal.x = (vector1[1] * vector2[2]) - (vector1[2] * vector2[1]);
+                normal.y = (vector1[2] * vector2[0]) - (vector1[0] * vector2[2]);
+                normal.z = (vector1[0] * vector2[1]) - (vector1[1] * vector2[0]);
+            }
+        }
+
+        // Average the faces touching every vertex.
+        for(auto j = int(); j < height; j++)
+        {
+            for(auto i = int(); i < width; i++)
+            {
+                float sum[3] = {0.0f, 0.0f, 0.0f};
+                auto count = int();
+
+                for(auto fj = j - 1; fj <= j; fj++)
+                {
+                    for(auto fi = i - 1; fi <= i; fi++)
+                    {
+                        if(fi < 0 || fj < 0 || fi >= width - 1 || fj >= height - 1)
+                            continue;
+
+                        auto& normal = normals[(fj * (width - 1)) + fi];
+                        sum[0] += normal.x;
+                        sum[1] += normal.y;
+                        sum[2] += normal.z;
+                        count++;
+                    }
+                }
+
+                if(count == 0)
+                {
+                    height_field.setNormal(i, j, Vector3D(0.0f, 1.0f, 0.0f));
+                    continue;
+                }
+
+                sum[0] /= static_cast<float>(count);
+                sum[1] /= static_cast<float>(count);
+                sum[2] /= static_cast<float>(count);
+
+                auto length = std::sqrt((sum[0] * sum[0]) + (sum[1] * sum[1]) + (sum[2] * sum[2]));
+
+                height_field.setNormal(i, j, Vector3D(sum[0] / length, sum[1] / length, sum[2] / length));
+            }
+        }
+    }
+
+    void computeHeightFieldFrames(const HeightField& height_field, int row, HeightFieldFrame* frames)
+    {
+        computeHeightFieldFrames(height_field, row, 0, height_field.getWidth(), frames);
+    }
+
+    void computeHeightFieldFrames(const HeightField& height_field, int row, int first_column, int last_column, HeightFieldFrame* frames)
+    {
+        auto width = height_field.getWidth();
+        auto height = height_field.getHeight();
+        auto spacing = height_field.getSpacing();
+
+        // Rows above and below, clamped on the borders. z_scale turns their difference into the slope along Z.
+        auto below_row = std::max(row - 1, 0);
+        auto above_row = std::min(row + 1, height - 1);
+        auto z_scale = above_row > below_row ? 1.0f / (static_cast<float>(above_row - below_row) * spacing) : 0.0f;
+
+        auto below = height_field.getRow(below_row);
+        auto center = height_field.getRow(row);
+        auto above = height_field.getRow(above_row);
+
+        if(first_column == 0)
+            computeFrame(below, center, above, 0, width, spacing, z_scale, frames[0]);
+        if(width > 1 && last_column == width)
+            computeFrame(below, center, above, width - 1, width, spacing, z_scale, frames[width - 1 - first_column]);
+
+        // Interior columns go in the same groups of four as for the whole row, whatever the range, and only the ones
+        // within it are stored.
+        auto i = 1 + (std::max(first_column - 1, 0) / 4) * 4;
+        auto last = std::min(width - 1, last_column);
+
+#ifdef BM_SIMD_SSE4
+        // The slopes and the three reciprocal lengths are computed four samples at a time, the frames are then written out.
+        const auto x_scale4 = _mm_set1_ps(1.0f / (2.0f * spacing));
+        const auto z_scale4 = _mm_set1_ps(z_scale);
+        const auto one = _mm_set1_ps(1.0f);
+
+        for(; i + 4 <= width - 1 && i < last; i += 4)
+        {
+            auto gx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(center + i + 1), _mm_loadu_ps(center + i - 1)), x_scale4);
+            auto gz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(above + i), _mm_loadu_ps(below + i)), z_scale4);
+
+            auto gx2 = _mm_mul_ps(gx, gx);
+            auto gz2 = _mm_mul_ps(gz, gz);
+
+            alignas(16) float gx_values[4], gz_values[4], tangent_scales[4], binormal_scales[4], normal_scales[4];
+            _mm_store_ps(gx_values, gx);
+            _mm_store_ps(gz_values, gz);
+            _mm_store_ps(tangent_scales, _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(one, gx2))));
+            _mm_store_ps(binormal_scales, _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(one, gz2))));
+            _mm_store_ps(normal_scales, _mm_div_ps(one, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(one, gx2), gz2))));
+
+            for(auto k = std::max(first_column - i, 0); k < std::min(last - i, 4); k++)
+                storeFrame(frames[i + k - first_column], gx_values[k], gz_values[k], tangent_scales[k], binormal_scales[k], normal_scales[k]);
+        }
+#endif
+
+        for(i = std::max(i, std::max(first_column, 1)); i < last; i++)
+            computeFrame(below, center, above, i, width, spacing, z_scale, frames[i - first_column]);
+    }
+
+    HeightFieldFrame getGradientFrame(float gx, float gz)
+    {
+        HeightFieldFrame frame;
+        storeFrame(frame, gx, gz, 1.0f / std::sqrt(1.0f + gx * gx), 1.0f / std::sqrt(1.0f + gz * gz),
+                   1.0f / std::sqrt(1.0f + gx * gx + gz * gz));
+
+        return frame;
+    }
+}
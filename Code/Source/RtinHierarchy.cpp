@@ -0,0 +1,180 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "RtinHierarchy.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace bm
+{
+    namespace
+    {
+        // Calls function(ax, az, bx, bz, cx, cz) for every triangle of the given depth below the triangle (a, b, c),
+        // which has its right angle at c. The children share the midpoint of the hypotenuse as their right angle.
+        template<typename Function>
+        void forEachTriangle(int ax, int az, int bx, int bz, int cx, int cz, int depth, Function& function)
+        {
+            if(depth == 0)
+            {
+                function(ax, az, bx, bz, cx, cz);
+                return;
+            }
+
+            auto mx = (ax + bx) / 2;
+            auto mz = (az + bz) / 2;
+
+            forEachTriangle(cx, cz, ax, az, mx, mz, depth - 1, function);
+            forEachTriangle(bx, bz, cx, cz, mx, mz, depth - 1, function);
+        }
+
+        // Largest vertical distance between the plane through the corners of a triangle and the samples it covers.
+        float measureTriangleError(const HeightField& height_field, int ax, int az, int bx, int bz, int cx, int cz)
+        {
+            auto ha = height_field.getHeight(ax, az);
+            auto hb = height_field.getHeight(bx, bz);
+            auto hc = height_field.getHeight(cx, cz);
+
+            // Twice the signed area, and the edge functions below share its sign for the samples inside.
+            auto area = (bx - ax) * (cz - az) - (bz - az) * (cx - ax);
+            auto scale = 1.0f / static_cast<float>(area);
+            auto error = 0.0f;
+
+            for(auto z = std::min(std::min(az, bz), cz); z <= std::max(std::max(az, bz), cz); z++)
+            {
+                auto row = height_field.getRow(z);
+
+                for(auto x = std::min(std::min(ax, bx), cx); x <= std::max(std::max(ax, bx), cx); x++)
+                {
+                    auto wa = (bx - x) * (cz - z) - (bz - z) * (cx - x);
+                    auto wb = (cx - x) * (az - z) - (cz - z) * (ax - x);
+                    auto wc = area - wa - wb;
+
+                    if((area > 0) ? (wa < 0 || wb < 0 || wc < 0) : (wa > 0 || wb > 0 || wc > 0))
+                        continue;
+
+                    auto interpolated = (static_cast<float>(wa) * ha + static_cast<float>(wb) * hb + static_cast<float>(wc) * hc) * scale;
+                    error = std::max(error, std::fabs(interpolated - row[x]));
+                }
+            }
+
+            return error;
+        }
+
+        // Whether a line at a multiple of block_size runs through the open interval (first, last).
+        bool crossesBlock(int first, int last, int block_size)
+        {
+            return block_size > 0 && last - first > 1 && first / block_size != (last - 1) / block_size;
+        }
+    }
+
+    void RtinHierarchy::build(const HeightField& height_field, int block_size)
+    {
+        width = height_field.getWidth();
+        height = height_field.getHeight();
+
+        errors.clear();
+        grid_size = 0;
+
+        if(width < 2 || height < 2)
+            return;
+
+        auto tile_size = 1;
+        auto levels = 0;
+        while(tile_size < std::max(width, height) - 1)
+        {
+            tile_size *= 2;
+            levels++;
+        }
+
+        grid_size = tile_size + 1;
+        errors.assign(static_cast<size_t>(grid_size) * grid_size, 0.0f);
+
+        auto last_x = width - 1;
+        auto last_z = height - 1;
+
+        // Triangles with legs of a single quad have no midpoint on the grid, the ones above them are handled bottom up,
+        // one depth at a time, so that both triangles on a hypotenuse are folded into it before their parents read it.
+        auto deepest = 2 * levels - 1;
+
+        for(auto depth = deepest; depth >= 0; depth--)
+        {
+            auto computeError([&](int ax, int az, int bx, int bz, int cx, int cz)
+            {
+                auto min_x = std::min(std::min(ax, bx), cx);
+                auto max_x = std::max(std::max(ax, bx), cx);
+                auto min_z = std::min(std::min(az, bz), cz);
+                auto max_z = std::max(std::max(az, bz), cz);
+
+                // Nothing of the triangle is on the height field.
+                if(min_x >= last_x || min_z >= last_z)
+                    return;
+
+                auto mx = (ax + bx) / 2;
+                auto mz = (az + bz) / 2;
+                auto& error = errors[static_cast<size_t>(mz) * grid_size + mx];
+
+                // Triangles hanging over the border of the height field or over a block line are always split.
+                if(max_x > last_x || max_z > last_z || crossesBlock(min_x, max_x, block_size) || crossesBlock(min_z, max_z, block_size))
+                {
+                    error = std::numeric_limits<float>::infinity();
+                    return;
+                }
+
+                // Measured over every covered sample rather than only at the midpoint, so the threshold is a real bound.
+                auto triangle_error = measureTriangleError(height_field, ax, az, bx, bz, cx, cz);
+
+                if(depth < deepest)
+                {
+                    triangle_error = std::max(triangle_error, errors[static_cast<size_t>((az + cz) / 2) * grid_size + (ax + cx) / 2]);
+                    triangle_error = std::max(triangle_error, errors[static_cast<size_t>((bz + cz) / 2) * grid_size + (bx + cx) / 2]);
+                }
+
+                error = std::max(error, triangle_error);
+            });
+
+            forEachTriangle(0, 0, tile_size, tile_size, tile_size, 0, depth, computeError);
+            forEachTriangle(tile_size, tile_size, 0, 0, 0, tile_size, depth, computeError);
+        }
+    }
+
+    void RtinHierarchy::extractMesh(float max_error, std::vector<uint32_t>& triangles) const
+    {
+        if(errors.empty())
+            return;
+
+        auto tile_size = grid_size - 1;
+
+        extractTriangle(0, 0, tile_size, tile_size, tile_size, 0, max_error, triangles);
+        extractTriangle(tile_size, tile_size, 0, 0, 0, tile_size, max_error, triangles);
+    }
+
+    void RtinHierarchy::extractTriangle(int ax, int az, int bx, int bz, int cx, int cz, float max_error, std::vector<uint32_t>& triangles) const
+    {
+        if(std::min(std::min(ax, bx), cx) >= width - 1 || std::min(std::min(az, bz), cz) >= height - 1)
+            return;
+
+        auto mx = (ax + bx) / 2;
+        auto mz = (az + bz) / 2;
+
+        if(std::abs(ax - cx) + std::abs(az - cz) > 1 && getError(mx, mz) > max_error)
+        {
+            extractTriangle(cx, cz, ax, az, mx, mz, max_error, triangles);
+            extractTriangle(bx, bz, cx, cz, mx, mz, max_error, triangles);
+
+            return;
+        }
+
+        // The terrain mesh winds clockwise seen from above (+Y, with Z pointing away).
+        auto a = static_cast<uint32_t>(az * width + ax);
+        auto b = static_cast<uint32_t>(bz * width + bx);
+        auto c = static_cast<uint32_t>(cz * width + cx);
+
+        if((bx - ax) * (cz - az) - (bz - az) * (cx - ax) > 0)
+            std::swap(b, c);
+
+        triangles.insert(triangles.end(), {a, b, c});
+    }
+}
@@ -3,450 +3,1779 @@
 #include <StdAfx.h>
 
 #include "Terrain.h"
+#include "MappedFile.h"
+#include "BitmapReader.h"
+#include "HeightCodec.h"
+#include "NormalKernels.h"
+#include "HeightQueries.h"
+#include "HeightFieldAccess.h"
+#include "ParallelFor.h"
+#include "VertexCache.h"
+#include "TerrainBake.h"
+#include "Geomipmapping.h"
+#include "RtinHierarchy.h"
+
+#include <limits>
 
 namespace bm
 {
-	Terrain::Terrain(ID3D11Device* device, const wchar_t* height_map_file_name, const wchar_t* diffuse_texture_file_name, const wchar_t* bump_map_file_name) :
-        height_map(nullptr),
+	Terrain::Terrain(ID3D11Device* device, const wchar_t* height_map_file_name, const wchar_t* diffuse_texture_file_name, const wchar_t* bump_map_file_name,
+	                 const TerrainSettings& settings) :
+		settings(settings),
 		terrain_model(nullptr),
+		occluder_step(1),
+		occluder_columns(0),
+		masked_occlusion(256, 128, 1U),
+		occluders_rendered(false),
+		chunk_columns(0),
+		vertex_stride(sizeof(VertexType)),
+		index_format(DXGI_FORMAT_R32_UINT),
 		vertex_buffer(nullptr),
 		index_buffer(nullptr),
+		lod_index_buffer(nullptr),
+		patch_vertex_buffer(nullptr),
+		patch_index_buffer(nullptr),
+		height_texture_resource(nullptr),
+		height_texture(nullptr),
 		diffuse_texture(nullptr),
 		bump_texture(nullptr)
 	{
-        auto result = loadHeightMap(height_map_file_name);
+        // A bake of the same heightmap and settings replaces the whole build, a missing or stale one is rebuilt and rewritten.
+        auto content_hash = hashTerrainSource(height_map_file_name);
+
+        auto result = loadBake(device, content_hash);
+        if(!result)
+        {
+            releaseMesh();
+
+            result = buildTerrain(device, height_map_file_name, content_hash);
+            if(!result)
+                return;
+        }
+
+        if(settings.tiled_ground_queries)
+            tiled_height_map.build(height_map, settings.thread_count);
+
+        result = buildCdlod(device);
+        if(!result)
+            return;
+
+        // Chunk draw calls keep their bounds for good, the CDLOD ones get new ones with every selection.
+        if(cdlod_quadtree.isEmpty())
+        {
+            draw_call_bounds.reserve(chunks.size());
+            for(auto& chunk : chunks)
+                draw_call_bounds.add(chunk.bounds_min, chunk.bounds_max);
+
+            // Horizon blocks of up to 8 quads that tile the chunks.
+            if(settings.horizon_culling && chunks.size() > 1)
+            {
+                auto chunk_quads = chunks.front().width - 1;
+
+                auto block_size = std::min(chunk_quads, 8);
+                while(chunk_quads % block_size != 0)
+                    block_size--;
+
+                horizon_culling.build(height_pyramid, block_size);
+            }
+
+            if(settings.occlusion_culling && chunks.size() > 1)
+                buildOccluderMesh();
+        }
+
+        visible_draw_calls = draw_calls;
+
+        result = loadTextures(device, diffuse_texture_file_name, bump_map_file_name);
         if(!result)
             return;
+	}
+
+    Terrain::~Terrain()
+    {
+        if(bump_texture)
+            bump_texture->Release();
+
+        if(diffuse_texture)
+            diffuse_texture->Release();
+
+        if(height_texture)
+            height_texture->Release();
+
+        if(height_texture_resource)
+            height_texture_resource->Release();
+
+        if(patch_index_buffer)
+            patch_index_buffer->Release();
+
+        if(patch_vertex_buffer)
+            patch_vertex_buffer->Release();
+
+        if(lod_index_buffer)
+            lod_index_buffer->Release();
+
+        if(index_buffer)
+            index_buffer->Release();
+
+        if(vertex_buffer)
+            vertex_buffer->Release();
+
+        if(terrain_model)
+            delete[] terrain_model;
+    }
+
+	void Terrain::render(ID3D11DeviceContext* device_context)
+	{
+        // Edits since the last frame, in the order they were made.
+        auto update_data = buffer_update_data.data();
+        for(auto& update : buffer_updates)
+        {
+            D3D11_BOX box = {update.offset, 0U, 0U, update.offset + update.size, 1U, 1U};
+            device_context->UpdateSubresource(vertex_buffer, 0U, &box, update_data, 0U, 0U);
+
+            update_data += update.size;
+        }
+
+        buffer_updates.clear();
+        buffer_update_data.clear();
+
+        UINT offset = 0U;
+
+        // CDLOD draws every node with the same grid patch.
+        if(patch_vertex_buffer)
+        {
+            UINT patch_stride = sizeof(Vector2D);
+
+            device_context->IASetVertexBuffers(0U, 1U, &patch_vertex_buffer, &patch_stride, &offset);
+            device_context->IASetIndexBuffer(patch_index_buffer, DXGI_FORMAT_R16_UINT, 0U);
+            device_context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+            return;
+        }
+
+        device_context->IASetVertexBuffers(0U, 1U, &vertex_buffer, &vertex_stride, &offset);
+        // With levels of detail every draw call refers to the level of detail index buffer.
+        if(lod_index_buffer)
+            device_context->IASetIndexBuffer(lod_index_buffer, DXGI_FORMAT_R16_UINT, 0U);
+        else
+            device_context->IASetIndexBuffer(index_buffer, index_format, 0U);
+        device_context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	}
+
+
+	int Terrain::getIndexCount()
+	{
+		return index_count;
+	}
+
+
+	ID3D11ShaderResourceView* Terrain::getColorTexture()
+	{
+		return diffuse_texture;
+	}
+
+
+	ID3D11ShaderResourceView* Terrain::getNormalMapTexture()
+	{
+		return bump_texture;
+	}
+
+
+	ID3D11ShaderResourceView* Terrain::getHeightTexture()
+	{
+		return height_texture;
+	}
+
+
+	void Terrain::getGroundHeights(const float* x, const float* z, size_t count, float* heights, Vector3D* normals) const
+	{
+		auto batch_count = static_cast<int>((count + ground_query_batch - 1) / ground_query_batch);
+
+		parallelFor(0, batch_count, settings.thread_count, [&](int first_batch, int last_batch)
+		{
+			auto first = static_cast<size_t>(first_batch) * ground_query_batch;
+			auto last = std::min(static_cast<size_t>(last_batch) * ground_query_batch, count);
+
+			if(!compressed_height_map.isEmpty())
+				sampleHeightField(compressed_height_map, x + first, z + first, last - first, heights + first, normals ? normals + first : nullptr);
+			else if(!tiled_height_map.isEmpty())
+				sampleHeightField(tiled_height_map, x + first, z + first, last - first, heights + first, normals ? normals + first : nullptr);
+			else
+				sampleHeightField(height_map, x + first, z + first, last - first, heights + first, normals ? normals + first : nullptr);
+		});
+	}
+
+
+	bool Terrain::castRay(const Vector3D& origin, const Vector3D& direction, float max_distance, HeightFieldRayHit& hit) const
+	{
+		if(!tiled_height_map.isEmpty())
+			return castHeightFieldRay(height_pyramid, tiled_height_map, origin, direction, max_distance, hit);
+
+		return castHeightFieldRay(height_pyramid, origin, direction, max_distance, hit);
+	}
+
+
+	void Terrain::castRays(const Vector3D* origins, const Vector3D* directions, size_t count, float max_distance, HeightFieldRayHit* hits) const
+	{
+		auto batch_count = static_cast<int>((count + ray_cast_batch - 1) / ray_cast_batch);
+
+		parallelFor(0, batch_count, settings.thread_count, [&](int first_batch, int last_batch)
+		{
+			auto first = static_cast<size_t>(first_batch) * ray_cast_batch;
+			auto last = std::min(static_cast<size_t>(last_batch) * ray_cast_batch, count);
+
+			if(!tiled_height_map.isEmpty())
+				castHeightFieldRays(height_pyramid, tiled_height_map, origins + first, directions + first, last - first, max_distance, hits + first);
+			else
+				castHeightFieldRays(height_pyramid, origins + first, directions + first, last - first, max_distance, hits + first);
+		});
+	}
+
+
+	bool Terrain::editHeights(int x, int z, int width, int height, const float* heights)
+	{
+		if(settings.mesh_type != TerrainMeshType::Indexed || settings.tangent_frames != TerrainTangentFrames::Gradient ||
+		   settings.simplification_error > 0.0f || !cdlod_quadtree.isEmpty() || chunks.empty())
+			return false;
+
+		auto x0 = std::max(x, 0), x1 = std::min(x + width, terrain_width) - 1;
+		auto z0 = std::max(z, 0), z1 = std::min(z + height, terrain_height) - 1;
+		if(x0 > x1 || z0 > z1)
+			return true;
+
+		// The compact format can't hold heights outside the range of the terrain it was built from.
+		auto min_height = -std::numeric_limits<float>::max(), max_height = std::numeric_limits<float>::max();
+		if(settings.vertex_format == TerrainVertexFormat::Compact)
+		{
+			auto& transform = chunks.front().transform;
+			min_height = transform.position_offset.y;
+			max_height = transform.position_offset.y + 65535.0f * transform.position_step.y;
+		}
+
+		for(auto j = z0; j <= z1; j++)
+		{
+			auto source = heights + static_cast<size_t>(j - z) * width;
+			auto row = height_map.getRow(j);
+
+			for(auto i = x0; i <= x1; i++)
+				row[i] = std::min(std::max(source[i - x], min_height), max_height);
+
+			// Onto the steps of the compressed heights, and back inside the range if rounding took them out.
+			if(!compressed_height_map.isEmpty())
+			{
+				auto precision = compressed_height_map.getPrecision();
+
+				for(auto i = x0; i <= x1; i++)
+				{
+					auto quantized = compressed_height_map.quantize(row[i]);
+					if(quantized > max_height)
+						quantized = compressed_height_map.quantize(quantized - precision);
+					else if(quantized < min_height)
+						quantized = compressed_height_map.quantize(quantized + precision);
+
+					row[i] = quantized;
+				}
+			}
+		}
+
+		if(!compressed_height_map.isEmpty())
+			compressed_height_map.update(height_map, x0, z0, x1, z1);
+
+		height_pyramid.update(x0, z0, x1, z1);
+
+		// Frames take central differences, so they change one sample further out.
+		auto frame_x0 = std::max(x0 - 1, 0), frame_x1 = std::min(x1 + 1, terrain_width - 1);
+		auto frame_z0 = std::max(z0 - 1, 0), frame_z1 = std::min(z1 + 1, terrain_height - 1);
+		auto frame_columns = frame_x1 - frame_x0 + 1;
+
+		edit_frames.resize(static_cast<size_t>(frame_columns) * (frame_z1 - frame_z0 + 1));
+
+		for(auto j = frame_z0; j <= frame_z1; j++)
+		{
+			auto frames = edit_frames.data() + static_cast<size_t>(j - frame_z0) * frame_columns;
+			computeHeightFieldFrames(height_map, j, frame_x0, frame_x1 + 1, frames);
+
+			// The packed normals and the model stay what a full build would have made of the new heights.
+			auto packed_normals = height_map.getPackedNormals() + height_map.getIndex(0, j);
+
+			for(auto i = frame_x0; i <= frame_x1; i++)
+			{
+				packed_normals[i] = packNormal(frames[i - frame_x0].normal);
+
+				if(terrain_model)
+				{
+					auto& model = terrain_model[height_map.getIndex(i, j)];
+					model.y = height_map.getHeight(i, j);
+					setFrame(model, frames[i - frame_x0]);
+				}
+			}
+		}
+
+		if(!tiled_height_map.isEmpty())
+			copyHeightField(height_map, tiled_height_map, frame_x0, frame_x1 + 1, frame_z0, frame_z1 + 1);
+
+		// Chunks share their border samples, so a sample on a border belongs to the chunks on both sides.
+		auto chunk_quads = chunks.front().width - 1;
+		auto chunk_rows = static_cast<int>(chunks.size()) / chunk_columns;
+
+		auto forEachChunk([&](int first_x, int first_z, int last_x, int last_z, auto body)
+		{
+			for(auto row = std::max(first_z - 1, 0) / chunk_quads; row <= std::min(last_z / chunk_quads, chunk_rows - 1); row++)
+			{
+				for(auto column = std::max(first_x - 1, 0) / chunk_quads; column <= std::min(last_x / chunk_quads, chunk_columns - 1); column++)
+					body(row * chunk_columns + column);
+			}
+		});
+
+		forEachChunk(frame_x0, frame_z0, frame_x1, frame_z1, [&](int c)
+		{
+			updateVertices(chunks[c], frame_x0, frame_z0, frame_x1, frame_z1);
+		});
+
+		// The bounds and errors only depend on the heights themselves.
+		forEachChunk(x0, z0, x1, z1, [&](int c)
+		{
+			auto& chunk = chunks[c];
+
+			height_pyramid.getRange(chunk.x, chunk.z, chunk.x + chunk.width - 1, chunk.z + chunk.height - 1, chunk.bounds_min.y, chunk.bounds_max.y);
+			draw_call_bounds.set(c, chunk.bounds_min, chunk.bounds_max);
+
+			if(lod_index_buffer)
+			{
+				for(auto level = int(); level < chunk.lod_level_count; level++)
+					chunk.lod_errors[level] = computeGeomipmapError(height_map, chunk.x, chunk.z, chunk.width, chunk.height, level);
+			}
+		});
+
+		horizon_culling.update(height_pyramid, x0, z0, x1, z1);
+
+		if(!occluder_heights.empty())
+		{
+			auto occluder_rows = static_cast<int>(occluder_heights.size()) / occluder_columns;
+
+			updateOccluderHeights(std::max(x0 - 1, 0) / occluder_step, std::min(x1 / occluder_step, occluder_columns - 1),
+			                      std::max(z0 - 1, 0) / occluder_step, std::min(z1 / occluder_step, occluder_rows - 1));
+		}
+
+		return true;
+	}
+
+
+	bool Terrain::buildTerrain(ID3D11Device* device, const wchar_t* height_map_file_name, uint64_t content_hash)
+	{
+        auto result = loadHeightMap(height_map_file_name);
+        if(!result)
+            return false;
 
         reduceHeightMap();
 
-        result = calculateNormals();
-        if(!result)
-            return;
+        // Everything from the normals on is built from the decoded rows, which getGroundHeights answers from.
+        if(settings.ground_height_precision > 0.0f)
+        {
+            compressed_height_map.build(height_map, settings.ground_height_precision, settings.thread_count);
+            if(!compressed_height_map.isComplete())
+                return false;
+
+            compressed_height_map.decode(height_map, settings.thread_count);
+        }
+
+        height_pyramid.build(height_map, settings.thread_count);
+
+        // The closed-form frames are produced by the model build itself, so the normal and tangent passes are skipped.
+        auto per_face_frames = settings.tangent_frames == TerrainTangentFrames::PerFace;
+
+        if(per_face_frames)
+        {
+            result = calculateNormals();
+            if(!result)
+                return false;
+        }
+
+        result = buildTerrainModel();
+        if(!result)
+            return false;
+
+        if(per_face_frames)
+            calculateTerrainVectors();
+
+        buildTerrainChunks();
+
+        std::vector<unsigned char> vertices;
+        buildVertices(vertices);
+
+        // The unindexed model is drawn with an identity index buffer.
+        std::vector<uint32_t> identity_indices;
+        if(settings.mesh_type == TerrainMeshType::Unindexed)
+        {
+            identity_indices.resize(index_count);
+
+            for(auto i = int(); i < index_count; i++)
+                identity_indices[i] = static_cast<uint32_t>(i);
+        }
+
+        auto indices = identity_indices.empty() ? static_cast<const void*>(chunk_indices.data()) : static_cast<const void*>(identity_indices.data());
+
+        result = initializeBuffers(device, vertices.data(), indices);
+        if(!result)
+            return false;
+
+        // Before the bake is written, which keeps the level of detail errors.
+        result = buildLevelsOfDetail(device, true);
+        if(!result)
+            return false;
+
+        // Failing to write the bake only costs the next start its speed.
+        if(!settings.bake_file_name.empty())
+        {
+            TerrainBakeHeader header = {};
+            header.content_hash = content_hash;
+            header.terrain_width = terrain_width;
+            header.terrain_height = terrain_height;
+            header.vertex_stride = vertex_stride;
+            header.vertex_count = static_cast<uint32_t>(vertex_count);
+            header.index_size = static_cast<uint32_t>(getIndexSize());
+            header.index_count = static_cast<uint32_t>(index_count);
+            header.chunk_count = static_cast<uint32_t>(chunks.size());
+            header.vertex_order_count = static_cast<uint32_t>(chunk_vertices.size());
+
+            writeTerrainBake(settings.bake_file_name.c_str(), header, height_map.getHeights(), height_map.getPackedNormals(), chunks.data(),
+                             vertices.data(), indices, chunk_vertices.data());
+        }
+
+        return true;
+	}
+
+	uint64_t Terrain::hashTerrainSource(const wchar_t* height_map_file_name)
+	{
+		if(settings.bake_file_name.empty())
+			return 0U;
+
+		MappedFile file(height_map_file_name);
+		if(!file.isOpen())
+			return 0U;
+
+		// Every setting that changes the baked data, the thread count doesn't.
+		struct
+		{
+			uint32_t version;
+			uint32_t chunk_size;
+			uint32_t mesh_type;
+			uint32_t vertex_format;
+			uint32_t tangent_frames;
+			uint32_t level_of_detail;
+			uint32_t optimize_vertex_cache;
+			float simplification_error;
+			float grid_spacing;
+			float height_scale;
+			float height_reduction;
+			float ground_height_precision;
+			uint32_t chunk_layout_size;
+		} parameters = {terrain_bake_version,
+		                static_cast<uint32_t>(std::max(2, std::min(settings.chunk_size, 256))),
+		                static_cast<uint32_t>(settings.mesh_type),
+		                static_cast<uint32_t>(settings.vertex_format),
+		                static_cast<uint32_t>(settings.tangent_frames),
+		                static_cast<uint32_t>(settings.level_of_detail),
+		                settings.optimize_vertex_cache ? 1U : 0U,
+		                std::max(settings.simplification_error, 0.0f),
+		                grid_spacing,
+		                height_scale,
+		                height_reduction,
+		                std::max(settings.ground_height_precision, 0.0f),
+		                static_cast<uint32_t>(sizeof(TerrainChunk))};
+
+		return hashBytes(&parameters, sizeof(parameters), hashBytes(file.getData(), file.getSize()));
+	}
+
+	bool Terrain::loadBake(ID3D11Device* device, uint64_t content_hash)
+	{
+		if(settings.bake_file_name.empty())
+			return false;
+
+		TerrainBake bake(settings.bake_file_name.c_str(), content_hash);
+		if(!bake.isValid())
+			return false;
+
+		auto& header = bake.getHeader();
+
+		terrain_width = header.terrain_width;
+		terrain_height = header.terrain_height;
+
+		// Only bulk copies, the vertex and index data is uploaded straight from the mapped view.
+		auto samples = terrain_width * terrain_height;
+		height_map.resize(terrain_width, terrain_height, grid_spacing);
+		std::copy(bake.getHeights(), bake.getHeights() + samples, height_map.getHeights());
+		std::copy(bake.getNormals(), bake.getNormals() + samples, height_map.getPackedNormals());
+		height_pyramid.build(height_map, settings.thread_count);
+
+		// The baked heights were decoded from it, so they encode to the same blocks again.
+		if(settings.ground_height_precision > 0.0f)
+		{
+			compressed_height_map.build(height_map, settings.ground_height_precision, settings.thread_count);
+			if(!compressed_height_map.isComplete())
+				return false;
+		}
+
+		chunks.assign(bake.getChunks(), bake.getChunks() + header.chunk_count);
+		chunk_columns = static_cast<int>(std::count_if(chunks.begin(), chunks.end(), [](const TerrainChunk& chunk) { return chunk.z == 0; }));
+		chunk_vertices.assign(bake.getVertexOrder(), bake.getVertexOrder() + header.vertex_order_count);
+
+		draw_calls.clear();
+		for(auto& chunk : chunks)
+			draw_calls.push_back({chunk.index_count, chunk.start_index, static_cast<INT>(chunk.base_vertex), chunk.transform});
+
+		vertex_count = static_cast<int>(header.vertex_count);
+		index_count = static_cast<int>(header.index_count);
+		vertex_stride = header.vertex_stride;
+		index_format = header.index_size == sizeof(uint16_t) ? DXGI_FORMAT_R16_UINT : DXGI_FORMAT_R32_UINT;
+
+		chunk_indices.clear();
+		if(index_format == DXGI_FORMAT_R16_UINT)
+		{
+			auto indices = static_cast<const uint16_t*>(bake.getIndices());
+			chunk_indices.assign(indices, indices + index_count);
+		}
+
+		// The level of detail errors come with the chunks, only the index sets are rebuilt.
+		return initializeBuffers(device, bake.getVertices(), bake.getIndices()) && buildLevelsOfDetail(device, false);
+	}
+
+	void Terrain::releaseMesh()
+	{
+		for(auto buffer : {&vertex_buffer, &index_buffer, &lod_index_buffer})
+		{
+			if(*buffer)
+			{
+				(*buffer)->Release();
+				*buffer = nullptr;
+			}
+		}
+
+		chunks.clear();
+		chunk_indices.clear();
+		chunk_vertices.clear();
+		draw_calls.clear();
+		lod_indices.clear();
+		lod_ranges.clear();
+		compressed_height_map = CompressedHeightField();
+
+		vertex_stride = sizeof(VertexType);
+		index_format = DXGI_FORMAT_R32_UINT;
+	}
+
+	bool Terrain::buildLevelsOfDetail(ID3D11Device* device, bool compute_errors)
+	{
+		if(settings.level_of_detail != TerrainLevelOfDetail::Geomipmapping || settings.mesh_type != TerrainMeshType::Indexed ||
+		   settings.simplification_error > 0.0f)
+			return true;
+
+		lod_indices.clear();
+		lod_ranges.clear();
+
+		// Index sets only depend on the size of a chunk and the order of its vertices, so chunks of the same shape share them.
+		std::vector<int> shape_chunks;
+		std::vector<uint16_t> row_major_indices;
+		std::vector<uint16_t> buffer_positions;
+
+		auto hasSameShape([&](const TerrainChunk& chunk, const TerrainChunk& shape)
+		{
+			if(chunk.width != shape.width || chunk.height != shape.height)
+				return false;
+
+			return chunk_vertices.empty() || std::equal(chunk_vertices.begin() + chunk.base_vertex,
+			                                            chunk_vertices.begin() + chunk.base_vertex + chunk.vertex_count,
+			                                            chunk_vertices.begin() + shape.base_vertex);
+		});
+
+		for(auto c = size_t(); c < chunks.size(); c++)
+		{
+			auto& chunk = chunks[c];
+			chunk.lod_level_count = std::min(getGeomipmapLevelCount(chunk.width, chunk.height), max_terrain_lod_levels);
+
+			auto shape = std::find_if(shape_chunks.begin(), shape_chunks.end(), [&](int s) { return hasSameShape(chunk, chunks[s]); });
+			if(shape != shape_chunks.end())
+			{
+				chunk.lod_ranges = chunks[*shape].lod_ranges;
+				continue;
+			}
+
+			shape_chunks.push_back(static_cast<int>(c));
+			chunk.lod_ranges = static_cast<UINT>(lod_ranges.size());
+
+			// Maps a row-major sample of the chunk to its place in the vertex buffer.
+			buffer_positions.resize(chunk.vertex_count);
+			for(auto v = UINT(); v < chunk.vertex_count; v++)
+				buffer_positions[chunk_vertices.empty() ? v : chunk_vertices[chunk.base_vertex + v]] = static_cast<uint16_t>(v);
+
+			for(auto level = int(); level < chunk.lod_level_count; level++)
+			{
+				for(auto edges = 0U; edges < geomipmap_variant_count; edges++)
+				{
+					auto start_index = static_cast<UINT>(lod_indices.size());
+
+					// Unstitched full resolution is the chunk's own, already cache optimized, index list.
+					if(level == 0 && edges == 0U)
+					{
+						lod_indices.insert(lod_indices.end(), chunk_indices.begin() + chunk.start_index,
+						                   chunk_indices.begin() + chunk.start_index + chunk.index_count);
+					}
+					else
+					{
+						row_major_indices.clear();
+						buildGeomipmapIndices(chunk.width, chunk.height, level, edges, row_major_indices);
+
+						for(auto index : row_major_indices)
+							lod_indices.push_back(buffer_positions[index]);
+					}
+
+					lod_ranges.push_back({start_index, static_cast<UINT>(lod_indices.size()) - start_index});
+				}
+			}
+		}
+
+		if(compute_errors)
+		{
+			parallelFor(0, static_cast<int>(chunks.size()), settings.thread_count, [&](int first_chunk, int last_chunk)
+			{
+				for(auto c = first_chunk; c < last_chunk; c++)
+				{
+					auto& chunk = chunks[c];
+
+					for(auto level = int(); level < chunk.lod_level_count; level++)
+						chunk.lod_errors[level] = computeGeomipmapError(height_map, chunk.x, chunk.z, chunk.width, chunk.height, level);
+				}
+			});
+		}
+
+		D3D11_BUFFER_DESC index_buffer_desc;
+		index_buffer_desc.Usage = D3D11_USAGE_DEFAULT;
+		index_buffer_desc.ByteWidth = static_cast<UINT>(sizeof(uint16_t) * lod_indices.size());
+		index_buffer_desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+		index_buffer_desc.CPUAccessFlags = 0U;
+		index_buffer_desc.MiscFlags = 0U;
+		index_buffer_desc.StructureByteStride = 0U;
+
+		D3D11_SUBRESOURCE_DATA index_data;
+		index_data.pSysMem = lod_indices.data();
+		index_data.SysMemPitch = 0U;
+		index_data.SysMemSlicePitch = 0U;
+
+		auto result = device->CreateBuffer(&index_buffer_desc, &index_data, &lod_index_buffer);
+		if(FAILED(result))
+			return false;
+
+		// Full resolution until the first selection.
+		lod_levels.assign(chunks.size(), 0);
+		updateLodDrawCalls();
+
+		return true;
+	}
+
+	void Terrain::selectLevelsOfDetail(const Vector& camera_position, const Matrix& projection, float viewport_height, float max_pixel_error)
+	{
+		if(!lod_index_buffer && cdlod_quadtree.isEmpty())
+			return;
+
+		Vector3D position;
+		DirectX::XMStoreFloat3(&position, camera_position);
+
+		// The second diagonal element of the projection is 1 / tan(fov / 2).
+		auto error_scale = 0.5f * viewport_height * DirectX::XMVectorGetY(projection.r[1]);
+
+		if(!cdlod_quadtree.isEmpty())
+		{
+			cdlod_quadtree.select(position, error_scale, max_pixel_error, cdlod_records);
+			updateCdlodDrawCalls();
+
+			return;
+		}
+
+		selectGeomipmapLevels(chunks, chunk_columns, position, error_scale, max_pixel_error, lod_levels);
+		updateLodDrawCalls();
+	}
+
+	void Terrain::cullDrawCalls(const Frustum& frustum, const Vector& camera_position, const Matrix& view_projection)
+	{
+		cullBoundingBoxes(frustum, draw_call_bounds, visible_indices);
+		occluders_rendered = false;
+
+		Vector3D position;
+		XMStoreFloat3(&position, camera_position);
+
+		// Occlusion culling works on the chunk grid, the CDLOD nodes aren't one, and only for a camera above the ground.
+		if((!horizon_culling.isEmpty() || !occluder_heights.empty()) && !isBelowGround(position))
+		{
+			auto errors = updateChunkErrors();
+
+			if(!horizon_culling.isEmpty())
+				horizon_culling.cull(position, chunks.front().width - 1, chunk_columns, errors, visible_indices);
+
+			if(!occluder_heights.empty())
+			{
+				// Pixels of the occlusion buffer per unit across at a unit distance, the larger of the two axes.
+				DirectX::XMFLOAT4X4 m;
+				XMStoreFloat4x4(&m, view_projection);
+
+				auto pixel_scale = 0.5f * std::max(static_cast<float>(masked_occlusion.getWidth()) * std::sqrt(m.m[0][0] * m.m[0][0] + m.m[1][0] * m.m[1][0] + m.m[2][0] * m.m[2][0]),
+				                                   static_cast<float>(masked_occlusion.getHeight()) * std::sqrt(m.m[0][1] * m.m[0][1] + m.m[1][1] * m.m[1][1] + m.m[2][1] * m.m[2][1]));
+
+				updateOccluderMesh(frustum, pixel_scale, errors, position);
+
+				masked_occlusion.clear(view_projection);
+				masked_occlusion.renderOccluders(occluder_vertices.data(), occluder_vertices.size(), occluder_indices.data(), occluder_indices.size() / 3);
+				masked_occlusion.cullBoundingBoxes(draw_call_bounds, visible_indices);
+				occluders_rendered = true;
+			}
+		}
+
+		visible_draw_calls.clear();
+		for(auto index : visible_indices)
+			visible_draw_calls.push_back(draw_calls[index]);
+	}
+
+	bool Terrain::isObjectVisible(const Vector3D& bounds_min, const Vector3D& bounds_max) const
+	{
+		return !occluders_rendered || masked_occlusion.isBoxVisible(bounds_min, bounds_max);
+	}
+
+	size_t Terrain::cullObjects(const BoundingBoxes& bounds, std::vector<uint32_t>& visible)
+	{
+		return occluders_rendered ? masked_occlusion.cullBoundingBoxes(bounds, visible) : visible.size();
+	}
+
+	bool Terrain::isBelowGround(const Vector3D& position) const
+	{
+		// Off the terrain the clamped ground height doesn't mean anything.
+		if(position.x < height_map.getX(0) || position.x > height_map.getX(terrain_width - 1) ||
+		   position.z < height_map.getZ(0) || position.z > height_map.getZ(terrain_height - 1))
+			return false;
+
+		float ground_height;
+		getGroundHeights(&position.x, &position.z, 1U, &ground_height);
+
+		return position.y < ground_height;
+	}
+
+	const float* Terrain::updateChunkErrors()
+	{
+		// Coarser levels and the simplified mesh leave the heightmap samples by up to their error.
+		if(lod_levels.size() != chunks.size() && settings.simplification_error <= 0.0f)
+			return nullptr;
+
+		chunk_errors.resize(chunks.size());
+		for(size_t c = 0; c < chunks.size(); c++)
+		{
+			// A stitched edge follows the next coarser level.
+			auto& chunk = chunks[c];
+			auto level = lod_levels.size() == chunks.size() ? std::min(lod_levels[c] + 1, chunk.lod_level_count - 1) : 0;
+
+			chunk_errors[c] = settings.simplification_error + (level > 0 ? chunk.lod_errors[level] : 0.0f);
+		}
+
+		return chunk_errors.data();
+	}
+
+	void Terrain::buildOccluderMesh()
+	{
+		// Four cells per chunk side, each a flat quad at its lowest sample with walls down to its lower neighbours: never
+		// above the terrain, and much closer to it than a mesh whose vertices have to be below every cell around them.
+		occluder_step = std::max((chunks.front().width - 1) / 4, 1);
+		occluder_columns = (terrain_width - 2) / occluder_step + 1;
+
+		auto occluder_rows = (terrain_height - 2) / occluder_step + 1;
+
+		occluder_heights.resize(occluder_columns * occluder_rows);
+		updateOccluderHeights(0, occluder_columns - 1, 0, occluder_rows - 1);
+
+		// The top, the wall towards the next column and the one towards the next row of every cell, as quads.
+		occluder_levels.resize(occluder_heights.size());
+		occluder_vertices.reserve(occluder_heights.size() * occluder_cell_quads * 4);
+		occluder_indices.reserve(occluder_heights.size() * occluder_cell_quads * 6);
+	}
+
+	void Terrain::updateOccluderHeights(int first_column, int last_column, int first_row, int last_row)
+	{
+		for(auto row = first_row; row <= last_row; row++)
+		{
+			for(auto column = first_column; column <= last_column; column++)
+			{
+				auto x = column * occluder_step;
+				auto z = row * occluder_step;
+
+				float min_height, max_height;
+				height_pyramid.getRange(x, z, x + occluder_step, z + occluder_step, min_height, max_height);
+
+				occluder_heights[row * occluder_columns + column] = min_height;
+			}
+		}
+	}
+
+	void Terrain::updateOccluderMesh(const Frustum& frustum, float pixel_scale, const float* errors, const Vector3D& camera_position)
+	{
+		auto chunk_quads = chunks.front().width - 1;
+		auto chunk_rows = static_cast<int>(chunks.size()) / chunk_columns;
+		auto occluder_rows = static_cast<int>(occluder_heights.size()) / occluder_columns;
+
+		auto getSample([&](int cell, int sample_count) { return std::min(cell * occluder_step, sample_count - 1); });
+
+		auto min_level = std::numeric_limits<float>::max(), max_level = -min_level;
+
+		// Every cell is lowered by the largest error of the chunks that share its samples, borders included.
+		for(auto row = 0; row < occluder_rows; row++)
+		{
+			auto first_chunk_row = std::max(getSample(row, terrain_height) - 1, 0) / chunk_quads;
+			auto last_chunk_row = std::min(getSample(row + 1, terrain_height) / chunk_quads, chunk_rows - 1);
+
+			for(auto column = 0; column < occluder_columns; column++)
+			{
+				auto first_chunk_column = std::max(getSample(column, terrain_width) - 1, 0) / chunk_quads;
+				auto last_chunk_column = std::min(getSample(column + 1, terrain_width) / chunk_quads, chunk_columns - 1);
+
+				auto error = 0.0f;
+				for(auto chunk_row = first_chunk_row; errors && chunk_row <= last_chunk_row; chunk_row++)
+					for(auto chunk_column = first_chunk_column; chunk_column <= last_chunk_column; chunk_column++)
+						error = std::max(error, errors[chunk_row * chunk_columns + chunk_column]);
+
+				auto cell = row * occluder_columns + column;
+				occluder_levels[cell] = occluder_heights[cell] - error;
+
+				min_level = std::min(min_level, occluder_levels[cell]);
+				max_level = std::max(max_level, occluder_levels[cell]);
+			}
+		}
+
+		occluder_vertices.clear();
+		occluder_indices.clear();
+
+		// A cell ring cells away is at least ring - 1 cells from the camera. Far cells are seen nearly edge on: a top
+		// thinner than a pixel from there, or a wall lower than one, is left out, as it would hardly cover a pixel center
+		// and the rasterizer would drop most of its triangles anyway.
+		auto cell_size = height_map.getSpacing() * static_cast<float>(occluder_step);
+
+		auto addCell([&](int column, int row, int ring)
+		{
+			auto z0 = height_map.getZ(getSample(row, terrain_height)), z1 = height_map.getZ(getSample(row + 1, terrain_height));
+			auto x0 = height_map.getX(getSample(column, terrain_width)), x1 = height_map.getX(getSample(column + 1, terrain_width));
+
+			auto cell = row * occluder_columns + column;
+			auto level = occluder_levels[cell];
+
+			// A wall between two cells stands on the shared edge, where the terrain is above both levels.
+			auto next_column = column + 1 < occluder_columns ? occluder_levels[cell + 1] : level;
+			auto next_row = row + 1 < occluder_rows ? occluder_levels[cell + occluder_columns] : level;
+
+			auto distance = static_cast<float>(std::max(ring - 1, 0)) * cell_size;
+
+			bool quads[occluder_cell_quads] =
+			{
+				pixel_scale * cell_size * std::fabs(camera_position.y - level) >= distance * distance,
+				next_column != level && pixel_scale * std::fabs(next_column - level) >= distance,
+				next_row != level && pixel_scale * std::fabs(next_row - level) >= distance
+			};
+
+			if(!(quads[0] || quads[1] || quads[2]))
+				return;
+
+			if(!isBoxInFrustum(frustum, Vector3D(x0, std::min({level, next_column, next_row}), z0), Vector3D(x1, std::max({level, next_column, next_row}), z1)))
+				return;
+
+			const Vector3D corners[occluder_cell_quads][4] =
+			{
+				{Vector3D(x0, level, z0), Vector3D(x1, level, z0), Vector3D(x1, level, z1), Vector3D(x0, level, z1)},
+
+				{Vector3D(x1, std::min(level, next_column), z0), Vector3D(x1, std::max(level, next_column), z0),
+				 Vector3D(x1, std::max(level, next_column), z1), Vector3D(x1, std::min(level, next_column), z1)},
+
+				{Vector3D(x0, std::min(level, next_row), z1), Vector3D(x0, std::max(level, next_row), z1),
+				 Vector3D(x1, std::max(level, next_row), z1), Vector3D(x1, std::min(level, next_row), z1)}
+			};
+
+			for(auto quad = 0U; quad < occluder_cell_quads; quad++)
+			{
+				if(!quads[quad])
+					continue;
+
+				auto v = static_cast<uint32_t>(occluder_vertices.size());
+
+				occluder_vertices.insert(occluder_vertices.end(), std::begin(corners[quad]), std::end(corners[quad]));
+				occluder_indices.insert(occluder_indices.end(), {v, v + 1U, v + 2U, v, v + 2U, v + 3U});
+			}
+		});
+
+		// The rasterizer keeps the most of what it is given front to back: rings of cells around the camera's cell, as
+		// in HorizonCulling, give that order without sorting the cells every frame.
+		auto getCameraCell([&](float position, int cell_count)
+		{
+			auto cell = position / cell_size;
+			return static_cast<int>(std::min(std::max(cell, 0.0f), static_cast<float>(cell_count - 1)));
+		});
+
+		auto camera_column = getCameraCell(camera_position.x, occluder_columns);
+		auto camera_row = getCameraCell(camera_position.z, occluder_rows);
+
+		auto ring_count = std::max(std::max(camera_column, occluder_columns - 1 - camera_column), std::max(camera_row, occluder_rows - 1 - camera_row));
+
+		// Past the rings where neither a top nor the highest wall can reach a pixel.
+		auto top_distance = std::sqrt(pixel_scale * cell_size * std::max(std::fabs(camera_position.y - min_level), std::fabs(camera_position.y - max_level)));
+		auto wall_distance = pixel_scale * (max_level - min_level);
+		ring_count = std::min(ring_count, static_cast<int>(std::min(std::max(top_distance, wall_distance) / cell_size, 1e6f)) + 1);
+
+		for(auto ring = 0; ring <= ring_count; ring++)
+		{
+			for(auto minor = 0; minor <= ring; minor++)
+			{
+				for(auto major_x : {true, false})
+				{
+					// The diagonal cells come up once.
+					if(!major_x && minor == ring)
+						continue;
+
+					for(auto sign_x : {1, -1})
+					{
+						for(auto sign_z : {1, -1})
+						{
+							auto x = sign_x * (major_x ? ring : minor);
+							auto z = sign_z * (major_x ? minor : ring);
+
+							if((x == 0 && sign_x < 0) || (z == 0 && sign_z < 0))
+								continue;
+
+							auto column = camera_column + x, row = camera_row + z;
+							if(column >= 0 && column < occluder_columns && row >= 0 && row < occluder_rows)
+								addCell(column, row, ring);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	void Terrain::updateLodDrawCalls()
+	{
+		draw_calls.resize(chunks.size());
+
+		for(auto c = size_t(); c < chunks.size(); c++)
+		{
+			auto& chunk = chunks[c];
+			auto edges = getGeomipmapStitching(lod_levels, chunk_columns, static_cast<int>(c));
+			auto& range = lod_ranges[chunk.lod_ranges + lod_levels[c] * geomipmap_variant_count + edges];
+
+			draw_calls[c] = {range.index_count, range.start_index, static_cast<INT>(chunk.base_vertex), chunk.transform};
+		}
+	}
+
+	bool Terrain::buildCdlod(ID3D11Device* device)
+	{
+		if(settings.level_of_detail != TerrainLevelOfDetail::Cdlod)
+			return true;
+
+		cdlod_quadtree.build(height_map, cdlod_patch_size, settings.thread_count);
+
+		// The patch is a regular grid of cdlod_patch_size quads with its triangles grouped by quadrant, so that any run of
+		// consecutive quadrants of a node is a single range. All quads share the diagonal of the heightmap triangulation,
+		// which lets a fully morphed 2x2 block collapse into exactly one quad of the next level.
+		auto patch_vertices = cdlod_patch_size + 1;
+		auto half_size = cdlod_patch_size / 2;
+
+		std::vector<Vector2D> vertices;
+		vertices.reserve(patch_vertices * patch_vertices);
+
+		for(auto j = int(); j < patch_vertices; j++)
+			for(auto i = int(); i < patch_vertices; i++)
+				vertices.emplace_back(static_cast<float>(i), static_cast<float>(j));
+
+		std::vector<uint16_t> indices;
+		indices.reserve(cdlod_patch_size * cdlod_patch_size * 6);
+
+		for(auto quadrant = int(); quadrant < 4; quadrant++)
+		{
+			auto first_i = (quadrant & 1) * half_size;
+			auto first_j = (quadrant >> 1) * half_size;
+
+			for(auto j = first_j; j < first_j + half_size; j++)
+			{
+				for(auto i = first_i; i < first_i + half_size; i++)
+				{
+					auto bottom_left = static_cast<uint16_t>(patch_vertices * j + i);
+					auto bottom_right = static_cast<uint16_t>(bottom_left + 1);
+					auto upper_left = static_cast<uint16_t>(bottom_left + patch_vertices);
+					auto upper_right = static_cast<uint16_t>(upper_left + 1);
+
+					indices.insert(indices.end(), {upper_left, upper_right, bottom_left, bottom_left, upper_right, bottom_right});
+				}
+			}
+		}
+
+		D3D11_BUFFER_DESC buffer_desc;
+		buffer_desc.Usage = D3D11_USAGE_IMMUTABLE;
+		buffer_desc.ByteWidth = static_cast<UINT>(sizeof(Vector2D) * vertices.size());
+		buffer_desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+		buffer_desc.CPUAccessFlags = 0U;
+		buffer_desc.MiscFlags = 0U;
+		buffer_desc.StructureByteStride = 0U;
+
+		D3D11_SUBRESOURCE_DATA buffer_data;
+		buffer_data.pSysMem = vertices.data();
+		buffer_data.SysMemPitch = 0U;
+		buffer_data.SysMemSlicePitch = 0U;
+
+		auto result = device->CreateBuffer(&buffer_desc, &buffer_data, &patch_vertex_buffer);
+		if(FAILED(result))
+			return false;
+
+		buffer_desc.ByteWidth = static_cast<UINT>(sizeof(uint16_t) * indices.size());
+		buffer_desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+		buffer_data.pSysMem = indices.data();
+
+		result = device->CreateBuffer(&buffer_desc, &buffer_data, &patch_index_buffer);
+		if(FAILED(result))
+			return false;
+
+		// Heights are fetched by the vertex shader, unfiltered, one texel per sample.
+		D3D11_TEXTURE2D_DESC texture_desc;
+		texture_desc.Width = static_cast<UINT>(terrain_width);
+		texture_desc.Height = static_cast<UINT>(terrain_height);
+		texture_desc.MipLevels = 1U;
+		texture_desc.ArraySize = 1U;
+		texture_desc.Format = DXGI_FORMAT_R32_FLOAT;
+		texture_desc.SampleDesc.Count = 1U;
+		texture_desc.SampleDesc.Quality = 0U;
+		texture_desc.Usage = D3D11_USAGE_IMMUTABLE;
+		texture_desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+		texture_desc.CPUAccessFlags = 0U;
+		texture_desc.MiscFlags = 0U;
+
+		D3D11_SUBRESOURCE_DATA texture_data;
+		texture_data.pSysMem = height_map.getHeights();
+		texture_data.SysMemPitch = static_cast<UINT>(sizeof(float) * terrain_width);
+		texture_data.SysMemSlicePitch = 0U;
+
+		result = device->CreateTexture2D(&texture_desc, &texture_data, &height_texture_resource);
+		if(FAILED(result))
+			return false;
+
+		D3D11_SHADER_RESOURCE_VIEW_DESC view_desc;
+		view_desc.Format = DXGI_FORMAT_R32_FLOAT;
+		view_desc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+		view_desc.Texture2D.MostDetailedMip = 0U;
+		view_desc.Texture2D.MipLevels = 1U;
+
+		result = device->CreateShaderResourceView(height_texture_resource, &view_desc, &height_texture);
+		if(FAILED(result))
+			return false;
+
+		// The chunk draw calls don't apply to the patches, nothing is drawn until the first selection.
+		cdlod_records.clear();
+		draw_calls.clear();
+
+		return true;
+	}
+
+	void Terrain::updateCdlodDrawCalls()
+	{
+		draw_calls.clear();
+		draw_call_bounds.clear();
+
+		auto quadrant_index_count = static_cast<UINT>(cdlod_patch_size * cdlod_patch_size / 4 * 6);
 
-        result = buildTerrainModel();
-        if(!result)
-            return;
+		for(auto& record : cdlod_records)
+		{
+			TerrainPatchTransform patch;
+			patch.x = static_cast<float>(cdlod_quadtree.getNodeX(record.level, record.node));
+			patch.z = static_cast<float>(cdlod_quadtree.getNodeZ(record.level, record.node));
+			patch.step = static_cast<float>(1 << record.level);
+			patch.spacing = height_map.getSpacing();
+			patch.morph_start = record.morph_start;
+			patch.morph_end = record.morph_end;
+
+			Vector3D bounds_min, bounds_max;
+			cdlod_quadtree.getNodeBounds(record.level, record.node, bounds_min, bounds_max);
+
+			// Runs of consecutive quadrants are contiguous in the patch index buffer and share a draw call.
+			for(auto quadrant = 0U; quadrant < 4U;)
+			{
+				if(!(record.quadrants & (1U << quadrant)))
+				{
+					quadrant++;
+					continue;
+				}
 
-        calculateTerrainVectors();
+				auto first_quadrant = quadrant;
+				while(quadrant < 4U && (record.quadrants & (1U << quadrant)))
+					quadrant++;
 
-        result = initializeBuffers(device);
-        if(!result)
-            return;
+				draw_calls.push_back({(quadrant - first_quadrant) * quadrant_index_count, first_quadrant * quadrant_index_count, 0, {}, patch});
+				draw_call_bounds.add(bounds_min, bounds_max);
+			}
+		}
+	}
 
-        result = loadTextures(device, diffuse_texture_file_name, bump_map_file_name);
-        if(!result)
-            return;
+	size_t Terrain::getIndexSize() const
+	{
+		return index_format == DXGI_FORMAT_R16_UINT ? sizeof(uint16_t) : sizeof(uint32_t);
 	}
 
-    Terrain::~Terrain()
-    {
-        if(bump_texture)
-            bump_texture->Release();
 
-        if(diffuse_texture)
-            diffuse_texture->Release();
+	bool Terrain::loadHeightMap(const wchar_t* file_name)
+	{
+		// Compressed heightmaps are decoded tile by tile straight into the height plane.
+		CompressedHeightFile compressed_file(file_name);
+		if(compressed_file.isValid())
+		{
+			terrain_width = compressed_file.getWidth();
+			terrain_height = compressed_file.getHeight();
 
-        if(index_buffer)
-            index_buffer->Release();
+			height_map.resize(terrain_width, terrain_height, grid_spacing);
 
-        if(vertex_buffer)
-            vertex_buffer->Release();
+			return compressed_file.decode(height_scale, height_map.getHeights(), settings.thread_count);
+		}
 
-        if(terrain_model)
-            delete[] terrain_model;
+		// The bitmap is mapped instead of read, so no full-size copy of the image is ever made.
+		MappedFile file(file_name);
+		if(!file.isOpen())
+			return false;
 
-        if(height_map)
-            delete[] height_map;
-    }
+		BitmapInfo bitmap_info;
+		if(!readBitmapInfo(file.getData(), file.getSize(), bitmap_info))
+			return false;
 
-	void Terrain::render(ID3D11DeviceContext* device_context)
-	{
-        UINT stride = sizeof(VertexType);
-        UINT offset = 0U;
+		terrain_width = bitmap_info.width;
+		terrain_height = bitmap_info.height;
 
-        device_context->IASetVertexBuffers(0U, 1U, &vertex_buffer, &stride, &offset);
-        device_context->IASetIndexBuffer(index_buffer, DXGI_FORMAT_R32_UINT, 0U);
-        device_context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-	}
+		height_map.resize(terrain_width, terrain_height, grid_spacing);
 
+		// Decode the image one row at a time straight from the mapped view into the height plane.
+		for(auto j = int(); j < terrain_height; j++)
+			decodeBitmapRow(getBitmapRow(file.getData(), bitmap_info, j), terrain_width, height_scale, height_map.getRow(j));
 
-	int Terrain::getIndexCount()
-	{
-		return index_count;
+		return true;
 	}
 
-
-	ID3D11ShaderResourceView* Terrain::getColorTexture()
+	void Terrain::reduceHeightMap()
 	{
-		return diffuse_texture;
+		auto heights = height_map.getHeights();
+
+		parallelFor(0, terrain_width * terrain_height, settings.thread_count, [&](int first, int last)
+		{
+			for(auto i = first; i < last; i++)
+				heights[i] /= height_reduction;
+		});
 	}
 
 
-	ID3D11ShaderResourceView* Terrain::getNormalMapTexture()
+	bool Terrain::calculateNormals()
 	{
-		return bump_texture;
+		// Every row only reads the heights around it and writes its own normals, so the rows are split into bands.
+		parallelFor(0, terrain_height, settings.thread_count, [&](int first_row, int last_row)
+		{
+			computeHeightFieldNormals(height_map, first_row, last_row);
+		});
+
+		return true;
 	}
 
 
-	bool Terrain::loadHeightMap(const wchar_t* file_name)
+	bool Terrain::buildTerrainModel()
 	{
-		FILE* filePtr = nullptr;
-		auto error = _wfopen_s(&filePtr, file_name, L"rb");
-		if(error != 0)
-			return false;
+		if(settings.mesh_type == TerrainMeshType::Indexed)
+			return buildIndexedTerrainModel();
 
-		BITMAPFILEHEADER bitmap_file_header;
-		auto count = fread(&bitmap_file_header, sizeof(BITMAPFILEHEADER), 1, filePtr);
-		if(count != 1)
-			return false;
+		vertex_count = (terrain_width - 1) * (terrain_height - 1) * 6;
 
-		BITMAPINFOHEADER bitmap_info_header;
-		count = fread(&bitmap_info_header, sizeof(BITMAPINFOHEADER), 1, filePtr);
-		if(count != 1)
+		terrain_model = new ModelType[vertex_count];
+		if(!terrain_model)
 			return false;
 
-		terrain_width = bitmap_info_header.biWidth;
-		terrain_height = bitmap_info_header.biHeight;
+		auto heights = height_map.getHeights();
+		auto packed_normals = height_map.getPackedNormals();
+		auto gradient_frames = settings.tangent_frames == TerrainTangentFrames::Gradient;
 
-		auto imageSize = terrain_width * terrain_height * 3;
+		// Copies one height field sample into the model, positions are synthesized from the grid.
+		// With gradient frames the normal is set together with the tangent and binormal instead.
+		auto copySample([&](ModelType& model, int i, int j, float tu, float tv)
+		{
+			auto sample = height_map.getIndex(i, j);
 
-		auto bitmap_image = new unsigned char[imageSize];
-		if(!bitmap_image)
-			return false;
+			model.x = height_map.getX(i);
+			model.y = heights[sample];
+			model.z = height_map.getZ(j);
+			model.tu = tu;
+			model.tv = tv;
 
-		fseek(filePtr, bitmap_file_header.bfOffBits, SEEK_SET);
+			if(!gradient_frames)
+			{
+				auto normal = unpackNormal(packed_normals[sample]);
 
-		count = fread(bitmap_image, 1, imageSize, filePtr);
-		if(static_cast<decltype(imageSize)>(count) != imageSize)
-			return false;
+				model.nx = normal.x;
+				model.ny = normal.y;
+				model.nz = normal.z;
+			}
+		});
 
-		error = fclose(filePtr);
-		if(error != 0)
-			return false;
+		// Each row of quads owns a fixed range of six vertices per quad.
+		parallelFor(0, terrain_height - 1, settings.thread_count, [&](int first_row, int last_row)
+		{
+			// Frames of the bottom and the top row of the current row of quads.
+			std::vector<HeightFieldFrame> bottom_frames, top_frames;
+			if(gradient_frames)
+			{
+				bottom_frames.resize(terrain_width);
+				top_frames.resize(terrain_width);
 
-		height_map = new HeightMapType[terrain_width * terrain_height];
-		if(!height_map)
-			return false;
+				computeHeightFieldFrames(height_map, first_row, bottom_frames.data());
+			}
 
-		// Initialize the position in the image data buffer.
-		// Read the image data into the height map.
-		for(auto j = int(), k = int(); j < terrain_height; j++)
-		{
-			for(auto i = int(); i < terrain_width; i++)
+			for(auto j = first_row; j < last_row; j++)
 			{
-				auto height = bitmap_image[k];
+				auto index = j * (terrain_width - 1) * 6;
+
+				if(gradient_frames)
+				{
+					computeHeightFieldFrames(height_map, j + 1, top_frames.data());
 
-				auto index = (terrain_width * j) + i;
+					// Each band packs the normals of the rows it starts quads on, the last band the top row as well.
+					storeFrameNormals(j, bottom_frames.data());
+					if(j + 1 == terrain_height - 1)
+						storeFrameNormals(j + 1, top_frames.data());
+				}
 
-				height_map[index].x = (float)i * 32;
-				height_map[index].y = (float)height * 8;
-				height_map[index].z = (float)j * 32;
+				for(auto i = int(); i < (terrain_width - 1); i++)
+				{
+					copySample(terrain_model[index++], i, j + 1, 0.0f, 0.0f);     // Upper left.
+					copySample(terrain_model[index++], i + 1, j + 1, 1.0f, 0.0f); // Upper right.
+					copySample(terrain_model[index++], i, j, 0.0f, 1.0f);         // Bottom left.
+
+					copySample(terrain_model[index++], i, j, 0.0f, 1.0f);         // Bottom left.
+					copySample(terrain_model[index++], i + 1, j + 1, 1.0f, 0.0f); // Upper right.
+					copySample(terrain_model[index++], i + 1, j, 1.0f, 1.0f);     // Bottom right.
+
+					if(gradient_frames)
+					{
+						auto quad = terrain_model + index - 6;
+
+						setFrame(quad[0], top_frames[i]);
+						setFrame(quad[1], top_frames[i + 1]);
+						setFrame(quad[2], bottom_frames[i]);
+						setFrame(quad[3], bottom_frames[i]);
+						setFrame(quad[4], top_frames[i + 1]);
+						setFrame(quad[5], bottom_frames[i + 1]);
+					}
+				}
 
-				k += 3;
+				std::swap(bottom_frames, top_frames);
 			}
-		}
+		});
+
+		return true;
+	}
+
+	bool Terrain::buildIndexedTerrainModel()
+	{
+		vertex_count = terrain_width * terrain_height;
+
+		terrain_model = new ModelType[vertex_count];
+		if(!terrain_model)
+			return false;
+
+		auto heights = height_map.getHeights();
+		auto packed_normals = height_map.getPackedNormals();
+		auto gradient_frames = settings.tangent_frames == TerrainTangentFrames::Gradient;
+
+		// One vertex per sample. The texture still repeats once per quad, so the coordinates simply count quads;
+		// V runs against Z to keep the orientation of the unindexed model.
+		parallelFor(0, terrain_height, settings.thread_count, [&](int first_row, int last_row)
+		{
+			std::vector<HeightFieldFrame> frames(gradient_frames ? terrain_width : 0);
+
+			for(auto j = first_row; j < last_row; j++)
+			{
+				if(gradient_frames)
+				{
+					computeHeightFieldFrames(height_map, j, frames.data());
+					storeFrameNormals(j, frames.data());
+				}
 
-		delete[] bitmap_image;
+				for(auto i = int(); i < terrain_width; i++)
+				{
+					auto index = height_map.getIndex(i, j);
+
+					auto& model = terrain_model[index];
+					model.x = height_map.getX(i);
+					model.y = heights[index];
+					model.z = height_map.getZ(j);
+					model.tu = static_cast<float>(i);
+					model.tv = static_cast<float>(terrain_height - 1 - j);
+
+					if(gradient_frames)
+					{
+						setFrame(model, frames[i]);
+						continue;
+					}
+
+					auto normal = unpackNormal(packed_normals[index]);
+					model.nx = normal.x;
+					model.ny = normal.y;
+					model.nz = normal.z;
+				}
+			}
+		});
 
 		return true;
 	}
 
-	void Terrain::reduceHeightMap()
+	void Terrain::calculateTerrainVectors()
 	{
-		for(auto j = int(); j < terrain_height; j++)
+		if(settings.mesh_type == TerrainMeshType::Indexed)
 		{
-			for(auto i = int(); i < terrain_width; i++)
-				height_map[(terrain_width * j) + i].y /= 15.0f;
+			calculateIndexedTerrainVectors();
+			return;
 		}
+
+		auto faceCount = vertex_count / 3;
+
+		// Faces don't share model vertices, so any band of faces can be processed on its own.
+		parallelFor(0, faceCount, settings.thread_count, [&](int first_face, int last_face)
+		{
+			TempVertexType vertex1, vertex2, vertex3;
+			VectorType tangent, binormal;
+
+			auto index = first_face * 3;
+			for(auto i = first_face; i < last_face; i++)
+			{
+				// Get the three vertices for this face from the terrain model.
+				vertex1.x = terrain_model[index].x;
+				vertex1.y = terrain_model[index].y;
+				vertex1.z = terrain_model[index].z;
+				vertex1.tu = terrain_model[index].tu;
+				vertex1.tv = terrain_model[index].tv;
+				vertex1.nx = terrain_model[index].nx;
+				vertex1.ny = terrain_model[index].ny;
+				vertex1.nz = terrain_model[index].nz;
+				index++;
+
+				vertex2.x = terrain_model[index].x;
+				vertex2.y = terrain_model[index].y;
+				vertex2.z = terrain_model[index].z;
+				vertex2.tu = terrain_model[index].tu;
+				vertex2.tv = terrain_model[index].tv;
+				vertex2.nx = terrain_model[index].nx;
+				vertex2.ny = terrain_model[index].ny;
+				vertex2.nz = terrain_model[index].nz;
+				index++;
+
+				vertex3.x = terrain_model[index].x;
+				vertex3.y = terrain_model[index].y;
+				vertex3.z = terrain_model[index].z;
+				vertex3.tu = terrain_model[index].tu;
+				vertex3.tv = terrain_model[index].tv;
+				vertex3.nx = terrain_model[index].nx;
+				vertex3.ny = terrain_model[index].ny;
+				vertex3.nz = terrain_model[index].nz;
+				index++;
+
+				calculateTangentBinormal(vertex1, vertex2, vertex3, tangent, binormal);
+
+				terrain_model[index - 1].tx = tangent.x;
+				terrain_model[index - 1].ty = tangent.y;
+				terrain_model[index - 1].tz = tangent.z;
+				terrain_model[index - 1].bx = binormal.x;
+				terrain_model[index - 1].by = binormal.y;
+				terrain_model[index - 1].bz = binormal.z;
+
+				terrain_model[index - 2].tx = tangent.x;
+				terrain_model[index - 2].ty = tangent.y;
+				terrain_model[index - 2].tz = tangent.z;
+				terrain_model[index - 2].bx = binormal.x;
+				terrain_model[index - 2].by = binormal.y;
+				terrain_model[index - 2].bz = binormal.z;
+
+				terrain_model[index - 3].tx = tangent.x;
+				terrain_model[index - 3].ty = tangent.y;
+				terrain_model[index - 3].tz = tangent.z;
+				terrain_model[index - 3].bx = binormal.x;
+				terrain_model[index - 3].by = binormal.y;
+				terrain_model[index - 3].bz = binormal.z;
+			}
+		});
 	}
 
 
-	bool Terrain::calculateNormals()
+	void Terrain::calculateIndexedTerrainVectors()
 	{
-		int index1, index2, index3, index, count;
-		float vertex1[3], vertex2[3], vertex3[3], vector1[3], vector2[3], sum[3], length;
+		auto faceCount = (terrain_width - 1) * (terrain_height - 1) * 2;
 
-		// Create a temporary array to hold the un-normalized normal vectors.
-		auto normals = new VectorType[(terrain_height - 1) * (terrain_width - 1)];
-		if(!normals)
-			return false;
+		std::vector<VectorType> face_tangents(faceCount);
+		std::vector<VectorType> face_binormals(faceCount);
+
+		auto getVertex([&](int i, int j)
+		{
+			auto& model = terrain_model[height_map.getIndex(i, j)];
+
+			TempVertexType vertex;
+			vertex.x = model.x;
+			vertex.y = model.y;
+			vertex.z = model.z;
+			vertex.tu = model.tu;
+			vertex.tv = model.tv;
+			vertex.nx = model.nx;
+			vertex.ny = model.ny;
+			vertex.nz = model.nz;
+
+			return vertex;
+		});
+
+		// Two triangles per quad with the same winding and diagonal as the unindexed model.
+		parallelFor(0, terrain_height - 1, settings.thread_count, [&](int first_row, int last_row)
+		{
+			for(auto j = first_row; j < last_row; j++)
+			{
+				for(auto i = int(); i < (terrain_width - 1); i++)
+				{
+					auto face = ((j * (terrain_width - 1)) + i) * 2;
+
+					calculateTangentBinormal(getVertex(i, j + 1), getVertex(i + 1, j + 1), getVertex(i, j), face_tangents[face], face_binormals[face]);
+					calculateTangentBinormal(getVertex(i, j), getVertex(i + 1, j + 1), getVertex(i + 1, j), face_tangents[face + 1], face_binormals[face + 1]);
+				}
+			}
+		});
 
-		// Go through all the faces in the mesh and calculate their normals.
-		for(auto j = int(); j < (terrain_height - 1); j++)
+		// Every vertex gathers the faces it belongs to in a fixed order, so the sums don't depend on the thread count.
+		// Seen from the vertex, the quad to the lower left contributes both triangles, the quad to the lower right only
+		// the first one, the quad to the upper left only the second one and the quad to the upper right both again.
+		parallelFor(0, terrain_height, settings.thread_count, [&](int first_row, int last_row)
 		{
-			for(auto i = int(); i < (terrain_width - 1); i++)
+			for(auto j = first_row; j < last_row; j++)
 			{
-				index1 = (j * terrain_width) + i;
-				index2 = (j * terrain_width) + (i + 1);
-				index3 = ((j + 1) * terrain_width) + i;
+				for(auto i = int(); i < terrain_width; i++)
+				{
+					float tangent[3] = {0.0f, 0.0f, 0.0f};
+					float binormal[3] = {0.0f, 0.0f, 0.0f};
+
+					auto addFace([&](int quad_i, int quad_j, int triangle)
+					{
+						if(quad_i < 0 || quad_j < 0 || quad_i >= terrain_width - 1 || quad_j >= terrain_height - 1)
+							return;
+
+						auto face = ((quad_j * (terrain_width - 1)) + quad_i) * 2 + triangle;
+
+						tangent[0] += face_tangents[face].x;
+						tangent[1] += face_tangents[face].y;
+						tangent[2] += face_tangents[face].z;
+						binormal[0] += face_binormals[face].x;
+						binormal[1] += face_binormals[face].y;
+						binormal[2] += face_binormals[face].z;
+					});
+
+					addFace(i - 1, j - 1, 0);
+					addFace(i - 1, j - 1, 1);
+					addFace(i, j - 1, 0);
+					addFace(i - 1, j, 1);
+					addFace(i, j, 0);
+					addFace(i, j, 1);
+
+					auto tangent_length = sqrt((tangent[0] * tangent[0]) + (tangent[1] * tangent[1]) + (tangent[2] * tangent[2]));
+					auto binormal_length = sqrt((binormal[0] * binormal[0]) + (binormal[1] * binormal[1]) + (binormal[2] * binormal[2]));
+
+					auto& model = terrain_model[height_map.getIndex(i, j)];
+					model.tx = tangent[0] / tangent_length;
+					model.ty = tangent[1] / tangent_length;
+					model.tz = tangent[2] / tangent_length;
+					model.bx = binormal[0] / binormal_length;
+					model.by = binormal[1] / binormal_length;
+					model.bz = binormal[2] / binormal_length;
+				}
+			}
+		});
+	}
 
-				// Get three vertices from the face.
-				vertex1[0] = height_map[index1].x;
-				vertex1[1] = height_map[index1].y;
-				vertex1[2] = height_map[index1].z;
 
-				vertex2[0] = height_map[index2].x;
-				vertex2[1] = height_map[index2].y;
-				vertex2[2] = height_map[index2].z;
+	void Terrain::buildTerrainChunks()
+	{
+		chunks.clear();
+		chunk_indices.clear();
+		chunk_vertices.clear();
+		draw_calls.clear();
+
+		// Heights are quantized against the range of the whole terrain and X/Z in whole grid steps, so the samples
+		// that neighbouring chunks share decode to exactly the same position and no cracks open between chunks.
+		float terrain_min, terrain_max;
+		height_pyramid.getRange(0, 0, terrain_width - 1, terrain_height - 1, terrain_min, terrain_max);
 
-				vertex3[0] = height_map[index3].x;
-				vertex3[1] = height_map[index3].y;
-				vertex3[2] = height_map[index3].z;
+		auto height_step = std::max((terrain_max - terrain_min) / 65535.0f, 1e-6f);
 
-				// Calculate the two vectors for this face.
-				vector1[0] = vertex1[0] - vertex3[0];
-				vector1[1] = vertex1[1] - vertex3[1];
-				vector1[2] = vertex1[2] - vertex3[2];
-				vector2[0] = vertex3[0] - vertex2[0];
-				vector2[1] = vertex3[1] - vertex2[1];
-				vector2[2] = vertex3[2] - vertex2[2];
+		auto getTransform([&](const TerrainChunk& chunk)
+		{
+			auto& first = terrain_model[settings.mesh_type == TerrainMeshType::Indexed ? height_map.getIndex(chunk.x, chunk.z) : 0];
 
-				index = (j * (terrain_width - 1)) + i;
+			CompactVertexTransform transform;
+			transform.position_offset = Vector3D(chunk.bounds_min.x, terrain_min, chunk.bounds_min.z);
+			transform.position_step = Vector3D(grid_spacing, height_step, grid_spacing);
 
-				// Calculate the cross product of those two vectors to get the un-normalized value for this face normal.
-				normals[index].x = (vector1[1] * vector2[2]) - (vector1[2] * vector2[1]);
-				normals[index].y = (vector1[2] * vector2[0]) - (vector1[0] * vector2[2]);
-				normals[index].z = (vector1[0] * vector2[1]) - (vector1[1] * vector2[0]);
+			// The indexed mesh counts quads in its texture coordinates, the unindexed one stays within [0, 1].
+			if(settings.mesh_type == TerrainMeshType::Indexed)
+			{
+				transform.texture_offset = Vector2D(first.tu, first.tv - static_cast<float>(chunk.height - 1));
+				transform.texture_extent = Vector2D(static_cast<float>(chunk.width - 1), static_cast<float>(chunk.height - 1));
 			}
+			else
+			{
+				transform.texture_offset = Vector2D(0.0f, 0.0f);
+				transform.texture_extent = Vector2D(1.0f, 1.0f);
+			}
+
+			return transform;
+		});
+
+		auto getBounds([&](TerrainChunk& chunk)
+		{
+			float min_height, max_height;
+			height_pyramid.getRange(chunk.x, chunk.z, chunk.x + chunk.width - 1, chunk.z + chunk.height - 1, min_height, max_height);
+
+			chunk.bounds_min = Vector3D(height_map.getX(chunk.x), min_height, height_map.getZ(chunk.z));
+			chunk.bounds_max = Vector3D(height_map.getX(chunk.x + chunk.width - 1), max_height, height_map.getZ(chunk.z + chunk.height - 1));
+		});
+
+		// The unindexed model is kept as one big chunk drawn with 32-bit indices.
+		if(settings.mesh_type == TerrainMeshType::Unindexed)
+		{
+			TerrainChunk chunk = {0, 0, terrain_width, terrain_height, 0U, static_cast<UINT>(vertex_count), 0U, static_cast<UINT>(vertex_count)};
+			getBounds(chunk);
+			chunk.transform = getTransform(chunk);
+
+			chunks.push_back(chunk);
+			chunk_columns = 1;
+			draw_calls.push_back({chunk.index_count, chunk.start_index, static_cast<INT>(chunk.base_vertex), chunk.transform});
+
+			index_count = vertex_count;
+			index_format = DXGI_FORMAT_R32_UINT;
+
+			return;
 		}
 
-		// Now go through all the vertices and take an average of each face normal that the vertex touches to get the averaged normal for that vertex.
-		for(auto j = int(); j < terrain_height; j++)
+		auto chunk_size = std::max(2, std::min(settings.chunk_size, 256));
+		auto chunk_quads = chunk_size - 1;
+
+		// The simplified mesh is extracted for the whole terrain at once, so it is crack-free, and never crosses a chunk
+		// border, so every triangle belongs to exactly one chunk: the one of its lowest corner.
+		auto simplify = settings.simplification_error > 0.0f;
+		auto columns = (terrain_width - 2) / chunk_quads + 1;
+		chunk_columns = columns;
+
+		std::vector<std::vector<uint32_t>> chunk_triangles;
+
+		if(simplify)
 		{
-			for(auto i = int(); i < terrain_width; i++)
+			RtinHierarchy rtin;
+			rtin.build(height_map, chunk_quads);
+
+			std::vector<uint32_t> triangles;
+			rtin.extractMesh(settings.simplification_error, triangles);
+
+			calculateSimplifiedTerrainVectors(triangles);
+
+			chunk_triangles.resize(columns * ((terrain_height - 2) / chunk_quads + 1));
+
+			for(auto t = size_t(); t < triangles.size(); t += 3)
 			{
-				// Initialize the sum.
-				sum[0] = 0.0f;
-				sum[1] = 0.0f;
-				sum[2] = 0.0f;
+				auto x = std::min(std::min(triangles[t] % terrain_width, triangles[t + 1] % terrain_width), triangles[t + 2] % terrain_width);
+				auto z = std::min(std::min(triangles[t] / terrain_width, triangles[t + 1] / terrain_width), triangles[t + 2] / terrain_width);
 
-				// Initialize the count.
-				count = 0;
+				auto& bin = chunk_triangles[(z / chunk_quads) * columns + x / chunk_quads];
+				bin.insert(bin.end(), triangles.begin() + t, triangles.begin() + t + 3);
+			}
+		}
 
-				// Bottom left face.
-				if(((i - 1) >= 0) && ((j - 1) >= 0))
-				{
-					index = ((j - 1) * (terrain_width - 1)) + (i - 1);
+		// Simplified chunks only keep the samples their triangles use, in the order the triangles first use them.
+		std::vector<std::vector<uint16_t>> chunk_samples(chunk_triangles.size());
 
-					sum[0] += normals[index].x;
-					sum[1] += normals[index].y;
-					sum[2] += normals[index].z;
-					count++;
-				}
+		auto base_vertex = 0U;
+		auto start_index = 0U;
 
-				// Bottom right face.
-				if((i < (terrain_width - 1)) && ((j - 1) >= 0))
+		for(auto z = int(); z < terrain_height - 1; z += chunk_quads)
+		{
+			for(auto x = int(); x < terrain_width - 1; x += chunk_quads)
+			{
+				TerrainChunk chunk = {};
+				chunk.x = x;
+				chunk.z = z;
+				chunk.width = std::min(chunk_size, terrain_width - x);
+				chunk.height = std::min(chunk_size, terrain_height - z);
+				chunk.base_vertex = base_vertex;
+				chunk.vertex_count = static_cast<UINT>(chunk.width * chunk.height);
+				chunk.start_index = start_index;
+				chunk.index_count = static_cast<UINT>((chunk.width - 1) * (chunk.height - 1) * 6);
+
+				if(simplify)
 				{
-					index = ((j - 1) * (terrain_height - 1)) + i;
-
-					sum[0] += normals[index].x;
-					sum[1] += normals[index].y;
-					sum[2] += normals[index].z;
-					count++;
+					auto& triangles = chunk_triangles[chunks.size()];
+					auto& samples = chunk_samples[chunks.size()];
+					std::vector<int> vertex_indices(chunk.width * chunk.height, -1);
+
+					// The global sample indices are replaced by chunk vertex indices in place.
+					for(auto& index : triangles)
+					{
+						auto sample = (static_cast<int>(index / terrain_width) - z) * chunk.width + static_cast<int>(index % terrain_width) - x;
+						if(vertex_indices[sample] < 0)
+						{
+							vertex_indices[sample] = static_cast<int>(samples.size());
+							samples.push_back(static_cast<uint16_t>(sample));
+						}
+
+						index = static_cast<uint32_t>(vertex_indices[sample]);
+					}
+
+					chunk.vertex_count = static_cast<UINT>(samples.size());
+					chunk.index_count = static_cast<UINT>(triangles.size());
 				}
 
-				// Upper left face.
-				if(((i - 1) >= 0) && (j < (terrain_height - 1)))
-				{
-					index = (j * (terrain_height - 1)) + (i - 1);
+				getBounds(chunk);
+				chunk.transform = getTransform(chunk);
 
-					sum[0] += normals[index].x;
-					sum[1] += normals[index].y;
-					sum[2] += normals[index].z;
-					count++;
-				}
+				base_vertex += chunk.vertex_count;
+				start_index += chunk.index_count;
 
-				// Upper right face.
-				if((i < (terrain_width - 1)) && (j < (terrain_height - 1)))
-				{
-					index = (j * (terrain_height - 1)) + i;
+				chunks.push_back(chunk);
+			}
+		}
+
+		// Local indices of every chunk, the vertices of a chunk are stored row by row unless they get reordered or simplified.
+		chunk_indices.resize(start_index);
+		if(settings.optimize_vertex_cache || simplify)
+			chunk_vertices.resize(base_vertex);
 
-					sum[0] += normals[index].x;
-					sum[1] += normals[index].y;
-					sum[2] += normals[index].z;
-					count++;
+		parallelFor(0, static_cast<int>(chunks.size()), settings.thread_count, [&](int first_chunk, int last_chunk)
+		{
+			for(auto c = first_chunk; c < last_chunk; c++)
+			{
+				auto& chunk = chunks[c];
+				auto index = chunk.start_index;
+
+				if(simplify)
+				{
+					for(auto vertex : chunk_triangles[c])
+						chunk_indices[index++] = static_cast<uint16_t>(vertex);
+				}
+				else
+				{
+					for(auto j = int(); j < chunk.height - 1; j++)
+					{
+						for(auto i = int(); i < chunk.width - 1; i++)
+						{
+							auto bottom_left = static_cast<uint16_t>((j * chunk.width) + i);
+							auto bottom_right = static_cast<uint16_t>(bottom_left + 1);
+							auto upper_left = static_cast<uint16_t>(bottom_left + chunk.width);
+							auto upper_right = static_cast<uint16_t>(upper_left + 1);
+
+							chunk_indices[index++] = upper_left;
+							chunk_indices[index++] = upper_right;
+							chunk_indices[index++] = bottom_left;
+
+							chunk_indices[index++] = bottom_left;
+							chunk_indices[index++] = upper_right;
+							chunk_indices[index++] = bottom_right;
+						}
+					}
 				}
 
-				// Take the average of the faces touching this vertex.
-				sum[0] = (sum[0] / (float)count);
-				sum[1] = (sum[1] / (float)count);
-				sum[2] = (sum[2] / (float)count);
+				auto indices = chunk_indices.data() + chunk.start_index;
 
-				// Calculate the length of this normal.
-				length = sqrt((sum[0] * sum[0]) + (sum[1] * sum[1]) + (sum[2] * sum[2]));
+				std::vector<uint16_t> vertex_order;
+				if(settings.optimize_vertex_cache)
+				{
+					optimizeVertexCache(indices, chunk.index_count, chunk.vertex_count);
+					optimizeVertexFetch(indices, chunk.index_count, chunk.vertex_count, vertex_order);
+				}
 
-				// Get an index to the vertex location in the height map array.
-				index = (j * terrain_height) + i;
+				// Buffer vertex to row-major chunk sample, through the simplified vertex numbering if there is one.
+				if(simplify)
+				{
+					auto& samples = chunk_samples[c];
 
-				// Normalize the final shared normal for this vertex and store it in the height map array.
-				height_map[index].nx = (sum[0] / length);
-				height_map[index].ny = (sum[1] / length);
-				height_map[index].nz = (sum[2] / length);
+					for(auto v = UINT(); v < chunk.vertex_count; v++)
+						chunk_vertices[chunk.base_vertex + v] = samples[vertex_order.empty() ? v : vertex_order[v]];
+				}
+				else if(!vertex_order.empty())
+				{
+					std::copy(vertex_order.begin(), vertex_order.end(), chunk_vertices.begin() + chunk.base_vertex);
+				}
 			}
-		}
+		});
 
-		// Release the temporary normals.
-		delete[] normals;
+		for(auto& chunk : chunks)
+			draw_calls.push_back({chunk.index_count, chunk.start_index, static_cast<INT>(chunk.base_vertex), chunk.transform});
 
-		return true;
+		vertex_count = static_cast<int>(base_vertex);
+		index_count = static_cast<int>(start_index);
+		index_format = DXGI_FORMAT_R16_UINT;
 	}
 
 
-	bool Terrain::buildTerrainModel()
+	void Terrain::calculateSimplifiedTerrainVectors(const std::vector<uint32_t>& triangles)
 	{
-		vertex_count = (terrain_width - 1) * (terrain_height - 1) * 6;
-
-		terrain_model = new ModelType[vertex_count];
-		if(!terrain_model)
-			return false;
+		// Every sample the simplified mesh keeps gets the frame of the area weighted average gradient of its triangles,
+		// so the normal map follows the surface that is actually drawn. The height field keeps its own normals.
+		struct Gradient
+		{
+			float gx, gz;
+			float weight;
+		};
 
-        auto index = int();
-		int index1, index2, index3, index4;
-		for(auto j = int(); j < (terrain_height - 1); j++)
-		{
-			for(auto i = int(); i<(terrain_width - 1); i++)
-			{
-				index1 = (terrain_width * j) + i;          // Bottom left.
-				index2 = (terrain_width * j) + (i + 1);      // Bottom right.
-				index3 = (terrain_width * (j + 1)) + i;      // Upper left.
-				index4 = (terrain_width * (j + 1)) + (i + 1);  // Upper right.
-
-				// Upper left.
-				terrain_model[index].x = height_map[index3].x;
-				terrain_model[index].y = height_map[index3].y;
-				terrain_model[index].z = height_map[index3].z;
-				terrain_model[index].nx = height_map[index3].nx;
-				terrain_model[index].ny = height_map[index3].ny;
-				terrain_model[index].nz = height_map[index3].nz;
-				terrain_model[index].tu = 0.0f;
-				terrain_model[index].tv = 0.0f;
-				index++;
+		std::vector<Gradient> gradients(terrain_width * terrain_height, {0.0f, 0.0f, 0.0f});
 
-				// Upper right.
-				terrain_model[index].x = height_map[index4].x;
-				terrain_model[index].y = height_map[index4].y;
-				terrain_model[index].z = height_map[index4].z;
-				terrain_model[index].nx = height_map[index4].nx;
-				terrain_model[index].ny = height_map[index4].ny;
-				terrain_model[index].nz = height_map[index4].nz;
-				terrain_model[index].tu = 1.0f;
-				terrain_model[index].tv = 0.0f;
-				index++;
+		for(auto t = size_t(); t < triangles.size(); t += 3)
+		{
+			auto& a = terrain_model[triangles[t]];
+			auto& b = terrain_model[triangles[t + 1]];
+			auto& c = terrain_model[triangles[t + 2]];
 
-				// Bottom left.
-				terrain_model[index].x = height_map[index1].x;
-				terrain_model[index].y = height_map[index1].y;
-				terrain_model[index].z = height_map[index1].z;
-				terrain_model[index].nx = height_map[index1].nx;
-				terrain_model[index].ny = height_map[index1].ny;
-				terrain_model[index].nz = height_map[index1].nz;
-				terrain_model[index].tu = 0.0f;
-				terrain_model[index].tv = 1.0f;
-				index++;
+			auto dx1 = b.x - a.x, dy1 = b.y - a.y, dz1 = b.z - a.z;
+			auto dx2 = c.x - a.x, dy2 = c.y - a.y, dz2 = c.z - a.z;
 
-				// Bottom left.
-				terrain_model[index].x = height_map[index1].x;
-				terrain_model[index].y = height_map[index1].y;
-				terrain_model[index].z = height_map[index1].z;
-				terrain_model[index].nx = height_map[index1].nx;
-				terrain_model[index].ny = height_map[index1].ny;
-				terrain_model[index].nz = height_map[index1].nz;
-				terrain_model[index].tu = 0.0f;
-				terrain_model[index].tv = 1.0f;
-				index++;
+			// Twice the area of the triangle seen from above.
+			auto determinant = dx1 * dz2 - dx2 * dz1;
+			if(determinant == 0.0f)
+				continue;
 
-				// Upper right.
-				terrain_model[index].x = height_map[index4].x;
-				terrain_model[index].y = height_map[index4].y;
-				terrain_model[index].z = height_map[index4].z;
-				terrain_model[index].nx = height_map[index4].nx;
-				terrain_model[index].ny = height_map[index4].ny;
-				terrain_model[index].nz = height_map[index4].nz;
-				terrain_model[index].tu = 1.0f;
-				terrain_model[index].tv = 0.0f;
-				index++;
+			auto gx = (dy1 * dz2 - dy2 * dz1) / determinant;
+			auto gz = (dx1 * dy2 - dx2 * dy1) / determinant;
+			auto weight = std::fabs(determinant);
 
-				// Bottom right.
-				terrain_model[index].x = height_map[index2].x;
-				terrain_model[index].y = height_map[index2].y;
-				terrain_model[index].z = height_map[index2].z;
-				terrain_model[index].nx = height_map[index2].nx;
-				terrain_model[index].ny = height_map[index2].ny;
-				terrain_model[index].nz = height_map[index2].nz;
-				terrain_model[index].tu = 1.0f;
-				terrain_model[index].tv = 1.0f;
-				index++;
+			for(auto k = 0; k < 3; k++)
+			{
+				auto& gradient = gradients[triangles[t + k]];
+				gradient.gx += gx * weight;
+				gradient.gz += gz * weight;
+				gradient.weight += weight;
 			}
 		}
 
-		return true;
+		for(auto sample = int(); sample < terrain_width * terrain_height; sample++)
+		{
+			auto& gradient = gradients[sample];
+			if(gradient.weight > 0.0f)
+				setFrame(terrain_model[sample], getGradientFrame(gradient.gx / gradient.weight, gradient.gz / gradient.weight));
+		}
 	}
 
-	void Terrain::calculateTerrainVectors()
+	void Terrain::setFrame(ModelType& model, const HeightFieldFrame& frame)
 	{
-		TempVertexType vertex1, vertex2, vertex3;
-		VectorType tangent, binormal;
+		model.nx = frame.normal.x;
+		model.ny = frame.normal.y;
+		model.nz = frame.normal.z;
+		model.tx = frame.tangent.x;
+		model.ty = frame.tangent.y;
+		model.tz = frame.tangent.z;
+		model.bx = frame.binormal.x;
+		model.by = frame.binormal.y;
+		model.bz = frame.binormal.z;
+	}
 
-		auto faceCount = vertex_count / 3;
+	void Terrain::storeFrameNormals(int row, const HeightFieldFrame* frames)
+	{
+		// The height field keeps its packed normals up to date for anything that samples it later.
+		auto packed_normals = height_map.getPackedNormals() + height_map.getIndex(0, row);
 
-		auto index = int();
-		for(auto i = int(); i<faceCount; i++)
-		{
-			// Get the three vertices for this face from the terrain model.
-			vertex1.x = terrain_model[index].x;
-			vertex1.y = terrain_model[index].y;
-			vertex1.z = terrain_model[index].z;
-			vertex1.tu = terrain_model[index].tu;
-			vertex1.tv = terrain_model[index].tv;
-			vertex1.nx = terrain_model[index].nx;
-			vertex1.ny = terrain_model[index].ny;
-			vertex1.nz = terrain_model[index].nz;
-			index++;
-
-			vertex2.x = terrain_model[index].x;
-			vertex2.y = terrain_model[index].y;
-			vertex2.z = terrain_model[index].z;
-			vertex2.tu = terrain_model[index].tu;
-			vertex2.tv = terrain_model[index].tv;
-			vertex2.nx = terrain_model[index].nx;
-			vertex2.ny = terrain_model[index].ny;
-			vertex2.nz = terrain_model[index].nz;
-			index++;
-
-			vertex3.x = terrain_model[index].x;
-			vertex3.y = terrain_model[index].y;
-			vertex3.z = terrain_model[index].z;
-			vertex3.tu = terrain_model[index].tu;
-			vertex3.tv = terrain_model[index].tv;
-			vertex3.nx = terrain_model[index].nx;
-			vertex3.ny = terrain_model[index].ny;
-			vertex3.nz = terrain_model[index].nz;
-			index++;
-
-			calculateTangentBinormal(vertex1, vertex2, vertex3, tangent, binormal);
-
-			terrain_model[index - 1].tx = tangent.x;
-			terrain_model[index - 1].ty = tangent.y;
-			terrain_model[index - 1].tz = tangent.z;
-			terrain_model[index - 1].bx = binormal.x;
-			terrain_model[index - 1].by = binormal.y;
-			terrain_model[index - 1].bz = binormal.z;
-
-			terrain_model[index - 2].tx = tangent.x;
-			terrain_model[index - 2].ty = tangent.y;
-			terrain_model[index - 2].tz = tangent.z;
-			terrain_model[index - 2].bx = binormal.x;
-			terrain_model[index - 2].by = binormal.y;
-			terrain_model[index - 2].bz = binormal.z;
-
-			terrain_model[index - 3].tx = tangent.x;
-			terrain_model[index - 3].ty = tangent.y;
-			terrain_model[index - 3].tz = tangent.z;
-			terrain_model[index - 3].bx = binormal.x;
-			terrain_model[index - 3].by = binormal.y;
-			terrain_model[index - 3].bz = binormal.z;
-		}
+		for(auto i = int(); i < terrain_width; i++)
+			packed_normals[i] = packNormal(frames[i].normal);
 	}
 
 
@@ -493,32 +1822,177 @@ namespace bm
 	}
 
 
-	bool Terrain::initializeBuffers(ID3D11Device* device)
+	void Terrain::buildVertices(std::vector<unsigned char>& vertices)
 	{
-		index_count = vertex_count;
+		// Calls write(vertex, model, chunk) for every vertex in buffer order.
+		auto fillVertices([&](auto* vertices, auto write)
+		{
+			// The unindexed model is already in buffer order and forms a single chunk.
+			if(settings.mesh_type == TerrainMeshType::Unindexed)
+			{
+				parallelFor(0, vertex_count, settings.thread_count, [&](int first, int last)
+				{
+					for(auto i = first; i < last; i++)
+						write(vertices[i], terrain_model[i], chunks.front());
+				});
 
-		auto vertices = new VertexType[vertex_count];
-		if(!vertices)
-			return false;
+				return;
+			}
 
-		auto indices = new unsigned long[index_count];
-		if(!indices)
-			return false;
+			// Chunks duplicate the samples on their borders, the indexed model holds every sample once.
+			parallelFor(0, static_cast<int>(chunks.size()), settings.thread_count, [&](int first_chunk, int last_chunk)
+			{
+				for(auto c = first_chunk; c < last_chunk; c++)
+				{
+					auto& chunk = chunks[c];
+
+					for(auto v = UINT(); v < chunk.vertex_count; v++)
+					{
+						auto sample = chunk_vertices.empty() ? v : chunk_vertices[chunk.base_vertex + v];
+						auto i = chunk.x + static_cast<int>(sample) % chunk.width;
+						auto j = chunk.z + static_cast<int>(sample) / chunk.width;
+
+						write(vertices[chunk.base_vertex + v], terrain_model[height_map.getIndex(i, j)], chunk);
+					}
+				}
+			});
+		});
+
+		if(settings.vertex_format == TerrainVertexFormat::Compact)
+		{
+			vertex_stride = sizeof(CompactTerrainVertex);
+			vertices.resize(vertex_stride * vertex_count);
+
+			fillVertices(reinterpret_cast<CompactTerrainVertex*>(vertices.data()), [](CompactTerrainVertex& vertex, const ModelType& model, const TerrainChunk& chunk)
+			{
+				storeVertex(vertex, model, chunk);
+			});
+		}
+		else
+		{
+			vertex_stride = sizeof(VertexType);
+			vertices.resize(vertex_stride * vertex_count);
+
+			fillVertices(reinterpret_cast<VertexType*>(vertices.data()), [](VertexType& vertex, const ModelType& model, const TerrainChunk& chunk)
+			{
+				storeVertex(vertex, model, chunk);
+			});
+		}
+	}
+
+	void Terrain::updateVertices(const TerrainChunk& chunk, int x0, int z0, int x1, int z1)
+	{
+		auto getSample([&](UINT v) { return chunk_vertices.empty() ? static_cast<int>(v) : static_cast<int>(chunk_vertices[chunk.base_vertex + v]); });
+
+		// Rewrites chunk vertices [first, last] from the height field, with the frames of edit_frames over [x0, x1] x [z0, z1].
+		auto writeRun([&](UINT first, UINT last)
+		{
+			auto offset = (chunk.base_vertex + first) * vertex_stride;
+			auto size = (last - first + 1) * vertex_stride;
+
+			if(!buffer_updates.empty() && buffer_updates.back().offset + buffer_updates.back().size == offset)
+				buffer_updates.back().size += size;
+			else
+				buffer_updates.push_back({offset, size});
+
+			auto data = buffer_update_data.size();
+			buffer_update_data.resize(data + size);
+
+			for(auto v = first; v <= last; v++, data += vertex_stride)
+			{
+				auto sample = getSample(v);
+				auto i = chunk.x + sample % chunk.width;
+				auto j = chunk.z + sample / chunk.width;
+
+				// Vertices outside the rectangle only fill the gaps between the ones in it and don't change.
+				HeightFieldFrame frame;
+				if(i >= x0 && i <= x1 && j >= z0 && j <= z1)
+					frame = edit_frames[static_cast<size_t>(j - z0) * (x1 - x0 + 1) + (i - x0)];
+				else
+					computeHeightFieldFrames(height_map, j, i, i + 1, &frame);
+
+				ModelType model;
+				model.x = height_map.getX(i);
+				model.y = height_map.getHeight(i, j);
+				model.z = height_map.getZ(j);
+				model.tu = static_cast<float>(i);
+				model.tv = static_cast<float>(terrain_height - 1 - j);
+				setFrame(model, frame);
+
+				if(settings.vertex_format == TerrainVertexFormat::Compact)
+					storeVertex(*reinterpret_cast<CompactTerrainVertex*>(buffer_update_data.data() + data), model, chunk);
+				else
+					storeVertex(*reinterpret_cast<VertexType*>(buffer_update_data.data() + data), model, chunk);
+			}
+		});
+
+		auto first_i = std::max(x0, chunk.x) - chunk.x, last_i = std::min(x1, chunk.x + chunk.width - 1) - chunk.x;
+		auto first_j = std::max(z0, chunk.z) - chunk.z, last_j = std::min(z1, chunk.z + chunk.height - 1) - chunk.z;
+
+		// Rows of the rectangle are runs of their own in a row-major chunk.
+		if(chunk_vertices.empty())
+		{
+			for(auto j = first_j; j <= last_j; j++)
+				writeRun(static_cast<UINT>(j * chunk.width + first_i), static_cast<UINT>(j * chunk.width + last_i));
+
+			return;
+		}
 
-		for(auto i = int(); i < vertex_count; i++)
+		// Reordered vertices are found with a pass over the chunk against a map of the edited samples, runs closer than
+		// buffer_update_gap are joined.
+		edit_samples.assign(static_cast<size_t>(chunk.width) * chunk.height, 0U);
+		for(auto j = first_j; j <= last_j; j++)
+			std::fill_n(edit_samples.begin() + j * chunk.width + first_i, last_i - first_i + 1, 1U);
+
+		auto run_first = UINT(), run_last = UINT();
+		auto in_run = false;
+
+		for(auto v = UINT(); v < chunk.vertex_count; v++)
 		{
-			vertices[i].position = Vector3D(terrain_model[i].x, terrain_model[i].y, terrain_model[i].z);
-			vertices[i].texture = Vector2D(terrain_model[i].tu, terrain_model[i].tv);
-			vertices[i].normal = Vector3D(terrain_model[i].nx, terrain_model[i].ny, terrain_model[i].nz);
-			vertices[i].tangent = Vector3D(terrain_model[i].tx, terrain_model[i].ty, terrain_model[i].tz);
-			vertices[i].binormal = Vector3D(terrain_model[i].bx, terrain_model[i].by, terrain_model[i].bz);
+			if(!edit_samples[getSample(v)])
+				continue;
+
+			if(in_run && v - run_last <= buffer_update_gap + 1U)
+			{
+				run_last = v;
+				continue;
+			}
+
+			if(in_run)
+				writeRun(run_first, run_last);
 
-			indices[i] = i;
+			run_first = run_last = v;
+			in_run = true;
 		}
 
+		if(in_run)
+			writeRun(run_first, run_last);
+	}
+
+	void Terrain::storeVertex(CompactTerrainVertex& vertex, const ModelType& model, const TerrainChunk& chunk)
+	{
+		vertex = encodeCompactVertex(chunk.transform,
+		                             Vector3D(model.x, model.y, model.z),
+		                             Vector2D(model.tu, model.tv),
+		                             Vector3D(model.nx, model.ny, model.nz),
+		                             Vector3D(model.tx, model.ty, model.tz),
+		                             Vector3D(model.bx, model.by, model.bz));
+	}
+
+	void Terrain::storeVertex(VertexType& vertex, const ModelType& model, const TerrainChunk&)
+	{
+		vertex.position = Vector3D(model.x, model.y, model.z);
+		vertex.texture = Vector2D(model.tu, model.tv);
+		vertex.normal = Vector3D(model.nx, model.ny, model.nz);
+		vertex.tangent = Vector3D(model.tx, model.ty, model.tz);
+		vertex.binormal = Vector3D(model.bx, model.by, model.bz);
+	}
+
+	bool Terrain::initializeBuffers(ID3D11Device* device, const void* vertices, const void* indices)
+	{
 		D3D11_BUFFER_DESC vertex_buffer_desc;
 		vertex_buffer_desc.Usage = D3D11_USAGE_DEFAULT;
-		vertex_buffer_desc.ByteWidth = sizeof(VertexType) * vertex_count;
+		vertex_buffer_desc.ByteWidth = vertex_stride * vertex_count;
 		vertex_buffer_desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
 		vertex_buffer_desc.CPUAccessFlags = 0U;
 		vertex_buffer_desc.MiscFlags = 0U;
@@ -535,7 +2009,7 @@ namespace bm
 
 		D3D11_BUFFER_DESC index_buffer_desc;
 		index_buffer_desc.Usage = D3D11_USAGE_DEFAULT;
-		index_buffer_desc.ByteWidth = sizeof(decltype(index_count)) * index_count;
+		index_buffer_desc.ByteWidth = static_cast<UINT>(getIndexSize() * index_count);
 		index_buffer_desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
 		index_buffer_desc.CPUAccessFlags = 0U;
 		index_buffer_desc.MiscFlags = 0U;
@@ -550,9 +2024,6 @@ namespace bm
 		if(FAILED(result))
 			return false;
 
-		delete[] vertices;
-		delete[] indices;
-
 		return true;
 	}
 
@@ -0,0 +1,213 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "TerrainBake.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace bm
+{
+    namespace
+    {
+        constexpr char terrain_bake_magic[4] = {'B', 'M', 'T', 'B'};
+        constexpr uint64_t section_alignment = 16U;
+
+        uint64_t alignSection(uint64_t offset)
+        {
+            return (offset + section_alignment - 1U) & ~(section_alignment - 1U);
+        }
+
+        uint64_t mix(uint64_t hash, uint64_t value)
+        {
+            hash ^= value * 0x9E3779B97F4A7C15ULL;
+            hash = (hash << 31U) | (hash >> 33U);
+
+            return hash * 0xBF58476D1CE4E5B9ULL;
+        }
+
+        // Sizes of the sections in bytes, in file order.
+        void getSectionSizes(const TerrainBakeHeader& header, uint64_t (&sizes)[6])
+        {
+            auto samples = static_cast<uint64_t>(header.terrain_width) * static_cast<uint64_t>(header.terrain_height);
+
+            sizes[0] = samples * sizeof(float);
+            sizes[1] = samples * sizeof(uint32_t);
+            sizes[2] = static_cast<uint64_t>(header.chunk_count) * sizeof(TerrainChunk);
+            sizes[3] = static_cast<uint64_t>(header.vertex_count) * header.vertex_stride;
+            sizes[4] = static_cast<uint64_t>(header.index_count) * header.index_size;
+            sizes[5] = static_cast<uint64_t>(header.vertex_order_count) * sizeof(uint16_t);
+        }
+
+        uint64_t hashSections(const void* const (&sections)[6], const uint64_t (&sizes)[6])
+        {
+            auto hash = uint64_t();
+            for(auto s = 0; s < 6; s++)
+                hash = hashBytes(sections[s], static_cast<size_t>(sizes[s]), hash);
+
+            return hash;
+        }
+    }
+
+    uint64_t hashBytes(const void* data, size_t size, uint64_t seed)
+    {
+        auto bytes = static_cast<const unsigned char*>(data);
+
+        // Four independent lanes over 32-byte blocks keep the multiplies in flight, large heightmaps hash at memory speed.
+        uint64_t lanes[4] = {seed ^ 0x243F6A8885A308D3ULL, seed ^ 0x13198A2E03707344ULL, seed ^ 0xA4093822299F31D0ULL, seed ^ 0x082EFA98EC4E6C89ULL};
+
+        auto offset = size_t();
+        for(; offset + 32U <= size; offset += 32U)
+        {
+            for(auto lane = int(); lane < 4; lane++)
+            {
+                uint64_t value;
+                std::memcpy(&value, bytes + offset + lane * 8, sizeof(value));
+
+                lanes[lane] = mix(lanes[lane], value);
+            }
+        }
+
+        auto hash = mix(mix(mix(mix(static_cast<uint64_t>(size), lanes[0]), lanes[1]), lanes[2]), lanes[3]);
+
+        for(; offset < size; offset++)
+            hash = mix(hash, bytes[offset]);
+
+        hash ^= hash >> 32U;
+
+        return hash;
+    }
+
+    TerrainBake::TerrainBake(const wchar_t* file_name, uint64_t content_hash) :
+        file(file_name),
+        valid(false)
+    {
+        if(!file.isOpen() || file.getSize() < sizeof(TerrainBakeHeader))
+            return;
+
+        auto& header = getHeader();
+        if(std::memcmp(header.magic, terrain_bake_magic, sizeof(terrain_bake_magic)) != 0 ||
+           header.version != terrain_bake_version ||
+           header.content_hash != content_hash ||
+           header.file_size != file.getSize())
+            return;
+
+        // The sections have to lie inside the file, in case it was produced by a broken writer.
+        uint64_t sizes[6];
+        getSectionSizes(header, sizes);
+
+        const uint64_t offsets[6] = {header.heights_offset, header.normals_offset, header.chunks_offset,
+                                     header.vertices_offset, header.indices_offset, header.vertex_order_offset};
+
+        if(header.terrain_width <= 0 || header.terrain_height <= 0 ||
+           (header.index_size != sizeof(uint16_t) && header.index_size != sizeof(uint32_t)) ||
+           (header.vertex_order_count != 0U && header.vertex_order_count != header.vertex_count))
+            return;
+
+        for(auto s = 0; s < 6; s++)
+        {
+            if(offsets[s] % section_alignment != 0U || offsets[s] > header.file_size || sizes[s] > header.file_size - offsets[s])
+                return;
+        }
+
+        // A flipped bit in the data would otherwise reach the GPU or index out of the vertex buffer.
+        const void* const sections[6] = {getHeights(), getNormals(), getChunks(), getVertices(), getIndices(), getVertexOrder()};
+        if(hashSections(sections, sizes) != header.sections_hash)
+            return;
+
+        valid = hasValidChunks();
+    }
+
+    bool TerrainBake::hasValidChunks() const
+    {
+        auto& header = getHeader();
+
+        return std::all_of(getChunks(), getChunks() + header.chunk_count, [&](const TerrainChunk& chunk)
+        {
+            return chunk.x >= 0 && chunk.z >= 0 && chunk.width > 0 && chunk.height > 0 &&
+                   chunk.width <= header.terrain_width - chunk.x && chunk.height <= header.terrain_height - chunk.z &&
+                   chunk.base_vertex <= header.vertex_count && chunk.vertex_count <= header.vertex_count - chunk.base_vertex &&
+                   chunk.start_index <= header.index_count && chunk.index_count <= header.index_count - chunk.start_index &&
+                   chunk.lod_level_count >= 0 && chunk.lod_level_count <= max_terrain_lod_levels;
+        });
+    }
+
+    bool writeTerrainBake(const wchar_t* file_name,
+                          TerrainBakeHeader header,
+                          const float* heights,
+                          const uint32_t* normals,
+                          const TerrainChunk* chunks,
+                          const void* vertices,
+                          const void* indices,
+                          const uint16_t* vertex_order)
+    {
+        uint64_t sizes[6];
+        getSectionSizes(header, sizes);
+
+        const void* const data[6] = {heights, normals, chunks, vertices, indices, vertex_order};
+
+        struct Section
+        {
+            uint64_t& offset;
+            const void* data;
+            uint64_t size;
+        };
+
+        Section sections[] = {{header.heights_offset, data[0], sizes[0]},
+                              {header.normals_offset, data[1], sizes[1]},
+                              {header.chunks_offset, data[2], sizes[2]},
+                              {header.vertices_offset, data[3], sizes[3]},
+                              {header.indices_offset, data[4], sizes[4]},
+                              {header.vertex_order_offset, data[5], sizes[5]}};
+
+        auto offset = alignSection(sizeof(TerrainBakeHeader));
+        for(auto& section : sections)
+        {
+            section.offset = offset;
+            offset = alignSection(offset + section.size);
+        }
+
+        std::memcpy(header.magic, terrain_bake_magic, sizeof(terrain_bake_magic));
+        header.version = terrain_bake_version;
+        header.file_size = offset;
+        header.sections_hash = hashSections(data, sizes);
+
+        // Written next to file_name and moved over it once complete, so that a failed write leaves the previous bake alone.
+        auto partial_file_name = std::wstring(file_name) + L".partial";
+
+        std::ofstream bake(fs::path(partial_file_name), std::ios::binary | std::ios::trunc);
+        if(!bake)
+            return false;
+
+        const char padding[section_alignment] = {};
+        auto padTo([&](uint64_t position)
+        {
+            bake.write(padding, static_cast<std::streamsize>(position - static_cast<uint64_t>(bake.tellp())));
+        });
+
+        // Zeroed header first, the real one is written once all the data made it to the file.
+        const TerrainBakeHeader empty_header = {};
+        bake.write(reinterpret_cast<const char*>(&empty_header), sizeof(empty_header));
+
+        for(auto& section : sections)
+        {
+            padTo(section.offset);
+            bake.write(static_cast<const char*>(section.data), static_cast<std::streamsize>(section.size));
+        }
+
+        padTo(header.file_size);
+
+        bake.seekp(0);
+        bake.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        bake.close();
+
+        if(!bake || !MoveFileExW(partial_file_name.c_str(), file_name, MOVEFILE_REPLACE_EXISTING))
+        {
+            DeleteFileW(partial_file_name.c_str());
+            return false;
+        }
+
+        return true;
+    }
+}
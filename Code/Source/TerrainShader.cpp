@@ -4,15 +4,24 @@
 
 #include "TerrainShader.h"
 
+#include <cfloat>
+
 namespace bm
 {
-    TerrainShader::TerrainShader(ID3D11Device* device, const wchar_t* vs_file_name, const wchar_t* ps_file_name) :
+    TerrainShader::TerrainShader(ID3D11Device* device,
+                                 const wchar_t* vs_file_name,
+                                 const wchar_t* ps_file_name,
+                                 TerrainVertexFormat vertex_format) :
+        vertex_format(vertex_format),
         vertex_shader(nullptr),
         pixel_shader(nullptr),
         layout(nullptr),
         sample_state(nullptr),
         matrix_buffer(nullptr),
-        light_buffer(nullptr)
+        light_buffer(nullptr),
+        chunk_buffer(nullptr),
+        patch_buffer(nullptr),
+        camera_position(0.0f, 0.0f, 0.0f)
     {
         auto checkFileExisting([](const wchar_t* file_name)
         {
@@ -35,6 +44,12 @@ namespace bm
 
     TerrainShader::~TerrainShader()
     {
+        if (patch_buffer)
+            patch_buffer->Release();
+
+        if (chunk_buffer)
+            chunk_buffer->Release();
+
         if (light_buffer)
             light_buffer->Release();
 
@@ -55,22 +70,22 @@ namespace bm
     }
 
     bool TerrainShader::render(ID3D11DeviceContext* device_context,
-                               int index_count,
+                               const std::vector<TerrainDrawCall>& draw_calls,
                                Matrix&& world,
                                Matrix&& view,
                                Matrix&& projection,
                                Vector4D diffuse_color,
                                Vector3D light_direction,
                                ID3D11ShaderResourceView* diffuse_texture,
-                               ID3D11ShaderResourceView* bump_map_texture)
+                               ID3D11ShaderResourceView* bump_map_texture,
+                               ID3D11ShaderResourceView* height_texture)
     {
-        auto result = setShaderParameters(device_context, world, view, projection, diffuse_color, light_direction, diffuse_texture, bump_map_texture);
+        auto result = setShaderParameters(device_context, world, view, projection, diffuse_color, light_direction, diffuse_texture, bump_map_texture,
+                                          height_texture);
         if (!result)
             return false;
 
-        renderShader(device_context, index_count);
-
-        return true;
+        return renderShader(device_context, draw_calls);
     }
 
 
@@ -206,10 +221,52 @@ namespace bm
         polygonLayout[4].InputSlotClass = D3D11_INPUT_PER_VERTEX_DATA;
         polygonLayout[4].InstanceDataStepRate = 0U;
 
-        UINT numElements = sizeof(polygonLayout) / sizeof(polygonLayout[0]);
-
-        result = device->CreateInputLayout(polygonLayout, numElements, vertexShaderBuffer->GetBufferPointer(), vertexShaderBuffer->GetBufferSize(),
-                                           &layout);
+        // The compact layout packs the normal into the position's w component and the tangent frame into a quaternion,
+        // both decoded by terrain_compact_vs.hlsl.
+        D3D11_INPUT_ELEMENT_DESC compactLayout[3];
+        compactLayout[0].SemanticName = "POSITION";
+        compactLayout[0].SemanticIndex = 0U;
+        compactLayout[0].Format = DXGI_FORMAT_R16G16B16A16_UINT;
+        compactLayout[0].InputSlot = 0U;
+        compactLayout[0].AlignedByteOffset = 0U;
+        compactLayout[0].InputSlotClass = D3D11_INPUT_PER_VERTEX_DATA;
+        compactLayout[0].InstanceDataStepRate = 0U;
+
+        compactLayout[1].SemanticName = "TEXCOORD";
+        compactLayout[1].SemanticIndex = 0U;
+        compactLayout[1].Format = DXGI_FORMAT_R16G16_UNORM;
+        compactLayout[1].InputSlot = 0U;
+        compactLayout[1].AlignedByteOffset = D3D11_APPEND_ALIGNED_ELEMENT;
+        compactLayout[1].InputSlotClass = D3D11_INPUT_PER_VERTEX_DATA;
+        compactLayout[1].InstanceDataStepRate = 0U;
+
+        compactLayout[2].SemanticName = "TANGENT";
+        compactLayout[2].SemanticIndex = 0U;
+        compactLayout[2].Format = DXGI_FORMAT_R8G8B8A8_SNORM;
+        compactLayout[2].InputSlot = 0U;
+        compactLayout[2].AlignedByteOffset = D3D11_APPEND_ALIGNED_ELEMENT;
+        compactLayout[2].InputSlotClass = D3D11_INPUT_PER_VERTEX_DATA;
+        compactLayout[2].InstanceDataStepRate = 0U;
+
+        // The patch layout is only the grid position, terrain_cdlod_vs.hlsl fetches the height and builds the tangent frame.
+        D3D11_INPUT_ELEMENT_DESC patchLayout[1];
+        patchLayout[0].SemanticName = "POSITION";
+        patchLayout[0].SemanticIndex = 0U;
+        patchLayout[0].Format = DXGI_FORMAT_R32G32_FLOAT;
+        patchLayout[0].InputSlot = 0U;
+        patchLayout[0].AlignedByteOffset = 0U;
+        patchLayout[0].InputSlotClass = D3D11_INPUT_PER_VERTEX_DATA;
+        patchLayout[0].InstanceDataStepRate = 0U;
+
+        if (vertex_format == TerrainVertexFormat::Compact)
+            result = device->CreateInputLayout(compactLayout, sizeof(compactLayout) / sizeof(compactLayout[0]),
+                                               vertexShaderBuffer->GetBufferPointer(), vertexShaderBuffer->GetBufferSize(), &layout);
+        else if (vertex_format == TerrainVertexFormat::Patch)
+            result = device->CreateInputLayout(patchLayout, sizeof(patchLayout) / sizeof(patchLayout[0]),
+                                               vertexShaderBuffer->GetBufferPointer(), vertexShaderBuffer->GetBufferSize(), &layout);
+        else
+            result = device->CreateInputLayout(polygonLayout, sizeof(polygonLayout) / sizeof(polygonLayout[0]),
+                                               vertexShaderBuffer->GetBufferPointer(), vertexShaderBuffer->GetBufferSize(), &layout);
         if (FAILED(result))
             return false;
 
@@ -260,6 +317,36 @@ namespace bm
         if (FAILED(result))
             return false;
 
+        if (vertex_format == TerrainVertexFormat::Compact)
+        {
+            D3D11_BUFFER_DESC chunk_buffer_desc;
+            chunk_buffer_desc.Usage = D3D11_USAGE_DYNAMIC;
+            chunk_buffer_desc.ByteWidth = sizeof(ChunkBufferType);
+            chunk_buffer_desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+            chunk_buffer_desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+            chunk_buffer_desc.MiscFlags = 0U;
+            chunk_buffer_desc.StructureByteStride = 0U;
+
+            result = device->CreateBuffer(&chunk_buffer_desc, nullptr, &chunk_buffer);
+            if (FAILED(result))
+                return false;
+        }
+
+        if (vertex_format == TerrainVertexFormat::Patch)
+        {
+            D3D11_BUFFER_DESC patch_buffer_desc;
+            patch_buffer_desc.Usage = D3D11_USAGE_DYNAMIC;
+            patch_buffer_desc.ByteWidth = sizeof(PatchBufferType);
+            patch_buffer_desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+            patch_buffer_desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+            patch_buffer_desc.MiscFlags = 0U;
+            patch_buffer_desc.StructureByteStride = 0U;
+
+            result = device->CreateBuffer(&patch_buffer_desc, nullptr, &patch_buffer);
+            if (FAILED(result))
+                return false;
+        }
+
         return true;
     }
 
@@ -285,8 +372,12 @@ namespace bm
                                             Vector4D diffuse_color,
                                             Vector3D light_direction,
                                             ID3D11ShaderResourceView* diffuse_texture,
-                                            ID3D11ShaderResourceView* bump_map_texture)
+                                            ID3D11ShaderResourceView* bump_map_texture,
+                                            ID3D11ShaderResourceView* height_texture)
     {
+        // The camera sits at the translation of the inverse view matrix.
+        DirectX::XMStoreFloat3(&camera_position, DirectX::XMMatrixInverse(nullptr, view).r[3]);
+
         world = DirectX::XMMatrixTranspose(world);
         view = DirectX::XMMatrixTranspose(view);
         projection = DirectX::XMMatrixTranspose(projection);
@@ -323,11 +414,52 @@ namespace bm
         device_context->PSSetShaderResources(0U, 1U, &diffuse_texture);
         device_context->PSSetShaderResources(1U, 1U, &bump_map_texture);
 
+        if (vertex_format == TerrainVertexFormat::Patch)
+            device_context->VSSetShaderResources(0U, 1U, &height_texture);
+
+        return true;
+    }
+
+
+    bool TerrainShader::setChunkParameters(ID3D11DeviceContext* device_context, const CompactVertexTransform& transform)
+    {
+        D3D11_MAPPED_SUBRESOURCE mapped_subresource;
+        auto result = device_context->Map(chunk_buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped_subresource);
+        if (FAILED(result))
+            return false;
+
+        auto data = reinterpret_cast<ChunkBufferType*>(mapped_subresource.pData);
+
+        data->position_offset = { transform.position_offset.x, transform.position_offset.y, transform.position_offset.z, 0.0f };
+        data->position_step = { transform.position_step.x, transform.position_step.y, transform.position_step.z, 0.0f };
+        data->texture_transform = { transform.texture_offset.x, transform.texture_offset.y, transform.texture_extent.x, transform.texture_extent.y };
+        device_context->Unmap(chunk_buffer, 0U);
+
         return true;
     }
 
+    bool TerrainShader::setPatchParameters(ID3D11DeviceContext* device_context, const TerrainPatchTransform& patch)
+    {
+        D3D11_MAPPED_SUBRESOURCE mapped_subresource;
+        auto result = device_context->Map(patch_buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped_subresource);
+        if (FAILED(result))
+            return false;
+
+        auto data = reinterpret_cast<PatchBufferType*>(mapped_subresource.pData);
+
+        // The coarsest level never morphs, its range has no end.
+        auto morph_range = patch.morph_end - patch.morph_start;
+        auto morph_scale = morph_range > 0.0f && patch.morph_end < FLT_MAX ? 1.0f / morph_range : 0.0f;
+
+        data->placement = { patch.x, patch.z, patch.step, patch.spacing };
+        data->morph = { patch.morph_start, morph_scale, 0.0f, 0.0f };
+        data->camera_position = { camera_position.x, camera_position.y, camera_position.z, 1.0f };
+        device_context->Unmap(patch_buffer, 0U);
 
-    void TerrainShader::renderShader(ID3D11DeviceContext* device_context, int index_count)
+        return true;
+    }
+
+    bool TerrainShader::renderShader(ID3D11DeviceContext* device_context, const std::vector<TerrainDrawCall>& draw_calls)
     {
         device_context->IASetInputLayout(layout);
 
@@ -336,6 +468,22 @@ namespace bm
 
         device_context->PSSetSamplers(0U, 1U, &sample_state);
 
-        device_context->DrawIndexed(index_count, 0U, 0);
+        if (vertex_format == TerrainVertexFormat::Compact)
+            device_context->VSSetConstantBuffers(1U, 1U, &chunk_buffer);
+        else if (vertex_format == TerrainVertexFormat::Patch)
+            device_context->VSSetConstantBuffers(1U, 1U, &patch_buffer);
+
+        for (auto& draw_call : draw_calls)
+        {
+            if (vertex_format == TerrainVertexFormat::Compact && !setChunkParameters(device_context, draw_call.transform))
+                return false;
+
+            if (vertex_format == TerrainVertexFormat::Patch && !setPatchParameters(device_context, draw_call.patch))
+                return false;
+
+            device_context->DrawIndexed(draw_call.index_count, draw_call.start_index, draw_call.base_vertex);
+        }
+
+        return true;
     }
 }
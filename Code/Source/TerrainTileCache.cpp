@@ -0,0 +1,716 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "TerrainTileCache.h"
+#include "HeightQueries.h"
+#include "ParallelFor.h"
+#include "VertexCache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace bm
+{
+    TerrainTileCache::TerrainTileCache(ID3D11Device* device, const wchar_t* height_map_file_name, const wchar_t* diffuse_texture_file_name,
+                                       const wchar_t* bump_map_file_name, const TerrainTileSettings& settings) :
+        settings(settings),
+        valid(false),
+        terrain_width(0),
+        terrain_height(0),
+        column_count(0),
+        row_count(0),
+        min_height(0.0f),
+        max_height(0.0f),
+        vertex_stride(settings.vertex_format == TerrainVertexFormat::Compact ? sizeof(CompactTerrainVertex) : sizeof(VertexType)),
+        slot_size(0U),
+        job_limit(0U),
+        frame(0U),
+        memory_usage(0U),
+        peak_memory_usage(0U),
+        stopping(false),
+        vertex_buffer(nullptr),
+        index_buffer(nullptr),
+        diffuse_texture(nullptr),
+        bump_texture(nullptr)
+    {
+        if(!loadHeightMap(height_map_file_name))
+            return;
+
+        if(settings.height_precision > 0.0f && !compressHeightMap())
+            return;
+
+        // A .bmheights file replaces the tile size of the settings with its own.
+        if(this->settings.tile_size < 2 || this->settings.tile_size > 256 || settings.vertex_format == TerrainVertexFormat::Patch)
+            return;
+
+        auto worker_count = resolveThreadCount(settings.worker_count);
+        job_limit = worker_count * jobs_per_worker;
+
+        // Fixed costs first: the tile mesh and the scratch of every worker, then the vertices of the tiles in flight.
+        // What is left is split into slots of the vertex buffer.
+        auto tile_size = this->settings.tile_size;
+        auto samples = static_cast<size_t>(tile_size) * tile_size;
+        auto apron_size = static_cast<size_t>(tile_size) + 2U;
+
+        slot_size = samples * vertex_stride;
+
+        auto scratch_memory = apron_size * apron_size * (sizeof(float) + sizeof(uint32_t)) + apron_size * sizeof(HeightFieldFrame);
+        if(tile_file)
+            scratch_memory += apron_size * apron_size * sizeof(float);
+
+        auto fixed_memory = samples * sizeof(uint16_t) * 2U + static_cast<size_t>(tile_size - 1) * (tile_size - 1) * 6U * sizeof(uint16_t) +
+                            worker_count * scratch_memory + compressed_heights.getMemoryUsage();
+        if(settings.memory_budget <= fixed_memory + job_limit * slot_size)
+            return;
+
+        auto slot_count = (settings.memory_budget - fixed_memory - job_limit * slot_size) / slot_size;
+        slot_count = std::min(slot_count, static_cast<size_t>(column_count) * row_count);
+        slot_count = std::min(slot_count, static_cast<size_t>(std::numeric_limits<UINT>::max()) / slot_size);
+        if(slot_count == 0U)
+            return;
+
+        tiles.resize(slot_count);
+        tile_slots.assign(static_cast<size_t>(column_count) * row_count, -1);
+
+        memory_usage = peak_memory_usage = fixed_memory + slot_count * slot_size;
+
+        if(!initializeBuffers(device))
+            return;
+
+        if(!loadTextures(device, diffuse_texture_file_name, bump_map_file_name))
+            return;
+
+        workers.reserve(worker_count);
+        for(auto w = 0U; w < worker_count; w++)
+            workers.emplace_back([this]() { runWorker(); });
+
+        valid = true;
+    }
+
+    TerrainTileCache::~TerrainTileCache()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        jobs_changed.notify_all();
+
+        for(auto& worker : workers)
+            worker.join();
+
+        if(bump_texture)
+            bump_texture->Release();
+
+        if(diffuse_texture)
+            diffuse_texture->Release();
+
+        if(index_buffer)
+            index_buffer->Release();
+
+        if(vertex_buffer)
+            vertex_buffer->Release();
+    }
+
+    void TerrainTileCache::update(ID3D11DeviceContext* device_context, const Vector& camera_position)
+    {
+        frame++;
+
+        std::vector<int> uploads;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            uploads.swap(built_tiles);
+        }
+
+        // Built tiles are left alone by the workers, so they are uploaded without the lock.
+        for(auto slot : uploads)
+        {
+            auto& tile = tiles[slot];
+
+            auto offset = static_cast<UINT>(slot * slot_size);
+            D3D11_BOX box = {offset, 0U, 0U, offset + static_cast<UINT>(slot_size), 1U, 1U};
+            device_context->UpdateSubresource(vertex_buffer, 0U, &box, tile.vertices.data(), 0U, 0U);
+
+            std::vector<unsigned char>().swap(tile.vertices);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            tile.state = TileState::Resident;
+            memory_usage -= slot_size;
+        }
+
+        Vector3D position;
+        DirectX::XMStoreFloat3(&position, camera_position);
+
+        // Tiles whose rectangle is within the load radius, nearest first.
+        auto tile_extent = static_cast<float>(settings.tile_size - 1) * grid_spacing;
+        auto radius = settings.load_radius;
+
+        auto getRange([&](float center, int count)
+        {
+            auto first = static_cast<int>(std::floor((center - radius) / tile_extent));
+            auto last = static_cast<int>(std::floor((center + radius) / tile_extent));
+
+            return std::make_pair(std::max(first, 0), std::min(last, count - 1));
+        });
+
+        auto columns = getRange(position.x, column_count);
+        auto rows = getRange(position.z, row_count);
+
+        std::vector<std::pair<float, int>> wanted;
+        for(auto row = rows.first; row <= rows.second; row++)
+        {
+            for(auto column = columns.first; column <= columns.second; column++)
+            {
+                auto x0 = static_cast<float>(column) * tile_extent, z0 = static_cast<float>(row) * tile_extent;
+                auto dx = std::max(std::max(x0 - position.x, position.x - (x0 + tile_extent)), 0.0f);
+                auto dz = std::max(std::max(z0 - position.z, position.z - (z0 + tile_extent)), 0.0f);
+
+                auto distance = dx * dx + dz * dz;
+                if(distance <= radius * radius)
+                    wanted.emplace_back(distance, row * column_count + column);
+            }
+        }
+
+        std::sort(wanted.begin(), wanted.end());
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for(auto& tile : wanted)
+            {
+                auto slot = tile_slots[tile.second];
+                if(slot >= 0)
+                    tiles[slot].last_used = frame;
+            }
+
+            // Queued tiles that are no longer wanted are dropped before a worker gets to them, the rest are queued again
+            // in the new order together with the missing ones.
+            jobs.clear();
+
+            auto pending = size_t();
+            for(auto slot = 0; slot < static_cast<int>(tiles.size()); slot++)
+            {
+                auto& tile = tiles[slot];
+                if(tile.state == TileState::Queued && tile.last_used != frame)
+                {
+                    tile_slots[tile.row * column_count + tile.column] = -1;
+                    tile.state = TileState::Empty;
+                    memory_usage -= slot_size;
+                }
+                else if(tile.state != TileState::Empty && tile.state != TileState::Resident)
+                    pending++;
+            }
+
+            for(auto& tile : wanted)
+            {
+                auto slot = tile_slots[tile.second];
+                if(slot >= 0)
+                {
+                    if(tiles[slot].state == TileState::Queued)
+                        jobs.push_back(slot);
+
+                    continue;
+                }
+
+                if(pending >= job_limit)
+                    continue;
+
+                slot = acquireSlot(frame);
+                if(slot < 0)
+                    break;
+
+                auto& new_tile = tiles[slot];
+                new_tile.state = TileState::Queued;
+                new_tile.column = tile.second % column_count;
+                new_tile.row = tile.second / column_count;
+                new_tile.last_used = frame;
+
+                tile_slots[tile.second] = slot;
+                memory_usage += slot_size;
+                peak_memory_usage = std::max(peak_memory_usage, memory_usage);
+
+                jobs.push_back(slot);
+                pending++;
+            }
+        }
+
+        jobs_changed.notify_all();
+
+        updateDrawCalls();
+    }
+
+    void TerrainTileCache::cullDrawCalls(const Frustum& frustum)
+    {
+        cullBoundingBoxes(frustum, draw_call_bounds, visible_indices);
+
+        visible_draw_calls.clear();
+        for(auto index : visible_indices)
+            visible_draw_calls.push_back(draw_calls[index]);
+    }
+
+    void TerrainTileCache::render(ID3D11DeviceContext* device_context)
+    {
+        UINT offset = 0U;
+
+        device_context->IASetVertexBuffers(0U, 1U, &vertex_buffer, &vertex_stride, &offset);
+        device_context->IASetIndexBuffer(index_buffer, DXGI_FORMAT_R16_UINT, 0U);
+        device_context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    }
+
+    bool TerrainTileCache::isTileResident(int column, int row) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto slot = tile_slots[row * column_count + column];
+        return slot >= 0 && tiles[slot].state == TileState::Resident;
+    }
+
+    size_t TerrainTileCache::getPendingTileCount() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        return static_cast<size_t>(std::count_if(tiles.begin(), tiles.end(), [](const TerrainTile& tile)
+        {
+            return tile.state != TileState::Empty && tile.state != TileState::Resident;
+        }));
+    }
+
+    size_t TerrainTileCache::getMemoryUsage() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return memory_usage;
+    }
+
+    size_t TerrainTileCache::getPeakMemoryUsage() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return peak_memory_usage;
+    }
+
+    bool TerrainTileCache::getGroundHeights(const float* x, const float* z, size_t count, float* heights, Vector3D* normals) const
+    {
+        if(compressed_heights.isEmpty())
+            return false;
+
+        sampleHeightField(compressed_heights, x, z, count, heights, normals);
+        return true;
+    }
+
+    bool TerrainTileCache::loadHeightMap(const wchar_t* file_name)
+    {
+        // The tiles of a .bmheights file are the ones drawn, its level 0 tiles line up with those made below.
+        tile_file = std::make_unique<HeightTileFile>(file_name);
+        if(tile_file->isValid())
+        {
+            auto& level = tile_file->getLevel(0);
+
+            settings.tile_size = tile_file->getHeader().tile_size;
+            terrain_width = level.width;
+            terrain_height = level.height;
+            column_count = level.columns;
+            row_count = level.rows;
+
+            // The compact vertices of every tile are quantized over the range of the whole heightmap.
+            min_height = std::numeric_limits<float>::max();
+            max_height = std::numeric_limits<float>::lowest();
+
+            for(auto row = 0; row < row_count; row++)
+            {
+                for(auto column = 0; column < column_count; column++)
+                {
+                    auto& tile = tile_file->getTile(0, column, row);
+
+                    min_height = std::min(min_height, tile.min_height);
+                    max_height = std::max(max_height, tile.max_height);
+                }
+            }
+
+            return true;
+        }
+
+        tile_file.reset();
+
+        // Only the rows of the tiles being built are ever touched, the rest of the bitmap stays on disk.
+        height_map_file = std::make_unique<MappedFile>(file_name);
+        if(!height_map_file->isOpen())
+            return false;
+
+        if(!readBitmapInfo(height_map_file->getData(), height_map_file->getSize(), bitmap_info))
+            return false;
+
+        terrain_width = bitmap_info.width;
+        terrain_height = bitmap_info.height;
+
+        // Whatever the bitmap holds, the compact vertices are quantized over the full range of a channel.
+        min_height = 0.0f;
+        max_height = 255.0f * height_scale / height_reduction;
+
+        // A heightmap narrower than a tile still makes one tile, its missing samples repeat the last column or row.
+        auto tile_quads = settings.tile_size - 1;
+        column_count = std::max((terrain_width - 1 + tile_quads - 1) / tile_quads, 1);
+        row_count = std::max((terrain_height - 1 + tile_quads - 1) / tile_quads, 1);
+
+        return true;
+    }
+
+    bool TerrainTileCache::compressHeightMap()
+    {
+        compressed_heights.reset(terrain_width, terrain_height, grid_spacing, settings.height_precision);
+
+        // Rows go into bands of eight, one row of blocks each. The tiles of a .bmheights file are read a row of tiles
+        // at a time, their interiors laid side by side.
+        std::vector<float> band(static_cast<size_t>(terrain_width) * 8U);
+        std::vector<float> tile_rows, stored_heights;
+        auto tile_row = -1;
+
+        auto tile_quads = settings.tile_size - 1;
+        if(tile_file)
+        {
+            tile_rows.resize(static_cast<size_t>(terrain_width) * settings.tile_size);
+            stored_heights.resize(static_cast<size_t>(tile_file->getStoredTileSize()) * tile_file->getStoredTileSize());
+        }
+
+        for(auto j = 0; j < terrain_height; j++)
+        {
+            auto row = band.data() + static_cast<size_t>(j % 8) * terrain_width;
+
+            if(tile_file)
+            {
+                auto row_of_tiles = std::min(j / tile_quads, row_count - 1);
+                if(row_of_tiles != tile_row)
+                {
+                    tile_row = row_of_tiles;
+
+                    auto stored_size = tile_file->getStoredTileSize();
+                    for(auto column = 0; column < column_count; column++)
+                    {
+                        if(!tile_file->readTile(0, column, tile_row, stored_heights.data()))
+                            return false;
+
+                        auto x0 = column * tile_quads;
+                        auto columns = std::min(settings.tile_size, terrain_width - x0);
+
+                        for(auto r = 0; r < settings.tile_size; r++)
+                        {
+                            auto stored = stored_heights.data() + static_cast<size_t>(r + 1) * stored_size + 1;
+                            std::copy(stored, stored + columns, tile_rows.data() + static_cast<size_t>(r) * terrain_width + x0);
+                        }
+                    }
+                }
+
+                auto source = tile_rows.data() + static_cast<size_t>(j - tile_row * tile_quads) * terrain_width;
+                std::copy(source, source + terrain_width, row);
+            }
+            else
+            {
+                // Decoded and scaled exactly like Terrain::loadHeightMap and Terrain::reduceHeightMap.
+                decodeBitmapRow(getBitmapRow(height_map_file->getData(), bitmap_info, j), terrain_width, height_scale, row);
+
+                for(auto i = int(); i < terrain_width; i++)
+                    row[i] /= height_reduction;
+            }
+
+            if(j % 8 == 7 || j == terrain_height - 1)
+                compressed_heights.appendBlockRow(band.data(), static_cast<size_t>(terrain_width));
+        }
+
+        tile_file.reset();
+        height_map_file.reset();
+
+        return compressed_heights.isComplete();
+    }
+
+    bool TerrainTileCache::initializeBuffers(ID3D11Device* device)
+    {
+        // All tiles share one triangle list over their row-major samples, split like the quads of Terrain.
+        auto tile_size = settings.tile_size;
+        auto vertex_count = static_cast<size_t>(tile_size) * tile_size;
+
+        indices.clear();
+        indices.reserve(static_cast<size_t>(tile_size - 1) * (tile_size - 1) * 6U);
+
+        for(auto j = int(); j < tile_size - 1; j++)
+        {
+            for(auto i = int(); i < tile_size - 1; i++)
+            {
+                auto bottom_left = static_cast<uint16_t>((j * tile_size) + i);
+                auto bottom_right = static_cast<uint16_t>(bottom_left + 1);
+                auto upper_left = static_cast<uint16_t>(bottom_left + tile_size);
+                auto upper_right = static_cast<uint16_t>(upper_left + 1);
+
+                indices.insert(indices.end(), {upper_left, upper_right, bottom_left, bottom_left, upper_right, bottom_right});
+            }
+        }
+
+        std::vector<uint16_t> fetch_order;
+        optimizeVertexCache(indices.data(), indices.size(), vertex_count);
+        optimizeVertexFetch(indices.data(), indices.size(), vertex_count, fetch_order);
+
+        vertex_order.resize(vertex_count);
+        for(auto v = size_t(); v < vertex_count; v++)
+            vertex_order[fetch_order[v]] = static_cast<uint16_t>(v);
+
+        D3D11_BUFFER_DESC vertex_buffer_desc;
+        vertex_buffer_desc.Usage = D3D11_USAGE_DEFAULT;
+        vertex_buffer_desc.ByteWidth = static_cast<UINT>(tiles.size() * slot_size);
+        vertex_buffer_desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+        vertex_buffer_desc.CPUAccessFlags = 0U;
+        vertex_buffer_desc.MiscFlags = 0U;
+        vertex_buffer_desc.StructureByteStride = 0U;
+
+        auto result = device->CreateBuffer(&vertex_buffer_desc, nullptr, &vertex_buffer);
+        if(FAILED(result))
+            return false;
+
+        D3D11_BUFFER_DESC index_buffer_desc;
+        index_buffer_desc.Usage = D3D11_USAGE_DEFAULT;
+        index_buffer_desc.ByteWidth = static_cast<UINT>(indices.size() * sizeof(uint16_t));
+        index_buffer_desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+        index_buffer_desc.CPUAccessFlags = 0U;
+        index_buffer_desc.MiscFlags = 0U;
+        index_buffer_desc.StructureByteStride = 0U;
+
+        D3D11_SUBRESOURCE_DATA index_data;
+        index_data.pSysMem = indices.data();
+        index_data.SysMemPitch = 0U;
+        index_data.SysMemSlicePitch = 0U;
+
+        result = device->CreateBuffer(&index_buffer_desc, &index_data, &index_buffer);
+        if(FAILED(result))
+            return false;
+
+        return true;
+    }
+
+    bool TerrainTileCache::loadTextures(ID3D11Device* device, const wchar_t* diffuse_texture_file_name, const wchar_t* bump_map_file_name)
+    {
+        if(!*diffuse_texture_file_name && !*bump_map_file_name)
+            return true;
+
+        auto x = DirectX::CreateDDSTextureFromFile(device, diffuse_texture_file_name, nullptr, &diffuse_texture);
+        if(FAILED(x))
+            return false;
+
+        x = DirectX::CreateDDSTextureFromFile(device, bump_map_file_name, nullptr, &bump_texture);
+        if(FAILED(x))
+            return false;
+
+        return true;
+    }
+
+    void TerrainTileCache::runWorker()
+    {
+        // Scratch for the largest tile, so that building one allocates nothing but the tile itself.
+        HeightField apron(settings.tile_size + 2, settings.tile_size + 2, grid_spacing);
+        std::vector<float> stored_heights(tile_file ? static_cast<size_t>(tile_file->getStoredTileSize()) * tile_file->getStoredTileSize() : 0U);
+        std::vector<HeightFieldFrame> frames(settings.tile_size + 2);
+
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while(true)
+        {
+            jobs_changed.wait(lock, [this]() { return stopping || !jobs.empty(); });
+            if(stopping)
+                return;
+
+            auto slot = jobs.front();
+            jobs.pop_front();
+
+            auto& tile = tiles[slot];
+            tile.state = TileState::Building;
+
+            lock.unlock();
+            auto result = buildTile(tile, apron, stored_heights, frames);
+            lock.lock();
+
+            if(result)
+            {
+                tile.state = TileState::Built;
+                built_tiles.push_back(slot);
+                continue;
+            }
+
+            // A tile that couldn't be read gives its slot back, the next update asks for it again.
+            tile_slots[tile.row * column_count + tile.column] = -1;
+            tile.state = TileState::Empty;
+            std::vector<unsigned char>().swap(tile.vertices);
+            memory_usage -= slot_size;
+        }
+    }
+
+    bool TerrainTileCache::buildTile(TerrainTile& tile, HeightField& apron, std::vector<float>& stored_heights, std::vector<HeightFieldFrame>& frames) const
+    {
+        auto tile_size = settings.tile_size;
+
+        // Heightmap samples of the tile, clamped to the heightmap, and the apron of one sample around them where the
+        // heightmap has one.
+        auto x0 = tile.column * (tile_size - 1), z0 = tile.row * (tile_size - 1);
+        auto x1 = std::min(x0 + tile_size - 1, terrain_width - 1), z1 = std::min(z0 + tile_size - 1, terrain_height - 1);
+
+        auto apron_x0 = std::max(x0 - 1, 0), apron_x1 = std::min(x1 + 1, terrain_width - 1);
+        auto apron_z0 = std::max(z0 - 1, 0), apron_z1 = std::min(z1 + 1, terrain_height - 1);
+
+        apron.resize(apron_x1 - apron_x0 + 1, apron_z1 - apron_z0 + 1, grid_spacing);
+
+        if(!compressed_heights.isEmpty())
+        {
+            for(auto j = apron_z0; j <= apron_z1; j++)
+                compressed_heights.decodeRow(j, apron_x0, apron_x1 + 1, apron.getRow(j - apron_z0));
+        }
+        else if(tile_file)
+        {
+            if(!tile_file->readTile(0, tile.column, tile.row, stored_heights.data()))
+                return false;
+
+            // The stored tile starts one sample before the tile and repeats the edges of the heightmap, the apron stops at them.
+            auto stored_size = tile_file->getStoredTileSize();
+            auto stored = stored_heights.data() + static_cast<size_t>(apron_z0 - (z0 - 1)) * stored_size + (apron_x0 - (x0 - 1));
+
+            for(auto j = int(); j < apron.getHeight(); j++, stored += stored_size)
+                std::copy(stored, stored + apron.getWidth(), apron.getRow(j));
+        }
+        else
+        {
+            // Decoded and scaled exactly like Terrain::loadHeightMap and Terrain::reduceHeightMap.
+            for(auto j = apron_z0; j <= apron_z1; j++)
+            {
+                auto row = apron.getRow(j - apron_z0);
+                decodeBitmapRow(getBitmapRow(height_map_file->getData(), bitmap_info, j) + static_cast<size_t>(apron_x0) * 3U, apron.getWidth(), height_scale, row);
+
+                for(auto i = int(); i < apron.getWidth(); i++)
+                    row[i] /= height_reduction;
+            }
+        }
+
+        auto& transform = tile.transform;
+        transform.position_offset = Vector3D(static_cast<float>(x0) * grid_spacing, min_height, static_cast<float>(z0) * grid_spacing);
+        transform.position_step = Vector3D(grid_spacing, std::max((max_height - min_height) / 65535.0f, 1e-6f), grid_spacing);
+        transform.texture_offset = Vector2D(static_cast<float>(x0), static_cast<float>(terrain_height - 1 - z0 - (tile_size - 1)));
+        transform.texture_extent = Vector2D(static_cast<float>(tile_size - 1), static_cast<float>(tile_size - 1));
+
+        tile.vertices.resize(slot_size);
+
+        auto min_tile_height = std::numeric_limits<float>::max(), max_tile_height = std::numeric_limits<float>::lowest();
+
+        for(auto j = int(); j < tile_size; j++)
+        {
+            auto z = std::min(z0 + j, z1);
+
+            // Frames of the tile's columns only, the apron columns just feed their differences.
+            computeHeightFieldFrames(apron, z - apron_z0, x0 - apron_x0, x1 - apron_x0 + 1, frames.data());
+
+            for(auto i = int(); i < tile_size; i++)
+            {
+                auto x = std::min(x0 + i, x1);
+
+                auto& frame = frames[x - x0];
+                auto height = apron.getHeight(x - apron_x0, z - apron_z0);
+
+                min_tile_height = std::min(min_tile_height, height);
+                max_tile_height = std::max(max_tile_height, height);
+
+                auto position = Vector3D(static_cast<float>(x) * grid_spacing, height, static_cast<float>(z) * grid_spacing);
+                auto texture = Vector2D(static_cast<float>(x), static_cast<float>(terrain_height - 1 - z));
+
+                auto vertex = tile.vertices.data() + static_cast<size_t>(vertex_order[j * tile_size + i]) * vertex_stride;
+                if(settings.vertex_format == TerrainVertexFormat::Compact)
+                {
+                    *reinterpret_cast<CompactTerrainVertex*>(vertex) = encodeCompactVertex(transform, position, texture, frame.normal, frame.tangent,
+                                                                                          frame.binormal);
+                    continue;
+                }
+
+                auto& full_vertex = *reinterpret_cast<VertexType*>(vertex);
+                full_vertex.position = position;
+                full_vertex.texture = texture;
+                full_vertex.normal = frame.normal;
+                full_vertex.tangent = frame.tangent;
+                full_vertex.binormal = frame.binormal;
+            }
+        }
+
+        tile.bounds_min = Vector3D(static_cast<float>(x0) * grid_spacing, min_tile_height, static_cast<float>(z0) * grid_spacing);
+        tile.bounds_max = Vector3D(static_cast<float>(x1) * grid_spacing, max_tile_height, static_cast<float>(z1) * grid_spacing);
+
+        return true;
+    }
+
+    bool TerrainTileCache::buildTileVertices(int column, int row, std::vector<unsigned char>& vertices) const
+    {
+        if(!valid || column < 0 || column >= column_count || row < 0 || row >= row_count)
+            return false;
+
+        // Scratch of its own, the workers may be using theirs.
+        HeightField apron(settings.tile_size + 2, settings.tile_size + 2, grid_spacing);
+        std::vector<float> stored_heights(tile_file ? static_cast<size_t>(tile_file->getStoredTileSize()) * tile_file->getStoredTileSize() : 0U);
+        std::vector<HeightFieldFrame> frames(settings.tile_size + 2);
+
+        TerrainTile tile;
+        tile.column = column;
+        tile.row = row;
+
+        if(!buildTile(tile, apron, stored_heights, frames))
+            return false;
+
+        vertices.resize(slot_size);
+        for(auto k = size_t(); k < vertex_order.size(); k++)
+            std::copy_n(tile.vertices.data() + static_cast<size_t>(vertex_order[k]) * vertex_stride, vertex_stride, vertices.data() + k * vertex_stride);
+
+        return true;
+    }
+
+    int TerrainTileCache::acquireSlot(uint64_t frame)
+    {
+        // An empty slot, or else the one of the least recently used resident tile that the current frame doesn't want.
+        auto best = -1;
+        for(auto slot = 0; slot < static_cast<int>(tiles.size()); slot++)
+        {
+            auto& tile = tiles[slot];
+            if(tile.state == TileState::Empty)
+                return slot;
+
+            if(tile.state == TileState::Resident && tile.last_used != frame && (best < 0 || tile.last_used < tiles[best].last_used))
+                best = slot;
+        }
+
+        if(best < 0)
+            return -1;
+
+        auto& evicted = tiles[best];
+        tile_slots[evicted.row * column_count + evicted.column] = -1;
+        evicted.state = TileState::Empty;
+
+        return best;
+    }
+
+    void TerrainTileCache::updateDrawCalls()
+    {
+        draw_calls.clear();
+        draw_call_bounds.clear();
+
+        auto index_count = static_cast<UINT>(indices.size());
+        auto vertex_count = static_cast<INT>(settings.tile_size * settings.tile_size);
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        for(auto slot = 0; slot < static_cast<int>(tiles.size()); slot++)
+        {
+            auto& tile = tiles[slot];
+            if(tile.state != TileState::Resident)
+                continue;
+
+            TerrainDrawCall draw_call = {};
+            draw_call.index_count = index_count;
+            draw_call.start_index = 0U;
+            draw_call.base_vertex = slot * vertex_count;
+            draw_call.transform = tile.transform;
+
+            draw_calls.push_back(draw_call);
+            draw_call_bounds.add(tile.bounds_min, tile.bounds_max);
+        }
+
+        visible_draw_calls = draw_calls;
+    }
+}
@@ -0,0 +1,206 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "TerrainVertex.h"
+#include "NormalPacking.h"
+
+#include <algorithm>
+
+namespace bm
+{
+    namespace
+    {
+        int8_t quantizeSnorm8(float value)
+        {
+            value = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+
+            return static_cast<int8_t>(std::lround(value * 127.0f));
+        }
+
+        float dequantizeSnorm8(int8_t value)
+        {
+            return std::max(static_cast<float>(value) / 127.0f, -1.0f);
+        }
+
+        uint16_t quantizeSteps(float value, float offset, float step)
+        {
+            auto steps = std::lround((value - offset) / step);
+
+            return static_cast<uint16_t>(std::max(0L, std::min(steps, 65535L)));
+        }
+
+        uint16_t quantizeUnorm16(float value, float offset, float extent)
+        {
+            auto normalized = (value - offset) / extent;
+
+            return static_cast<uint16_t>(std::lround(std::max(0.0f, std::min(normalized, 1.0f)) * 65535.0f));
+        }
+
+        float dot(const Vector3D& a, const Vector3D& b)
+        {
+            return a.x * b.x + a.y * b.y + a.z * b.z;
+        }
+
+        Vector3D cross(const Vector3D& a, const Vector3D& b)
+        {
+            return Vector3D(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+        }
+
+        Vector3D normalize(const Vector3D& v)
+        {
+            auto length = std::sqrt(dot(v, v));
+
+            return Vector3D(v.x / length, v.y / length, v.z / length);
+        }
+    }
+
+    CompactTerrainVertex encodeCompactVertex(const CompactVertexTransform& transform,
+                                             const Vector3D& position,
+                                             const Vector2D& texture,
+                                             const Vector3D& normal,
+                                             const Vector3D& tangent,
+                                             const Vector3D& binormal)
+    {
+        CompactTerrainVertex vertex;
+
+        vertex.position[0] = quantizeSteps(position.x, transform.position_offset.x, transform.position_step.x);
+        vertex.position[1] = quantizeSteps(position.y, transform.position_offset.y, transform.position_step.y);
+        vertex.position[2] = quantizeSteps(position.z, transform.position_offset.z, transform.position_step.z);
+
+        float u, v;
+        projectOctahedral(normal, u, v);
+        vertex.position[3] = static_cast<uint16_t>(static_cast<uint8_t>(quantizeSnorm8(u)) | (static_cast<uint8_t>(quantizeSnorm8(v)) << 8));
+
+        vertex.texture[0] = quantizeUnorm16(texture.x, transform.texture_offset.x, transform.texture_extent.x);
+        vertex.texture[1] = quantizeUnorm16(texture.y, transform.texture_offset.y, transform.texture_extent.y);
+
+        encodeTangentFrame(normal, tangent, binormal, vertex.tangent_frame);
+
+        return vertex;
+    }
+
+    void decodeCompactVertex(const CompactTerrainVertex& vertex,
+                             const CompactVertexTransform& transform,
+                             Vector3D& position,
+                             Vector2D& texture,
+                             Vector3D& normal,
+                             Vector3D& tangent,
+                             Vector3D& binormal)
+    {
+        position.x = transform.position_offset.x + static_cast<float>(vertex.position[0]) * transform.position_step.x;
+        position.y = transform.position_offset.y + static_cast<float>(vertex.position[1]) * transform.position_step.y;
+        position.z = transform.position_offset.z + static_cast<float>(vertex.position[2]) * transform.position_step.z;
+
+        texture.x = transform.texture_offset.x + (static_cast<float>(vertex.texture[0]) / 65535.0f) * transform.texture_extent.x;
+        texture.y = transform.texture_offset.y + (static_cast<float>(vertex.texture[1]) / 65535.0f) * transform.texture_extent.y;
+
+        // The normal comes from the octahedral encoding, the frame quaternion only provides tangent and binormal.
+        Vector3D frame_normal;
+        decodeTangentFrame(vertex.tangent_frame, frame_normal, tangent, binormal);
+
+        normal = unprojectOctahedral(dequantizeSnorm8(static_cast<int8_t>(vertex.position[3] & 0xFFU)),
+                                     dequantizeSnorm8(static_cast<int8_t>(vertex.position[3] >> 8)));
+    }
+
+    void encodeTangentFrame(const Vector3D& normal, const Vector3D& tangent, const Vector3D& binormal, int8_t quaternion[4])
+    {
+        // Gram-Schmidt around the normal, the binormal is rebuilt so the basis is a proper rotation.
+        auto n = normalize(normal);
+        auto along_normal = dot(n, tangent);
+        auto tn = normalize(Vector3D(tangent.x - n.x * along_normal, tangent.y - n.y * along_normal, tangent.z - n.z * along_normal));
+        auto b = cross(n, tn);
+
+        auto reflected = dot(b, binormal) < 0.0f;
+
+        // Columns of the rotation matrix are tangent, binormal and normal.
+        float m00 = tn.x, m01 = b.x, m02 = n.x;
+        float m10 = tn.y, m11 = b.y, m12 = n.y;
+        float m20 = tn.z, m21 = b.z, m22 = n.z;
+
+        float q[4]; // x, y, z, w
+        auto trace = m00 + m11 + m22;
+
+        if(trace > 0.0f)
+        {
+            auto s = std::sqrt(trace + 1.0f) * 2.0f;
+            q[3] = 0.25f * s;
+            q[0] = (m21 - m12) / s;
+            q[1] = (m02 - m20) / s;
+            q[2] = (m10 - m01) / s;
+        }
+        else if(m00 > m11 && m00 > m22)
+        {
+            auto s = std::sqrt(1.0f + m00 - m11 - m22) * 2.0f;
+            q[3] = (m21 - m12) / s;
+            q[0] = 0.25f * s;
+            q[1] = (m01 + m10) / s;
+            q[2] = (m02 + m20) / s;
+        }
+        else if(m11 > m22)
+        {
+            auto s = std::sqrt(1.0f + m11 - m00 - m22) * 2.0f;
+            q[3] = (m02 - m20) / s;
+            q[0] = (m01 + m10) / s;
+            q[1] = 0.25f * s;
+            q[2] = (m12 + m21) / s;
+        }
+        else
+        {
+            auto s = std::sqrt(1.0f + m22 - m00 - m11) * 2.0f;
+            q[3] = (m10 - m01) / s;
+            q[0] = (m02 + m20) / s;
+            q[1] = (m12 + m21) / s;
+            q[2] = 0.25f * s;
+        }
+
+        // q and -q are the same rotation, so W is made positive and its sign is free to carry the reflection.
+        // W must not quantize to zero, otherwise the sign would be lost.
+        if(q[3] < 0.0f)
+        {
+            for(auto& component : q)
+                component = -component;
+        }
+
+        const auto min_w = 1.0f / 127.0f;
+        if(q[3] < min_w)
+        {
+            auto scale = std::sqrt(1.0f - min_w * min_w) / std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2]);
+
+            q[0] *= scale;
+            q[1] *= scale;
+            q[2] *= scale;
+            q[3] = min_w;
+        }
+
+        if(reflected)
+        {
+            for(auto& component : q)
+                component = -component;
+        }
+
+        for(auto i = 0; i < 4; i++)
+            quaternion[i] = quantizeSnorm8(q[i]);
+    }
+
+    void decodeTangentFrame(const int8_t quaternion[4], Vector3D& normal, Vector3D& tangent, Vector3D& binormal)
+    {
+        float x = dequantizeSnorm8(quaternion[0]);
+        float y = dequantizeSnorm8(quaternion[1]);
+        float z = dequantizeSnorm8(quaternion[2]);
+        float w = dequantizeSnorm8(quaternion[3]);
+
+        auto length = std::sqrt(x * x + y * y + z * z + w * w);
+        x /= length;
+        y /= length;
+        z /= length;
+        w /= length;
+
+        tangent = Vector3D(1.0f - 2.0f * (y * y + z * z), 2.0f * (x * y + w * z), 2.0f * (x * z - w * y));
+        binormal = Vector3D(2.0f * (x * y - w * z), 1.0f - 2.0f * (x * x + z * z), 2.0f * (y * z + w * x));
+        normal = Vector3D(2.0f * (x * z + w * y), 2.0f * (y * z - w * x), 1.0f - 2.0f * (x * x + y * y));
+
+        if(w < 0.0f)
+            binormal = Vector3D(-binormal.x, -binormal.y, -binormal.z);
+    }
+}
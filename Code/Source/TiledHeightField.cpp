@@ -0,0 +1,45 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "TiledHeightField.h"
+#include "HeightFieldAccess.h"
+#include "ParallelFor.h"
+
+namespace bm
+{
+    TiledHeightField::TiledHeightField(int width, int height, float spacing)
+    {
+        resize(width, height, spacing);
+    }
+
+    void TiledHeightField::resize(int width, int height, float spacing)
+    {
+        this->width = width;
+        this->height = height;
+        this->spacing = spacing;
+
+        tile_columns = (width + tile_mask) >> tile_shift;
+        tile_rows = (height + tile_mask) >> tile_shift;
+
+        auto sample_count = (static_cast<size_t>(tile_columns) * static_cast<size_t>(tile_rows)) << (2 * tile_shift);
+
+        heights.assign(sample_count, 0.0f);
+        normals.assign(sample_count, packNormal(Vector3D(0.0f, 1.0f, 0.0f)));
+    }
+
+    void TiledHeightField::build(const HeightField& height_field, unsigned thread_count)
+    {
+        resize(height_field.getWidth(), height_field.getHeight(), height_field.getSpacing());
+
+        parallelFor(0, height, thread_count, [&](int first_row, int last_row)
+        {
+            copyHeightField(height_field, *this, 0, width, first_row, last_row);
+        });
+    }
+
+    size_t TiledHeightField::getMemoryUsage() const
+    {
+        return heights.capacity() * sizeof(float) + normals.capacity() * sizeof(uint32_t);
+    }
+}
@@ -0,0 +1,214 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "VertexCache.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace bm
+{
+    namespace
+    {
+        // Size of the LRU cache modelled while scoring, larger than the real cache on purpose, as suggested by the paper.
+        constexpr int max_cache_size = 32;
+
+        constexpr float cache_decay_power = 1.5f;
+        constexpr float last_triangle_score = 0.75f;
+        constexpr float valence_boost_scale = 2.0f;
+        constexpr float valence_boost_power = 0.5f;
+
+        float scoreVertex(int cache_position, int remaining_triangles)
+        {
+            // Vertices without triangles left are never picked again.
+            if(remaining_triangles == 0)
+                return -1.0f;
+
+            auto score = 0.0f;
+
+            // The three vertices of the last triangle get a fixed score, so the next triangle doesn't simply reuse the same edge.
+            if(cache_position >= 0)
+            {
+                if(cache_position < 3)
+                    score = last_triangle_score;
+                else
+                    score = std::pow(1.0f - static_cast<float>(cache_position - 3) / static_cast<float>(max_cache_size - 3), cache_decay_power);
+            }
+
+            // Vertices with few triangles left are boosted, so that they are finished off and leave no lonely triangles behind.
+            return score + valence_boost_scale * std::pow(static_cast<float>(remaining_triangles), -valence_boost_power);
+        }
+    }
+
+    VertexCacheStats simulateVertexCache(const uint16_t* indices, size_t index_count, size_t vertex_count, size_t cache_size)
+    {
+        // Time stamp of the moment every vertex entered the FIFO; a vertex is cached while fewer than cache_size misses followed it.
+        std::vector<size_t> cache_time(vertex_count, 0U);
+        std::vector<bool> referenced(vertex_count, false);
+
+        size_t misses = 0U;
+        size_t unique = 0U;
+
+        for(auto k = size_t(); k < index_count; k++)
+        {
+            auto vertex = indices[k];
+
+            if(!referenced[vertex])
+            {
+                referenced[vertex] = true;
+                unique++;
+            }
+
+            if(cache_time[vertex] == 0U || misses - cache_time[vertex] >= cache_size)
+            {
+                misses++;
+                cache_time[vertex] = misses;
+            }
+        }
+
+        VertexCacheStats stats;
+        stats.acmr = index_count ? static_cast<float>(misses) / static_cast<float>(index_count / 3U) : 0.0f;
+        stats.atvr = unique ? static_cast<float>(misses) / static_cast<float>(unique) : 0.0f;
+
+        return stats;
+    }
+
+    void optimizeVertexCache(uint16_t* indices, size_t index_count, size_t vertex_count)
+    {
+        auto triangle_count = index_count / 3U;
+        if(triangle_count == 0U)
+            return;
+
+        // Triangles adjacent to every vertex, in compressed rows.
+        std::vector<int> remaining(vertex_count, 0);
+        for(auto k = size_t(); k < triangle_count * 3U; k++)
+            remaining[indices[k]]++;
+
+        std::vector<size_t> adjacency_offsets(vertex_count + 1U, 0U);
+        for(auto v = size_t(); v < vertex_count; v++)
+            adjacency_offsets[v + 1U] = adjacency_offsets[v] + static_cast<size_t>(remaining[v]);
+
+        std::vector<int> adjacency(adjacency_offsets.back());
+        {
+            auto fill = adjacency_offsets;
+            for(auto k = size_t(); k < triangle_count * 3U; k++)
+                adjacency[fill[indices[k]]++] = static_cast<int>(k / 3U);
+        }
+
+        std::vector<int> cache_position(vertex_count, -1);
+        std::vector<float> vertex_score(vertex_count);
+        for(auto v = size_t(); v < vertex_count; v++)
+            vertex_score[v] = scoreVertex(-1, remaining[v]);
+
+        std::vector<bool> emitted(triangle_count, false);
+
+        std::vector<uint16_t> output;
+        output.reserve(triangle_count * 3U);
+
+        // Three more entries than the modelled cache, so vertices pushed out of it can still be rescored.
+        std::vector<uint16_t> cache, next_cache;
+        cache.reserve(max_cache_size + 3);
+        next_cache.reserve(max_cache_size + 3);
+
+        auto best_triangle = -1;
+        auto scan_position = size_t();
+
+        for(auto emitted_count = size_t(); emitted_count < triangle_count; emitted_count++)
+        {
+            // Nothing in the cache has triangles left, so fall back to the first triangle that hasn't been emitted yet.
+            if(best_triangle < 0)
+            {
+                while(emitted[scan_position])
+                    scan_position++;
+
+                best_triangle = static_cast<int>(scan_position);
+            }
+
+            auto triangle = indices + best_triangle * 3;
+            emitted[best_triangle] = true;
+
+            next_cache.clear();
+
+            for(auto c = int(); c < 3; c++)
+            {
+                auto vertex = triangle[c];
+                output.push_back(vertex);
+                next_cache.push_back(vertex);
+
+                // Drop the emitted triangle from the adjacency of its vertices.
+                auto first = adjacency.begin() + adjacency_offsets[vertex];
+                auto last = first + remaining[vertex];
+                std::iter_swap(std::find(first, last, best_triangle), last - 1);
+                remaining[vertex]--;
+            }
+
+            for(auto vertex : cache)
+            {
+                if(vertex != triangle[0] && vertex != triangle[1] && vertex != triangle[2])
+                    next_cache.push_back(vertex);
+            }
+
+            std::swap(cache, next_cache);
+
+            // Update the scores of everything in the cache, including the vertices that just fell out of it.
+            for(auto position = int(); position < static_cast<int>(cache.size()); position++)
+            {
+                auto vertex = cache[position];
+                cache_position[vertex] = position < max_cache_size ? position : -1;
+                vertex_score[vertex] = scoreVertex(cache_position[vertex], remaining[vertex]);
+            }
+
+            // Rescore the triangles around the cached vertices and pick the best one for the next step.
+            best_triangle = -1;
+            auto best_score = -1.0f;
+
+            for(auto vertex : cache)
+            {
+                auto first = adjacency_offsets[vertex];
+
+                for(auto a = first; a < first + static_cast<size_t>(remaining[vertex]); a++)
+                {
+                    auto t = static_cast<size_t>(adjacency[a]);
+                    auto score = vertex_score[indices[t * 3U]] + vertex_score[indices[t * 3U + 1U]] + vertex_score[indices[t * 3U + 2U]];
+
+                    if(score > best_score)
+                    {
+                        best_score = score;
+                        best_triangle = static_cast<int>(t);
+                    }
+                }
+            }
+
+            if(cache.size() > static_cast<size_t>(max_cache_size))
+                cache.resize(max_cache_size);
+        }
+
+        std::copy(output.begin(), output.end(), indices);
+    }
+
+    void optimizeVertexFetch(uint16_t* indices, size_t index_count, size_t vertex_count, std::vector<uint16_t>& vertex_order)
+    {
+        std::vector<int> remap(vertex_count, -1);
+        vertex_order.clear();
+        vertex_order.reserve(vertex_count);
+
+        for(auto k = size_t(); k < index_count; k++)
+        {
+            auto& new_index = remap[indices[k]];
+            if(new_index < 0)
+            {
+                new_index = static_cast<int>(vertex_order.size());
+                vertex_order.push_back(indices[k]);
+            }
+
+            indices[k] = static_cast<uint16_t>(new_index);
+        }
+
+        for(auto v = size_t(); v < vertex_count; v++)
+        {
+            if(remap[v] < 0)
+                vertex_order.push_back(static_cast<uint16_t>(v));
+        }
+    }
+}
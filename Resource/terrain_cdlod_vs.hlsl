@@ -0,0 +1,112 @@
+// Copyright (c) 2018 Valentyn Bondarenko. All rights reserved.
+
+cbuffer MatrixBuffer : register(b0)
+{
+	matrix worldMatrix;
+	matrix viewMatrix;
+	matrix projectionMatrix;
+};
+
+// Placement of the CDLOD node being drawn.
+cbuffer PatchBuffer : register(b1)
+{
+	float4 patchPlacement; // xy - first heightmap sample of the node, z - samples per patch quad, w - world units per sample.
+	float4 morphRange;     // x - distance the morph starts at, y - 1 / length of the morph.
+	float4 cameraPosition;
+};
+
+Texture2D<float> heightMap : register(t0);
+
+
+struct VertexInputType
+{
+    float2 position : POSITION; // Grid position within the patch.
+};
+
+struct PixelInputType
+{
+    float4 position : SV_POSITION;
+    float2 tex : TEXCOORD0;
+   	float3 normal : NORMAL;
+	float3 tangent : TANGENT;
+	float3 binormal : BINORMAL;
+    float4 depthPosition : TEXCOORD1;
+};
+
+float loadHeight(int2 sample, int2 lastSample)
+{
+	return heightMap.Load(int3(clamp(sample, int2(0, 0), lastSample), 0));
+}
+
+// Bilinear height between the samples, done by hand so that the R32_FLOAT texture doesn't need filtering support.
+float sampleHeight(float2 sample, int2 lastSample)
+{
+	float2 base = floor(sample);
+	float2 weight = sample - base;
+	int2 texel = int2(base);
+
+	float bottom = lerp(loadHeight(texel, lastSample), loadHeight(texel + int2(1, 0), lastSample), weight.x);
+	float top = lerp(loadHeight(texel + int2(0, 1), lastSample), loadHeight(texel + int2(1, 1), lastSample), weight.x);
+
+	return lerp(bottom, top, weight.y);
+}
+
+PixelInputType TerrainVertexShader(VertexInputType input)
+{
+    PixelInputType output;
+
+	uint width, height;
+	heightMap.GetDimensions(width, height);
+
+	int2 lastSample = int2(width, height) - 1;
+	float spacing = patchPlacement.w;
+
+	// Distance of the unmorphed vertex, the world matrix is expected to keep the terrain in place.
+	float2 sample = min(patchPlacement.xy + input.position * patchPlacement.z, float2(lastSample));
+	float3 gridPosition = float3(sample.x * spacing, sampleHeight(sample, lastSample), sample.y * spacing);
+
+	// Odd grid vertices slide onto their even neighbour towards the end of the node's range, where the patch then
+	// matches the next coarser level exactly.
+	float morph = saturate((distance(gridPosition, cameraPosition.xyz) - morphRange.x) * morphRange.y);
+	float2 morphedPosition = input.position - frac(input.position * 0.5f) * 2.0f * morph;
+
+	sample = min(patchPlacement.xy + morphedPosition * patchPlacement.z, float2(lastSample));
+	float4 position = float4(sample.x * spacing, sampleHeight(sample, lastSample), sample.y * spacing, 1.0f);
+
+	// Calculate the position of the vertex against the world, view, and projection matrices.
+    output.position = mul(position, worldMatrix);
+    output.position = mul(output.position, viewMatrix);
+    output.position = mul(output.position, projectionMatrix);
+
+	// Store the position value in a second input value for depth value calculations.
+	output.depthPosition = output.position;
+
+    // One texture repeat per heightmap sample, like the chunk mesh.
+    output.tex = float2(sample.x, float(lastSample.y) - sample.y);
+
+	// Closed-form tangent frame from the height gradient, central differences of the full resolution heightmap
+	// (one-sided at the border).
+	float2 lower = max(sample - 1.0f, 0.0f);
+	float2 upper = min(sample + 1.0f, float2(lastSample));
+
+	float gx = (sampleHeight(float2(upper.x, sample.y), lastSample) - sampleHeight(float2(lower.x, sample.y), lastSample)) / ((upper.x - lower.x) * spacing);
+	float gz = (sampleHeight(float2(sample.x, upper.y), lastSample) - sampleHeight(float2(sample.x, lower.y), lastSample)) / ((upper.y - lower.y) * spacing);
+
+	float3 normal = float3(-gx, 1.0f, -gz);
+	float3 tangent = float3(1.0f, gx, 0.0f);
+	float3 binormal = float3(0.0f, -gz, -1.0f);
+
+    // Calculate the normal vector against the world matrix only and then normalize the final value.
+    output.normal = mul(normal, (float3x3)worldMatrix);
+    output.normal = normalize(output.normal);
+
+	// Calculate the tangent vector against the world matrix only and then normalize the final value.
+    output.tangent = mul(tangent, (float3x3)worldMatrix);
+    output.tangent = normalize(output.tangent);
+
+    // Calculate the binormal vector against the world matrix only and then normalize the final value.
+    output.binormal = mul(binormal, (float3x3)worldMatrix);
+    output.binormal = normalize(output.binormal);
+
+    return output;
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2018 Valentyn Bondarenko. All rights reserved.
+
+cbuffer MatrixBuffer : register(b0)
+{
+	matrix worldMatrix;
+	matrix viewMatrix;
+	matrix projectionMatrix;
+};
+
+// Dequantization constants of the chunk being drawn.
+cbuffer ChunkBuffer : register(b1)
+{
+	float4 positionOffset;
+	float4 positionStep;
+	float4 textureTransform; // xy - offset, zw - extent.
+};
+
+
+struct VertexInputType
+{
+    uint4 position : POSITION; // xyz - quantized position, w - octahedral normal as two snorm8 values.
+    float2 tex : TEXCOORD0;
+	float4 tangentFrame : TANGENT; // Quaternion, a negative w flips the binormal.
+};
+
+struct PixelInputType
+{
+    float4 position : SV_POSITION;
+    float2 tex : TEXCOORD0;
+   	float3 normal : NORMAL;
+	float3 tangent : TANGENT;
+	float3 binormal : BINORMAL;
+    float4 depthPosition : TEXCOORD1;
+};
+
+float3 decodeOctahedralNormal(uint packed)
+{
+	// Sign extend both bytes.
+	int2 snorm = asint(uint2(packed << 24, packed << 16)) >> 24;
+	float2 uv = max(float2(snorm) / 127.0f, -1.0f);
+
+	float3 normal = float3(uv.x, 1.0f - abs(uv.x) - abs(uv.y), uv.y);
+	if (normal.y < 0.0f)
+		normal.xz = (1.0f - abs(normal.zx)) * float2(normal.x >= 0.0f ? 1.0f : -1.0f, normal.z >= 0.0f ? 1.0f : -1.0f);
+
+	return normalize(normal);
+}
+
+PixelInputType TerrainVertexShader(VertexInputType input)
+{
+    PixelInputType output;
+
+	float4 position = float4(positionOffset.xyz + float3(input.position.xyz) * positionStep.xyz, 1.0f);
+
+	// Calculate the position of the vertex against the world, view, and projection matrices.
+    output.position = mul(position, worldMatrix);
+    output.position = mul(output.position, viewMatrix);
+    output.position = mul(output.position, projectionMatrix);
+
+	// Store the position value in a second input value for depth value calculations.
+	output.depthPosition = output.position;
+
+    // Store the texture coordinates for the pixel shader.
+    output.tex = textureTransform.xy + input.tex * textureTransform.zw;
+
+	// Rebuild the tangent and binormal from the columns of the quaternion's rotation matrix.
+	float4 q = normalize(max(input.tangentFrame, -1.0f));
+
+	float3 tangent = float3(1.0f - 2.0f * (q.y * q.y + q.z * q.z), 2.0f * (q.x * q.y + q.w * q.z), 2.0f * (q.x * q.z - q.w * q.y));
+	float3 binormal = float3(2.0f * (q.x * q.y - q.w * q.z), 1.0f - 2.0f * (q.x * q.x + q.z * q.z), 2.0f * (q.y * q.z + q.w * q.x));
+
+	if (q.w < 0.0f)
+		binormal = -binormal;
+
+    // Calculate the normal vector against the world matrix only and then normalize the final value.
+    output.normal = mul(decodeOctahedralNormal(input.position.w), (float3x3)worldMatrix);
+    output.normal = normalize(output.normal);
+
+	// Calculate the tangent vector against the world matrix only and then normalize the final value.
+    output.tangent = mul(tangent, (float3x3)worldMatrix);
+    output.tangent = normalize(output.tangent);
+
+    // Calculate the binormal vector against the world matrix only and then normalize the final value.
+    output.binormal = mul(binormal, (float3x3)worldMatrix);
+    output.binormal = normalize(output.binormal);
+
+    return output;
+}
@@ -0,0 +1,64 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace bm
+{
+    // Minimal self-registering runner of the console test project. Every BM_TEST and BM_BENCHMARK adds itself to one
+    // list; the executable runs the tests, or the benchmarks with --benchmark, whose name contains an optional filter.
+    struct TestCase
+    {
+        const char* name;
+        void (*run)();
+        bool benchmark;
+    };
+
+    std::vector<TestCase>& getTestCases();
+
+    struct TestRegistration
+    {
+        TestRegistration(const char* name, void (*run)(), bool benchmark) { getTestCases().push_back({name, run, benchmark}); }
+    };
+
+    // Records a failed check of the running test, which carries on so that all of its failures get reported.
+    void reportTestFailure(const char* file, int line, const char* expression);
+
+    // Prints one measurement of the running benchmark.
+    void reportBenchmark(const char* label, double value, const char* unit);
+
+    // Full name of a scratch file in the temporary directory of the tests, created on first use.
+    std::wstring getTestFileName(const wchar_t* name);
+
+    // Fastest of repeat_count runs of body, in seconds.
+    template<typename Function>
+    double measureSeconds(int repeat_count, Function&& body)
+    {
+        auto best = 1e30;
+
+        for(auto repeat = 0; repeat < repeat_count; repeat++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            body();
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            best = std::min(best, seconds);
+        }
+
+        return best;
+    }
+}
+
+#define BM_TEST_CASE(name, benchmark) \
+    static void name(); \
+    static const bm::TestRegistration name##_registration(#name, &name, benchmark); \
+    static void name()
+
+#define BM_TEST(name) BM_TEST_CASE(name, false)
+#define BM_BENCHMARK(name) BM_TEST_CASE(name, true)
+
+#define BM_CHECK(expression) ((expression) ? static_cast<void>(0) : bm::reportTestFailure(__FILE__, __LINE__, #expression))
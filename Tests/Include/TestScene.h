@@ -0,0 +1,27 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+namespace bm
+{
+    // Device the terrain tests build their buffers on, a WARP one so that no GPU is needed. Created on first use and
+    // kept for the whole run.
+    ID3D11Device* getTestDevice();
+
+    // Immediate context of the test device.
+    ID3D11DeviceContext* getTestDeviceContext();
+
+    // Writes a 24-bit grey heightmap bitmap of width x height samples, sample (i, j) being getValue(i, j) in [0, 255]
+    // with row 0 at the bottom, as Terrain reads it.
+    bool writeTestHeightMap(const std::wstring& file_name, int width, int height, const std::function<int(int, int)>& getValue);
+
+    // Smooth rolling hills over the whole 8-bit range, a few periods across the map.
+    int getRollingHillsValue(int i, int j, int width, int height);
+
+    // Ridged value noise of six octaves, the largest 64 samples across, squared: deep valleys between sharp crests.
+    // In [0, 4) and the same for every run.
+    float getRidgedValue(int i, int j);
+}
@@ -0,0 +1,248 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "CdlodQuadtree.h"
+
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        // Largest distance between a sample and the surface through every step-th sample (and the last ones), the
+        // cells split from (x0, z0) to (x1, z1), one sample at a time.
+        float getLevelErrorBruteForce(const HeightField& height_field, int step)
+        {
+            auto width = height_field.getWidth(), height = height_field.getHeight();
+
+            auto getCell([](int sample, int size, int step, int& first, int& last)
+            {
+                first = std::min(sample / step * step, (size - 2) / step * step);
+                last = std::min(first + step, size - 1);
+            });
+
+            auto error = 0.0f;
+
+            for(auto j = 0; j < height; j++)
+            {
+                for(auto i = 0; i < width; i++)
+                {
+                    int x0, x1, z0, z1;
+                    getCell(i, width, step, x0, x1);
+                    getCell(j, height, step, z0, z1);
+
+                    auto u = static_cast<float>(i - x0) / static_cast<float>(x1 - x0);
+                    auto v = static_cast<float>(j - z0) / static_cast<float>(z1 - z0);
+
+                    auto h00 = height_field.getHeight(x0, z0), h11 = height_field.getHeight(x1, z1);
+                    auto surface = u >= v ? h00 + u * (height_field.getHeight(x1, z0) - h00) + v * (h11 - height_field.getHeight(x1, z0))
+                                          : h00 + v * (height_field.getHeight(x0, z1) - h00) + u * (h11 - height_field.getHeight(x0, z1));
+
+                    error = std::max(error, std::fabs(height_field.getHeight(i, j) - surface));
+                }
+            }
+
+            return error;
+        }
+    }
+
+    BM_TEST(cdlodLevelErrorsAreMeasuredAtFullResolution)
+    {
+        std::mt19937 random(5U);
+
+        const int sizes[][2] = {{129, 129}, {200, 77}};
+
+        for(auto& size : sizes)
+        {
+            // Rolling hills with noise, which the midpoints of the coarser levels alone underestimate.
+            HeightField height_field(size[0], size[1], 32.0f);
+            for(auto j = 0; j < size[1]; j++)
+            {
+                for(auto i = 0; i < size[0]; i++)
+                    height_field.setHeight(i, j, static_cast<float>(getRollingHillsValue(i, j, size[0], size[1]) * 8) + static_cast<float>(random() % 64U));
+            }
+
+            CdlodQuadtree quadtree;
+            quadtree.build(height_field, 16);
+
+            BM_CHECK(quadtree.getLevelCount() > 3);
+            BM_CHECK(quadtree.getLevelError(0) == 0.0f);
+
+            for(auto level = 1; level < quadtree.getLevelCount(); level++)
+            {
+                auto expected = getLevelErrorBruteForce(height_field, 1 << level);
+                BM_CHECK(std::fabs(quadtree.getLevelError(level) - expected) <= 1e-3f * expected);
+            }
+        }
+    }
+
+    BM_TEST(cdlodSelectionTilesTheHeightmapOnce)
+    {
+        const auto width = 1025, height = 700;
+
+        HeightField height_field(width, height, 32.0f);
+        for(auto j = 0; j < height; j++)
+        {
+            for(auto i = 0; i < width; i++)
+                height_field.setHeight(i, j, static_cast<float>(getRollingHillsValue(i, j, width, height) * 8));
+        }
+
+        CdlodQuadtree quadtree;
+        quadtree.build(height_field, 16);
+
+        auto leaf_columns = quadtree.getNodeColumns(0), leaf_rows = quadtree.getNodeRows(0);
+
+        // 1080 lines at a vertical field of view of 60 degrees.
+        const auto error_scale = 1080.0f / (2.0f * std::tan(0.5236f));
+
+        std::mt19937 random(9U);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+        auto tiled_once = true, levels_adjacent = true, morphs_monotonic = true;
+        std::vector<CdlodDrawRecord> records;
+
+        for(auto camera = 0; camera < 40; camera++)
+        {
+            // Over the terrain, near the ground and high above it, and off its edges.
+            auto camera_position = Vector3D((unit(random) * 1.4f - 0.2f) * height_field.getX(width - 1),
+                                            camera % 4 == 0 ? 20000.0f : 300.0f + unit(random) * 1000.0f,
+                                            (unit(random) * 1.4f - 0.2f) * height_field.getZ(height - 1));
+
+            quadtree.select(camera_position, error_scale, camera % 3 == 0 ? 0.5f : 2.0f, records);
+
+            // The leaves every record covers, with the level they are drawn at.
+            std::vector<int> leaf_levels(static_cast<size_t>(leaf_columns) * leaf_rows, -1);
+            std::vector<int> leaf_counts(leaf_levels.size(), 0);
+
+            std::vector<float> morph_starts(quadtree.getLevelCount(), -1.0f), morph_ends(quadtree.getLevelCount(), -1.0f);
+
+            for(auto& record : records)
+            {
+                auto level = static_cast<int>(record.level);
+                auto column = static_cast<int>(record.node % static_cast<uint32_t>(quadtree.getNodeColumns(level)));
+                auto row = static_cast<int>(record.node / static_cast<uint32_t>(quadtree.getNodeColumns(level)));
+
+                for(auto quadrant = 0; quadrant < 4; quadrant++)
+                {
+                    if((record.quadrants & (1U << quadrant)) == 0U)
+                        continue;
+
+                    // A whole node is its four quadrants, a quadrant of a leaf is the whole leaf.
+                    auto quadrant_leaves = level > 0 ? 1 << (level - 1) : 1;
+                    auto first_column = level > 0 ? (column * 2 + (quadrant & 1)) * quadrant_leaves : column;
+                    auto first_row = level > 0 ? (row * 2 + (quadrant >> 1)) * quadrant_leaves : row;
+
+                    if(level == 0 && quadrant > 0)
+                        continue;
+
+                    for(auto leaf_row = first_row; leaf_row < std::min(first_row + quadrant_leaves, leaf_rows); leaf_row++)
+                    {
+                        for(auto leaf_column = first_column; leaf_column < std::min(first_column + quadrant_leaves, leaf_columns); leaf_column++)
+                        {
+                            leaf_counts[static_cast<size_t>(leaf_row) * leaf_columns + leaf_column]++;
+                            leaf_levels[static_cast<size_t>(leaf_row) * leaf_columns + leaf_column] = level;
+                        }
+                    }
+                }
+
+                // Every record of a level morphs over the same distances.
+                morphs_monotonic = morphs_monotonic && record.morph_start < record.morph_end &&
+                                   (morph_starts[level] < 0.0f || (morph_starts[level] == record.morph_start && morph_ends[level] == record.morph_end));
+
+                morph_starts[level] = record.morph_start;
+                morph_ends[level] = record.morph_end;
+            }
+
+            tiled_once = tiled_once && std::all_of(leaf_counts.begin(), leaf_counts.end(), [](int count) { return count == 1; });
+
+            for(auto leaf_row = 0; leaf_row < leaf_rows; leaf_row++)
+            {
+                for(auto leaf_column = 0; leaf_column < leaf_columns; leaf_column++)
+                {
+                    auto level = leaf_levels[static_cast<size_t>(leaf_row) * leaf_columns + leaf_column];
+
+                    if(leaf_column + 1 < leaf_columns)
+                        levels_adjacent = levels_adjacent && std::abs(level - leaf_levels[static_cast<size_t>(leaf_row) * leaf_columns + leaf_column + 1]) <= 1;
+                    if(leaf_row + 1 < leaf_rows)
+                        levels_adjacent = levels_adjacent && std::abs(level - leaf_levels[static_cast<size_t>(leaf_row + 1) * leaf_columns + leaf_column]) <= 1;
+                }
+            }
+
+            // Each level morphs out before the next coarser one starts morphing.
+            auto previous_end = 0.0f;
+            for(auto level = 0; level < quadtree.getLevelCount(); level++)
+            {
+                if(morph_starts[level] < 0.0f)
+                    continue;
+
+                morphs_monotonic = morphs_monotonic && morph_starts[level] >= previous_end;
+                previous_end = morph_ends[level];
+            }
+        }
+
+        BM_CHECK(tiled_once);
+        BM_CHECK(levels_adjacent);
+        BM_CHECK(morphs_monotonic);
+    }
+
+    BM_BENCHMARK(cdlodBuild)
+    {
+        const auto size = 4097;
+
+        HeightField height_field(size, size, 32.0f);
+        for(auto j = 0; j < size; j++)
+        {
+            for(auto i = 0; i < size; i++)
+                height_field.setHeight(i, j, static_cast<float>(getRollingHillsValue(i, j, size, size) * 8));
+        }
+
+        CdlodQuadtree quadtree;
+        auto seconds = measureSeconds(3, [&]() { quadtree.build(height_field, 32); });
+
+        reportBenchmark("CDLOD build of 4097^2 with full resolution level errors", seconds * 1e3, "ms");
+    }
+
+    BM_BENCHMARK(cdlodSelect)
+    {
+        // 16k^2, walked over at a few hundred metres.
+        const auto size = 16385;
+
+        CdlodQuadtree quadtree;
+        {
+            HeightField height_field(size, size, 32.0f);
+            for(auto j = 0; j < size; j++)
+            {
+                for(auto i = 0; i < size; i++)
+                    height_field.setHeight(i, j, static_cast<float>(getRollingHillsValue(i, j, size, size) * 8));
+            }
+
+            quadtree.build(height_field, 32);
+        }
+
+        const auto error_scale = 1080.0f / (2.0f * std::tan(0.5236f));
+
+        std::vector<CdlodDrawRecord> records;
+        auto total_seconds = 0.0, slowest_seconds = 0.0;
+        auto record_count = size_t();
+
+        const auto steps = 200;
+        for(auto step = 0; step < steps; step++)
+        {
+            auto t = static_cast<float>(step) / steps;
+            auto camera_position = Vector3D((0.1f + 0.8f * t) * 32.0f * (size - 1), 500.0f, (0.5f + 0.3f * std::sin(6.2832f * t)) * 32.0f * (size - 1));
+
+            auto seconds = measureSeconds(3, [&]() { quadtree.select(camera_position, error_scale, 2.0f, records); });
+
+            total_seconds += seconds;
+            slowest_seconds = std::max(slowest_seconds, seconds);
+            record_count = std::max(record_count, records.size());
+        }
+
+        std::printf("    16385^2 in leaves of 32, up to %zu records\n", record_count);
+        reportBenchmark("select, mean", total_seconds * 1e3 / steps, "ms");
+        reportBenchmark("select, slowest", slowest_seconds * 1e3, "ms");
+    }
+}
@@ -0,0 +1,123 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "FrustumCulling.h"
+#include "Simd.h"
+
+#include <cfloat>
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        // A square grid of chunks of size units around the origin, with random height ranges.
+        BoundingBoxes makeChunkGrid(int columns, float size, unsigned seed)
+        {
+            std::mt19937 random(seed);
+
+            BoundingBoxes boxes;
+            boxes.reserve(static_cast<size_t>(columns) * columns);
+
+            for(auto z = 0; z < columns; z++)
+            {
+                for(auto x = 0; x < columns; x++)
+                {
+                    auto x0 = (x - columns / 2) * size, z0 = (z - columns / 2) * size;
+                    auto y = static_cast<float>(random() % 500U);
+
+                    boxes.add(Vector3D(x0, y - 200.0f, z0), Vector3D(x0 + size, y + 100.0f, z0 + size));
+                }
+            }
+
+            return boxes;
+        }
+
+        // Smallest distance + radius over the planes, negative if the box is outside one of them.
+        float getBoxMargin(const Frustum& frustum, const BoundingBoxes& boxes, size_t b)
+        {
+            auto margin = FLT_MAX;
+
+            for(auto& plane : frustum.planes)
+            {
+                auto distance = plane.x * boxes.getCenterX()[b] + plane.y * boxes.getCenterY()[b] + plane.z * boxes.getCenterZ()[b] + plane.w;
+                auto radius = std::fabs(plane.x) * boxes.getExtentX()[b] + std::fabs(plane.y) * boxes.getExtentY()[b] +
+                              std::fabs(plane.z) * boxes.getExtentZ()[b];
+
+                margin = std::min(margin, distance + radius);
+            }
+
+            return margin;
+        }
+
+        Matrix getViewProjection(float yaw, float pitch, const Vector3D& position)
+        {
+            auto direction = Vector3D(std::sin(yaw) * std::cos(pitch), std::sin(pitch), std::cos(yaw) * std::cos(pitch));
+            auto view = DirectX::XMMatrixLookAtLH(DirectX::XMVectorSet(position.x, position.y, position.z, 1.0f),
+                                                  DirectX::XMVectorSet(position.x + direction.x, position.y + direction.y, position.z + direction.z, 1.0f),
+                                                  DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+
+            return DirectX::XMMatrixMultiply(view, DirectX::XMMatrixPerspectiveFovLH(0.4f * 3.14159265f, 16.0f / 9.0f, 1.0f, 100000.0f));
+        }
+    }
+
+    BM_TEST(frustumCullingMatchesPlaneTests)
+    {
+        std::mt19937 random(3U);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+        // Odd count, so that the vector loops leave a tail.
+        auto boxes = makeChunkGrid(101, 2048.0f, 1U);
+        std::vector<uint32_t> visible;
+
+        for(auto view = 0; view < 20; view++)
+        {
+            auto frustum = computeFrustum(getViewProjection(3.14159265f * unit(random), 0.5f * unit(random),
+                                                            Vector3D(50000.0f * unit(random), 300.0f + 200.0f * unit(random), 50000.0f * unit(random))));
+
+            auto count = cullBoundingBoxes(frustum, boxes, visible);
+            BM_CHECK(count == visible.size());
+
+            // Increasing indices of all boxes inside, boxes on a plane may go either way with the rounding of the sums.
+            auto matches = std::is_sorted(visible.begin(), visible.end());
+            auto next = visible.begin();
+
+            for(auto b = size_t(); b < boxes.getCount(); b++)
+            {
+                auto is_visible = next != visible.end() && *next == b;
+                if(is_visible)
+                    ++next;
+
+                auto margin = getBoxMargin(frustum, boxes, b);
+                if(std::fabs(margin) > 0.1f)
+                    matches = matches && is_visible == (margin >= 0.0f);
+            }
+
+            BM_CHECK(matches);
+        }
+    }
+
+    BM_BENCHMARK(frustumCulling)
+    {
+        // 316^2 chunks of 2048 units with the camera in the middle, looking along +Z.
+        auto boxes = makeChunkGrid(316, 2048.0f, 1U);
+        auto frustum = computeFrustum(getViewProjection(0.0f, 0.0f, Vector3D(0.0f, 0.0f, 0.0f)));
+
+        std::vector<uint32_t> visible;
+        auto seconds = measureSeconds(200, [&]() { cullBoundingBoxes(frustum, boxes, visible); });
+
+#if defined(BM_SIMD_AVX2)
+        const char* path = "AVX2";
+#elif defined(BM_SIMD_SSE4)
+        const char* path = "SSE4.1";
+#else
+        const char* path = "scalar";
+#endif
+
+        std::printf("    %zu boxes, %.1f%% visible, %s path\n", boxes.getCount(), 100.0 * visible.size() / boxes.getCount(), path);
+        reportBenchmark("frustum culling pass", seconds * 1e3, "ms");
+        reportBenchmark("per box", seconds * 1e9 / boxes.getCount(), "ns");
+    }
+}
@@ -0,0 +1,280 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "Geomipmapping.h"
+#include "Terrain.h"
+#include "TerrainBake.h"
+
+#include <random>
+#include <set>
+#include <utility>
+
+namespace bm
+{
+    namespace
+    {
+        // Segments of the triangles of a chunk that lie on one of its edges, as pairs of sample offsets along the edge.
+        std::set<std::pair<int, int>> getEdgeSegments(int width, int height, const std::vector<uint16_t>& indices, unsigned edge)
+        {
+            auto onEdge([&](int index)
+            {
+                auto i = index % width, j = index / width;
+
+                switch(edge)
+                {
+                    case geomipmap_edge_left: return i == 0;
+                    case geomipmap_edge_right: return i == width - 1;
+                    case geomipmap_edge_bottom: return j == 0;
+                    default: return j == height - 1;
+                }
+            });
+
+            auto along([&](int index) { return edge == geomipmap_edge_left || edge == geomipmap_edge_right ? index / width : index % width; });
+
+            std::set<std::pair<int, int>> segments;
+            for(auto t = size_t(); t < indices.size(); t += 3)
+            {
+                for(auto k = 0; k < 3; k++)
+                {
+                    int a = indices[t + k], b = indices[t + (k + 1) % 3];
+                    if(onEdge(a) && onEdge(b))
+                        segments.insert(std::minmax(along(a), along(b)));
+                }
+            }
+
+            return segments;
+        }
+
+        // Twice the signed area of every triangle, in quads, with the winding of the full resolution chunk positive.
+        std::vector<int> getDoubleAreas(int width, const std::vector<uint16_t>& indices)
+        {
+            std::vector<int> areas;
+            for(auto t = size_t(); t < indices.size(); t += 3)
+            {
+                int ax = indices[t] % width, az = indices[t] / width;
+                int bx = indices[t + 1] % width, bz = indices[t + 1] / width;
+                int cx = indices[t + 2] % width, cz = indices[t + 2] / width;
+
+                areas.push_back((bx - ax) * (cz - az) - (bz - az) * (cx - ax));
+            }
+
+            return areas;
+        }
+
+        float getDistance(const TerrainChunk& chunk, const Vector3D& point)
+        {
+            auto dx = std::max(std::max(chunk.bounds_min.x - point.x, point.x - chunk.bounds_max.x), 0.0f);
+            auto dy = std::max(std::max(chunk.bounds_min.y - point.y, point.y - chunk.bounds_max.y), 0.0f);
+            auto dz = std::max(std::max(chunk.bounds_min.z - point.z, point.z - chunk.bounds_max.z), 0.0f);
+
+            return std::sqrt(dx * dx + dy * dy + dz * dz);
+        }
+    }
+
+    BM_TEST(geomipmapVariantsCoverTheChunk)
+    {
+        for(auto size : {33, 20, 9})
+        {
+            std::vector<uint16_t> full, indices;
+            buildGeomipmapIndices(size, size, 0, 0U, full);
+
+            auto full_sign = getDoubleAreas(size, full).front() > 0 ? 1 : -1;
+
+            for(auto level = 0; level < getGeomipmapLevelCount(size, size); level++)
+            {
+                for(auto edges = 0U; edges < geomipmap_variant_count; edges++)
+                {
+                    indices.clear();
+                    buildGeomipmapIndices(size, size, level, edges, indices);
+
+                    // No holes, no overlaps and no flipped or degenerate triangles.
+                    auto area = 0;
+                    auto same_winding = true;
+                    for(auto double_area : getDoubleAreas(size, indices))
+                    {
+                        area += double_area * full_sign;
+                        same_winding = same_winding && double_area * full_sign > 0;
+                    }
+
+                    BM_CHECK(area == 2 * (size - 1) * (size - 1));
+                    BM_CHECK(same_winding);
+                }
+            }
+        }
+    }
+
+    BM_TEST(geomipmapStitchingMatchesTheCoarserNeighbour)
+    {
+        const unsigned opposite_edges[][2] = {{geomipmap_edge_right, geomipmap_edge_left}, {geomipmap_edge_left, geomipmap_edge_right},
+                                              {geomipmap_edge_top, geomipmap_edge_bottom}, {geomipmap_edge_bottom, geomipmap_edge_top}};
+
+        for(auto size : {33, 20, 9})
+        {
+            std::vector<uint16_t> fine, coarse;
+
+            for(auto level = 0; level + 1 < getGeomipmapLevelCount(size, size); level++)
+            {
+                for(auto& edges : opposite_edges)
+                {
+                    // Whatever the other edges of either chunk do, the shared one has to have the same segments on both sides.
+                    for(auto other_edges = 0U; other_edges < geomipmap_variant_count; other_edges++)
+                    {
+                        fine.clear();
+                        buildGeomipmapIndices(size, size, level, edges[0] | (other_edges & ~edges[0]), fine);
+
+                        coarse.clear();
+                        buildGeomipmapIndices(size, size, level + 1, other_edges & ~edges[1], coarse);
+
+                        BM_CHECK(getEdgeSegments(size, size, fine, edges[0]) == getEdgeSegments(size, size, coarse, edges[1]));
+                    }
+                }
+            }
+        }
+    }
+
+    BM_TEST(geomipmapSelectionMeetsThePixelError)
+    {
+        std::mt19937 random(11U);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+        // A 16 x 12 grid of 33-sample chunks with growing random errors per level.
+        const auto columns = 16, rows = 12, size = 33;
+        const auto spacing = 32.0f;
+
+        std::vector<TerrainChunk> chunks(columns * rows);
+        for(auto c = 0; c < columns * rows; c++)
+        {
+            auto& chunk = chunks[c];
+            chunk.x = c % columns * (size - 1);
+            chunk.z = c / columns * (size - 1);
+            chunk.width = chunk.height = size;
+            chunk.bounds_min = Vector3D(chunk.x * spacing, 0.0f, chunk.z * spacing);
+            chunk.bounds_max = Vector3D((chunk.x + size - 1) * spacing, 50.0f + 200.0f * unit(random), (chunk.z + size - 1) * spacing);
+            chunk.lod_level_count = getGeomipmapLevelCount(size, size);
+
+            chunk.lod_errors[0] = 0.0f;
+            for(auto level = 1; level < chunk.lod_level_count; level++)
+                chunk.lod_errors[level] = chunk.lod_errors[level - 1] + 40.0f * unit(random) * static_cast<float>(level);
+        }
+
+        const auto error_scale = 600.0f, max_pixel_error = 2.0f;
+        std::vector<int> levels;
+
+        for(auto camera = 0; camera < 50; camera++)
+        {
+            auto position = Vector3D(columns * (size - 1) * spacing * unit(random), 300.0f * unit(random), rows * (size - 1) * spacing * unit(random));
+            selectGeomipmapLevels(chunks, columns, position, error_scale, max_pixel_error, levels);
+
+            auto within_error = true, within_one_level = true, coarsest_allowed = true;
+
+            for(auto c = 0; c < columns * rows; c++)
+            {
+                auto& chunk = chunks[c];
+                auto max_error = getDistance(chunk, position) * max_pixel_error / error_scale;
+                auto level = levels[c];
+
+                within_error = within_error && chunk.lod_errors[level] <= max_error;
+
+                auto neighbours = {c % columns > 0 ? c - 1 : -1, c % columns < columns - 1 ? c + 1 : -1,
+                                   c >= columns ? c - columns : -1, c < (rows - 1) * columns ? c + columns : -1};
+
+                // Coarser would be good enough only if a neighbour holds the chunk back.
+                auto held_back = false;
+                for(auto n : neighbours)
+                {
+                    if(n < 0)
+                        continue;
+
+                    within_one_level = within_one_level && std::abs(levels[n] - level) <= 1;
+                    held_back = held_back || levels[n] + 1 == level;
+                }
+
+                if(level + 1 < chunk.lod_level_count && chunk.lod_errors[level + 1] <= max_error)
+                    coarsest_allowed = coarsest_allowed && held_back;
+            }
+
+            BM_CHECK(within_error);
+            BM_CHECK(within_one_level);
+            BM_CHECK(coarsest_allowed);
+
+            // Stitched edges are exactly those towards a coarser neighbour.
+            for(auto c = 0; c < columns * rows; c++)
+            {
+                auto edges = getGeomipmapStitching(levels, columns, c);
+
+                BM_CHECK(((edges & geomipmap_edge_left) != 0U) == (c % columns > 0 && levels[c - 1] > levels[c]));
+                BM_CHECK(((edges & geomipmap_edge_top) != 0U) == (c < (rows - 1) * columns && levels[c + columns] > levels[c]));
+            }
+        }
+    }
+
+    BM_TEST(geomipmapErrorsComeWithTheBake)
+    {
+        auto height_map = getTestFileName(L"lod.bmp");
+        BM_CHECK(writeTestHeightMap(height_map, 129, 129, [](int i, int j) { return getRollingHillsValue(i, j, 129, 129); }));
+
+        TerrainSettings settings;
+        settings.chunk_size = 33;
+        settings.horizon_culling = false;
+        settings.bake_file_name = getTestFileName(L"lod.bmterrain");
+        fs::remove(fs::path(settings.bake_file_name));
+
+        auto projection = DirectX::XMMatrixPerspectiveFovLH(0.785f, 4.0f / 3.0f, 1.0f, 10000.0f);
+        auto camera_position = DirectX::XMVectorSet(200.0f, 300.0f, 300.0f, 1.0f);
+
+        // Built, then loaded from the bake it wrote: the selections have to agree.
+        std::vector<TerrainDrawCall> built_draw_calls, loaded_draw_calls;
+        {
+            Terrain terrain(getTestDevice(), height_map.c_str(), L"", L"", settings);
+            terrain.selectLevelsOfDetail(camera_position, projection, 720.0f);
+            built_draw_calls = terrain.getDrawCalls();
+        }
+        {
+            Terrain terrain(getTestDevice(), height_map.c_str(), L"", L"", settings);
+            terrain.selectLevelsOfDetail(camera_position, projection, 720.0f);
+            loaded_draw_calls = terrain.getDrawCalls();
+        }
+
+        BM_CHECK(!built_draw_calls.empty() && built_draw_calls.size() == loaded_draw_calls.size());
+        BM_CHECK(std::equal(built_draw_calls.begin(), built_draw_calls.end(), loaded_draw_calls.begin(), loaded_draw_calls.end(),
+                            [](const TerrainDrawCall& a, const TerrainDrawCall& b) { return a.start_index == b.start_index && a.index_count == b.index_count; }));
+
+        // Some chunks far enough away to be drawn coarser than their 32 x 32 quads.
+        BM_CHECK(std::any_of(built_draw_calls.begin(), built_draw_calls.end(), [](const TerrainDrawCall& draw_call) { return draw_call.index_count < 32U * 32U * 6U; }));
+
+        // The baked errors are those of the baked heights.
+        uint64_t content_hash;
+        {
+            MappedFile file(settings.bake_file_name.c_str());
+            BM_CHECK(file.isOpen() && file.getSize() >= sizeof(TerrainBakeHeader));
+            if(!file.isOpen() || file.getSize() < sizeof(TerrainBakeHeader))
+                return;
+
+            content_hash = reinterpret_cast<const TerrainBakeHeader*>(file.getData())->content_hash;
+        }
+
+        TerrainBake bake(settings.bake_file_name.c_str(), content_hash);
+        BM_CHECK(bake.isValid());
+        if(!bake.isValid())
+            return;
+
+        auto& header = bake.getHeader();
+
+        HeightField heights(header.terrain_width, header.terrain_height, 32.0f);
+        std::copy(bake.getHeights(), bake.getHeights() + header.terrain_width * header.terrain_height, heights.getHeights());
+
+        auto same_errors = true;
+        for(auto chunk = bake.getChunks(); chunk != bake.getChunks() + header.chunk_count; chunk++)
+        {
+            same_errors = same_errors && chunk->lod_level_count == getGeomipmapLevelCount(chunk->width, chunk->height);
+
+            for(auto level = 0; level < chunk->lod_level_count; level++)
+                same_errors = same_errors && chunk->lod_errors[level] == computeGeomipmapError(heights, chunk->x, chunk->z, chunk->width, chunk->height, level);
+        }
+
+        BM_CHECK(same_errors);
+    }
+}
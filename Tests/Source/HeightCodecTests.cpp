@@ -0,0 +1,184 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "HeightCodec.h"
+
+#include <cmath>
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        // Ridged terrain over the 8-bit range, rougher than the rolling hills.
+        int getRidgedHeightMapValue(int i, int j)
+        {
+            return std::min(static_cast<int>(getRidgedValue(i, j) * 64.0f), 255);
+        }
+
+        // Largest difference between the decoded file and the bitmap values, -1 if the file doesn't decode.
+        int getLargestError(const CompressedHeightFile& height_file, const std::function<int(int, int)>& getValue)
+        {
+            std::vector<float> heights(static_cast<size_t>(height_file.getWidth()) * height_file.getHeight());
+            if(!height_file.decode(1.0f, heights.data(), 0U))
+                return -1;
+
+            auto largest_error = 0;
+            for(auto j = 0; j < height_file.getHeight(); j++)
+            {
+                for(auto i = 0; i < height_file.getWidth(); i++)
+                {
+                    auto error = std::abs(static_cast<int>(heights[static_cast<size_t>(j) * height_file.getWidth() + i]) - getValue(i, j));
+                    largest_error = std::max(largest_error, error);
+                }
+            }
+
+            return largest_error;
+        }
+    }
+
+    BM_TEST(heightTilesRoundTripWithinTheirError)
+    {
+        std::mt19937 random(3U);
+
+        // Full-range noise, smooth terrain and a flat tile, in tiles down to a single sample. Rows of 300 have blocks of
+        // 128 that start mid-row and blocks that run into the next row.
+        const int sizes[][2] = {{128, 128}, {300, 9}, {100, 37}, {5, 128}, {3, 7}, {1, 1}};
+
+        auto within_error = true, damage_reported = true;
+
+        for(auto& size : sizes)
+        {
+            for(auto kind = 0; kind < 3; kind++)
+            {
+                for(auto max_error : {0, 1, 3, 300})
+                {
+                    auto width = size[0], height = size[1];
+                    auto stride = static_cast<size_t>(width) + 3U;
+
+                    std::vector<uint16_t> samples(stride * height);
+                    for(auto j = 0; j < height; j++)
+                    {
+                        for(auto i = 0; i < width; i++)
+                        {
+                            auto smooth = 1000.0 + 400.0 * std::sin(i * 0.05) * std::cos(j * 0.04) + random() % 3U;
+                            samples[j * stride + i] = static_cast<uint16_t>(kind == 0 ? random() : kind == 1 ? static_cast<unsigned>(smooth) : 777U);
+                        }
+                    }
+
+                    std::vector<unsigned char> code;
+                    encodeHeightTile(samples.data(), width, height, stride, max_error, code);
+
+                    // One float past every row, which the decoder must leave alone.
+                    std::vector<float> decoded((static_cast<size_t>(width) + 1U) * height, -1.0f);
+                    within_error = within_error && decodeHeightTile(code.data(), code.size(), width, height, 1.0f, decoded.data(), width + 1U);
+
+                    for(auto j = 0; j < height; j++)
+                    {
+                        for(auto i = 0; i < width; i++)
+                            within_error = within_error && std::fabs(decoded[j * (width + 1U) + i] - samples[j * stride + i]) <= max_error;
+
+                        within_error = within_error && decoded[j * (width + 1U) + width] == -1.0f;
+                    }
+
+                    // Truncated codes are reported, not read past.
+                    if(code.size() > 1U)
+                        damage_reported = damage_reported && !decodeHeightTile(code.data(), code.size() / 2U, width, height, 1.0f, decoded.data(), width + 1U);
+                }
+            }
+        }
+
+        BM_CHECK(within_error);
+        BM_CHECK(damage_reported);
+    }
+
+    BM_TEST(compressedHeightFileMatchesTheBitmap)
+    {
+        auto bitmap = getTestFileName(L"codec.bmp"), file_name = getTestFileName(L"codec.bmhc");
+        writeTestHeightMap(bitmap, 300, 203, getRidgedHeightMapValue);
+
+        for(auto max_error : {0, 2})
+        {
+            HeightCodecSettings settings;
+            settings.tile_size = 50;
+            settings.max_error = max_error;
+
+            BM_CHECK(convertBitmapToCompressedHeights(bitmap.c_str(), file_name.c_str(), settings));
+            BM_CHECK(!fs::exists(fs::path(file_name + L".partial")));
+
+            CompressedHeightFile height_file(file_name.c_str());
+            BM_CHECK(height_file.isValid());
+            if(height_file.isValid())
+            {
+                auto largest_error = getLargestError(height_file, getRidgedHeightMapValue);
+                BM_CHECK(largest_error >= 0 && largest_error <= max_error);
+            }
+        }
+
+        // A directory can't be replaced by the converted file.
+        auto directory_name = getTestFileName(L"codec_directory.bmhc");
+        fs::create_directories(fs::path(directory_name));
+
+        BM_CHECK(!convertBitmapToCompressedHeights(bitmap.c_str(), directory_name.c_str()));
+        BM_CHECK(fs::is_directory(fs::path(directory_name)));
+        BM_CHECK(!fs::exists(fs::path(directory_name + L".partial")));
+    }
+
+    BM_BENCHMARK(heightCodec)
+    {
+        const auto size = 4097;
+
+        auto bitmap = getTestFileName(L"codec.bmp"), file_name = getTestFileName(L"codec.bmhc");
+        auto samples = static_cast<double>(size) * size;
+
+        std::vector<float> heights(static_cast<size_t>(size) * size);
+
+        for(auto ridged : {false, true})
+        {
+            auto getValue = ridged ? std::function<int(int, int)>(getRidgedHeightMapValue) : [](int i, int j) { return getRollingHillsValue(i, j, size, size); };
+            writeTestHeightMap(bitmap, size, size, getValue);
+
+            for(auto max_error : {0, 1, 2})
+            {
+                HeightCodecSettings settings;
+                settings.max_error = max_error;
+
+                auto encode_seconds = measureSeconds(1, [&]() { convertBitmapToCompressedHeights(bitmap.c_str(), file_name.c_str(), settings); });
+
+                CompressedHeightFile height_file(file_name.c_str());
+                auto file_size = static_cast<double>(height_file.getHeader().file_size);
+
+                auto decode_seconds = measureSeconds(3, [&]() { height_file.decode(8.0f, heights.data(), 1U); });
+                auto parallel_decode_seconds = measureSeconds(3, [&]() { height_file.decode(8.0f, heights.data(), 0U); });
+
+                // One tile decoded over and over into the same place, which stays in cache: the speed of the decoder
+                // itself, where the whole heightmap is bounded by the stores of its 64 MB of heights.
+                std::vector<uint16_t> tile_samples(128U * 128U);
+                for(auto j = 0; j < 128; j++)
+                {
+                    for(auto i = 0; i < 128; i++)
+                        tile_samples[j * 128 + i] = static_cast<uint16_t>(getValue(1024 + i, 1024 + j));
+                }
+
+                std::vector<unsigned char> tile_code;
+                encodeHeightTile(tile_samples.data(), 128, 128, 128U, max_error, tile_code);
+
+                auto tile_seconds = measureSeconds(3, [&]()
+                {
+                    for(auto repeat = 0; repeat < 1000; repeat++)
+                        decodeHeightTile(tile_code.data(), tile_code.size(), 128, 128, 8.0f, heights.data(), 128U);
+                });
+
+                std::printf("    %s 4097^2, max error %d: %.2f bits per sample, %.2f : 1 against 8-bit samples\n", ridged ? "ridged" : "rolling hills",
+                            max_error, file_size * 8.0 / samples, samples / file_size);
+                reportBenchmark("encode from the bitmap", encode_seconds * 1e3, "ms");
+                reportBenchmark("decode, one thread", samples / (decode_seconds * 1e6), "Msamples/s");
+                reportBenchmark("decode, every thread", samples / (parallel_decode_seconds * 1e6), "Msamples/s");
+                reportBenchmark("decode a tile in cache, one thread", 1000.0 * 128.0 * 128.0 / (tile_seconds * 1e6), "Msamples/s");
+            }
+        }
+    }
+}
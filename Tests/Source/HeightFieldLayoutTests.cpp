@@ -0,0 +1,182 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "HeightQueries.h"
+
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        // Set-associative cache with least recently used replacement, that counts the misses of the addresses it's fed.
+        // There are no hardware counters to read on every machine the tests run on, so the misses of the two layouts are
+        // compared on a model of a typical core instead.
+        class CacheModel
+        {
+        public:
+            CacheModel(size_t size, int ways, int line_shift) :
+                ways(ways),
+                line_shift(line_shift),
+                set_count(size >> line_shift)
+            {
+                set_count /= static_cast<size_t>(ways);
+                tags.assign(set_count * ways, ~uint64_t());
+            }
+
+            void access(uintptr_t address)
+            {
+                auto line = static_cast<uint64_t>(address) >> line_shift;
+                auto set = tags.data() + (line % set_count) * ways;
+
+                // Most recently used first.
+                auto way = 0;
+                while(way < ways - 1 && set[way] != line)
+                    way++;
+
+                if(set[way] != line)
+                    misses++;
+
+                for(; way > 0; way--)
+                    set[way] = set[way - 1];
+
+                set[0] = line;
+            }
+
+            size_t getMisses() const { return misses; }
+
+        private:
+            int ways;
+            int line_shift;
+            size_t set_count;
+
+            std::vector<uint64_t> tags;
+            size_t misses = 0U;
+        };
+
+        struct CacheMisses
+        {
+            double l1, l2, tlb; // Per query.
+        };
+
+        // Misses of the four samples around every query, the ones sampleHeightField reads, on a 32 KB 8-way L1, a 1 MB
+        // 16-way L2 and a 64-entry 4-way data TLB of 4 KB pages.
+        template<typename Field>
+        CacheMisses countCacheMisses(const Field& height_field, const std::vector<float>& x, const std::vector<float>& z)
+        {
+            CacheModel l1(32U << 10U, 8, 6), l2(1U << 20U, 16, 6), tlb(64U << 12U, 4, 12);
+
+            auto heights = height_field.getHeights();
+            auto inverse_spacing = 1.0f / height_field.getSpacing();
+
+            for(auto k = size_t(); k < x.size(); k++)
+            {
+                auto i = std::min(std::max(static_cast<int>(x[k] * inverse_spacing), 0), height_field.getWidth() - 2);
+                auto j = std::min(std::max(static_cast<int>(z[k] * inverse_spacing), 0), height_field.getHeight() - 2);
+
+                for(auto corner = 0; corner < 4; corner++)
+                {
+                    auto address = reinterpret_cast<uintptr_t>(heights + height_field.getIndex(i + (corner & 1), j + (corner >> 1)));
+
+                    l1.access(address);
+                    l2.access(address);
+                    tlb.access(address);
+                }
+            }
+
+            auto count = static_cast<double>(x.size());
+            return {l1.getMisses() / count, l2.getMisses() / count, tlb.getMisses() / count};
+        }
+    }
+
+    BM_BENCHMARK(heightFieldLayout)
+    {
+        // Rows of 32 KB, so that the rows above and below a sample are on other pages.
+        const auto size = 8193;
+        const auto query_count = size_t(1U) << 20U;
+
+        HeightField height_field(size, size, 32.0f);
+        for(auto j = 0; j < size; j++)
+        {
+            for(auto i = 0; i < size; i++)
+                height_field.setHeight(i, j, static_cast<float>(getRollingHillsValue(i, j, size, size) * 8));
+        }
+
+        TiledHeightField tiled_height_field;
+        tiled_height_field.build(height_field);
+
+        std::mt19937 random(1U);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+        auto extent = height_field.getX(size - 1);
+        std::vector<float> x(query_count), z(query_count);
+
+        auto makeQueries([&](int pattern)
+        {
+            for(auto k = size_t(); k < query_count; k++)
+            {
+                switch(pattern)
+                {
+                // Scattered over the whole field.
+                case 0:
+                    x[k] = unit(random) * extent;
+                    z[k] = unit(random) * extent;
+                    break;
+
+                // Around a few places at a time, within 64 samples of each, as for a crowd or a vehicle's wheels.
+                case 1:
+                    if(k % 4096U == 0U)
+                    {
+                        x[k] = 2048.0f + unit(random) * (extent - 4096.0f);
+                        z[k] = 2048.0f + unit(random) * (extent - 4096.0f);
+                    }
+                    else
+                    {
+                        auto centre = k - k % 4096U;
+                        x[k] = x[centre] + (unit(random) - 0.5f) * 4096.0f;
+                        z[k] = z[centre] + (unit(random) - 0.5f) * 4096.0f;
+                    }
+                    break;
+
+                // Down the field or across it a sample at a time, as along a path.
+                case 2:
+                case 3:
+                {
+                    auto line = static_cast<float>(k / size_t(size - 1)) * 37.0f * 32.0f + 5.5f;
+                    auto along = (static_cast<float>(k % size_t(size - 1)) + 0.5f) * 32.0f;
+
+                    x[k] = pattern == 2 ? line : along;
+                    z[k] = pattern == 2 ? along : line;
+                    break;
+                }
+                }
+            }
+        });
+
+        std::vector<float> heights(query_count);
+        std::vector<Vector3D> normals(query_count);
+
+        const char* patterns[] = {"scattered", "clustered", "down columns", "along rows"};
+
+        std::printf("    %zu heights and normals on 8193^2, misses per query modelled\n", query_count);
+
+        for(auto pattern = 0; pattern < 4; pattern++)
+        {
+            makeQueries(pattern);
+
+            auto seconds = measureSeconds(3, [&]() { sampleHeightField(height_field, x.data(), z.data(), x.size(), heights.data(), normals.data()); });
+            auto tiled_seconds = measureSeconds(3, [&]() { sampleHeightField(tiled_height_field, x.data(), z.data(), x.size(), heights.data(), normals.data()); });
+
+            auto misses = countCacheMisses(height_field, x, z);
+            auto tiled_misses = countCacheMisses(tiled_height_field, x, z);
+
+            std::printf("    %s: L1 %.2f / %.2f, L2 %.2f / %.2f, TLB %.2f / %.2f, row-major / tiled\n", patterns[pattern],
+                        misses.l1, tiled_misses.l1, misses.l2, tiled_misses.l2, misses.tlb, tiled_misses.tlb);
+            reportBenchmark("row-major", seconds * 1e9 / query_count, "ns/query");
+            reportBenchmark("tiled", tiled_seconds * 1e9 / query_count, "ns/query");
+        }
+    }
+}
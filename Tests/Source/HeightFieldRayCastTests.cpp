@@ -0,0 +1,210 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "HeightFieldRayCast.h"
+
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        // Ridged terrain, or 8-bit noise scaled like a heightmap for the sharpest slopes.
+        HeightField makeRayCastHeightField(int width, int height, bool noise, std::mt19937& random)
+        {
+            HeightField height_field(width, height, 32.0f);
+            for(auto j = 0; j < height; j++)
+            {
+                for(auto i = 0; i < width; i++)
+                    height_field.setHeight(i, j, noise ? static_cast<float>(random() % 256U) * 8.0f / 15.0f : getRidgedValue(3 * i, 3 * j) * 100.0f);
+            }
+
+            return height_field;
+        }
+
+        // Whether two casts found the same hit, if any. Within the edge tolerance of intersectQuad, a ray skimming a shared
+        // edge can hit either quad, at points a fraction of a unit apart.
+        bool isSameHit(bool found, const HeightFieldRayHit& hit, bool expected_found, const HeightFieldRayHit& expected_hit)
+        {
+            if(found != expected_found)
+                return false;
+
+            auto dx = hit.position.x - expected_hit.position.x, dy = hit.position.y - expected_hit.position.y, dz = hit.position.z - expected_hit.position.z;
+            return !found || std::sqrt(dx * dx + dy * dy + dz * dz) <= 0.01f;
+        }
+    }
+
+    BM_TEST(heightFieldRayCastMatchesTheReference)
+    {
+        std::mt19937 random(5U);
+        auto uniform([&](float low, float high) { return std::uniform_real_distribution<float>(low, high)(random); });
+
+        // Down to a single quad, odd sizes that cut the pyramid levels at the borders.
+        const int sizes[][2] = {{2, 2}, {65, 65}, {90, 37}, {129, 100}};
+
+        auto ray_count = 0, hit_count = 0, grazing_hit_count = 0;
+
+        for(auto& size : sizes)
+        {
+            for(auto noise : {false, true})
+            {
+                auto height_field = makeRayCastHeightField(size[0], size[1], noise, random);
+                auto extent_x = height_field.getX(size[0] - 1), extent_z = height_field.getZ(size[1] - 1);
+
+                HeightPyramid height_pyramid;
+                height_pyramid.build(height_field);
+
+                TiledHeightField tiled_height_field;
+                tiled_height_field.build(height_field);
+
+                auto same = true, same_tiled = true;
+
+                for(auto ray = 0; ray < 1500; ray++)
+                {
+                    Vector3D origin(uniform(-200.0f, extent_x + 200.0f), uniform(-50.0f, 600.0f), uniform(-200.0f, extent_z + 200.0f));
+                    Vector3D direction;
+                    auto max_distance = 5000.0f;
+                    auto grazing = false;
+
+                    switch(ray % 4)
+                    {
+                        // Anywhere, mostly downwards.
+                        case 0:
+                            direction = Vector3D(uniform(-1.0f, 1.0f), uniform(-1.0f, 0.2f), uniform(-1.0f, 1.0f));
+                            break;
+
+                        // Line of sight between two points over the field.
+                        case 1:
+                            direction = Vector3D(uniform(0.0f, extent_x) - origin.x, uniform(0.0f, 500.0f) - origin.y, uniform(0.0f, extent_z) - origin.z);
+                            max_distance = 1.0f;
+                            break;
+
+                        // Level, some of them along the sample rows or columns.
+                        case 2:
+                            direction = Vector3D(ray % 8 == 2 ? 0.0f : uniform(-1.0f, 1.0f), 0.0f, ray % 12 == 2 ? 0.0f : uniform(-1.0f, 1.0f));
+                            break;
+
+                        // Grazing: from just above a sample, almost level, skimming over the surface.
+                        default:
+                        {
+                            auto i = static_cast<int>(random() % static_cast<unsigned>(size[0])), j = static_cast<int>(random() % static_cast<unsigned>(size[1]));
+                            origin = height_field.getPosition(i, j);
+                            origin.y += uniform(0.01f, 1.0f);
+                            direction = Vector3D(uniform(-1.0f, 1.0f), uniform(-0.02f, 0.005f), uniform(-1.0f, 1.0f));
+                            grazing = true;
+                            break;
+                        }
+                    }
+
+                    HeightFieldRayHit expected_hit, hit, tiled_hit;
+                    auto expected_found = castHeightFieldRayReference(height_field, origin, direction, max_distance, expected_hit);
+                    auto found = castHeightFieldRay(height_pyramid, origin, direction, max_distance, hit);
+                    auto tiled_found = castHeightFieldRay(height_pyramid, tiled_height_field, origin, direction, max_distance, tiled_hit);
+
+                    same = same && isSameHit(found, hit, expected_found, expected_hit);
+                    same_tiled = same_tiled && isSameHit(tiled_found, tiled_hit, expected_found, expected_hit);
+
+                    ray_count++;
+                    hit_count += expected_found ? 1 : 0;
+                    grazing_hit_count += expected_found && grazing ? 1 : 0;
+                }
+
+                BM_CHECK(same);
+                BM_CHECK(same_tiled);
+            }
+        }
+
+        // Enough of both for the comparison to mean something.
+        BM_CHECK(hit_count > ray_count / 4 && hit_count < ray_count);
+        BM_CHECK(grazing_hit_count > ray_count / 16);
+    }
+
+    BM_TEST(heightFieldRaysFlagTheirMisses)
+    {
+        std::mt19937 random(6U);
+
+        auto height_field = makeRayCastHeightField(65, 65, false, random);
+        HeightPyramid height_pyramid;
+        height_pyramid.build(height_field);
+
+        // Straight down onto the middle, then straight up from under the highest sample.
+        const Vector3D origins[] = {{1024.0f, 1000.0f, 1024.0f}, {1024.0f, -1000.0f, 1024.0f}};
+        const Vector3D directions[] = {{0.0f, -1.0f, 0.0f}, {0.0f, -1.0f, 0.0f}};
+
+        HeightFieldRayHit hits[2];
+        castHeightFieldRays(height_pyramid, origins, directions, 2U, 5000.0f, hits);
+
+        BM_CHECK(hits[0].distance > 0.0f && hits[0].i == 32 && hits[0].j == 32);
+        BM_CHECK(hits[1].distance < 0.0f);
+    }
+
+    BM_BENCHMARK(heightFieldRayCast)
+    {
+        const auto size = 1025;
+
+        std::mt19937 random(1U);
+        auto uniform([&](float low, float high) { return std::uniform_real_distribution<float>(low, high)(random); });
+
+        auto height_field = makeRayCastHeightField(size, size, false, random);
+        auto extent = height_field.getX(size - 1);
+
+        HeightPyramid height_pyramid;
+        height_pyramid.build(height_field);
+
+        TiledHeightField tiled_height_field;
+        tiled_height_field.build(height_field);
+
+        auto getGround([&](float x, float z)
+        {
+            return height_field.getHeight(std::min(static_cast<int>(x / 32.0f), size - 1), std::min(static_cast<int>(z / 32.0f), size - 1));
+        });
+
+        const auto ray_count = 100000;
+        std::vector<Vector3D> origins(ray_count), directions(ray_count), picking_origins(ray_count), picking_directions(ray_count);
+        std::vector<HeightFieldRayHit> hits(ray_count);
+
+        for(auto k = 0; k < ray_count; k++)
+        {
+            // Line of sight between points a few units over the ground, up to 4000 units (125 quads) apart.
+            auto x = uniform(0.0f, extent), z = uniform(0.0f, extent);
+            auto target_x = uniform(0.0f, extent), target_z = uniform(0.0f, extent);
+            auto scale = std::min(1.0f, 4000.0f / std::max(std::sqrt((target_x - x) * (target_x - x) + (target_z - z) * (target_z - z)), 1.0f));
+
+            origins[k] = Vector3D(x, getGround(x, z) + uniform(2.0f, 40.0f), z);
+            directions[k] = Vector3D((target_x - x) * scale, (getGround(target_x, target_z) + uniform(2.0f, 40.0f) - origins[k].y) * scale, (target_z - z) * scale);
+
+            // Picking from a camera over the middle of the terrain, looking down at it.
+            picking_origins[k] = Vector3D(0.5f * extent, 1200.0f, 0.5f * extent);
+            picking_directions[k] = Vector3D(uniform(-1.0f, 1.0f), uniform(-0.6f, -0.05f), uniform(-1.0f, 1.0f));
+        }
+
+        auto countHits([&]() { return std::count_if(hits.begin(), hits.end(), [](const HeightFieldRayHit& hit) { return hit.distance >= 0.0f; }); });
+
+        auto seconds = measureSeconds(3, [&]() { castHeightFieldRays(height_pyramid, origins.data(), directions.data(), ray_count, 1.0f, hits.data()); });
+        std::printf("    line of sight, %d%% blocked\n", static_cast<int>(countHits() * 100 / ray_count));
+        reportBenchmark("quadtree", seconds * 1e6 / ray_count, "us/ray");
+
+        seconds = measureSeconds(3, [&]() { castHeightFieldRays(height_pyramid, tiled_height_field, origins.data(), directions.data(), ray_count, 1.0f, hits.data()); });
+        reportBenchmark("quadtree, tiled", seconds * 1e6 / ray_count, "us/ray");
+
+        seconds = measureSeconds(3, [&]() { castHeightFieldRays(height_pyramid, picking_origins.data(), picking_directions.data(), ray_count, 1e6f, hits.data()); });
+        std::printf("    picking, %d%% hit\n", static_cast<int>(countHits() * 100 / ray_count));
+        reportBenchmark("quadtree", seconds * 1e6 / ray_count, "us/ray");
+
+        seconds = measureSeconds(3, [&]() { castHeightFieldRays(height_pyramid, tiled_height_field, picking_origins.data(), picking_directions.data(), ray_count, 1e6f, hits.data()); });
+        reportBenchmark("quadtree, tiled", seconds * 1e6 / ray_count, "us/ray");
+
+        // Every quad for every ray: a few of them are enough.
+        const auto reference_count = 20;
+        seconds = measureSeconds(1, [&]()
+        {
+            for(auto k = 0; k < reference_count; k++)
+                castHeightFieldRayReference(height_field, picking_origins[k], picking_directions[k], 1e6f, hits[k]);
+        });
+
+        reportBenchmark("reference", seconds * 1e6 / reference_count, "us/ray");
+    }
+}
@@ -0,0 +1,203 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "HeightPyramid.h"
+
+#include <cfloat>
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        void getRangeBruteForce(const HeightField& height_field, int x0, int z0, int x1, int z1, float& min_height, float& max_height)
+        {
+            min_height = FLT_MAX;
+            max_height = -FLT_MAX;
+
+            for(auto j = std::max(z0, 0); j <= std::min(z1, height_field.getHeight() - 1); j++)
+            {
+                for(auto i = std::max(x0, 0); i <= std::min(x1, height_field.getWidth() - 1); i++)
+                {
+                    min_height = std::min(min_height, height_field.getHeight(i, j));
+                    max_height = std::max(max_height, height_field.getHeight(i, j));
+                }
+            }
+        }
+
+        void fillRandom(HeightField& height_field, std::mt19937& random)
+        {
+            for(auto j = 0; j < height_field.getHeight(); j++)
+            {
+                for(auto i = 0; i < height_field.getWidth(); i++)
+                    height_field.setHeight(i, j, static_cast<float>(random() % 10000U) * 0.01f);
+            }
+        }
+    }
+
+    BM_TEST(heightPyramidRangesMatchBruteForce)
+    {
+        std::mt19937 random(7U);
+
+        // Square, odd and single sample sizes, so that the levels get cut at the borders.
+        const int sizes[][2] = {{1, 1}, {64, 64}, {65, 33}, {203, 150}};
+
+        for(auto& size : sizes)
+        {
+            HeightField height_field(size[0], size[1], 32.0f);
+            fillRandom(height_field, random);
+
+            HeightPyramid height_pyramid;
+            height_pyramid.build(height_field);
+
+            auto exact = true, bounding = true;
+
+            // Random rectangles, partly off the height field.
+            for(auto query = 0; query < 2000; query++)
+            {
+                auto x0 = static_cast<int>(random() % (size[0] + 4U)) - 2, x1 = static_cast<int>(random() % (size[0] + 4U)) - 2;
+                auto z0 = static_cast<int>(random() % (size[1] + 4U)) - 2, z1 = static_cast<int>(random() % (size[1] + 4U)) - 2;
+
+                if(x0 > x1)
+                    std::swap(x0, x1);
+                if(z0 > z1)
+                    std::swap(z0, z1);
+
+                if(std::max(x0, 0) > std::min(x1, size[0] - 1) || std::max(z0, 0) > std::min(z1, size[1] - 1))
+                    continue;
+
+                float expected_min, expected_max, min_height, max_height;
+                getRangeBruteForce(height_field, x0, z0, x1, z1, expected_min, expected_max);
+
+                height_pyramid.getRange(x0, z0, x1, z1, min_height, max_height);
+                exact = exact && min_height == expected_min && max_height == expected_max;
+
+                height_pyramid.getBoundingRange(x0, z0, x1, z1, min_height, max_height);
+                bounding = bounding && min_height <= expected_min && max_height >= expected_max;
+            }
+
+            BM_CHECK(exact);
+            BM_CHECK(bounding);
+        }
+    }
+
+    BM_TEST(heightPyramidUpdateMatchesRebuild)
+    {
+        std::mt19937 random(9U);
+
+        HeightField height_field(203, 150, 32.0f);
+        fillRandom(height_field, random);
+
+        HeightPyramid height_pyramid;
+        height_pyramid.build(height_field);
+
+        for(auto edit = 0; edit < 10; edit++)
+        {
+            auto x0 = static_cast<int>(random() % 203U), x1 = static_cast<int>(random() % 203U);
+            auto z0 = static_cast<int>(random() % 150U), z1 = static_cast<int>(random() % 150U);
+
+            if(x0 > x1)
+                std::swap(x0, x1);
+            if(z0 > z1)
+                std::swap(z0, z1);
+
+            for(auto j = z0; j <= z1; j++)
+            {
+                for(auto i = x0; i <= x1; i++)
+                    height_field.setHeight(i, j, static_cast<float>(random() % 10000U) * 0.01f - 20.0f);
+            }
+
+            height_pyramid.update(x0, z0, x1, z1);
+
+            HeightPyramid rebuilt;
+            rebuilt.build(height_field);
+
+            auto same = true;
+            for(auto level = 1; level < height_pyramid.getLevelCount(); level++)
+            {
+                for(auto j = 0; j < height_pyramid.getRows(level); j++)
+                {
+                    for(auto i = 0; i < height_pyramid.getColumns(level); i++)
+                        same = same && height_pyramid.getMin(level, i, j) == rebuilt.getMin(level, i, j) && height_pyramid.getMax(level, i, j) == rebuilt.getMax(level, i, j);
+                }
+            }
+
+            BM_CHECK(same);
+        }
+    }
+
+    BM_BENCHMARK(heightPyramidRanges)
+    {
+        const auto size = 4097;
+
+        HeightField hills(size, size, 32.0f), noise(size, size, 32.0f);
+        std::mt19937 random(1U);
+
+        for(auto j = 0; j < size; j++)
+        {
+            for(auto i = 0; i < size; i++)
+            {
+                hills.setHeight(i, j, static_cast<float>(getRollingHillsValue(i, j, size, size) * 8));
+                noise.setHeight(i, j, static_cast<float>(random() % 65536U));
+            }
+        }
+
+        HeightPyramid height_pyramid;
+        auto seconds = measureSeconds(3, [&]() { height_pyramid.build(hills, 1U); });
+        reportBenchmark("build of 4097^2 on one thread", seconds * 1e3, "ms");
+
+        // Random squares of each size, the noise being the worst case for the pruning along the border.
+        const auto query_count = 20000;
+
+        std::vector<int> corners(2 * query_count);
+        for(auto& corner : corners)
+            corner = static_cast<int>(random() % static_cast<unsigned>(size));
+
+        for(auto field : {&hills, &noise})
+        {
+            height_pyramid.build(*field);
+
+            for(auto side : {33, 257, 1025})
+            {
+                auto sum = 0.0f;
+                float min_height, max_height;
+
+                auto range_seconds = measureSeconds(3, [&]()
+                {
+                    for(auto q = 0; q < query_count; q++)
+                    {
+                        height_pyramid.getRange(corners[2 * q], corners[2 * q + 1], corners[2 * q] + side - 1, corners[2 * q + 1] + side - 1, min_height, max_height);
+                        sum += max_height - min_height;
+                    }
+                });
+
+                auto bounding_seconds = measureSeconds(3, [&]()
+                {
+                    for(auto q = 0; q < query_count; q++)
+                    {
+                        height_pyramid.getBoundingRange(corners[2 * q], corners[2 * q + 1], corners[2 * q] + side - 1, corners[2 * q + 1] + side - 1, min_height, max_height);
+                        sum += max_height - min_height;
+                    }
+                });
+
+                // Brute force on a tenth of the queries, it reads every sample.
+                auto brute_force_seconds = measureSeconds(1, [&]()
+                {
+                    for(auto q = 0; q < query_count / 10; q++)
+                    {
+                        getRangeBruteForce(*field, corners[2 * q], corners[2 * q + 1], corners[2 * q] + side - 1, corners[2 * q + 1] + side - 1, min_height, max_height);
+                        sum += max_height - min_height;
+                    }
+                }) * 10.0;
+
+                std::printf("    %s, %d^2 squares (%g)\n", field == &hills ? "rolling hills" : "noise", side, sum);
+                reportBenchmark("getRange", range_seconds * 1e9 / query_count, "ns");
+                reportBenchmark("getBoundingRange", bounding_seconds * 1e9 / query_count, "ns");
+                reportBenchmark("brute force", brute_force_seconds * 1e9 / query_count, "ns");
+            }
+        }
+    }
+}
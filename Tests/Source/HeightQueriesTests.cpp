@@ -0,0 +1,306 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "HeightQueries.h"
+
+#include <limits>
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        HeightField makeRandomHeightField(int width, int height, std::mt19937& random)
+        {
+            HeightField height_field(width, height, 32.0f);
+            for(auto j = 0; j < height; j++)
+            {
+                for(auto i = 0; i < width; i++)
+                    height_field.setHeight(i, j, static_cast<float>(random() % 1000U) * 0.37f);
+            }
+
+            return height_field;
+        }
+
+        // Positions over the field and a few samples past every border, some of them right on the samples.
+        void makeQueries(const HeightField& height_field, size_t count, std::mt19937& random, std::vector<float>& x, std::vector<float>& z)
+        {
+            std::uniform_real_distribution<float> unit(-0.05f, 1.05f);
+
+            x.resize(count);
+            z.resize(count);
+
+            for(auto k = size_t(); k < count; k++)
+            {
+                x[k] = unit(random) * height_field.getX(height_field.getWidth() - 1);
+                z[k] = unit(random) * height_field.getZ(height_field.getHeight() - 1);
+
+                if(k % 7U == 0U)
+                {
+                    x[k] = height_field.getX(static_cast<int>(random() % static_cast<unsigned>(height_field.getWidth())));
+                    z[k] = height_field.getZ(static_cast<int>(random() % static_cast<unsigned>(height_field.getHeight())));
+                }
+            }
+        }
+
+        bool isSameNormal(const Vector3D& a, const Vector3D& b)
+        {
+            return a.x == b.x && a.y == b.y && a.z == b.z;
+        }
+    }
+
+    BM_TEST(batchedHeightQueriesMatchTheReference)
+    {
+        std::mt19937 random(2U);
+
+        // Wide, odd, single row and single sample fields; the counts leave remainders to the scalar code.
+        const int sizes[][2] = {{700, 530}, {33, 17}, {40, 1}, {1, 1}};
+
+        for(auto& size : sizes)
+        {
+            auto height_field = makeRandomHeightField(size[0], size[1], random);
+
+            TiledHeightField tiled_height_field;
+            tiled_height_field.build(height_field);
+
+            std::vector<float> x, z;
+            makeQueries(height_field, 10003U, random, x, z);
+
+            std::vector<float> expected_heights(x.size()), heights(x.size()), tiled_heights(x.size()), plain_heights(x.size());
+            std::vector<Vector3D> expected_normals(x.size()), normals(x.size()), tiled_normals(x.size());
+
+            sampleHeightFieldReference(height_field, x.data(), z.data(), x.size(), expected_heights.data(), expected_normals.data());
+            sampleHeightField(height_field, x.data(), z.data(), x.size(), heights.data(), normals.data());
+            sampleHeightField(height_field, x.data(), z.data(), x.size(), plain_heights.data());
+
+            auto same = true, same_tiled = true;
+            for(auto k = size_t(); k < x.size(); k++)
+                same = same && heights[k] == expected_heights[k] && plain_heights[k] == expected_heights[k] && isSameNormal(normals[k], expected_normals[k]);
+
+            BM_CHECK(same);
+
+            sampleHeightField(tiled_height_field, x.data(), z.data(), x.size(), tiled_heights.data(), tiled_normals.data());
+
+            for(auto k = size_t(); k < x.size(); k++)
+                same_tiled = same_tiled && tiled_heights[k] == expected_heights[k] && isSameNormal(tiled_normals[k], expected_normals[k]);
+
+            BM_CHECK(same_tiled);
+        }
+    }
+
+    BM_TEST(compressedHeightQueriesMatchTheDecodedField)
+    {
+        std::mt19937 random(4U);
+
+        auto height_field = makeRandomHeightField(203, 150, random);
+
+        CompressedHeightField compressed_height_field;
+        compressed_height_field.build(height_field, 0.05f);
+
+        HeightField decoded;
+        compressed_height_field.decode(decoded);
+
+        std::vector<float> x, z;
+        makeQueries(height_field, 4000U, random, x, z);
+
+        std::vector<float> expected_heights(x.size()), heights(x.size());
+        std::vector<Vector3D> expected_normals(x.size()), normals(x.size());
+
+        sampleHeightFieldReference(decoded, x.data(), z.data(), x.size(), expected_heights.data(), expected_normals.data());
+        sampleHeightField(compressed_height_field, x.data(), z.data(), x.size(), heights.data(), normals.data());
+
+        auto same = true;
+        for(auto k = size_t(); k < x.size(); k++)
+            same = same && heights[k] == expected_heights[k] && isSameNormal(normals[k], expected_normals[k]);
+
+        BM_CHECK(same);
+    }
+
+    BM_TEST(compressedHeightFieldUpdateMatchesRebuild)
+    {
+        std::mt19937 random(5U);
+
+        auto height_field = makeRandomHeightField(203, 150, random);
+
+        CompressedHeightField compressed_height_field;
+        compressed_height_field.build(height_field, 0.05f);
+
+        std::vector<float> row(203U), expected_row(203U);
+        auto same = true, bounded = true;
+
+        for(auto edit = 0; edit < 60; edit++)
+        {
+            // Flat patches that need fewer bits, rough ones that need more, across block borders and up to the field's edges.
+            auto x0 = static_cast<int>(random() % 203U), z0 = static_cast<int>(random() % 150U);
+            auto x1 = std::min(x0 + static_cast<int>(random() % 24U), 202), z1 = std::min(z0 + static_cast<int>(random() % 24U), 149);
+            auto scale = edit % 3 == 0 ? 0.0f : edit % 3 == 1 ? 0.37f : 3.7f;
+
+            for(auto j = z0; j <= z1; j++)
+            {
+                for(auto i = x0; i <= x1; i++)
+                    height_field.setHeight(i, j, 100.0f + static_cast<float>(random() % 1000U) * scale);
+            }
+
+            compressed_height_field.update(height_field, x0, z0, x1, z1);
+
+            CompressedHeightField rebuilt;
+            rebuilt.build(height_field, 0.05f);
+
+            for(auto j = 0; j < 150; j++)
+            {
+                compressed_height_field.decodeRow(j, 0, 203, row.data());
+                rebuilt.decodeRow(j, 0, 203, expected_row.data());
+
+                same = same && row == expected_row && compressed_height_field.getHeight(j % 203, j) == rebuilt.getHeight(j % 203, j);
+            }
+
+            // The moved blocks leave at most as much behind as the data holds.
+            bounded = bounded && compressed_height_field.getMemoryUsage() <= 3U * rebuilt.getMemoryUsage();
+        }
+
+        BM_CHECK(compressed_height_field.isComplete());
+        BM_CHECK(same);
+        BM_CHECK(bounded);
+    }
+
+    BM_TEST(compressedHeightsStayWithinHalfThePrecision)
+    {
+        std::mt19937 random(6U);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+        for(auto precision : {0.05f, 8.0f / 15.0f, 0.37f, 4.0f})
+        {
+            // Rough heights of either sign, hundreds to hundreds of thousands of steps from 0.
+            HeightField height_field(203, 150, 32.0f);
+            for(auto j = 0; j < 150; j++)
+            {
+                for(auto i = 0; i < 203; i++)
+                    height_field.setHeight(i, j, unit(random) * (j < 75 ? 100.0f : 20000.0f));
+            }
+
+            CompressedHeightField compressed_height_field;
+            compressed_height_field.build(height_field, precision);
+            BM_CHECK(compressed_height_field.isComplete());
+
+            std::vector<float> row(203U);
+            auto within = true;
+
+            for(auto j = 0; j < 150; j++)
+            {
+                compressed_height_field.decodeRow(j, 0, 203, row.data());
+
+                for(auto i = 0; i < 203; i++)
+                {
+                    // Half a step, and the rounding of the division by the precision and of the product back.
+                    auto original = height_field.getHeight(i, j);
+                    auto bound = precision * 0.5f + 2.0f * std::numeric_limits<float>::epsilon() * std::fabs(original);
+
+                    within = within && std::fabs(row[i] - original) <= bound && compressed_height_field.getHeight(i, j) == row[i];
+                }
+            }
+
+            BM_CHECK(within);
+        }
+
+        // Heights past 2^30 steps are clamped, not wrapped, so that the difference of any two samples still fits the bits
+        // of a block; a NaN is stored as 0.
+        HeightField height_field(16, 16, 32.0f);
+        for(auto j = 0; j < 16; j++)
+        {
+            for(auto i = 0; i < 16; i++)
+                height_field.setHeight(i, j, 1.0f);
+        }
+
+        height_field.setHeight(1, 1, 1e30f);
+        height_field.setHeight(2, 1, -1e30f);
+        height_field.setHeight(3, 1, std::numeric_limits<float>::infinity());
+        height_field.setHeight(4, 1, std::numeric_limits<float>::quiet_NaN());
+
+        CompressedHeightField compressed_height_field;
+        compressed_height_field.build(height_field, 1.0f);
+        BM_CHECK(compressed_height_field.isComplete());
+
+        BM_CHECK(compressed_height_field.getHeight(1, 1) == static_cast<float>((1 << 30) - 1));
+        BM_CHECK(compressed_height_field.getHeight(2, 1) == -static_cast<float>(1 << 30));
+        BM_CHECK(compressed_height_field.getHeight(3, 1) == static_cast<float>((1 << 30) - 1));
+        BM_CHECK(compressed_height_field.getHeight(4, 1) == 0.0f);
+        BM_CHECK(compressed_height_field.getHeight(0, 1) == 1.0f && compressed_height_field.getHeight(5, 1) == 1.0f);
+    }
+
+    BM_TEST(compressedTerrainTakesLessThanAByteASample)
+    {
+        const auto size = 1025;
+        const auto samples = static_cast<double>(size) * size;
+
+        // Bitmap heights at the step of a bitmap, as TerrainTileCache keeps them.
+        HeightField rolling_hills(size, size, 32.0f), ridged(size, size, 32.0f);
+        for(auto j = 0; j < size; j++)
+        {
+            for(auto i = 0; i < size; i++)
+            {
+                rolling_hills.setHeight(i, j, static_cast<float>(getRollingHillsValue(i, j, size, size)) * 8.0f / 15.0f);
+                ridged.setHeight(i, j, static_cast<float>(static_cast<int>(getRidgedValue(i, j) * 63.0f)) * 8.0f / 15.0f);
+            }
+        }
+
+        for(auto height_field : {&rolling_hills, &ridged})
+        {
+            CompressedHeightField compressed_height_field;
+            compressed_height_field.build(*height_field, 8.0f / 15.0f);
+
+            BM_CHECK(compressed_height_field.isComplete());
+            BM_CHECK(compressed_height_field.getMemoryUsage() / samples < 1.0);
+        }
+    }
+
+    BM_BENCHMARK(heightQueries)
+    {
+        const auto size = 4097;
+
+        HeightField height_field(size, size, 32.0f);
+        for(auto j = 0; j < size; j++)
+        {
+            for(auto i = 0; i < size; i++)
+                height_field.setHeight(i, j, static_cast<float>(getRollingHillsValue(i, j, size, size) * 8));
+        }
+
+        TiledHeightField tiled_height_field;
+        tiled_height_field.build(height_field);
+
+        CompressedHeightField compressed_height_field;
+        compressed_height_field.build(height_field, 0.05f);
+
+        // Scattered over the whole field, as for objects spread over the terrain.
+        std::mt19937 random(1U);
+        std::vector<float> x, z;
+        makeQueries(height_field, 1U << 20U, random, x, z);
+
+        std::vector<float> heights(x.size());
+        std::vector<Vector3D> normals(x.size());
+
+        auto reference_seconds = measureSeconds(3, [&]() { sampleHeightFieldReference(height_field, x.data(), z.data(), x.size(), heights.data(), normals.data()); });
+        auto batched_seconds = measureSeconds(3, [&]() { sampleHeightField(height_field, x.data(), z.data(), x.size(), heights.data(), normals.data()); });
+        auto tiled_seconds = measureSeconds(3, [&]() { sampleHeightField(tiled_height_field, x.data(), z.data(), x.size(), heights.data(), normals.data()); });
+        auto compressed_seconds = measureSeconds(3, [&]() { sampleHeightField(compressed_height_field, x.data(), z.data(), x.size(), heights.data(), normals.data()); });
+
+        // Every row of the compressed field decoded in turn, as a tile is read from it.
+        std::vector<float> row(size);
+        auto row_seconds = measureSeconds(3, [&]()
+        {
+            for(auto j = 0; j < size; j++)
+                compressed_height_field.decodeRow(j, 0, size, row.data());
+        });
+
+        std::printf("    %zu heights and normals on 4097^2\n", x.size());
+        reportBenchmark("reference", x.size() / (reference_seconds * 1e6), "Mqueries/s");
+        reportBenchmark("batched", x.size() / (batched_seconds * 1e6), "Mqueries/s");
+        reportBenchmark("batched, tiled", x.size() / (tiled_seconds * 1e6), "Mqueries/s");
+
+        std::printf("    compressed to a step of 0.05, %.2f bytes per sample\n", static_cast<double>(compressed_height_field.getMemoryUsage()) / (static_cast<double>(size) * size));
+        reportBenchmark("batched, compressed", x.size() / (compressed_seconds * 1e6), "Mqueries/s");
+        reportBenchmark("compressed row decode", static_cast<double>(size) * size / (row_seconds * 1e6), "Msamples/s");
+    }
+}
@@ -0,0 +1,162 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "HeightTileFile.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace bm
+{
+    namespace
+    {
+        // Sharp enough that the samples a coarse level drops hold its extremes.
+        int getTileTestValue(int i, int j)
+        {
+            return static_cast<int>(getRidgedValue(5 * i, 5 * j) * 63.0f) ^ ((i * 7 + j * 13) & 3);
+        }
+
+        // Scaled like the converter does.
+        float getTileTestHeight(int i, int j)
+        {
+            return (static_cast<float>(getTileTestValue(i, j)) * 8.0f) / 15.0f;
+        }
+    }
+
+    BM_TEST(heightTileRangesCoverTheFullHeightmap)
+    {
+        // Sizes that the levels don't divide, so that the coarse levels drop the last samples.
+        const int sizes[][2] = {{300, 203}, {129, 129}, {98, 261}};
+
+        for(auto& size : sizes)
+        {
+            auto bitmap = getTestFileName(L"tiles.bmp"), file_name = getTestFileName(L"tiles.bmheights");
+            writeTestHeightMap(bitmap, size[0], size[1], getTileTestValue);
+
+            HeightTileFileSettings settings;
+            settings.tile_size = 33;
+
+            BM_CHECK(convertBitmapToHeightTiles(bitmap.c_str(), file_name.c_str(), settings));
+            BM_CHECK(!fs::exists(fs::path(file_name + L".partial")));
+
+            HeightTileFile tile_file(file_name.c_str());
+            BM_CHECK(tile_file.isValid());
+            if(!tile_file.isValid())
+                continue;
+
+            std::vector<float> stored(static_cast<size_t>(tile_file.getStoredTileSize()) * tile_file.getStoredTileSize());
+            auto exact = true, readable = true, covering = true, stored_exactly = true;
+
+            for(auto level = 0; level < tile_file.getLevelCount(); level++)
+            {
+                auto& tile_level = tile_file.getLevel(level);
+
+                for(auto row = 0; row < tile_level.rows; row++)
+                {
+                    for(auto column = 0; column < tile_level.columns; column++)
+                    {
+                        // The level 0 samples of the tile, up to the edge of the heightmap for the last column and row.
+                        auto x0 = (column * 32) << level, z0 = (row * 32) << level;
+                        auto x1 = column == tile_level.columns - 1 ? size[0] - 1 : std::min(((column + 1) * 32) << level, size[0] - 1);
+                        auto z1 = row == tile_level.rows - 1 ? size[1] - 1 : std::min(((row + 1) * 32) << level, size[1] - 1);
+
+                        auto min_height = std::numeric_limits<float>::max(), max_height = std::numeric_limits<float>::lowest();
+                        for(auto j = z0; j <= z1; j++)
+                        {
+                            for(auto i = x0; i <= x1; i++)
+                            {
+                                min_height = std::min(min_height, getTileTestHeight(i, j));
+                                max_height = std::max(max_height, getTileTestHeight(i, j));
+                            }
+                        }
+
+                        auto& record = tile_file.getTile(level, column, row);
+                        exact = exact && record.min_height == min_height && record.max_height == max_height;
+
+                        // And so every sample the level keeps, apron aside.
+                        auto read = tile_file.readTile(level, column, row, stored.data());
+                        readable = readable && read;
+                        if(!read)
+                            continue;
+
+                        for(auto j = 1; j < tile_file.getStoredTileSize() - 1; j++)
+                        {
+                            for(auto i = 1; i < tile_file.getStoredTileSize() - 1; i++)
+                            {
+                                auto height = stored[static_cast<size_t>(j) * tile_file.getStoredTileSize() + i];
+                                covering = covering && height >= record.min_height && height <= record.max_height;
+                            }
+                        }
+
+                        // Every stored sample, apron included, is the level 0 sample the level keeps there, the edges of
+                        // the level repeated past them.
+                        for(auto j = 0; j < tile_file.getStoredTileSize(); j++)
+                        {
+                            auto z = std::min(std::max(row * 32 + j - 1, 0), tile_level.height - 1);
+
+                            for(auto i = 0; i < tile_file.getStoredTileSize(); i++)
+                            {
+                                auto x = std::min(std::max(column * 32 + i - 1, 0), tile_level.width - 1);
+                                stored_exactly = stored_exactly && stored[static_cast<size_t>(j) * tile_file.getStoredTileSize() + i] == getTileTestHeight(x << level, z << level);
+                            }
+                        }
+                    }
+                }
+            }
+
+            BM_CHECK(exact);
+            BM_CHECK(readable);
+            BM_CHECK(covering);
+            BM_CHECK(stored_exactly);
+        }
+    }
+
+    BM_TEST(heightTileConversionLeavesNothingBehindWhenItFails)
+    {
+        auto bitmap = getTestFileName(L"tiles.bmp");
+        writeTestHeightMap(bitmap, 100, 100, getTileTestValue);
+
+        // A directory can't be replaced by the converted file.
+        auto file_name = getTestFileName(L"tiles_directory.bmheights");
+        fs::create_directories(fs::path(file_name));
+
+        BM_CHECK(!convertBitmapToHeightTiles(bitmap.c_str(), file_name.c_str()));
+        BM_CHECK(fs::is_directory(fs::path(file_name)));
+        BM_CHECK(!fs::exists(fs::path(file_name + L".partial")));
+    }
+
+    BM_TEST(truncatedHeightTileFilesAreRejected)
+    {
+        auto bitmap = getTestFileName(L"tiles.bmp"), file_name = getTestFileName(L"tiles.bmheights");
+        writeTestHeightMap(bitmap, 300, 203, getTileTestValue);
+
+        HeightTileFileSettings settings;
+        settings.tile_size = 33;
+        BM_CHECK(convertBitmapToHeightTiles(bitmap.c_str(), file_name.c_str(), settings));
+
+        uint64_t index_offset, file_size;
+        {
+            HeightTileFile tile_file(file_name.c_str());
+            BM_CHECK(tile_file.isValid());
+            if(!tile_file.isValid())
+                return;
+
+            index_offset = tile_file.getHeader().index_offset;
+            file_size = tile_file.getHeader().file_size;
+        }
+
+        // Cut in the header, in the index and in the last tile, then the file grown back by a byte.
+        const uint64_t sizes[] = {0U, sizeof(HeightTileFileHeader) - 1U, sizeof(HeightTileFileHeader), index_offset + 1U, file_size - 1U, file_size + 1U};
+
+        for(auto size : sizes)
+        {
+            fs::resize_file(fs::path(file_name), size);
+
+            HeightTileFile tile_file(file_name.c_str());
+            BM_CHECK(!tile_file.isValid());
+        }
+    }
+}
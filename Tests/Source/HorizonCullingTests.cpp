@@ -0,0 +1,211 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "FrustumCulling.h"
+#include "HorizonCulling.h"
+#include "Terrain.h"
+
+namespace bm
+{
+    namespace
+    {
+        // Fixed scene: deep valleys between sharp crests on 32-unit samples.
+        HeightField makeRidgedHeightField(int size)
+        {
+            HeightField height_field(size, size, 32.0f);
+
+            for(auto j = 0; j < size; j++)
+            {
+                for(auto i = 0; i < size; i++)
+                    height_field.setHeight(i, j, getRidgedValue(i, j) * 1500.0f);
+            }
+
+            return height_field;
+        }
+
+        // Height of the triangulated surface, the cells split from (i, j) to (i + 1, j + 1).
+        float getSurfaceHeight(const HeightField& height_field, float x, float z)
+        {
+            auto u = x / height_field.getSpacing(), v = z / height_field.getSpacing();
+            auto i = std::min(static_cast<int>(u), height_field.getWidth() - 2), j = std::min(static_cast<int>(v), height_field.getHeight() - 2);
+            auto fu = u - static_cast<float>(i), fv = v - static_cast<float>(j);
+
+            auto h00 = height_field.getHeight(i, j), h11 = height_field.getHeight(i + 1, j + 1);
+            if(fu >= fv)
+                return h00 + (height_field.getHeight(i + 1, j) - h00) * fu + (h11 - height_field.getHeight(i + 1, j)) * fv;
+
+            return h00 + (height_field.getHeight(i, j + 1) - h00) * fv + (h11 - height_field.getHeight(i, j + 1)) * fu;
+        }
+
+        // Whether any sample of the chunk can be seen from the camera: marched in half-sample steps, the segment to it
+        // never goes under the surface.
+        bool isChunkSeen(const HeightField& height_field, const Vector3D& camera, int x, int z, int quads)
+        {
+            auto last_x = std::min(x + quads, height_field.getWidth() - 1), last_z = std::min(z + quads, height_field.getHeight() - 1);
+
+            for(auto j = z; j <= last_z; j++)
+            {
+                for(auto i = x; i <= last_x; i++)
+                {
+                    auto target = height_field.getPosition(i, j);
+                    auto dx = target.x - camera.x, dy = target.y - camera.y, dz = target.z - camera.z;
+
+                    auto steps = std::max(2, static_cast<int>(std::sqrt(dx * dx + dz * dz) / (0.5f * height_field.getSpacing())));
+                    auto blocked = false;
+
+                    // The last steps end on the surface around the sample itself.
+                    for(auto s = 1; s < steps - 2 && !blocked; s++)
+                    {
+                        auto t = static_cast<float>(s) / static_cast<float>(steps);
+                        blocked = camera.y + dy * t < getSurfaceHeight(height_field, camera.x + dx * t, camera.z + dz * t) - 0.01f;
+                    }
+
+                    if(!blocked)
+                        return true;
+                }
+            }
+
+            return false;
+        }
+
+        Frustum getViewFrustum(const Vector3D& position, float yaw)
+        {
+            auto view = DirectX::XMMatrixLookAtLH(DirectX::XMVectorSet(position.x, position.y, position.z, 1.0f),
+                                                  DirectX::XMVectorSet(position.x + std::sin(yaw), position.y - 0.05f, position.z + std::cos(yaw), 1.0f),
+                                                  DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+
+            return computeFrustum(DirectX::XMMatrixMultiply(view, DirectX::XMMatrixPerspectiveFovLH(0.4f * 3.14159265f, 16.0f / 9.0f, 1.0f, 100000.0f)));
+        }
+    }
+
+    BM_TEST(horizonCullingHidesOnlyHiddenChunks)
+    {
+        const auto size = 257, chunk_quads = 32;
+
+        auto height_field = makeRidgedHeightField(size);
+        HeightPyramid height_pyramid;
+        height_pyramid.build(height_field);
+
+        HorizonCulling horizon_culling;
+        horizon_culling.build(height_pyramid, 8);
+
+        auto columns = (size - 2) / chunk_quads + 1;
+
+        BoundingBoxes boxes;
+        for(auto c = 0; c < columns * columns; c++)
+        {
+            auto x = c % columns * chunk_quads, z = c / columns * chunk_quads;
+
+            float min_height, max_height;
+            height_pyramid.getRange(x, z, x + chunk_quads, z + chunk_quads, min_height, max_height);
+            boxes.add(Vector3D(height_field.getX(x), min_height, height_field.getZ(z)),
+                      Vector3D(height_field.getX(x + chunk_quads), max_height, height_field.getZ(z + chunk_quads)));
+        }
+
+        auto frustum_count = size_t(), horizon_count = size_t();
+        auto hidden_only = true;
+
+        // Low cameras 30 units above the ground, looking around.
+        for(auto view = 0; view < 8; view++)
+        {
+            auto x = (0.2f + 0.08f * view) * height_field.getX(size - 1), z = (0.15f + 0.05f * view) * height_field.getZ(size - 1);
+            auto camera = Vector3D(x, getSurfaceHeight(height_field, x, z) + 30.0f, z);
+
+            std::vector<uint32_t> visible;
+            cullBoundingBoxes(getViewFrustum(camera, 0.8f * view), boxes, visible);
+            auto in_frustum = visible;
+
+            horizon_culling.cull(camera, chunk_quads, columns, nullptr, visible);
+
+            frustum_count += in_frustum.size();
+            horizon_count += visible.size();
+
+            for(auto index : in_frustum)
+            {
+                if(!std::binary_search(visible.begin(), visible.end(), index))
+                    hidden_only = hidden_only && !isChunkSeen(height_field, camera, index % columns * chunk_quads, index / columns * chunk_quads, chunk_quads);
+            }
+        }
+
+        // The valleys hide most of the chunks in the frustums from these cameras. The horizon raised by the lowest sample of
+        // every block finds 58 of the 258, so at least a fifth of them have to go.
+        BM_CHECK(hidden_only);
+        BM_CHECK(horizon_count * 5U <= frustum_count * 4U);
+    }
+
+    BM_TEST(horizonCullingKeepsEverythingForACameraUnderTheGround)
+    {
+        auto height_field = makeRidgedHeightField(129);
+        HeightPyramid height_pyramid;
+        height_pyramid.build(height_field);
+
+        HorizonCulling horizon_culling;
+        horizon_culling.build(height_pyramid, 8);
+
+        auto x = 0.5f * height_field.getX(128), z = 0.5f * height_field.getZ(128);
+        float min_height, max_height;
+        height_pyramid.getRange(56, 56, 72, 72, min_height, max_height);
+
+        std::vector<uint32_t> all(16), visible;
+        for(auto c = 0U; c < 16U; c++)
+            all[c] = c;
+
+        visible = all;
+        horizon_culling.cull(Vector3D(x, min_height - 100.0f, z), 32, 4, nullptr, visible);
+
+        BM_CHECK(visible == all);
+    }
+
+    BM_TEST(terrainCullsOnlyTheFrustumUnderTheGround)
+    {
+        auto height_map = getTestFileName(L"under.bmp");
+        BM_CHECK(writeTestHeightMap(height_map, 257, 257, [](int i, int j) { return getRollingHillsValue(i, j, 257, 257); }));
+
+        TerrainSettings settings;
+        settings.chunk_size = 17;
+        settings.level_of_detail = TerrainLevelOfDetail::None;
+
+        auto frustum_settings = settings;
+        frustum_settings.horizon_culling = false;
+        frustum_settings.occlusion_culling = false;
+
+        Terrain terrain(getTestDevice(), height_map.c_str(), L"", L"", settings);
+        Terrain frustum_terrain(getTestDevice(), height_map.c_str(), L"", L"", frustum_settings);
+
+        auto view_projection = DirectX::XMMatrixPerspectiveFovLH(0.4f * 3.14159265f, 16.0f / 9.0f, 1.0f, 100000.0f);
+
+        // Along the middle row, a sample at a time, looking along +Z from just over and just under the ground.
+        auto culled_above = false, kept_under = true;
+
+        for(auto i = 8; i < 248; i += 8)
+        {
+            auto x = 32.0f * static_cast<float>(i), z = 32.0f * 40.0f;
+
+            float ground_height;
+            terrain.getGroundHeights(&x, &z, 1U, &ground_height);
+
+            for(auto offset : {5.0f, -2.0f})
+            {
+                auto position = DirectX::XMVectorSet(x, ground_height + offset, z, 1.0f);
+                auto view = DirectX::XMMatrixTranslation(-x, -(ground_height + offset), -z);
+                auto frustum = computeFrustum(DirectX::XMMatrixMultiply(view, view_projection));
+
+                terrain.cullDrawCalls(frustum, position, DirectX::XMMatrixMultiply(view, view_projection));
+                frustum_terrain.cullDrawCalls(frustum, position, DirectX::XMMatrixMultiply(view, view_projection));
+
+                auto count = terrain.getVisibleDrawCalls().size(), frustum_count = frustum_terrain.getVisibleDrawCalls().size();
+
+                if(offset > 0.0f)
+                    culled_above = culled_above || count < frustum_count;
+                else
+                    kept_under = kept_under && count == frustum_count;
+            }
+        }
+
+        BM_CHECK(culled_above);
+        BM_CHECK(kept_under);
+    }
+}
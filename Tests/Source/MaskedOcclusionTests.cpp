@@ -0,0 +1,213 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "MaskedOcclusion.h"
+#include "Terrain.h"
+
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        Matrix getViewProjection(const Vector3D& position, const Vector3D& target)
+        {
+            auto view = DirectX::XMMatrixLookAtLH(DirectX::XMVectorSet(position.x, position.y, position.z, 1.0f),
+                                                  DirectX::XMVectorSet(target.x, target.y, target.z, 1.0f),
+                                                  DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+
+            return DirectX::XMMatrixMultiply(view, DirectX::XMMatrixPerspectiveFovLH(0.4f * 3.14159265f, 16.0f / 9.0f, 1.0f, 100000.0f));
+        }
+
+        // A 129 x 129 flat heightmap crossed by a 24-sample wide ridge of the full 8-bit height from row 56 on.
+        std::wstring writeRidgeHeightMap()
+        {
+            auto height_map = getTestFileName(L"ridge.bmp");
+            writeTestHeightMap(height_map, 129, 129, [](int, int j) { return j >= 56 && j <= 80 ? 255 : 0; });
+
+            return height_map;
+        }
+    }
+
+    BM_TEST(maskedOcclusionHidesBoxesBehindAWall)
+    {
+        MaskedOcclusion masked_occlusion(256, 128, 1U);
+        masked_occlusion.clear(getViewProjection(Vector3D(0.0f, 0.0f, 0.0f), Vector3D(0.0f, 0.0f, 1.0f)));
+
+        // A 100 x 100 wall 100 units ahead, as two triangles.
+        const Vector3D wall[] = {{-50.0f, -50.0f, 100.0f}, {50.0f, -50.0f, 100.0f}, {50.0f, 50.0f, 100.0f}, {-50.0f, 50.0f, 100.0f}};
+        const uint32_t indices[] = {0, 1, 2, 0, 2, 3};
+        masked_occlusion.renderOccluders(wall, 4U, indices, 2U);
+
+        BM_CHECK(!masked_occlusion.isBoxVisible(Vector3D(-10.0f, -10.0f, 200.0f), Vector3D(10.0f, 10.0f, 220.0f)));
+        BM_CHECK(!masked_occlusion.isBoxVisible(Vector3D(40.0f, -10.0f, 200.0f), Vector3D(80.0f, 10.0f, 220.0f)));
+
+        // In front of the wall, past its edge and reaching through the near plane.
+        BM_CHECK(masked_occlusion.isBoxVisible(Vector3D(-10.0f, -10.0f, 50.0f), Vector3D(10.0f, 10.0f, 60.0f)));
+        BM_CHECK(masked_occlusion.isBoxVisible(Vector3D(120.0f, -10.0f, 200.0f), Vector3D(160.0f, 10.0f, 220.0f)));
+        BM_CHECK(masked_occlusion.isBoxVisible(Vector3D(-1.0f, -1.0f, -1.0f), Vector3D(1.0f, 1.0f, 300.0f)));
+
+        // Off the screen.
+        BM_CHECK(!masked_occlusion.isBoxVisible(Vector3D(500.0f, -10.0f, 100.0f), Vector3D(520.0f, 10.0f, 120.0f)));
+    }
+
+    BM_TEST(maskedOcclusionVectorCodeMatchesTheReference)
+    {
+        std::mt19937 random(3U);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+        // Triangles of every size around the view, some of them through the near plane or past the guard band.
+        std::vector<Vector3D> positions;
+        std::vector<uint32_t> indices;
+        for(auto t = 0U; t < 1200U; t++)
+        {
+            auto center = Vector3D(unit(random) * 400.0f, unit(random) * 200.0f, 30.0f + (unit(random) + 1.0f) * 150.0f);
+            auto size = t % 50U == 0U ? 300.0f : t % 3U == 0U ? 2.0f : 30.0f;
+
+            for(auto k = 0; k < 3; k++)
+            {
+                indices.push_back(static_cast<uint32_t>(positions.size()));
+                positions.push_back(Vector3D(center.x + unit(random) * size, center.y + unit(random) * size, center.z + unit(random) * size));
+            }
+        }
+
+        auto same_depths = true, same_queries = true;
+
+        for(auto view = 0; view < 4; view++)
+        {
+            auto view_projection = getViewProjection(Vector3D(0.0f, 0.0f, 0.0f), Vector3D(0.3f * view - 0.45f, 0.1f * view - 0.15f, 1.0f));
+
+            // Odd sizes leave partial tiles, more threads than one split the tile rows.
+            MaskedOcclusion masked_occlusion(250, 124, 3U), reference(250, 124, 1U);
+            masked_occlusion.clear(view_projection);
+            reference.clear(view_projection);
+
+            // In batches, so that later triangles land on layers in progress.
+            for(auto first = size_t(); first < indices.size(); first += 300U)
+            {
+                masked_occlusion.renderOccluders(positions.data(), positions.size(), indices.data() + first, 100U);
+                reference.renderOccludersReference(positions.data(), positions.size(), indices.data() + first, 100U);
+            }
+
+            for(auto tile_y = 0; tile_y < reference.getHeight() / MaskedOcclusion::tile_height; tile_y++)
+                for(auto tile_x = 0; tile_x < reference.getWidth() / MaskedOcclusion::tile_width; tile_x++)
+                    same_depths = same_depths && masked_occlusion.getTileDepth(tile_x, tile_y) == reference.getTileDepth(tile_x, tile_y);
+
+            // Small boxes at every depth also read the coverage masks and the layers in progress.
+            for(auto box = 0; box < 4000; box++)
+            {
+                auto center = Vector3D(unit(random) * 300.0f, unit(random) * 150.0f, 20.0f + (unit(random) + 1.0f) * 200.0f);
+                auto extent = (unit(random) + 1.5f) * 0.5f;
+
+                auto bounds_min = Vector3D(center.x - extent, center.y - extent, center.z - extent);
+                auto bounds_max = Vector3D(center.x + extent, center.y + extent, center.z + extent);
+
+                same_queries = same_queries && masked_occlusion.isBoxVisible(bounds_min, bounds_max) == reference.isBoxVisible(bounds_min, bounds_max);
+            }
+        }
+
+        BM_CHECK(same_depths);
+        BM_CHECK(same_queries);
+    }
+
+    BM_TEST(terrainHidesObjectsBehindIt)
+    {
+        auto height_map = writeRidgeHeightMap();
+
+        TerrainSettings settings;
+        settings.chunk_size = 33;
+        settings.level_of_detail = TerrainLevelOfDetail::None;
+        settings.horizon_culling = false;
+        settings.occlusion_culling = true;
+
+        Terrain terrain(getTestDevice(), height_map.c_str(), L"", L"", settings);
+
+        // Low in front of the ridge (136 units high from z = 1792 on), looking across it.
+        auto camera = Vector3D(2048.0f, 40.0f, 640.0f);
+        auto view_projection = getViewProjection(camera, Vector3D(2048.0f, 40.0f, 4000.0f));
+
+        auto behind_ridge_min = Vector3D(2000.0f, 0.0f, 3450.0f), behind_ridge_max = Vector3D(2100.0f, 30.0f, 3550.0f);
+        auto above_ridge_min = Vector3D(2000.0f, 600.0f, 3450.0f), above_ridge_max = Vector3D(2100.0f, 630.0f, 3550.0f);
+
+        // Nothing is hidden before the first culling.
+        BM_CHECK(terrain.isObjectVisible(behind_ridge_min, behind_ridge_max));
+
+        terrain.cullDrawCalls(computeFrustum(view_projection), DirectX::XMVectorSet(camera.x, camera.y, camera.z, 1.0f), view_projection);
+
+        BM_CHECK(!terrain.isObjectVisible(behind_ridge_min, behind_ridge_max));
+        BM_CHECK(terrain.isObjectVisible(above_ridge_min, above_ridge_max));
+
+        // Only the occluder cells in the frustum are drawn, out of 32 x 32 of two triangles for the top and each wall.
+        BM_CHECK(terrain.getMaskedOcclusion().getStats().triangle_count < 32U * 32U * 6U / 2U);
+        BM_CHECK(terrain.isObjectVisible(Vector3D(2000.0f, 0.0f, 1200.0f), Vector3D(2100.0f, 30.0f, 1300.0f)));
+
+        BoundingBoxes objects;
+        objects.add(behind_ridge_min, behind_ridge_max);
+        objects.add(above_ridge_min, above_ridge_max);
+
+        std::vector<uint32_t> visible = {0U, 1U};
+        BM_CHECK(terrain.cullObjects(objects, visible) == 1U && visible.front() == 1U);
+    }
+
+    BM_BENCHMARK(maskedOcclusion)
+    {
+        // 1025^2 ridged terrain in 33-sample chunks: 128^2 occluder cells, eight low cameras looking around.
+        auto height_map = getTestFileName(L"occlusion.bmp");
+        writeTestHeightMap(height_map, 1025, 1025, [](int i, int j) { return std::min(static_cast<int>(getRidgedValue(i, j) * 64.0f), 255); });
+
+        TerrainSettings settings;
+        settings.chunk_size = 33;
+        settings.level_of_detail = TerrainLevelOfDetail::None;
+        settings.horizon_culling = false;
+        settings.occlusion_culling = true;
+
+        Terrain terrain(getTestDevice(), height_map.c_str(), L"", L"", settings);
+
+        auto triangles = size_t(), rasterized = size_t(), queries = size_t(), hidden = size_t();
+        auto raster_milliseconds = 0.0, query_milliseconds = 0.0, cull_milliseconds = 0.0;
+
+        for(auto view = 0; view < 8; view++)
+        {
+            auto x = (0.2f + 0.08f * view) * 32768.0f, z = (0.15f + 0.05f * view) * 32768.0f;
+
+            float ground_height;
+            terrain.getGroundHeights(&x, &z, 1U, &ground_height);
+
+            auto camera = Vector3D(x, ground_height + 30.0f, z);
+            auto yaw = 0.8f * view;
+            auto view_projection = getViewProjection(camera, Vector3D(x + std::sin(yaw), camera.y - 0.05f, z + std::cos(yaw)));
+
+            // Best of a few runs of each view.
+            auto best_raster = 1e30, best_query = 1e30;
+            auto cull_seconds = measureSeconds(5, [&]()
+            {
+                terrain.cullDrawCalls(computeFrustum(view_projection), DirectX::XMVectorSet(camera.x, camera.y, camera.z, 1.0f), view_projection);
+
+                auto& stats = terrain.getMaskedOcclusion().getStats();
+                best_raster = std::min(best_raster, stats.raster_milliseconds);
+                best_query = std::min(best_query, stats.query_milliseconds);
+            });
+
+            auto& stats = terrain.getMaskedOcclusion().getStats();
+            triangles += stats.triangle_count;
+            rasterized += stats.raster_count;
+            queries += stats.query_count;
+            hidden += stats.hidden_count;
+            raster_milliseconds += best_raster;
+            query_milliseconds += best_query;
+            cull_milliseconds += cull_seconds * 1e3;
+        }
+
+        std::printf("    per view: %zu occluder triangles, %zu rasterized, %zu boxes queried, %zu hidden\n",
+                    triangles / 8, rasterized / 8, queries / 8, hidden / 8);
+
+        reportBenchmark("cullDrawCalls per view", cull_milliseconds / 8.0, "ms");
+        reportBenchmark("occluder raster per view", raster_milliseconds / 8.0, "ms");
+        reportBenchmark("occluder triangles submitted", triangles / (raster_milliseconds * 1e3), "Mtriangles/s");
+        reportBenchmark("box queries per view", query_milliseconds / 8.0, "ms");
+        reportBenchmark("box query", query_milliseconds * 1e6 / std::max<size_t>(queries, 1U), "ns/box");
+    }
+}
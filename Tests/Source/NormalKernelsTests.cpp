@@ -0,0 +1,113 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "NormalKernels.h"
+
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        // Heights in the steps of the bitmap heightmaps, over sixteen times their range for steep slopes.
+        HeightField makeRandomHeightField(int width, int height, unsigned seed)
+        {
+            std::mt19937 random(seed);
+
+            HeightField height_field(width, height, 32.0f);
+            for(auto j = 0; j < height; j++)
+                for(auto i = 0; i < width; i++)
+                    height_field.setHeight(i, j, static_cast<float>(random() % 4096U) * 8.0f / 15.0f);
+
+            return height_field;
+        }
+
+        float getLargestDifference(const HeightField& a, const HeightField& b)
+        {
+            auto difference = 0.0f;
+
+            for(auto j = 0; j < a.getHeight(); j++)
+            {
+                for(auto i = 0; i < a.getWidth(); i++)
+                {
+                    auto normal_a = a.getNormal(i, j), normal_b = b.getNormal(i, j);
+
+                    difference = std::max({difference, std::fabs(normal_a.x - normal_b.x), std::fabs(normal_a.y - normal_b.y),
+                                           std::fabs(normal_a.z - normal_b.z)});
+                }
+            }
+
+            return difference;
+        }
+    }
+
+    BM_TEST(normalKernelsMatchReference)
+    {
+        // Sizes with and without vector tails, and grids too small to have an interior.
+        const int sizes[][2] = {{128, 128}, {37, 19}, {1000, 9}, {2, 2}, {3, 5}, {1, 7}, {9, 1}};
+
+        for(auto& size : sizes)
+        {
+            auto kernel = makeRandomHeightField(size[0], size[1], 1U);
+            auto reference = kernel;
+
+            computeHeightFieldNormals(kernel, 0, size[1]);
+            computeHeightFieldNormalsReference(reference);
+
+            // Both end in the same 16-bit octahedral encoding, whose steps are about 3e-5.
+            BM_CHECK(getLargestDifference(kernel, reference) < 1e-3f);
+        }
+    }
+
+    BM_TEST(normalKernelsDoNotDependOnRowBands)
+    {
+        auto whole = makeRandomHeightField(77, 61, 2U);
+        auto banded = whole;
+
+        computeHeightFieldNormals(whole, 0, whole.getHeight());
+
+        for(auto row : {0, 1, 2, 30, 59, 60, 61})
+            computeHeightFieldNormals(banded, row, std::min(row + 29, banded.getHeight()));
+
+        BM_CHECK(std::equal(whole.getPackedNormals(), whole.getPackedNormals() + 77 * 61, banded.getPackedNormals()));
+    }
+
+    BM_TEST(normalKernelsRoundVectorAndScalarColumnsAlike)
+    {
+        auto source = makeRandomHeightField(301, 33, 3U);
+        computeHeightFieldNormals(source, 0, source.getHeight());
+
+        // A 3 x 3 grid has a single interior sample, which always goes through the scalar code.
+        HeightField neighbourhood(3, 3, source.getSpacing());
+
+        auto same = true;
+        for(auto j = 1; j < source.getHeight() - 1; j++)
+        {
+            for(auto i = 1; i < source.getWidth() - 1; i++)
+            {
+                for(auto y = 0; y < 3; y++)
+                    for(auto x = 0; x < 3; x++)
+                        neighbourhood.setHeight(x, y, source.getHeight(i + x - 1, j + y - 1));
+
+                computeHeightFieldNormals(neighbourhood, 1, 2);
+                same = same && neighbourhood.getPackedNormals()[neighbourhood.getIndex(1, 1)] == source.getPackedNormals()[source.getIndex(i, j)];
+            }
+        }
+
+        BM_CHECK(same);
+    }
+
+    BM_BENCHMARK(normalKernels)
+    {
+        auto height_field = makeRandomHeightField(4097, 4097, 4U);
+        auto samples = 4097.0 * 4097.0;
+
+        auto kernel_seconds = measureSeconds(3, [&]() { computeHeightFieldNormals(height_field, 0, height_field.getHeight()); });
+        auto reference_seconds = measureSeconds(1, [&]() { computeHeightFieldNormalsReference(height_field); });
+
+        reportBenchmark("vector kernels, 4097^2, one thread", kernel_seconds * 1e9 / samples, "ns/sample");
+        reportBenchmark("scalar reference, 4097^2", reference_seconds * 1e9 / samples, "ns/sample");
+    }
+}
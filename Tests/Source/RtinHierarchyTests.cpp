@@ -0,0 +1,282 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "RtinHierarchy.h"
+#include "Terrain.h"
+#include "TerrainBake.h"
+
+#include <map>
+#include <random>
+#include <utility>
+
+namespace bm
+{
+    namespace
+    {
+        HeightField makeHeightField(int width, int height, bool smooth)
+        {
+            std::mt19937 random(11U);
+
+            HeightField height_field(width, height, 32.0f);
+            for(auto j = 0; j < height; j++)
+            {
+                for(auto i = 0; i < width; i++)
+                {
+                    auto value = smooth ? static_cast<float>(getRollingHillsValue(i, j, width, height)) : getRidgedValue(i, j) * 64.0f + static_cast<float>(random() % 4U);
+                    height_field.setHeight(i, j, value * 8.0f / 15.0f);
+                }
+            }
+
+            return height_field;
+        }
+
+        // Twice the signed area of a triangle of samples, in samples squared. Negative for the winding of the terrain mesh.
+        int64_t getDoubleArea(int width, uint32_t a, uint32_t b, uint32_t c)
+        {
+            int64_t ax = a % width, az = a / width, bx = b % width, bz = b / width, cx = c % width, cz = c / width;
+
+            return (bx - ax) * (cz - az) - (bz - az) * (cx - ax);
+        }
+
+        // Largest distance between a sample and the triangle over it, -1 if a sample isn't under any triangle.
+        float getLargestError(const HeightField& height_field, const std::vector<uint32_t>& triangles)
+        {
+            auto width = height_field.getWidth(), height = height_field.getHeight();
+            std::vector<float> errors(static_cast<size_t>(width) * height, -1.0f);
+
+            for(auto t = size_t(); t < triangles.size(); t += 3)
+            {
+                int64_t x[3], z[3];
+                double h[3];
+                for(auto k = 0; k < 3; k++)
+                {
+                    x[k] = triangles[t + k] % width;
+                    z[k] = triangles[t + k] / width;
+                    h[k] = height_field.getHeight(static_cast<int>(x[k]), static_cast<int>(z[k]));
+                }
+
+                auto area = (x[1] - x[0]) * (z[2] - z[0]) - (z[1] - z[0]) * (x[2] - x[0]);
+
+                for(auto j = *std::min_element(z, z + 3); j <= *std::max_element(z, z + 3); j++)
+                {
+                    for(auto i = *std::min_element(x, x + 3); i <= *std::max_element(x, x + 3); i++)
+                    {
+                        // Edge functions, all of the sign of the area inside and on the edges.
+                        int64_t w[3];
+                        for(auto k = 0; k < 3; k++)
+                        {
+                            auto p = k, q = (k + 1) % 3;
+                            w[(k + 2) % 3] = (x[q] - x[p]) * (j - z[p]) - (z[q] - z[p]) * (i - x[p]);
+                        }
+
+                        if(std::any_of(w, w + 3, [&](int64_t weight) { return area > 0 ? weight < 0 : weight > 0; }))
+                            continue;
+
+                        auto surface = (w[0] * h[0] + w[1] * h[1] + w[2] * h[2]) / static_cast<double>(area);
+                        auto& error = errors[static_cast<size_t>(j) * width + i];
+                        error = std::max(error, static_cast<float>(std::fabs(surface - height_field.getHeight(static_cast<int>(i), static_cast<int>(j)))));
+                    }
+                }
+            }
+
+            return *std::min_element(errors.begin(), errors.end()) < 0.0f ? -1.0f : *std::max_element(errors.begin(), errors.end());
+        }
+
+        // Whether the triangles tile the width x height samples without gaps, overlaps or T-junctions, all wound alike.
+        bool isWatertight(int width, int height, const std::vector<uint32_t>& triangles)
+        {
+            // Every directed edge once, its reverse once from the neighbour unless it lies on the border.
+            std::map<std::pair<uint32_t, uint32_t>, int> edges;
+            auto area = int64_t();
+
+            for(auto t = size_t(); t < triangles.size(); t += 3)
+            {
+                auto double_area = getDoubleArea(width, triangles[t], triangles[t + 1], triangles[t + 2]);
+                if(double_area >= 0)
+                    return false;
+
+                area -= double_area;
+
+                for(auto k = 0; k < 3; k++)
+                {
+                    if(++edges[{triangles[t + k], triangles[t + (k + 1) % 3]}] > 1)
+                        return false;
+                }
+            }
+
+            auto onBorder([&](uint32_t a, uint32_t b)
+            {
+                auto ax = a % width, az = a / width, bx = b % width, bz = b / width;
+
+                return (ax == bx && (ax == 0U || ax == static_cast<uint32_t>(width - 1))) || (az == bz && (az == 0U || az == static_cast<uint32_t>(height - 1)));
+            });
+
+            for(auto& edge : edges)
+            {
+                if(!onBorder(edge.first.first, edge.first.second) && edges.count({edge.first.second, edge.first.first}) == 0U)
+                    return false;
+            }
+
+            return area == 2 * static_cast<int64_t>(width - 1) * (height - 1);
+        }
+    }
+
+    BM_TEST(rtinMeshStaysWithinItsError)
+    {
+        // Sizes that the covering grid of 2^k + 1 samples is larger than.
+        const int sizes[][2] = {{129, 129}, {200, 77}, {65, 190}};
+
+        for(auto& size : sizes)
+        {
+            auto height_field = makeHeightField(size[0], size[1], false);
+
+            for(auto block_size : {0, 32})
+            {
+                RtinHierarchy rtin;
+                rtin.build(height_field, block_size);
+
+                for(auto max_error : {0.0f, 0.5f, 2.0f, 10.0f})
+                {
+                    std::vector<uint32_t> triangles;
+                    rtin.extractMesh(max_error, triangles);
+
+                    auto largest_error = getLargestError(height_field, triangles);
+                    BM_CHECK(largest_error >= 0.0f && largest_error <= max_error * (1.0f + 1e-5f) + 1e-4f);
+                }
+            }
+        }
+    }
+
+    BM_TEST(rtinMeshIsWatertightAcrossBlocks)
+    {
+        const int sizes[][2] = {{129, 129}, {200, 77}, {65, 190}};
+
+        auto watertight = true, within_blocks = true;
+
+        for(auto& size : sizes)
+        {
+            auto height_field = makeHeightField(size[0], size[1], false);
+
+            for(auto block_size : {0, 16, 32})
+            {
+                RtinHierarchy rtin;
+                rtin.build(height_field, block_size);
+
+                for(auto max_error : {0.0f, 1.0f, 10.0f, 1000.0f})
+                {
+                    std::vector<uint32_t> triangles;
+                    rtin.extractMesh(max_error, triangles);
+
+                    watertight = watertight && isWatertight(size[0], size[1], triangles);
+
+                    // No triangle crosses a block line, so the chunks cut along them share the vertices of their borders.
+                    for(auto t = size_t(); block_size > 0 && t < triangles.size(); t += 3)
+                    {
+                        uint32_t x[3], z[3];
+                        for(auto k = 0; k < 3; k++)
+                        {
+                            x[k] = triangles[t + k] % size[0];
+                            z[k] = triangles[t + k] / size[0];
+                        }
+
+                        auto min_x = *std::min_element(x, x + 3), max_x = *std::max_element(x, x + 3);
+                        auto min_z = *std::min_element(z, z + 3), max_z = *std::max_element(z, z + 3);
+
+                        within_blocks = within_blocks && min_x / block_size == (max_x - 1U) / block_size && min_z / block_size == (max_z - 1U) / block_size;
+                    }
+                }
+            }
+        }
+
+        BM_CHECK(watertight);
+        BM_CHECK(within_blocks);
+    }
+
+    BM_TEST(rtinMeshDropsTrianglesOnSmoothTerrain)
+    {
+        auto height_field = makeHeightField(257, 257, true);
+
+        RtinHierarchy rtin;
+        rtin.build(height_field, 64);
+
+        std::vector<uint32_t> triangles;
+        rtin.extractMesh(1.0f, triangles);
+
+        // Two triangles per quad at full resolution, a unit of error drops most of them on rolling hills.
+        BM_CHECK(triangles.size() * 4U < 2U * 3U * 256U * 256U);
+    }
+
+    BM_TEST(simplifiedTerrainChunksAreWatertight)
+    {
+        auto height_map = getTestFileName(L"simplified.bmp");
+        BM_CHECK(writeTestHeightMap(height_map, 129, 97, [](int i, int j) { return static_cast<int>(getRidgedValue(i, j) * 63.0f); }));
+
+        TerrainSettings settings;
+        settings.chunk_size = 33;
+        settings.simplification_error = 2.0f;
+        settings.level_of_detail = TerrainLevelOfDetail::None;
+        settings.horizon_culling = false;
+        settings.bake_file_name = getTestFileName(L"simplified.bmterrain");
+        fs::remove(fs::path(settings.bake_file_name));
+
+        uint64_t content_hash;
+        {
+            Terrain terrain(getTestDevice(), height_map.c_str(), L"", L"", settings);
+            BM_CHECK(terrain.getChunks().size() == 12U);
+
+            MappedFile file(settings.bake_file_name.c_str());
+            BM_CHECK(file.isOpen() && file.getSize() >= sizeof(TerrainBakeHeader));
+            if(!file.isOpen() || file.getSize() < sizeof(TerrainBakeHeader))
+                return;
+
+            content_hash = reinterpret_cast<const TerrainBakeHeader*>(file.getData())->content_hash;
+        }
+
+        TerrainBake bake(settings.bake_file_name.c_str(), content_hash);
+        BM_CHECK(bake.isValid() && bake.getHeader().index_size == sizeof(uint16_t));
+        if(!bake.isValid() || bake.getHeader().index_size != sizeof(uint16_t))
+            return;
+
+        // The chunks' triangles back in heightmap samples, through the positions of the Full vertices they index.
+        auto vertices = static_cast<const float*>(bake.getVertices());
+        auto indices = static_cast<const uint16_t*>(bake.getIndices());
+        auto vertex_floats = bake.getHeader().vertex_stride / sizeof(float);
+
+        std::vector<uint32_t> triangles;
+        for(auto chunk = bake.getChunks(); chunk != bake.getChunks() + bake.getHeader().chunk_count; chunk++)
+        {
+            for(auto k = chunk->start_index; k < chunk->start_index + chunk->index_count; k++)
+            {
+                auto position = vertices + (chunk->base_vertex + indices[k]) * vertex_floats;
+                triangles.push_back(static_cast<uint32_t>(position[2] / 32.0f) * 129U + static_cast<uint32_t>(position[0] / 32.0f));
+            }
+        }
+
+        BM_CHECK(triangles.size() < 6U * 128U * 96U);
+        BM_CHECK(isWatertight(129, 97, triangles));
+    }
+
+    BM_BENCHMARK(rtinBuild)
+    {
+        const auto size = 4097;
+        auto height_field = makeHeightField(size, size, false);
+
+        RtinHierarchy rtin;
+        auto build_seconds = measureSeconds(1, [&]() { rtin.build(height_field, 64); });
+
+        std::printf("    4097^2 ridged terrain in blocks of 64 quads\n");
+        reportBenchmark("build", build_seconds * 1e3, "ms");
+
+        for(auto max_error : {2.0f, 4.0f, 16.0f})
+        {
+            std::vector<uint32_t> triangles;
+            auto extract_seconds = measureSeconds(3, [&]() { triangles.clear(); rtin.extractMesh(max_error, triangles); });
+
+            std::printf("    error %.0f: %.2f%% of the triangles\n", max_error, 100.0 * triangles.size() / (6.0 * (size - 1) * (size - 1)));
+            reportBenchmark("extract", extract_seconds * 1e3, "ms");
+        }
+    }
+}
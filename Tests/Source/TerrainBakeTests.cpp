@@ -0,0 +1,148 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TerrainBake.h"
+
+#include <fstream>
+#include <vector>
+
+namespace bm
+{
+    namespace
+    {
+        constexpr uint64_t test_content_hash = 0x0123456789ABCDEFULL;
+
+        // A 3 x 3 terrain drawn as one chunk of two triangles per quad, with 16-bit indices.
+        struct TestBake
+        {
+            std::vector<float> heights = std::vector<float>(9, 1.0f);
+            std::vector<uint32_t> normals = std::vector<uint32_t>(9, 0x7FFFU);
+            std::vector<float> vertices = std::vector<float>(9 * 3, 0.5f);
+            std::vector<uint16_t> indices = {0, 3, 1, 1, 3, 4, 1, 4, 2, 2, 4, 5, 3, 6, 4, 4, 6, 7, 4, 7, 5, 5, 7, 8};
+            TerrainChunk chunk = {};
+
+            TestBake()
+            {
+                chunk.width = 3;
+                chunk.height = 3;
+                chunk.vertex_count = 9U;
+                chunk.index_count = static_cast<UINT>(indices.size());
+            }
+
+            bool write(const std::wstring& file_name) const
+            {
+                TerrainBakeHeader header = {};
+                header.content_hash = test_content_hash;
+                header.terrain_width = 3;
+                header.terrain_height = 3;
+                header.vertex_stride = 3U * sizeof(float);
+                header.vertex_count = 9U;
+                header.index_size = sizeof(uint16_t);
+                header.index_count = static_cast<uint32_t>(indices.size());
+                header.chunk_count = 1U;
+
+                return writeTerrainBake(file_name.c_str(), header, heights.data(), normals.data(), &chunk, vertices.data(), indices.data(), nullptr);
+            }
+        };
+
+        bool isValidBake(const std::wstring& file_name)
+        {
+            return TerrainBake(file_name.c_str(), test_content_hash).isValid();
+        }
+
+        // Flips one bit of the file at offset.
+        void damageFile(const std::wstring& file_name, uint64_t offset)
+        {
+            std::fstream file(fs::path(file_name), std::ios::binary | std::ios::in | std::ios::out);
+
+            char byte;
+            file.seekg(static_cast<std::streamoff>(offset));
+            file.read(&byte, 1);
+
+            byte ^= 0x10;
+            file.seekp(static_cast<std::streamoff>(offset));
+            file.write(&byte, 1);
+        }
+
+        uint64_t getSectionOffset(const std::wstring& file_name, uint64_t TerrainBakeHeader::* offset)
+        {
+            MappedFile file(file_name.c_str());
+
+            return reinterpret_cast<const TerrainBakeHeader*>(file.getData())->*offset;
+        }
+    }
+
+    BM_TEST(terrainBakeRoundTrips)
+    {
+        auto file_name = getTestFileName(L"bake.bmterrain");
+
+        TestBake bake;
+        BM_CHECK(bake.write(file_name));
+        BM_CHECK(isValidBake(file_name));
+        BM_CHECK(!fs::exists(fs::path(file_name + L".partial")));
+        BM_CHECK(!TerrainBake(file_name.c_str(), test_content_hash + 1U).isValid());
+
+        TerrainBake loaded(file_name.c_str(), test_content_hash);
+        if(!loaded.isValid())
+            return;
+
+        BM_CHECK(std::equal(bake.heights.begin(), bake.heights.end(), loaded.getHeights()));
+        BM_CHECK(std::equal(bake.indices.begin(), bake.indices.end(), static_cast<const uint16_t*>(loaded.getIndices())));
+        BM_CHECK(loaded.getChunks()->index_count == bake.chunk.index_count);
+    }
+
+    BM_TEST(terrainBakeWriteLeavesNothingBehindWhenItFails)
+    {
+        // A directory can't be replaced by the bake.
+        auto file_name = getTestFileName(L"bake_directory.bmterrain");
+        fs::create_directories(fs::path(file_name));
+
+        BM_CHECK(!TestBake().write(file_name));
+        BM_CHECK(fs::is_directory(fs::path(file_name)));
+        BM_CHECK(!fs::exists(fs::path(file_name + L".partial")));
+    }
+
+    BM_TEST(terrainBakeRejectsDamagedSections)
+    {
+        auto file_name = getTestFileName(L"damaged.bmterrain");
+
+        for(auto offset : {&TerrainBakeHeader::heights_offset, &TerrainBakeHeader::normals_offset, &TerrainBakeHeader::chunks_offset,
+                           &TerrainBakeHeader::vertices_offset, &TerrainBakeHeader::indices_offset})
+        {
+            BM_CHECK(TestBake().write(file_name));
+
+            damageFile(file_name, getSectionOffset(file_name, offset) + 5U);
+            BM_CHECK(!isValidBake(file_name));
+        }
+
+        // Cut short.
+        BM_CHECK(TestBake().write(file_name));
+        fs::resize_file(fs::path(file_name), fs::file_size(fs::path(file_name)) - 16U);
+        BM_CHECK(!isValidBake(file_name));
+    }
+
+    BM_TEST(terrainBakeRejectsChunksOutsideTheSections)
+    {
+        auto file_name = getTestFileName(L"chunks.bmterrain");
+
+        // Written with a matching hash, as a broken writer would.
+        auto isValidChunk([&](void (*change)(TerrainChunk&))
+        {
+            TestBake bake;
+            change(bake.chunk);
+
+            return bake.write(file_name) && isValidBake(file_name);
+        });
+
+        BM_CHECK(isValidChunk([](TerrainChunk&) {}));
+        BM_CHECK(!isValidChunk([](TerrainChunk& chunk) { chunk.base_vertex = 1U; }));
+        BM_CHECK(!isValidChunk([](TerrainChunk& chunk) { chunk.vertex_count = 0xFFFFFFFFU; }));
+        BM_CHECK(!isValidChunk([](TerrainChunk& chunk) { chunk.start_index = 3U; }));
+        BM_CHECK(!isValidChunk([](TerrainChunk& chunk) { chunk.index_count = 25U; }));
+        BM_CHECK(!isValidChunk([](TerrainChunk& chunk) { chunk.x = 1; }));
+        BM_CHECK(!isValidChunk([](TerrainChunk& chunk) { chunk.height = 4; }));
+        BM_CHECK(!isValidChunk([](TerrainChunk& chunk) { chunk.lod_level_count = max_terrain_lod_levels + 1; }));
+    }
+}
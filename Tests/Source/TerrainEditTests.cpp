@@ -0,0 +1,198 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "Terrain.h"
+#include "TerrainBake.h"
+
+#include <cstring>
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        // Height of a heightmap byte once loaded, so that edits to it rebuild to the same heights.
+        float getLoadedHeight(int value)
+        {
+            return static_cast<float>(value) * 8.0f / 15.0f;
+        }
+
+        // Vertex buffer of the bake a terrain wrote when it was built.
+        std::vector<unsigned char> readBakedVertexBuffer(const std::wstring& file_name)
+        {
+            uint64_t content_hash;
+            {
+                MappedFile file(file_name.c_str());
+                if(!file.isOpen() || file.getSize() < sizeof(TerrainBakeHeader))
+                    return {};
+
+                content_hash = reinterpret_cast<const TerrainBakeHeader*>(file.getData())->content_hash;
+            }
+
+            TerrainBake bake(file_name.c_str(), content_hash);
+            if(!bake.isValid())
+                return {};
+
+            auto vertices = static_cast<const unsigned char*>(bake.getVertices());
+            return std::vector<unsigned char>(vertices, vertices + static_cast<size_t>(bake.getHeader().vertex_count) * bake.getHeader().vertex_stride);
+        }
+    }
+
+    BM_TEST(editedTerrainMatchesARebuild)
+    {
+        auto getValue([](int i, int j) { return static_cast<int>(getRidgedValue(i, j) * 63.0f); });
+
+        // Strokes straddling chunk borders and corners, one of them over the terrain's corner and clipped by it.
+        struct Stroke { int x, z, width, height, value; };
+        const Stroke strokes[] = {{20, 25, 31, 21, 200}, {60, 60, 9, 9, 0}, {28, 56, 40, 12, 90}, {120, 90, 20, 20, 150}};
+
+        std::vector<int> edited_values(129 * 97);
+        for(auto j = 0; j < 97; j++)
+            for(auto i = 0; i < 129; i++)
+                edited_values[j * 129 + i] = getValue(i, j);
+
+        std::mt19937 random(8U);
+
+        std::vector<std::vector<float>> stroke_heights;
+        for(auto& stroke : strokes)
+        {
+            std::vector<float> heights(static_cast<size_t>(stroke.width) * stroke.height);
+            for(auto j = 0; j < stroke.height; j++)
+            {
+                for(auto i = 0; i < stroke.width; i++)
+                {
+                    // Rough, so that every level of detail error and frame changes.
+                    auto value = std::min(stroke.value + static_cast<int>(random() % 40U), 255);
+                    heights[j * stroke.width + i] = getLoadedHeight(value);
+
+                    if(stroke.x + i < 129 && stroke.z + j < 97)
+                        edited_values[(stroke.z + j) * 129 + stroke.x + i] = value;
+                }
+            }
+
+            stroke_heights.push_back(heights);
+        }
+
+        auto height_map = getTestFileName(L"edit_source.bmp"), edited_height_map = getTestFileName(L"edit_target.bmp");
+        BM_CHECK(writeTestHeightMap(height_map, 129, 97, getValue));
+        BM_CHECK(writeTestHeightMap(edited_height_map, 129, 97, [&](int i, int j) { return edited_values[j * 129 + i]; }));
+
+        // Geomipmapped, with the chunk vertices in both orders.
+        for(auto optimize_vertex_cache : {false, true})
+        {
+            TerrainSettings settings;
+            settings.chunk_size = 33;
+            settings.optimize_vertex_cache = optimize_vertex_cache;
+            settings.horizon_culling = false;
+            settings.bake_file_name = getTestFileName(L"edit_source.bmterrain");
+            fs::remove(fs::path(settings.bake_file_name));
+
+            auto rebuilt_settings = settings;
+            rebuilt_settings.bake_file_name = getTestFileName(L"edit_target.bmterrain");
+            fs::remove(fs::path(rebuilt_settings.bake_file_name));
+
+            Terrain terrain(getTestDevice(), height_map.c_str(), L"", L"", settings);
+            Terrain rebuilt(getTestDevice(), edited_height_map.c_str(), L"", L"", rebuilt_settings);
+
+            // The edits' buffer updates over the vertices the terrain was built with.
+            auto vertices = readBakedVertexBuffer(settings.bake_file_name);
+            auto rebuilt_vertices = readBakedVertexBuffer(rebuilt_settings.bake_file_name);
+            BM_CHECK(!vertices.empty() && vertices.size() == rebuilt_vertices.size());
+            if(vertices.empty() || vertices.size() != rebuilt_vertices.size())
+                return;
+
+            for(auto k = 0; k < 4; k++)
+                BM_CHECK(terrain.editHeights(strokes[k].x, strokes[k].z, strokes[k].width, strokes[k].height, stroke_heights[k].data()));
+
+            auto update_data = terrain.getBufferUpdateData().data();
+            auto in_buffer = true;
+
+            for(auto& update : terrain.getBufferUpdates())
+            {
+                in_buffer = in_buffer && update.offset + update.size <= vertices.size();
+                if(!in_buffer)
+                    break;
+
+                std::memcpy(vertices.data() + update.offset, update_data, update.size);
+                update_data += update.size;
+            }
+
+            BM_CHECK(in_buffer);
+            BM_CHECK(vertices == rebuilt_vertices);
+
+            // Bounds and the errors of every level, which select the levels and cull the chunks.
+            auto& chunks = terrain.getChunks();
+            auto& rebuilt_chunks = rebuilt.getChunks();
+            BM_CHECK(chunks.size() == rebuilt_chunks.size());
+
+            auto same_bounds = true, same_errors = true;
+            for(auto c = size_t(); c < std::min(chunks.size(), rebuilt_chunks.size()); c++)
+            {
+                auto& chunk = chunks[c];
+                auto& rebuilt_chunk = rebuilt_chunks[c];
+
+                same_bounds = same_bounds && chunk.bounds_min.x == rebuilt_chunk.bounds_min.x && chunk.bounds_min.y == rebuilt_chunk.bounds_min.y &&
+                              chunk.bounds_min.z == rebuilt_chunk.bounds_min.z && chunk.bounds_max.x == rebuilt_chunk.bounds_max.x &&
+                              chunk.bounds_max.y == rebuilt_chunk.bounds_max.y && chunk.bounds_max.z == rebuilt_chunk.bounds_max.z;
+
+                same_errors = same_errors && chunk.lod_level_count == rebuilt_chunk.lod_level_count && chunk.lod_level_count > 1 &&
+                              std::equal(chunk.lod_errors, chunk.lod_errors + chunk.lod_level_count, rebuilt_chunk.lod_errors);
+            }
+
+            BM_CHECK(same_bounds);
+            BM_CHECK(same_errors);
+
+            // Ground heights and normals, on the samples and between them.
+            std::vector<float> x, z;
+            for(auto k = 0; k < 5000; k++)
+            {
+                x.push_back(k % 2 == 0 ? static_cast<float>(random() % 129U) * 32.0f : static_cast<float>(random() % 4096U));
+                z.push_back(k % 2 == 0 ? static_cast<float>(random() % 97U) * 32.0f : static_cast<float>(random() % 3072U));
+            }
+
+            std::vector<float> heights(x.size()), rebuilt_heights(x.size());
+            std::vector<Vector3D> normals(x.size()), rebuilt_normals(x.size());
+            terrain.getGroundHeights(x.data(), z.data(), x.size(), heights.data(), normals.data());
+            rebuilt.getGroundHeights(x.data(), z.data(), x.size(), rebuilt_heights.data(), rebuilt_normals.data());
+
+            auto same_ground = heights == rebuilt_heights;
+            for(auto k = size_t(); k < x.size(); k++)
+                same_ground = same_ground && normals[k].x == rebuilt_normals[k].x && normals[k].y == rebuilt_normals[k].y && normals[k].z == rebuilt_normals[k].z;
+
+            BM_CHECK(same_ground);
+        }
+    }
+
+    BM_BENCHMARK(terrainEdit)
+    {
+        // Default settings on a 4097^2 map: geomipmapped 65-sample chunks, optimized vertex order, horizon culling.
+        auto height_map = getTestFileName(L"edit.bmp");
+        writeTestHeightMap(height_map, 4097, 4097, [](int i, int j) { return getRollingHillsValue(i, j, 4097, 4097); });
+
+        Terrain terrain(getTestDevice(), height_map.c_str(), L"", L"", TerrainSettings());
+
+        // A 64 x 64 brush stroke, moving along so that it crosses chunk borders, every edit uploaded by the next frame.
+        // An edit only touches the chunks under it, so its cost doesn't depend on the size of the map.
+        std::vector<float> heights(64 * 64, 50.0f);
+        auto stroke = 0;
+        auto edit_seconds = 1e30, upload_seconds = 1e30;
+        auto upload_size = size_t(), update_count = size_t();
+
+        for(auto repeat = 0; repeat < 20; repeat++)
+        {
+            edit_seconds = std::min(edit_seconds, measureSeconds(1, [&]() { terrain.editHeights(1000 + 37 * stroke++, 2000, 64, 64, heights.data()); }));
+
+            upload_size = terrain.getBufferUpdateData().size();
+            update_count = terrain.getBufferUpdates().size();
+
+            upload_seconds = std::min(upload_seconds, measureSeconds(1, [&]() { terrain.render(getTestDeviceContext()); }));
+        }
+
+        std::printf("    %zu bytes in %zu buffer updates per edit\n", upload_size, update_count);
+        reportBenchmark("64 x 64 edit", edit_seconds * 1e6, "us");
+        reportBenchmark("upload and draw", upload_seconds * 1e3, "ms");
+    }
+}
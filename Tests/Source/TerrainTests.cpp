@@ -0,0 +1,238 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "Terrain.h"
+#include "TerrainBake.h"
+
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        // Floats of a Full format vertex: position, texture coordinates, normal, tangent and binormal.
+        constexpr int full_vertex_floats = 14;
+
+        // Settings of the test terrains: the row-major indexed mesh without levels of detail or culling data, baked.
+        TerrainSettings getTestTerrainSettings(const wchar_t* bake_name)
+        {
+            TerrainSettings settings;
+            settings.chunk_size = 33;
+            settings.optimize_vertex_cache = false;
+            settings.level_of_detail = TerrainLevelOfDetail::None;
+            settings.horizon_culling = false;
+            settings.bake_file_name = getTestFileName(bake_name);
+
+            fs::remove(fs::path(settings.bake_file_name));
+
+            return settings;
+        }
+
+        // Vertex data of the bake a terrain wrote, whatever it was baked from.
+        std::vector<float> readBakedVertices(const std::wstring& file_name)
+        {
+            uint64_t content_hash;
+            {
+                MappedFile file(file_name.c_str());
+                if(!file.isOpen() || file.getSize() < sizeof(TerrainBakeHeader))
+                    return {};
+
+                content_hash = reinterpret_cast<const TerrainBakeHeader*>(file.getData())->content_hash;
+            }
+
+            TerrainBake bake(file_name.c_str(), content_hash);
+            if(!bake.isValid())
+                return {};
+
+            auto vertices = static_cast<const float*>(bake.getVertices());
+            auto& header = bake.getHeader();
+
+            return std::vector<float>(vertices, vertices + header.vertex_count * header.vertex_stride / sizeof(float));
+        }
+
+        float getAngle(const float* a, const float* b)
+        {
+            auto cosine = (a[0] * b[0] + a[1] * b[1] + a[2] * b[2]) /
+                          std::sqrt((a[0] * a[0] + a[1] * a[1] + a[2] * a[2]) * (b[0] * b[0] + b[1] * b[1] + b[2] * b[2]));
+
+            return std::acos(std::min(std::max(cosine, -1.0f), 1.0f)) * 180.0f / 3.14159265f;
+        }
+    }
+
+    BM_TEST(gradientFramesMatchPerFaceFrames)
+    {
+        auto height_map = getTestFileName(L"frames.bmp");
+        BM_CHECK(writeTestHeightMap(height_map, 129, 97, [](int i, int j) { return getRollingHillsValue(i, j, 129, 97); }));
+
+        auto per_face_settings = getTestTerrainSettings(L"frames_per_face.bmterrain");
+        per_face_settings.tangent_frames = TerrainTangentFrames::PerFace;
+
+        auto gradient_settings = getTestTerrainSettings(L"frames_gradient.bmterrain");
+        gradient_settings.tangent_frames = TerrainTangentFrames::Gradient;
+
+        {
+            Terrain per_face(getTestDevice(), height_map.c_str(), L"", L"", per_face_settings);
+            Terrain gradient(getTestDevice(), height_map.c_str(), L"", L"", gradient_settings);
+        }
+
+        auto per_face_vertices = readBakedVertices(per_face_settings.bake_file_name);
+        auto gradient_vertices = readBakedVertices(gradient_settings.bake_file_name);
+
+        BM_CHECK(!per_face_vertices.empty() && per_face_vertices.size() == gradient_vertices.size());
+        if(per_face_vertices.empty() || per_face_vertices.size() != gradient_vertices.size())
+            return;
+
+        auto same_positions = true;
+        float largest[3] = {}, sum[3] = {};
+        auto vertex_count = per_face_vertices.size() / full_vertex_floats;
+
+        for(auto v = size_t(); v < vertex_count; v++)
+        {
+            auto a = per_face_vertices.data() + v * full_vertex_floats, b = gradient_vertices.data() + v * full_vertex_floats;
+
+            same_positions = same_positions && std::equal(a, a + 5, b);
+
+            // Normal, tangent and binormal.
+            for(auto k = 0; k < 3; k++)
+            {
+                auto angle = getAngle(a + 5 + k * 3, b + 5 + k * 3);
+
+                largest[k] = std::max(largest[k], angle);
+                sum[k] += angle;
+            }
+        }
+
+        // The per-face normals average the four quads around a sample, which take forward differences, so they are
+        // half a sample off the central differences of the gradient; the tangents and binormals average six triangles.
+        const float largest_limits[3] = {4.0f, 2.0f, 2.0f};
+        const float mean_limits[3] = {1.0f, 0.25f, 0.25f};
+
+        BM_CHECK(same_positions);
+        for(auto k = 0; k < 3; k++)
+        {
+            BM_CHECK(largest[k] < largest_limits[k]);
+            BM_CHECK(sum[k] / vertex_count < mean_limits[k]);
+        }
+    }
+
+    BM_TEST(compressedGroundHeightsMatchTheMesh)
+    {
+        auto height_map = getTestFileName(L"compressed.bmp");
+        BM_CHECK(writeTestHeightMap(height_map, 129, 97, [](int i, int j) { return static_cast<int>(getRidgedValue(i, j) * 63.0f); }));
+
+        // A coarse step, so that the quantization shows.
+        auto settings = getTestTerrainSettings(L"compressed.bmterrain");
+        settings.ground_height_precision = 1.5f;
+
+        std::vector<float> x, z, heights, baked_heights;
+        {
+            Terrain terrain(getTestDevice(), height_map.c_str(), L"", L"", settings);
+
+            // Every vertex sits on a sample, where the queries answer the decoded height.
+            auto vertices = readBakedVertices(settings.bake_file_name);
+            BM_CHECK(!vertices.empty());
+
+            for(auto v = size_t(); v < vertices.size(); v += full_vertex_floats)
+            {
+                x.push_back(vertices[v]);
+                z.push_back(vertices[v + 2]);
+                baked_heights.push_back(vertices[v + 1]);
+            }
+
+            heights.resize(x.size());
+            terrain.getGroundHeights(x.data(), z.data(), x.size(), heights.data());
+
+            BM_CHECK(heights == baked_heights);
+
+            // Edits land on the same steps, and the queries follow them.
+            std::vector<float> edit(20 * 20);
+            for(auto k = size_t(); k < edit.size(); k++)
+                edit[k] = 40.0f + static_cast<float>(k % 37U) * 0.7f;
+
+            BM_CHECK(terrain.editHeights(50, 30, 20, 20, edit.data()));
+
+            auto on_steps = true;
+            for(auto j = 0; j < 20; j++)
+            {
+                for(auto i = 0; i < 20; i++)
+                {
+                    float height;
+                    auto sample_x = static_cast<float>(50 + i) * 32.0f, sample_z = static_cast<float>(30 + j) * 32.0f;
+                    terrain.getGroundHeights(&sample_x, &sample_z, 1U, &height);
+
+                    auto expected = edit[j * 20 + i];
+                    on_steps = on_steps && std::fabs(height - expected) <= 0.75f && height == std::round(height / 1.5f) * 1.5f;
+                }
+            }
+
+            BM_CHECK(on_steps);
+        }
+
+        // Loaded from the bake, the queries answer the same.
+        Terrain baked(getTestDevice(), height_map.c_str(), L"", L"", settings);
+        baked.getGroundHeights(x.data(), z.data(), x.size(), heights.data());
+
+        BM_CHECK(heights == baked_heights);
+    }
+
+    BM_TEST(tiledTerrainRaysMatchTheRowMajorOnes)
+    {
+        auto height_map = getTestFileName(L"tiled_rays.bmp");
+        BM_CHECK(writeTestHeightMap(height_map, 129, 97, [](int i, int j) { return static_cast<int>(getRidgedValue(i, j) * 63.0f); }));
+
+        auto settings = getTestTerrainSettings(L"tiled_rays.bmterrain");
+        settings.bake_file_name.clear();
+
+        auto tiled_settings = settings;
+        tiled_settings.tiled_ground_queries = true;
+
+        Terrain terrain(getTestDevice(), height_map.c_str(), L"", L"", settings);
+        Terrain tiled_terrain(getTestDevice(), height_map.c_str(), L"", L"", tiled_settings);
+
+        // Picking rays from above and grazing ones across the valleys, some of them missing.
+        std::mt19937 random(6U);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+        std::vector<Vector3D> origins, directions;
+        for(auto k = 0; k < 500; k++)
+        {
+            origins.push_back(Vector3D(unit(random) * 4096.0f, 20.0f + unit(random) * 200.0f, unit(random) * 3072.0f));
+            directions.push_back(Vector3D(unit(random) - 0.5f, -unit(random) * (k % 2 == 0 ? 1.0f : 0.05f), unit(random) - 0.5f));
+        }
+
+        auto same = true;
+        auto hit_count = size_t();
+
+        auto checkRays([&]()
+        {
+            std::vector<HeightFieldRayHit> hits(origins.size()), tiled_hits(origins.size());
+            terrain.castRays(origins.data(), directions.data(), origins.size(), 1e4f, hits.data());
+            tiled_terrain.castRays(origins.data(), directions.data(), origins.size(), 1e4f, tiled_hits.data());
+
+            for(auto k = size_t(); k < origins.size(); k++)
+            {
+                HeightFieldRayHit hit;
+                auto found = tiled_terrain.castRay(origins[k], directions[k], 1e4f, hit);
+                hit_count += found ? 1U : 0U;
+
+                same = same && hits[k].distance == tiled_hits[k].distance && hits[k].i == tiled_hits[k].i && hits[k].j == tiled_hits[k].j;
+                same = same && found == (hits[k].distance >= 0.0f) && (!found || (hit.distance == hits[k].distance && hit.i == hits[k].i && hit.j == hits[k].j));
+            }
+        });
+
+        checkRays();
+
+        // And once the heights were edited, which the tiled copy follows.
+        std::vector<float> edit(30 * 20, 90.0f);
+        BM_CHECK(terrain.editHeights(40, 30, 30, 20, edit.data()));
+        BM_CHECK(tiled_terrain.editHeights(40, 30, 30, 20, edit.data()));
+
+        checkRays();
+
+        BM_CHECK(same);
+        BM_CHECK(hit_count > 0U);
+    }
+}
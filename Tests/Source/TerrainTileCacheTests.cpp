@@ -0,0 +1,222 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TestScene.h"
+#include "Terrain.h"
+#include "TerrainBake.h"
+#include "TerrainTileCache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include <utility>
+
+namespace bm
+{
+    namespace
+    {
+        // Updates the cache from the camera position until every tile it queued is resident, or gives up after a while.
+        void settleTileCache(TerrainTileCache& tile_cache, const Vector& camera_position)
+        {
+            for(auto attempt = 0; attempt < 5000; attempt++)
+            {
+                tile_cache.update(getTestDeviceContext(), camera_position);
+                if(tile_cache.getPendingTileCount() == 0U)
+                    return;
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        // Vertex data of the bake a terrain wrote.
+        std::vector<float> readBakedVertices(const std::wstring& file_name)
+        {
+            uint64_t content_hash;
+            {
+                MappedFile file(file_name.c_str());
+                if(!file.isOpen() || file.getSize() < sizeof(TerrainBakeHeader))
+                    return {};
+
+                content_hash = reinterpret_cast<const TerrainBakeHeader*>(file.getData())->content_hash;
+            }
+
+            TerrainBake bake(file_name.c_str(), content_hash);
+            if(!bake.isValid())
+                return {};
+
+            auto vertices = static_cast<const float*>(bake.getVertices());
+            auto& header = bake.getHeader();
+
+            return std::vector<float>(vertices, vertices + header.vertex_count * header.vertex_stride / sizeof(float));
+        }
+    }
+
+    BM_TEST(terrainTileCacheStaysWithinItsBudget)
+    {
+        // 16 x 16 tiles of 129 samples, streamed without textures.
+        const auto size = 2049;
+
+        auto height_map = getTestFileName(L"tiles.bmp");
+        writeTestHeightMap(height_map, size, size, [](int i, int j) { return getRollingHillsValue(i, j, size, size); });
+
+        // Room for a dozen tiles, fewer than the load radius takes in, so that the path keeps evicting them.
+        TerrainTileSettings settings;
+        settings.load_radius = 6000.0f;
+        settings.memory_budget = 16U << 20;
+
+        TerrainTileCache tile_cache(getTestDevice(), height_map.c_str(), L"", L"", settings);
+        BM_CHECK(tile_cache.isValid());
+        if(!tile_cache.isValid())
+            return;
+
+        auto within_budget = true;
+
+        // A circle around the middle of the map, then straight across it, at the speed of a few tiles a second.
+        auto extent = static_cast<float>(size - 1) * 32.0f;
+        for(auto step = 0; step < 400; step++)
+        {
+            auto angle = static_cast<float>(step) / 200.0f * 6.2831853f;
+            auto x = step < 200 ? 0.5f * extent + 0.35f * extent * std::cos(angle) : static_cast<float>(step - 200) / 200.0f * extent;
+            auto z = step < 200 ? 0.5f * extent + 0.35f * extent * std::sin(angle) : 0.5f * extent;
+
+            tile_cache.update(getTestDeviceContext(), DirectX::XMVectorSet(x, 500.0f, z, 1.0f));
+            within_budget = within_budget && tile_cache.getMemoryUsage() <= settings.memory_budget;
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+
+        BM_CHECK(within_budget);
+        BM_CHECK(tile_cache.getPeakMemoryUsage() <= settings.memory_budget);
+
+        // Once the camera stops, every slot ends up with one of the tiles it wants.
+        auto camera_position = DirectX::XMVectorSet(0.5f * extent, 500.0f, 0.5f * extent, 1.0f);
+        settleTileCache(tile_cache, camera_position);
+
+        BM_CHECK(tile_cache.getResidentTileCount() == tile_cache.getSlotCount());
+        BM_CHECK(tile_cache.getMemoryUsage() <= tile_cache.getPeakMemoryUsage());
+    }
+
+    BM_TEST(tileBordersMatchTheirNeighboursAndTheWholeTerrain)
+    {
+        // 5 x 4 tiles of 65 samples, the last column and row cut short by the edges of the heightmap.
+        const auto width = 300, height = 230, tile_size = 65;
+        const auto vertex_floats = 14;
+
+        auto height_map = getTestFileName(L"tile_borders.bmp"), tile_file_name = getTestFileName(L"tile_borders.bmheights");
+        BM_CHECK(writeTestHeightMap(height_map, width, height, [](int i, int j) { return static_cast<int>(getRidgedValue(i, j) * 63.0f); }));
+
+        HeightTileFileSettings file_settings;
+        file_settings.tile_size = tile_size;
+        BM_CHECK(convertBitmapToHeightTiles(height_map.c_str(), tile_file_name.c_str(), file_settings));
+
+        // The Full vertex of every sample of the terrain built from the whole heightmap, out of the row-major chunks of its bake.
+        TerrainSettings terrain_settings;
+        terrain_settings.chunk_size = 33;
+        terrain_settings.optimize_vertex_cache = false;
+        terrain_settings.level_of_detail = TerrainLevelOfDetail::None;
+        terrain_settings.horizon_culling = false;
+        terrain_settings.bake_file_name = getTestFileName(L"tile_borders.bmterrain");
+        fs::remove(fs::path(terrain_settings.bake_file_name));
+
+        {
+            Terrain terrain(getTestDevice(), height_map.c_str(), L"", L"", terrain_settings);
+        }
+
+        auto terrain_vertices = readBakedVertices(terrain_settings.bake_file_name);
+        BM_CHECK(!terrain_vertices.empty());
+
+        std::vector<const float*> terrain_samples(static_cast<size_t>(width) * height);
+        for(auto v = terrain_vertices.data(); v < terrain_vertices.data() + terrain_vertices.size(); v += vertex_floats)
+        {
+            auto& sample = terrain_samples[static_cast<size_t>(v[2] / 32.0f) * width + static_cast<size_t>(v[0] / 32.0f)];
+            if(!sample)
+                sample = v;
+        }
+
+        BM_CHECK(std::find(terrain_samples.begin(), terrain_samples.end(), nullptr) == terrain_samples.end());
+        if(std::find(terrain_samples.begin(), terrain_samples.end(), nullptr) != terrain_samples.end())
+            return;
+
+        // Tiles read from the bitmap, from the .bmheights file, and decoded from the bitmap held compressed at its own step.
+        TerrainTileSettings bitmap_settings;
+        bitmap_settings.tile_size = tile_size;
+        bitmap_settings.worker_count = 1U;
+
+        auto compressed_settings = bitmap_settings;
+        compressed_settings.height_precision = 8.0f / 15.0f;
+
+        const std::pair<const std::wstring*, const TerrainTileSettings*> sources[] = {{&height_map, &bitmap_settings}, {&tile_file_name, &bitmap_settings},
+                                                                                      {&height_map, &compressed_settings}};
+
+        for(auto& source : sources)
+        {
+            TerrainTileCache tile_cache(getTestDevice(), source.first->c_str(), L"", L"", *source.second);
+            BM_CHECK(tile_cache.isValid() && tile_cache.getColumnCount() == 5 && tile_cache.getRowCount() == 4);
+            if(!tile_cache.isValid())
+                continue;
+
+            // The first tile to hold a sample sets what every later one has to repeat exactly: the samples on shared
+            // borders, and within a tile the samples repeated past the edges of the heightmap.
+            std::vector<float> first_vertices(static_cast<size_t>(width) * height * vertex_floats);
+            std::vector<bool> seen(static_cast<size_t>(width) * height);
+
+            // Decoded heights are the bitmap's to within float rounding, the heights read are the bitmap's exactly.
+            auto tolerance = source.second->height_precision > 0.0f ? 1e-5f : 0.0f;
+
+            auto built = true, placed = true, matches_neighbours = true, matches_terrain = true;
+            auto shared = 0;
+            std::vector<unsigned char> tile_vertices;
+
+            for(auto row = 0; row < tile_cache.getRowCount(); row++)
+            {
+                for(auto column = 0; column < tile_cache.getColumnCount(); column++)
+                {
+                    if(!tile_cache.buildTileVertices(column, row, tile_vertices) || tile_vertices.size() != static_cast<size_t>(tile_size) * tile_size * vertex_floats * sizeof(float))
+                    {
+                        built = false;
+                        continue;
+                    }
+
+                    auto vertices = reinterpret_cast<const float*>(tile_vertices.data());
+                    for(auto j = 0; j < tile_size; j++)
+                    {
+                        for(auto i = 0; i < tile_size; i++)
+                        {
+                            auto vertex = vertices + (j * tile_size + i) * vertex_floats;
+
+                            auto x = std::min(column * (tile_size - 1) + i, width - 1), z = std::min(row * (tile_size - 1) + j, height - 1);
+                            placed = placed && vertex[0] == static_cast<float>(x) * 32.0f && vertex[2] == static_cast<float>(z) * 32.0f;
+
+                            auto sample = static_cast<size_t>(z) * width + x;
+                            matches_terrain = matches_terrain && std::equal(vertex, vertex + vertex_floats, terrain_samples[sample], [&](float a, float b)
+                            {
+                                return std::fabs(a - b) <= tolerance * std::max(std::fabs(b), 1.0f);
+                            });
+
+                            auto first = first_vertices.data() + sample * vertex_floats;
+                            if(seen[sample])
+                            {
+                                matches_neighbours = matches_neighbours && std::equal(vertex, vertex + vertex_floats, first);
+                                shared++;
+                                continue;
+                            }
+
+                            std::copy(vertex, vertex + vertex_floats, first);
+                            seen[sample] = true;
+                        }
+                    }
+                }
+            }
+
+            BM_CHECK(built);
+            BM_CHECK(placed);
+            BM_CHECK(std::find(seen.begin(), seen.end(), false) == seen.end());
+            BM_CHECK(shared > 0);
+            BM_CHECK(matches_neighbours);
+            BM_CHECK(matches_terrain);
+        }
+    }
+}
@@ -0,0 +1,156 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "TerrainVertex.h"
+
+#include <cmath>
+#include <random>
+
+namespace bm
+{
+    namespace
+    {
+        float dot(const Vector3D& a, const Vector3D& b)
+        {
+            return a.x * b.x + a.y * b.y + a.z * b.z;
+        }
+
+        Vector3D cross(const Vector3D& a, const Vector3D& b)
+        {
+            return Vector3D(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+        }
+
+        Vector3D normalize(const Vector3D& v)
+        {
+            auto length = std::sqrt(dot(v, v));
+
+            return Vector3D(v.x / length, v.y / length, v.z / length);
+        }
+
+        float getAngle(const Vector3D& a, const Vector3D& b)
+        {
+            return std::acos(std::min(std::max(dot(a, b), -1.0f), 1.0f)) * 180.0f / 3.14159265f;
+        }
+
+        // Orthonormal frame around normal, with the binormal flipped for mirrored texture mappings.
+        void makeFrame(const Vector3D& normal, const Vector3D& direction, bool reflected, Vector3D& tangent, Vector3D& binormal)
+        {
+            tangent = normalize(cross(normal, direction));
+            binormal = cross(normal, tangent);
+
+            if(reflected)
+                binormal = Vector3D(-binormal.x, -binormal.y, -binormal.z);
+        }
+    }
+
+    BM_TEST(compactVertexRoundTripErrors)
+    {
+        std::mt19937 random(7U);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+        CompactVertexTransform transform;
+        transform.position_offset = Vector3D(100.0f, -5.0f, 200.0f);
+        transform.position_step = Vector3D(32.0f, 0.01f, 32.0f);
+        transform.texture_offset = Vector2D(3.0f, 7.0f);
+        transform.texture_extent = Vector2D(64.0f, 64.0f);
+
+        // Float spacing at the top of the quantized range, where decoding offset + steps * step rounds the most. Whether that
+        // multiply-add is contracted to an FMA depends on the build, so up to two roundings are allowed for.
+        auto getUlp([](float offset, float range) { auto top = offset + range; return std::nextafter(top, 2.0f * top) - top; });
+        auto position_ulp = Vector3D(getUlp(transform.position_offset.x, 32.0f * 255.0f), getUlp(transform.position_offset.y, 0.01f * 65535.0f),
+                                     getUlp(transform.position_offset.z, 32.0f * 255.0f));
+
+        auto position_error = 0.0f, texture_error = 0.0f;
+        auto normal_error = 0.0f, tangent_error = 0.0f, binormal_error = 0.0f;
+        auto kept_handedness = true;
+
+        for(auto k = 0; k < 100000; k++)
+        {
+            // Anywhere inside the quantized range, not only on the grid.
+            auto position = Vector3D(transform.position_offset.x + 32.0f * 255.0f * (0.5f + 0.5f * unit(random)),
+                                     transform.position_offset.y + 0.01f * 65535.0f * (0.5f + 0.5f * unit(random)),
+                                     transform.position_offset.z + 32.0f * 255.0f * (0.5f + 0.5f * unit(random)));
+            auto texture = Vector2D(3.0f + 64.0f * (0.5f + 0.5f * unit(random)), 7.0f + 64.0f * (0.5f + 0.5f * unit(random)));
+
+            auto normal = normalize(Vector3D(unit(random), unit(random), unit(random)));
+            Vector3D tangent, binormal;
+            makeFrame(normal, Vector3D(unit(random), unit(random), unit(random)), (k & 1) != 0, tangent, binormal);
+
+            auto vertex = encodeCompactVertex(transform, position, texture, normal, tangent, binormal);
+
+            Vector3D decoded_position, decoded_normal, decoded_tangent, decoded_binormal;
+            Vector2D decoded_texture;
+            decodeCompactVertex(vertex, transform, decoded_position, decoded_texture, decoded_normal, decoded_tangent, decoded_binormal);
+
+            position_error = std::max({position_error, (std::fabs(decoded_position.x - position.x) - 2.0f * position_ulp.x) / transform.position_step.x,
+                                       (std::fabs(decoded_position.y - position.y) - 2.0f * position_ulp.y) / transform.position_step.y,
+                                       (std::fabs(decoded_position.z - position.z) - 2.0f * position_ulp.z) / transform.position_step.z});
+            texture_error = std::max({texture_error, std::fabs(decoded_texture.x - texture.x) / transform.texture_extent.x,
+                                      std::fabs(decoded_texture.y - texture.y) / transform.texture_extent.y});
+
+            normal_error = std::max(normal_error, getAngle(normal, decoded_normal));
+            tangent_error = std::max(tangent_error, getAngle(tangent, decoded_tangent));
+            binormal_error = std::max(binormal_error, getAngle(binormal, decoded_binormal));
+
+            kept_handedness = kept_handedness && dot(binormal, decoded_binormal) > 0.0f;
+        }
+
+        // Half a quantization step, past the float rounding above.
+        BM_CHECK(position_error <= 0.5f);
+        BM_CHECK(texture_error <= 0.5f / 65535.0f + 1e-6f);
+
+        // Snorm8 octahedral normal and snorm8 quaternion frame, in degrees.
+        BM_CHECK(normal_error < 1.2f);
+        BM_CHECK(tangent_error < 1.5f);
+        BM_CHECK(binormal_error < 1.5f);
+        BM_CHECK(kept_handedness);
+    }
+
+    BM_TEST(compactVertexClampsOutOfRangeValues)
+    {
+        CompactVertexTransform transform;
+        transform.position_offset = Vector3D(0.0f, 0.0f, 0.0f);
+        transform.position_step = Vector3D(1.0f, 1.0f, 1.0f);
+        transform.texture_offset = Vector2D(0.0f, 0.0f);
+        transform.texture_extent = Vector2D(1.0f, 1.0f);
+
+        auto up = Vector3D(0.0f, 1.0f, 0.0f), along_x = Vector3D(1.0f, 0.0f, 0.0f), against_z = Vector3D(0.0f, 0.0f, -1.0f);
+
+        auto vertex = encodeCompactVertex(transform, Vector3D(-10.0f, 70000.0f, 5.0f), Vector2D(-0.5f, 2.0f), up, along_x, against_z);
+
+        BM_CHECK(vertex.position[0] == 0U);
+        BM_CHECK(vertex.position[1] == 65535U);
+        BM_CHECK(vertex.position[2] == 5U);
+        BM_CHECK(vertex.texture[0] == 0U);
+        BM_CHECK(vertex.texture[1] == 65535U);
+    }
+
+    BM_TEST(tangentFrameSurvivesHalfTurns)
+    {
+        // Rotations by 180 degrees have W = 0, whose sign can't hold the reflection unless it is kept away from zero.
+        const Vector3D frames[][3] = {{{-1.0f, 0.0f, 0.0f}, {0.0f, -1.0f, 0.0f}, {0.0f, 0.0f, 1.0f}},
+                                      {{1.0f, 0.0f, 0.0f}, {0.0f, -1.0f, 0.0f}, {0.0f, 0.0f, -1.0f}},
+                                      {{-1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, -1.0f}},
+                                      {{1.0f, 0.0f, 0.0f}, {0.0f, 0.0f, -1.0f}, {0.0f, 1.0f, 0.0f}}};
+
+        for(auto& frame : frames)
+        {
+            for(auto reflected : {false, true})
+            {
+                auto binormal = reflected ? Vector3D(-frame[1].x, -frame[1].y, -frame[1].z) : frame[1];
+
+                int8_t quaternion[4];
+                encodeTangentFrame(frame[2], frame[0], binormal, quaternion);
+
+                Vector3D normal, tangent, decoded_binormal;
+                decodeTangentFrame(quaternion, normal, tangent, decoded_binormal);
+
+                BM_CHECK(getAngle(frame[2], normal) < 1.5f);
+                BM_CHECK(getAngle(frame[0], tangent) < 1.5f);
+                BM_CHECK(getAngle(binormal, decoded_binormal) < 1.5f);
+            }
+        }
+    }
+}
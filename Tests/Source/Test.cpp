@@ -0,0 +1,85 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+
+#include <cstdio>
+#include <cstring>
+
+namespace bm
+{
+    namespace
+    {
+        int failure_count = 0;
+    }
+
+    std::vector<TestCase>& getTestCases()
+    {
+        static std::vector<TestCase> test_cases;
+
+        return test_cases;
+    }
+
+    void reportTestFailure(const char* file, int line, const char* expression)
+    {
+        // The format Visual Studio jumps to from the output window.
+        std::printf("%s(%d): check failed: %s\n", file, line, expression);
+        failure_count++;
+    }
+
+    void reportBenchmark(const char* label, double value, const char* unit)
+    {
+        std::printf("    %-48s %12.3f %s\n", label, value, unit);
+    }
+
+    std::wstring getTestFileName(const wchar_t* name)
+    {
+        auto directory = fs::temp_directory_path() / L"BumpMappingTests";
+        fs::create_directories(directory);
+
+        return (directory / name).wstring();
+    }
+}
+
+// BumpMappingTests [--benchmark] [filter]
+int main(int argc, char* argv[])
+{
+    using namespace bm;
+
+    auto benchmark = false;
+    auto filter = "";
+
+    for(auto a = 1; a < argc; a++)
+    {
+        if(std::strcmp(argv[a], "--benchmark") == 0)
+            benchmark = true;
+        else
+            filter = argv[a];
+    }
+
+    // Registration order depends on the link order, so the cases are run by name.
+    auto test_cases = getTestCases();
+    std::sort(test_cases.begin(), test_cases.end(), [](const TestCase& a, const TestCase& b) { return std::strcmp(a.name, b.name) < 0; });
+
+    auto run_count = 0, failed_count = 0;
+    for(auto& test_case : test_cases)
+    {
+        if(test_case.benchmark != benchmark || !std::strstr(test_case.name, filter))
+            continue;
+
+        std::printf("%s\n", test_case.name);
+        std::fflush(stdout);
+
+        auto failures = failure_count;
+        test_case.run();
+
+        run_count++;
+        if(failure_count != failures)
+            failed_count++;
+    }
+
+    std::printf("%d of %d %s passed.\n", run_count - failed_count, run_count, benchmark ? "benchmarks" : "tests");
+
+    return failed_count == 0 ? 0 : 1;
+}
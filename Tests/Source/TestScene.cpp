@@ -0,0 +1,119 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "TestScene.h"
+
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+namespace bm
+{
+    namespace
+    {
+        ID3D11Device* test_device = nullptr;
+        ID3D11DeviceContext* test_device_context = nullptr;
+
+        void createTestDevice()
+        {
+            if(!test_device)
+                D3D11CreateDevice(nullptr, D3D_DRIVER_TYPE_WARP, nullptr, 0U, nullptr, 0U, D3D11_SDK_VERSION, &test_device, nullptr, &test_device_context);
+        }
+
+        float getNoiseHash(int x, int y)
+        {
+            auto hash = static_cast<uint32_t>(x) * 374761393U + static_cast<uint32_t>(y) * 668265263U;
+            hash = (hash ^ (hash >> 13U)) * 1274126177U;
+
+            return static_cast<float>(hash & 0xFFFFFFU) / 16777216.0f;
+        }
+
+        float getValueNoise(float x, float y)
+        {
+            auto xi = static_cast<int>(std::floor(x)), yi = static_cast<int>(std::floor(y));
+            auto fx = x - static_cast<float>(xi), fy = y - static_cast<float>(yi);
+            fx = fx * fx * (3.0f - 2.0f * fx);
+            fy = fy * fy * (3.0f - 2.0f * fy);
+
+            auto a = getNoiseHash(xi, yi), b = getNoiseHash(xi + 1, yi), c = getNoiseHash(xi, yi + 1), d = getNoiseHash(xi + 1, yi + 1);
+
+            return a + (b - a) * fx + (c - a) * fy + (a - b - c + d) * fx * fy;
+        }
+    }
+
+    ID3D11Device* getTestDevice()
+    {
+        createTestDevice();
+        return test_device;
+    }
+
+    ID3D11DeviceContext* getTestDeviceContext()
+    {
+        createTestDevice();
+        return test_device_context;
+    }
+
+    bool writeTestHeightMap(const std::wstring& file_name, int width, int height, const std::function<int(int, int)>& getValue)
+    {
+        auto row_pitch = (static_cast<uint32_t>(width) * 3U + 3U) & ~3U;
+        auto pixel_offset = 14U + 40U;
+        auto file_size = pixel_offset + row_pitch * static_cast<uint32_t>(height);
+
+        std::vector<unsigned char> bytes(file_size, 0U);
+
+        auto write16([&](size_t offset, uint32_t value)
+        {
+            bytes[offset] = static_cast<unsigned char>(value);
+            bytes[offset + 1] = static_cast<unsigned char>(value >> 8);
+        });
+
+        auto write32([&](size_t offset, uint32_t value)
+        {
+            write16(offset, value & 0xFFFFU);
+            write16(offset + 2, value >> 16);
+        });
+
+        // BITMAPFILEHEADER and BITMAPINFOHEADER of a bottom-up 24-bit BI_RGB image.
+        bytes[0] = 'B';
+        bytes[1] = 'M';
+        write32(2, file_size);
+        write32(10, pixel_offset);
+        write32(14, 40U);
+        write32(18, static_cast<uint32_t>(width));
+        write32(22, static_cast<uint32_t>(height));
+        write16(26, 1U);
+        write16(28, 24U);
+
+        for(auto j = 0; j < height; j++)
+        {
+            auto row = bytes.data() + pixel_offset + row_pitch * static_cast<uint32_t>(j);
+
+            for(auto i = 0; i < width; i++)
+                row[i * 3] = row[i * 3 + 1] = row[i * 3 + 2] = static_cast<unsigned char>(getValue(i, j));
+        }
+
+        std::ofstream file(fs::path(file_name), std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+
+        return static_cast<bool>(file);
+    }
+
+    int getRollingHillsValue(int i, int j, int width, int height)
+    {
+        auto x = 6.2831853 * static_cast<double>(i) / width, z = 6.2831853 * static_cast<double>(j) / height;
+        auto value = 127.5 + 70.0 * std::sin(2.0 * x) * std::cos(3.0 * z) + 50.0 * std::sin(5.0 * x + 1.0 * z + 0.5);
+
+        return static_cast<int>(std::lround(std::min(std::max(value, 0.0), 255.0)));
+    }
+
+    float getRidgedValue(int i, int j)
+    {
+        auto value = 0.0f, amplitude = 1.0f, frequency = 1.0f / 64.0f;
+        for(auto octave = 0; octave < 6; octave++, amplitude *= 0.5f, frequency *= 2.0f)
+            value += amplitude * (1.0f - std::fabs(2.0f * getValueNoise(static_cast<float>(i) * frequency, static_cast<float>(j) * frequency) - 1.0f));
+
+        return value * value;
+    }
+}
@@ -0,0 +1,105 @@
+﻿// Copyright ⓒ 2018, 2020 Valentyn Bondarenko. All rights reserved.
+
+#include <StdAfx.h>
+
+#include "Test.h"
+#include "VertexCache.h"
+
+#include <algorithm>
+#include <array>
+
+namespace bm
+{
+    namespace
+    {
+        // Triangle list of a grid of width x height vertices, row by row, split like Terrain::buildTerrainModel.
+        std::vector<uint16_t> makeGridIndices(int width, int height)
+        {
+            std::vector<uint16_t> indices;
+            for(auto j = 0; j < height - 1; j++)
+            {
+                for(auto i = 0; i < width - 1; i++)
+                {
+                    auto bottom_left = static_cast<uint16_t>(j * width + i), bottom_right = static_cast<uint16_t>(bottom_left + 1);
+                    auto upper_left = static_cast<uint16_t>(bottom_left + width), upper_right = static_cast<uint16_t>(upper_left + 1);
+
+                    indices.insert(indices.end(), {upper_left, upper_right, bottom_left, bottom_left, upper_right, bottom_right});
+                }
+            }
+
+            return indices;
+        }
+
+        // Triangles with their first corner rotated to the lowest index, which keeps their winding, sorted.
+        std::vector<std::array<uint16_t, 3>> getTriangles(const std::vector<uint16_t>& indices)
+        {
+            std::vector<std::array<uint16_t, 3>> triangles;
+            for(auto t = size_t(); t < indices.size(); t += 3)
+            {
+                std::array<uint16_t, 3> triangle = {indices[t], indices[t + 1], indices[t + 2]};
+                std::rotate(triangle.begin(), std::min_element(triangle.begin(), triangle.end()), triangle.end());
+
+                triangles.push_back(triangle);
+            }
+
+            std::sort(triangles.begin(), triangles.end());
+            return triangles;
+        }
+    }
+
+    BM_TEST(vertexCacheOptimizationKeepsTheTriangles)
+    {
+        // The chunk sizes Terrain uses, the largest being the largest a 16-bit chunk holds.
+        for(auto size : {5, 33, 65, 129, 256})
+        {
+            auto vertex_count = static_cast<size_t>(size) * size;
+
+            auto row_major = makeGridIndices(size, size);
+            auto row_major_stats = simulateVertexCache(row_major.data(), row_major.size(), vertex_count);
+
+            auto indices = row_major;
+            optimizeVertexCache(indices.data(), indices.size(), vertex_count);
+
+            // Only the order of the triangles changes, and the cache misses less on rows longer than it.
+            BM_CHECK(getTriangles(indices) == getTriangles(row_major));
+
+            auto stats = simulateVertexCache(indices.data(), indices.size(), vertex_count);
+            BM_CHECK(stats.acmr <= row_major_stats.acmr);
+            if(size > 16)
+                BM_CHECK(stats.acmr < 0.8f * row_major_stats.acmr);
+
+            // The fetch order is a permutation of the vertices, and reading the renumbered indices through it gives the
+            // same triangles in the same order.
+            auto optimized = indices;
+            std::vector<uint16_t> vertex_order;
+            optimizeVertexFetch(indices.data(), indices.size(), vertex_count, vertex_order);
+
+            auto sorted_order = vertex_order;
+            std::sort(sorted_order.begin(), sorted_order.end());
+
+            auto permutation = sorted_order.size() == vertex_count;
+            for(auto v = size_t(); permutation && v < vertex_count; v++)
+                permutation = sorted_order[v] == v;
+
+            BM_CHECK(permutation);
+            if(!permutation)
+                continue;
+
+            auto remapped = true, forward = true;
+            auto next_vertex = 0U;
+
+            for(auto k = size_t(); k < indices.size(); k++)
+            {
+                remapped = remapped && vertex_order[indices[k]] == optimized[k];
+
+                // First uses come in buffer order.
+                forward = forward && indices[k] <= next_vertex;
+                next_vertex = std::max(next_vertex, indices[k] + 1U);
+            }
+
+            BM_CHECK(remapped);
+            BM_CHECK(forward);
+            BM_CHECK(simulateVertexCache(indices.data(), indices.size(), vertex_count).acmr == stats.acmr);
+        }
+    }
+}